@@ -11,7 +11,7 @@ RECOVERY_SITE_METHOD = local
 RECOVERY_LICENSE = BSD-3c
 RECOVERY_LICENSE_FILES = LICENSE.txt
 RECOVERY_INSTALL_STAGING = NO
-RECOVERY_DEPENDENCIES = qt qjson wpa_supplicant
+RECOVERY_DEPENDENCIES = qt qjson wpa_supplicant zlib xz bzip2 openssl
 
 define RECOVERY_BUILD_CMDS
 	(cd $(@D) ; $(QT_QMAKE))
@@ -36,7 +36,7 @@ define RECOVERY_INSTALL_TARGET_CMDS
 	$(INSTALL) -m 0644 package/recovery/wpa_supplicant.conf $(TARGET_DIR)/etc/wpa_supplicant.conf
 	# allow wpa_supplicant to be controlled through dbus, and log to syslog
 	sed -i 's/wpa_supplicant -B/wpa_supplicant -u -s -B/g' $(TARGET_DIR)/libexec/dhcpcd-hooks/10-wpa_supplicant
-	mkdir -p $(TARGET_DIR)/settings $(TARGET_DIR)/mnt2 $(TARGET_DIR)/mnt/os $(TARGET_DIR)/boot
+	mkdir -p $(TARGET_DIR)/settings $(TARGET_DIR)/cache $(TARGET_DIR)/mnt2 $(TARGET_DIR)/mnt/os $(TARGET_DIR)/boot
 endef
 
 $(eval $(generic-package))
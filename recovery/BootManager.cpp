@@ -22,18 +22,24 @@
 #include <QCoreApplication>
 #include <QApplication>
 #include <QTime>
+#include <QElapsedTimer>
 #include <QTextStream>
+#include <QtConcurrentRun>
 #include "Utility.h"
 #include "PreSetup.h"
 #include "InstallManager.h"
 
 BootManager *_bootManager;
 
-BootManager::BootManager(): QObject(), webserver(true) {
+BootManager::BootManager(): QObject(), webserver(true), _lastJobId(0) {
     _bootManager = this;
 }
 
 void BootManager::setDefaultBootPartitionREST(Web::Server::Request *request, Web::Server::Response *response) {
+    // The install job sets the default boot partition itself
+    if(installJobActive(response)) {
+        return;
+    }
     LINFO << "Got request to set default boot partition to "  << request->body;
     if(BootManager::setDefaultBootPartition(QString(request->body.c_str()))) {
         LINFO << "Successfully set default partition to " << request->body;
@@ -50,7 +56,66 @@ void BootManager::setDefaultBootPartitionREST(Web::Server::Request *request, Web
     }
 }
 
+bool BootManager::installJobActive(Web::Server::Response *response) {
+    foreach(InstallJob *job, _bootManager->_jobs) {
+        if(job->isActive()) {
+            LERROR << "Install job " << job->id() << " is still running, not starting another one";
+            response->phrase = "Conflict";
+            response->code = 409;
+            response->type = "text/plain";
+            response->body = "Install job " + to_string(job->id()) + " is still running\n";
+            return true;
+        }
+    }
+    return false;
+}
+
+bool BootManager::isOSDescription(const QVariant &description) {
+    QVariantMap os = description.toMap();
+    return description.type() == QVariant::Map &&
+           (os.value("name").type() == QVariant::String || os.value("os_name").type() == QVariant::String);
+}
+
+void BootManager::pruneJobs() {
+    /*
+     * The jobs are deleted right away instead of through deleteLater(), since the event loop does not run while the
+     * web server is serving requests. A job that is no longer active has finished its work, deleting it waits for its
+     * thread to return.
+     */
+    QMap<int, InstallJob *>::iterator it = _bootManager->_jobs.begin();
+    while(_bootManager->_jobs.size() > INSTALL_JOB_HISTORY && it != _bootManager->_jobs.end()) {
+        if(it.value()->isActive()) {
+            ++it;
+        } else {
+            LDEBUG << "Deleting finished install job " << it.key();
+            delete(it.value());
+            it = _bootManager->_jobs.erase(it);
+        }
+    }
+}
+
+void BootManager::startInstallJob(const QList<QVariantMap> &descriptions, Web::Server::Request *request,
+                                  Web::Server::Response *response) {
+    int id = ++_bootManager->_lastJobId;
+    InstallJob *job = new InstallJob(id, descriptions, request->header.find("AutoReboot") != request->header.end());
+    _bootManager->_jobs.insert(id, job);
+    pruneJobs();
+    job->start();
+
+    LINFO << "Started install job " << id;
+    QVariantMap status = job->status();
+    response->phrase = "Accepted";
+    response->code = 202;
+    response->type = "application/json";
+    response->header["Location"] = "/jobs/" + to_string(id);
+    response->body = Utility::Json::serialize(status).constData();
+}
+
 void BootManager::installOSREST(Web::Server::Request *request, Web::Server::Response *response) {
+    if(installJobActive(response)) {
+        return;
+    }
+
     QMap<QString, QVariant> osInfoJson = Utility::Json::parseJson(QString(request->body.c_str()));
     if(osInfoJson.size() <= 0) {
         LERROR << "Unable to parse Json!";
@@ -58,43 +123,91 @@ void BootManager::installOSREST(Web::Server::Request *request, Web::Server::Resp
         response->code = 400;
         response->type = "text/plain";
         response->body = "Unable to install OS\n";
-    } else {
-        OSInfo os = OSInfo(osInfoJson);
-        if(!os.isValid()) {
-            LERROR << "OS Json creates invalid OS Info object";
-            LERROR << "Json does not conform specification!";
+        return;
+    }
+
+    /* The OS metadata is downloaded and validated by the install job, so the server is not blocked while fetching it */
+    if(!isOSDescription(osInfoJson)) {
+        LERROR << "Json does not conform specification!";
+        response->phrase = "Bad Request";
+        response->code = 400;
+        response->type = "text/plain";
+        response->body = "Unable to install OS\n";
+        return;
+    }
+
+    QList<QVariantMap> descriptions;
+    descriptions.append(osInfoJson);
+    startInstallJob(descriptions, request, response);
+}
+
+void BootManager::installOSBatchREST(Web::Server::Request *request, Web::Server::Response *response) {
+    if(installJobActive(response)) {
+        return;
+    }
+
+    QList<QVariant> osInfoJson = Utility::Json::parseJsonArray(QByteArray(request->body.c_str()));
+    if(osInfoJson.isEmpty()) {
+        LERROR << "Unable to parse Json, expecting a non-empty array of OS descriptions!";
+        response->phrase = "Bad Request";
+        response->code = 400;
+        response->type = "text/plain";
+        response->body = "Unable to install OSes\n";
+        return;
+    }
+
+    QList<QVariantMap> descriptions;
+    for(int i = 0; i < osInfoJson.size(); i++) {
+        if(!isOSDescription(osInfoJson[i])) {
+            LERROR << "OS Json at index " << i << " does not conform specification";
             response->phrase = "Bad Request";
             response->code = 400;
             response->type = "text/plain";
-            response->body = "Unable to install OS\n";
-        } else {
-            os.printOSInfo();
-            InstallManager *installManager = new InstallManager();
-            if (!installManager->installOS(os)) {
-                LERROR << "Unable to install OS";
-                response->phrase = "Internal Server Error";
-                response->code = 500;
-                response->type = "text/plain";
-                response->body = "Unable to install OS\n";
-            } else {
-                LINFO << "Successfully installed OS";
-                response->phrase = "OK";
-                response->code = 200;
-                response->type = "text/plain";
-                if(request->header.find("AutoReboot") != request->header.end()) {
-                    response->body = "Successfully installed OS and rebooting now!\n";
-                    response->sendResponse();
-                    _bootManager->bootIntoPartition();
-                } else {
-                    response->body = "Successfully installed OS\n";
-                }
-            }
+            response->body = "Unable to install OS at index " + to_string(i) + "\n";
+            return;
         }
+        descriptions.append(osInfoJson[i].toMap());
     }
+    startInstallJob(descriptions, request, response);
+}
+
+void BootManager::jobStatusREST(Web::Server::Request *request, Web::Server::Response *response) {
+    bool ok;
+    int id = QString(request->params["id"].c_str()).toInt(&ok);
+    if(!ok || !_bootManager->_jobs.contains(id)) {
+        LERROR << "Unable to find install job " << request->params["id"];
+        response->phrase = "Not Found";
+        response->code = 404;
+        response->type = "text/plain";
+        response->body = "Unable to find install job " + request->params["id"] + "\n";
+        return;
+    }
+
+    response->phrase = "OK";
+    response->code = 200;
+    response->type = "application/json";
+    response->body = Utility::Json::serialize(_bootManager->_jobs.value(id)->status()).constData();
+}
+
+void BootManager::jobListREST(Web::Server::Request *request, Web::Server::Response *response) {
+    Q_UNUSED(request);
+    QVariantList jobs;
+    foreach(InstallJob *job, _bootManager->_jobs) {
+        jobs.append(job->status());
+    }
+
+    response->phrase = "OK";
+    response->code = 200;
+    response->type = "application/json";
+    response->body = Utility::Json::serialize(jobs).constData();
 }
 
 void BootManager::rebootToDefaultPartition(Web::Server::Request *request, Web::Server::Response *response) {
     Q_UNUSED(request);
+    // Rebooting while the SD card is written would leave corrupted partitions behind
+    if(installJobActive(response)) {
+        return;
+    }
     response->phrase = "OK";
     response->code = 200;
     response->type = "text/plain";
@@ -105,6 +218,9 @@ void BootManager::rebootToDefaultPartition(Web::Server::Request *request, Web::S
 
 void BootManager::exitToShell(Web::Server::Request *request, Web::Server::Response *response) {
     Q_UNUSED(request);
+    if(installJobActive(response)) {
+        return;
+    }
     response->phrase = "OK";
     response->code = 200;
     response->type = "text/plain";
@@ -113,6 +229,32 @@ void BootManager::exitToShell(Web::Server::Request *request, Web::Server::Respon
     exit(0);
 }
 
+void BootManager::bootTimesREST(Web::Server::Request *request, Web::Server::Response *response) {
+    Q_UNUSED(request);
+    response->phrase = "OK";
+    response->code = 200;
+    response->type = "application/json";
+    response->body = Utility::Json::serialize(_bootManager->_bootTimes).constData();
+}
+
+void BootManager::reportBootTimes(qint64 sdCardTime, qint64 cmdlineTime, qint64 networkTime, qint64 timeToAddress,
+                                  qint64 overlappedTime) {
+    // Running the stages one after another would have taken the sum of their durations
+    qint64 sequentialTime = sdCardTime + cmdlineTime + networkTime;
+    LINFO << "Boot stage timing:";
+    LINFO << "    SD card preparation: " << sdCardTime << " ms";
+    LINFO << "    Command line cleanup: " << cmdlineTime << " ms";
+    LINFO << "    Network bring-up: " << networkTime << " ms (first address after " << timeToAddress << " ms)";
+    LINFO << "    Wall time: " << overlappedTime << " ms, saved by overlapping: " << sequentialTime - overlappedTime << " ms";
+
+    _bootTimes.insert("sd_card_ms", sdCardTime);
+    _bootTimes.insert("cmdline_ms", cmdlineTime);
+    _bootTimes.insert("network_ms", networkTime);
+    _bootTimes.insert("time_to_address_ms", timeToAddress);
+    _bootTimes.insert("wall_ms", overlappedTime);
+    _bootTimes.insert("saved_ms", sequentialTime - overlappedTime);
+}
+
 void BootManager::run() {
     if(Utility::Sys::mountSettingsPartition()) {
         LFATAL << "Unable to mount settings partition";
@@ -123,15 +265,29 @@ void BootManager::run() {
         LINFO << "Booting into OS specified in " << DEFAULT_BOOT_PARTITION_FILE << " this can be changed through setup mode and by modifying the file directly lying on " << SETTINGS_PARTITION;
         bootIntoPartition();
     } else {
+        QElapsedTimer bootTimer;
+        bootTimer.start();
         PreSetup preSetup;
+
+        /* Bringing up the network does not depend on the SD card, so it runs concurrently to its preparation. dhcpcd
+         * only reads the Wi-Fi configuration from the settings partition, which is not reformatted if it exists. */
+        QFuture<void> network = QtConcurrent::run(&preSetup, &PreSetup::startNetworking);
+
+        QElapsedTimer stageTimer;
+        stageTimer.start();
         if(!preSetup.checkAndPrepareSDCard()) {
             LFATAL << "Unable to check and prepare SDCard, aborting";
             emit finished();
         }
+        qint64 sdCardTime = stageTimer.restart();
         if(!preSetup.clearCMDline()) {
             LERROR << "Unable to remove 'runinstaller' from commandline arguments!";
         }
-        preSetup.startNetworking();
+        qint64 cmdlineTime = stageTimer.restart();
+
+        network.waitForFinished();
+        qint64 overlappedTime = bootTimer.elapsed();
+        reportBootTimes(sdCardTime, cmdlineTime, preSetup.networkTime(), preSetup.timeToAddress(), overlappedTime);
 
         Utility::Sys::mountSettingsPartition();
 
@@ -140,18 +296,26 @@ void BootManager::run() {
             LINFO << "Creating web server...";
             Web::WebServer server;
             server.post("/os", &BootManager::installOSREST);
+            server.post("/os/batch", &BootManager::installOSBatchREST);
+            server.get("/jobs", &BootManager::jobListREST);
+            server.get("/jobs/:id", &BootManager::jobStatusREST);
             server.post("/bootPartition", &BootManager::setDefaultBootPartitionREST);
             server.post("/reboot", &BootManager::rebootToDefaultPartition);
             server.post("/exit", &BootManager::exitToShell);
+            server.get("/boot", &BootManager::bootTimesREST);
 
             LINFO << "Starting server...";
+            _bootTimes.insert("until_server_ms", bootTimer.elapsed());
 
             const char* ip = Web::getIP().toUtf8().constData();
             std::cout << "REST API listening on " << ip << ":" << PORT << std::endl;
-            std::cout << "POST JSON object with OS information to '" << ip << ":" << PORT << "/os' in order to install the os (request will timeout, since response will be send after install is finished!)" << std::endl;
+            std::cout << "POST JSON object with OS information to '" << ip << ":" << PORT << "/os' in order to install the os (the install runs in the background, the response contains the job id)" << std::endl;
+            std::cout << "POST JSON array of OS information to '" << ip << ":" << PORT << "/os/batch' in order to install several OSes at once" << std::endl;
+            std::cout << "GET '" << ip << ":" << PORT << "/jobs/{id}' in order to retrieve the phase and progress of an install job" << std::endl;
             std::cout << "POST partition device string to '" << ip << ":" << PORT << "/bootPartition' in order to set it as default boot partition" << std::endl;
             std::cout << "POST to '" << ip << ":" << PORT << "/reboot' in order to reboot to the default boot partition" << std::endl;
             std::cout << "POST to '" << ip << ":" << PORT << "/exit' in order to exit to recovery shell" << std::endl;
+            std::cout << "GET '" << ip << ":" << PORT << "/boot' in order to retrieve the duration of the boot stages" << std::endl;
 
             const qrcodegen::QrCode qrCode = qrcodegen::QrCode::encodeText(ip, qrcodegen::QrCode::Ecc::LOW);
             Utility::printQrCode(qrCode);
@@ -190,7 +354,7 @@ void BootManager::run() {
                     }
                     case 4: {
                         InstallManager *installManager = new InstallManager();
-                        OSInfo os = OSInfo(*Utility::Debug::getRaspbianJSON());
+                        OSInfo os(*Utility::Debug::getRaspbianJSON());
                         if(!os.isValid()) {
                             LERROR <<  "OSInfo object is invalid";
                         } else {
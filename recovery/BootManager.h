@@ -19,9 +19,12 @@
 #include <QVariant>
 #include "PartitionInfo.h"
 #include "OSInfo.h"
+#include "InstallJob.h"
 #include "libs/Web/WebServer.h"
 
 #define PORT 80
+// Number of install jobs kept for the REST-API, older finished jobs are deleted
+#define INSTALL_JOB_HISTORY 10
 
 class BootManager: public QObject {
     Q_OBJECT
@@ -33,9 +36,15 @@ public:
      * Network callbacks
      */
     static void installOSREST(Web::Server::Request* request, Web::Server::Response* response);
+    // Installs several OSes (given as JSON array) in a single install job, sharing one partitioning pass
+    static void installOSBatchREST(Web::Server::Request* request, Web::Server::Response* response);
+    static void jobStatusREST(Web::Server::Request* request, Web::Server::Response* response);
+    static void jobListREST(Web::Server::Request* request, Web::Server::Response* response);
     static void setDefaultBootPartitionREST(Web::Server::Request* request, Web::Server::Response* response);
     static void rebootToDefaultPartition(Web::Server::Request* request, Web::Server::Response* response);
     static void exitToShell(Web::Server::Request* request, Web::Server::Response* response);
+    // Returns the duration of the boot stages (see reportBootTimes())
+    static void bootTimesREST(Web::Server::Request* request, Web::Server::Response* response);
 
     /*
      * The following function save the default partition's number to
@@ -56,9 +65,27 @@ private:
     bool bootCheck();
     bool hasInstalledOS();
     QVariantList getInstalledOS();
+    // Responds with a conflict and returns true, if there is still an install job running
+    static bool installJobActive(Web::Server::Response* response);
+    // Checks the shape of an OS description (a JSON object with a name), the description itself is parsed by the job
+    static bool isOSDescription(const QVariant &description);
+    static void startInstallJob(const QList<QVariantMap> &descriptions, Web::Server::Request* request,
+                                Web::Server::Response* response);
+    // Deletes the oldest finished jobs, until at most INSTALL_JOB_HISTORY jobs are left
+    static void pruneJobs();
+    // Logs the duration of the boot stages and how much time was saved by bringing up the network concurrently
+    void reportBootTimes(qint64 sdCardTime, qint64 cmdlineTime, qint64 networkTime, qint64 timeToAddress,
+                         qint64 overlappedTime);
     // Flag indicating whether the webserver should be started.
     bool webserver;
 
+    // All install jobs started through the REST-API (key: job id)
+    QMap<int, InstallJob *> _jobs;
+    int _lastJobId;
+
+    // Duration of the boot stages (in ms), reported through the REST-API
+    QVariantMap _bootTimes;
+
 signals:
     void finished();
 };
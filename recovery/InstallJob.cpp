@@ -0,0 +1,179 @@
+//
+// Created by agent on 10/17/26 as part of NOOBS4IoT (https://github.com/steilerDev/NOOBS4IoT)
+//
+// InstallJob.cpp:
+//      This class runs the installation of an Operating System on a worker thread, so the REST-API can continue to
+//      serve requests. It keeps track of the current phase and progress of the installation, which can be queried
+//      through the REST-API while the installation is running.
+//      For more information see https://github.com/steilerDev/NOOBS4IoT/wiki.
+//
+// This file is licensed under a GNU General Public License v3.0 (c) Frank Steiler.
+// See https://raw.githubusercontent.com/steilerDev/NOOBS4IoT/master/LICENSE for more information.
+//
+
+#include <QMutexLocker>
+#include "InstallJob.h"
+#include "InstallManager.h"
+#include "BootManager.h"
+#include "libs/easylogging++.h"
+
+extern BootManager *_bootManager;
+
+InstallJob::InstallJob(int id, const QList<QVariantMap> &descriptions, bool autoReboot): QThread(),
+                                                                                         _id(id),
+                                                                                         _descriptions(descriptions),
+                                                                                         _autoReboot(autoReboot),
+                                                                                         _phase(Queued),
+                                                                                         _bytesTotal(0),
+                                                                                         _bytesDone(0),
+                                                                                         _writeStart(0),
+                                                                                         _sampleTime(0),
+                                                                                         _sampleBytes(0),
+                                                                                         _throughput(0) {
+    QStringList names;
+    foreach(const QVariantMap &description, _descriptions) {
+        names.append(description.value("name", description.value("os_name")).toString());
+    }
+    _osNames = names.join(", ");
+    _timer.start();
+}
+
+InstallJob::~InstallJob() {
+    wait();
+    qDeleteAll(_oses);
+}
+
+void InstallJob::run() {
+    LINFO << "Starting install job " << _id << " for " << _osNames.toUtf8().constData();
+
+    setPhase(Preparing);
+    if(!createOSInfos()) {
+        LERROR << "Install job " << _id << " failed";
+        setPhase(Failed);
+        return;
+    }
+
+    InstallManager *installManager = new InstallManager(this);
+    bool success = installManager->installOS(_oses);
+    delete(installManager);
+
+    if(!success) {
+        LERROR << "Install job " << _id << " failed";
+        setPhase(Failed);
+        return;
+    }
+
+    LINFO << "Install job " << _id << " finished successfully";
+    setPhase(Finished);
+
+    if(_autoReboot) {
+        LINFO << "Rebooting into newly installed OS";
+        _bootManager->bootIntoPartition();
+    }
+}
+
+bool InstallJob::createOSInfos() {
+    for(int i = 0; i < _descriptions.size(); i++) {
+        OSInfo *os = new OSInfo(_descriptions[i]);
+        _oses.append(os);
+        if(!os->isValid()) {
+            LERROR << "OS description at index " << i << " creates invalid OS Info object";
+            setError("Unable to install OS at index " + QString::number(i) + ", invalid OS description or metadata");
+            return false;
+        }
+        os->printOSInfo();
+    }
+    return true;
+}
+
+QVariantMap InstallJob::status() {
+    QMutexLocker locker(&_mutex);
+    QVariantMap status;
+    status.insert("id", _id);
+    status.insert("os", _osNames);
+    status.insert("phase", phaseName(_phase));
+    status.insert("elapsed", _timer.elapsed() / 1000);
+    status.insert("bytes_done", _bytesDone);
+    status.insert("bytes_total", _bytesTotal);
+    // Bytes per second, measured over the last sample interval and over the whole writing phase
+    status.insert("throughput", _throughput);
+    qint64 writeTime = _sampleTime - _writeStart;
+    status.insert("average_throughput", writeTime > 0 ? _sampleBytes * 1000 / writeTime : 0);
+    if(!_stages.isEmpty()) {
+        status.insert("stages", _stages);
+    }
+    if(!_error.isEmpty()) {
+        status.insert("error", _error);
+    }
+    return status;
+}
+
+bool InstallJob::isActive() {
+    QMutexLocker locker(&_mutex);
+    return _phase != Finished && _phase != Failed;
+}
+
+void InstallJob::setPhase(Phase phase) {
+    QMutexLocker locker(&_mutex);
+    LDEBUG << "Install job " << _id << " entering phase " << phaseName(phase).toUtf8().constData();
+    _phase = phase;
+    if(phase == Writing) {
+        _writeStart = _sampleTime = _timer.elapsed();
+    } else if(phase == Finished || phase == Failed) {
+        _throughput = 0;
+    }
+}
+
+void InstallJob::setBytesTotal(qint64 bytesTotal) {
+    QMutexLocker locker(&_mutex);
+    _bytesTotal = bytesTotal;
+}
+
+void InstallJob::setBytesDone(qint64 bytesDone) {
+    QMutexLocker locker(&_mutex);
+    _bytesDone = bytesDone;
+
+    // Only sampling once per second, in order to get a meaningful throughput
+    qint64 now = _timer.elapsed();
+    if(now - _sampleTime >= 1000) {
+        _throughput = (_bytesDone - _sampleBytes) * 1000 / (now - _sampleTime);
+        _sampleTime = now;
+        _sampleBytes = _bytesDone;
+    }
+}
+
+void InstallJob::setError(const QString &error) {
+    QMutexLocker locker(&_mutex);
+    // Keeping the first error, since it is the most specific one and following errors are only consequences of it
+    if(_error.isEmpty()) {
+        _error = error;
+    }
+}
+
+void InstallJob::setStages(const QVariantList &stages) {
+    QMutexLocker locker(&_mutex);
+    _stages = stages;
+}
+
+QString InstallJob::phaseName(Phase phase) {
+    switch (phase) {
+        case Queued:
+            return "queued";
+        case Preparing:
+            return "preparing";
+        case Partitioning:
+            return "partitioning";
+        case Writing:
+            return "writing";
+        case Verifying:
+            return "verifying";
+        case Finishing:
+            return "finishing";
+        case Finished:
+            return "finished";
+        case Failed:
+            return "failed";
+        default:
+            return "unknown";
+    }
+}
@@ -0,0 +1,93 @@
+//
+// Created by agent on 10/17/26 as part of NOOBS4IoT (https://github.com/steilerDev/NOOBS4IoT)
+//
+// InstallJob.h:
+//      This class runs the installation of an Operating System on a worker thread, so the REST-API can continue to
+//      serve requests. It keeps track of the current phase and progress of the installation, which can be queried
+//      through the REST-API while the installation is running.
+//      For more information see https://github.com/steilerDev/NOOBS4IoT/wiki.
+//
+// This file is licensed under a GNU General Public License v3.0 (c) Frank Steiler.
+// See https://raw.githubusercontent.com/steilerDev/NOOBS4IoT/master/LICENSE for more information.
+//
+
+#ifndef RECOVERY_INSTALLJOB_H
+#define RECOVERY_INSTALLJOB_H
+
+#include <QThread>
+#include <QMutex>
+#include <QElapsedTimer>
+#include <QVariantMap>
+#include "OSInfo.h"
+
+class InstallJob: public QThread {
+    Q_OBJECT
+
+public:
+    enum Phase {
+        Queued,
+        Preparing,
+        Partitioning,
+        Writing,
+        Verifying,
+        Finishing,
+        Finished,
+        Failed
+    };
+
+    // The OSes are given by their JSON descriptions, the first one becomes the default boot partition. Creating the
+    // OSInfo objects downloads their metadata, which is why it is done by the job (while preparing).
+    InstallJob(int id, const QList<QVariantMap> &descriptions, bool autoReboot);
+    ~InstallJob();
+
+    // Returns a snapshot of the job's state, suitable for serialization
+    QVariantMap status();
+    // Returns true while the job is queued or running
+    bool isActive();
+
+    inline int id() const { return _id; }
+
+    /*
+     * Progress reporting, called by the InstallManager from within the install thread
+     */
+    void setPhase(Phase phase);
+    void setBytesTotal(qint64 bytesTotal);
+    void setBytesDone(qint64 bytesDone);
+    void setError(const QString &error);
+    // Byte counters of the stages of the currently running pipelines
+    void setStages(const QVariantList &stages);
+
+    static QString phaseName(Phase phase);
+
+protected:
+    void run();
+
+private:
+    // Creates the OSInfo objects from their descriptions, returns false if one of them is invalid
+    bool createOSInfos();
+
+    int _id;
+    QList<QVariantMap> _descriptions;
+    // Owned by the job, only accessed by its thread
+    QList<OSInfo *> _oses;
+    // Names of all OSes installed by the job, separated by commas
+    QString _osNames;
+    bool _autoReboot;
+
+    QMutex _mutex;
+    Phase _phase;
+    QString _error;
+    QVariantList _stages;
+    qint64 _bytesTotal,
+           _bytesDone;
+
+    // Measures the runtime of the job
+    QElapsedTimer _timer;
+    // Start of the writing phase and last progress sample (in ms since start), used to calculate the throughput
+    qint64 _writeStart,
+           _sampleTime,
+           _sampleBytes,
+           _throughput;
+};
+
+#endif //RECOVERY_INSTALLJOB_H
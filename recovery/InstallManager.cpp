@@ -20,10 +20,22 @@
 #include "InstallManager.h"
 #include "Utility.h"
 #include "BootManager.h"
+#include "InstallJob.h"
+#include "libs/Stream/ChunkStore.h"
+#include "libs/Stream/WriteRecord.h"
+#include "libs/Stream/Prefetch.h"
+#include "libs/Stream/StreamSource.h"
+#include "libs/Stream/StreamDecoder.h"
 #include <QDebug>
 #include <QTime>
-
-InstallManager::InstallManager() {
+#include <QSet>
+#include <QVector>
+#include <QRunnable>
+#include <QThreadPool>
+#include <QtAlgorithms>
+#include <QMutexLocker>
+
+InstallManager::InstallManager(InstallJob *job): _job(job), _bytesRead(0), _bytesWritten(0) {
     _extraSpacePerPartition = 0;
     _part = 5,
     _totalnominalsize = 0;
@@ -33,6 +45,22 @@ InstallManager::InstallManager() {
     _startSector = Utility::Sys::getFileContents("/sys/class/block/mmcblk0p5/start").trimmed().toULongLong()
                       + Utility::Sys::getFileContents("/sys/class/block/mmcblk0p5/size").trimmed().toULongLong();
     _totalSectors = Utility::Sys::getFileContents("/sys/class/block/mmcblk0/size").trimmed().toULongLong();
+
+    /* The chunk cache occupies the end of the SD card, operating systems are installed in front of it */
+    _cacheStart = 0;
+    _cacheSectors = 0;
+    _chunkStore = NULL;
+    _prefetch = NULL;
+    if (QFile::exists(CACHE_PARTITION) && getLabel(CACHE_PARTITION) == CACHE_LABEL) {
+        _cacheStart = Utility::Sys::getFileContents("/sys/class/block/mmcblk0p3/start").trimmed().toInt();
+        _cacheSectors = Utility::Sys::getFileContents("/sys/class/block/mmcblk0p3/size").trimmed().toInt();
+        _totalSectors = _cacheStart;
+        if (Utility::Sys::mountCachePartition()) {
+            _chunkStore = new Stream::ChunkStore(CACHE_DIR "/chunks");
+        } else {
+            LWARNING << "Unable to mount cache partition, downloading all images";
+        }
+    }
     _availableMB = (_totalSectors-_startSector)/2048;
 
     LDEBUG << "Mounting systems partition";
@@ -47,88 +75,123 @@ InstallManager::InstallManager() {
     _partitionMap = QMap<int, PartitionInfo*>();
     _osList = new QList<OSInfo*>();
     _installed_os = QVariantList();
+
+    QSettings settings("/settings/noobs.conf", QSettings::IniFormat);
+    _verifyWrites = settings.value(SETTING_VERIFY_WRITES, false).toBool();
+    _buildFilesystems = settings.value(SETTING_BUILD_FILESYSTEMS, true).toBool();
+    _maxConcurrentWriters = qMax(1, settings.value(SETTING_MAX_CONCURRENT_WRITERS, DEFAULT_MAX_CONCURRENT_WRITERS).toInt());
 }
 
 InstallManager::~InstallManager() {
+    // Stops the download, if it was never taken over
+    delete(_prefetch);
+    if (_chunkStore) {
+        delete(_chunkStore);
+        Utility::Sys::unmountCachePartition();
+    }
     Utility::Sys::unmountSystemsPartition();
     qDeleteAll(*_osList);
     delete(_osList);
+    for (int i = 0; i < _writeRecords.size(); i++) {
+        delete(_writeRecords[i].second);
+    }
 }
 
 
-bool InstallManager::installOS(QList<OSInfo> &os) {
-    if(!prepareImage(os)) {
-        LFATAL << "Unable to prepare images";
+bool InstallManager::installOS(QList<OSInfo *> &oses) {
+    QStringList names;
+    foreach(OSInfo *os, oses) {
+        names.append(os->name());
+    }
+    QByteArray osNames = names.join(", ").toUtf8();
+
+    reportPhase(InstallJob::Preparing);
+    if(!prepareImage(oses)) {
+        LFATAL << "Unable to prepare images for " << osNames.constData();
+        reportError("Unable to prepare image");
         return false;
     } else {
-        LDEBUG << "Successfully prepared images";
+        LDEBUG << "Successfully prepared images for " << osNames.constData();
     }
 
+    /* The download of the largest image does not need to wait for the SD card */
+    prefetchImage(oses);
+
+    /* All operating systems share a single partitioning pass */
+    reportPhase(InstallJob::Partitioning);
     if(!partitionSDCard()) {
         LFATAL << "Unable to partition & prepare SD Card";
+        reportError("Unable to partition & prepare SD Card");
         return false;
     } else {
         LDEBUG << "Successfully partitioned & prepared SD Card";
     }
 
-    if(!writeImage(os)) {
-        LFATAL << "Unable to write images";
+    if(_job) {
+        _job->setBytesTotal(qint64(_totaluncompressedsize)*1024*1024);
+    }
+    reportPhase(InstallJob::Writing);
+    if(!writeImage(oses)) {
+        LFATAL << "Unable to write images " << osNames.constData();
+        reportError("Unable to write image");
+        return false;
     } else {
-        LDEBUG << "Successfully written images";
+        LDEBUG << "Successfully written images " << osNames.constData();
     }
-    BootManager::setDefaultBootPartition(os.first());
+
+    /* The first operating system becomes the default one */
+    reportPhase(InstallJob::Finishing);
+    BootManager::setDefaultBootPartition(*oses.first());
 
     LINFO << "Finish writing (sync)";
     sync();
     return true;
 }
 
-
 bool InstallManager::installOS(OSInfo &os) {
-    if(!prepareImage(os)) {
-        LFATAL << "Unable to prepare image for " << os.name().toUtf8().constData();
-        return false;
-    } else {
-        LDEBUG << "Successfully prepared image for " << os.name().toUtf8().constData();
-    }
+    QList<OSInfo *> oses;
+    oses.append(&os);
+    return installOS(oses);
+}
 
-    if(!partitionSDCard()) {
-        LFATAL << "Unable to partition & prepare SD Card";
-        return false;
-    } else {
-        LDEBUG << "Successfully partitioned & prepared SD Card";
+bool InstallManager::verifyWrites() {
+    bool success = true;
+    for (int i = 0; i < _writeRecords.size(); i++) {
+        QTime t1;
+        t1.start();
+        const QString &device = _writeRecords[i].first;
+        Stream::WriteRecord *record = _writeRecords[i].second;
+        LINFO << "Verifying " << device.toUtf8().constData();
+        if (!record->verify(device.toStdString())) {
+            LFATAL << "Verification of " << device.toUtf8().constData() << " failed";
+            success = false;
+        } else {
+            LDEBUG << "Read back " << record->recordedSize() << " bytes in " << (t1.elapsed() / 1000.0) << " seconds";
+        }
+        delete(record);
     }
+    _writeRecords.clear();
+    return success;
+}
 
-    if(!writeImage(os)) {
-        LFATAL << "Unable to write image " << os.name().toUtf8().constData();
-    } else {
-        LDEBUG << "Successfully written image " << os.name().toUtf8().constData();
+void InstallManager::reportPhase(InstallJob::Phase phase) {
+    if(_job) {
+        _job->setPhase(phase);
     }
-    BootManager::setDefaultBootPartition(os);
-
-    LINFO << "Finish writing (sync)";
-    sync();
-    return true;
 }
 
-bool InstallManager::prepareImage(QList<OSInfo> &osList) {
-    foreach(OSInfo os, osList) {
-        if(!checkImage(os)) {
-            LFATAL << "Unable to prepare image " << os.name().toUtf8().constData();
-            return false;
-        }
-    }
-    if(!calculateSpaceRequirements()) {
-        LFATAL << "Unable to calculate space requirements";
-        return false;
+void InstallManager::reportError(const QString &error) {
+    if(_job) {
+        _job->setError(error);
     }
-    return true;
 }
 
-bool InstallManager::prepareImage(OSInfo &os) {
-    if(!checkImage(os)) {
-        LFATAL << "Unable to prepare image " << os.name().toUtf8().constData();
-        return false;
+bool InstallManager::prepareImage(QList<OSInfo *> &osList) {
+    foreach(OSInfo *os, osList) {
+        if(!checkImage(*os)) {
+            LFATAL << "Unable to prepare image " << os->name().toUtf8().constData();
+            return false;
+        }
     }
     if(!calculateSpaceRequirements()) {
         LFATAL << "Unable to calculate space requirements";
@@ -207,6 +270,10 @@ bool InstallManager::checkPartition(PartitionInfo *partitionInfo) {
         LFATAL << "Operating system cannot claim both primary partitions 2 and 4";
         return false;
     }
+    if (reqPart == 3 && _cacheSectors) {
+        LWARNING << "Operating system requires partition 3, removing the cache partition";
+        removeCachePartition();
+    }
 
     partitionInfo->setPartitionDevice("/dev/mmcblk0p"+QByteArray::number(reqPart));
     _partitionMap.insert(reqPart, partitionInfo);
@@ -222,6 +289,18 @@ bool InstallManager::checkPartition(PartitionInfo *partitionInfo) {
     return true;
 }
 
+void InstallManager::removeCachePartition() {
+    if (_chunkStore) {
+        delete(_chunkStore);
+        _chunkStore = NULL;
+        Utility::Sys::unmountCachePartition();
+    }
+    _totalSectors = Utility::Sys::getFileContents("/sys/class/block/mmcblk0/size").trimmed().toULongLong();
+    _availableMB = (_totalSectors-_startSector)/2048;
+    _cacheStart = 0;
+    _cacheSectors = 0;
+}
+
 bool InstallManager::calculateSpaceRequirements() {
     if (_numexpandparts) {
         /* Extra spare space available for partitions that want to be expanded */
@@ -315,6 +394,17 @@ bool InstallManager::partitionSDCard() {
         f.remove();
     }
 
+    /* Uncompressed raw partitions with a chunk index are updated in place, if they keep their position on the SD card */
+    foreach (PartitionInfo *p, _partitionMap.values()) {
+        if (p->fsType() == "raw" && !p->chunkIndex().isEmpty() && p->tarball().endsWith(".img")) {
+            QString sysfs = "/sys/class/block/" + QString(p->partitionDevice()).section('/', -1);
+            int start = Utility::Sys::getFileContents(sysfs + "/start").trimmed().toInt();
+            int size = Utility::Sys::getFileContents(sysfs + "/size").trimmed().toInt();
+            p->setReuseContents(start == p->offset() && size == p->partitionSizeSectors());
+            LDEBUG << "Partition " << p->partitionDevice().constData() << (p->reuseContents() ? " keeps" : " changes") << " its position";
+        }
+    }
+
     LINFO << "Writing partition table";
     if (!writePartitionTable()) {
         LFATAL << "Unable to write partition table";
@@ -326,102 +416,322 @@ bool InstallManager::partitionSDCard() {
     /* Zero out first sector of partitions, to make sure to get rid of previous file system (label) */
     LINFO << "Zero'ing start of each partition";
     foreach (PartitionInfo *p, _partitionMap.values()) {
-        if (p->partitionSizeSectors()) {
+        if (p->partitionSizeSectors() && !p->reuseContents()) {
             if(QProcess::execute("/bin/dd count=1 bs=512 if=/dev/zero of="+p->partitionDevice()) != 0) {
                 LINFO << "Zero'ing start of partition " << p->label().constData() << " failed!";
                 return false;
             }
         }
     }
+
+    /* Probe the labels of all file systems once, so the label checks of writeImage() do not need to scan the devices */
+    _labelIndex.build();
     return true;
 }
 
-bool InstallManager::writeImage(QList<OSInfo> &osList) {
-    foreach(OSInfo os, osList) {
-        if(!writeImage(os)) {
-            LFATAL << "Unable to write OS " << os.name().toUtf8().constData();
+bool InstallManager::writePartition(OSInfo &image, PartitionInfo *curPartition, const QString &mountDir) {
+    QString os_name = image.name();
+    bool bootFilesWritten = false;
+    if (curPartition->fsType() == "raw") {
+        LINFO << os_name.toUtf8().constData() << ": Writing raw OS image to " << curPartition->partitionDevice().constData();
+        if (!dd(curPartition->tarball(), curPartition->partitionDevice(), curPartition->bmap(),
+                curPartition->chunkIndex(), curPartition->sha256(), curPartition->reuseContents())) {
+            LFATAL << "Write failed!";
             return false;
         }
-    }
-    return true;
-}
+    } else if (curPartition->fsType().startsWith("partclone")) {
+        LINFO << os_name.toUtf8().constData() << ": Writing cloned OS image to " << curPartition->partitionDevice().constData();
+        if (!partclone_restore(curPartition->tarball(), curPartition->partitionDevice(), curPartition->chunkIndex(),
+                               curPartition->sha256())) {
+            LFATAL << "Write failed!";
+            return false;
+        }
+    } else if (!curPartition->emptyFS() && !curPartition->tarball().isEmpty() &&
+               canBuildFilesystem(curPartition->fsType(), curPartition->mkfsOptions())) {
+        LINFO << os_name.toUtf8().constData() << ": Building filesystem " << curPartition->fsType().constData() << " on " << curPartition->partitionDevice().constData() << " from tarball";
+        /*
+         * The settings finishImage() would write into the mounted boot partition are written along with its content,
+         * so it does not need to be mounted afterwards (unless there is a partition setup script)
+         */
+        QMap<QString, QByteArray> files,
+                                  appendedFiles;
+        if (curPartition == image.partitions()->first() &&
+            (curPartition->fsType() == "fat" || curPartition->fsType() == "FAT")) {
+            files.insert("os_config.json", Utility::Json::serialize(osConfig(image)));
+            appendedFiles.insert("config.txt", configTxtOptions());
+            bootFilesWritten = true;
+        }
+        if (!mkfsFromTarball(curPartition->tarball(), curPartition->partitionDevice(), curPartition->fsType(),
+                             curPartition->label(), curPartition->chunkIndex(), curPartition->sha256(), files,
+                             appendedFiles)) {
+            LFATAL << "Building file system failed!";
+            return false;
+        } else {
+            LINFO << "File system successfully built";
+        }
+    } else if (curPartition->fsType() != "unformatted") {
+        LINFO << os_name.toUtf8().constData() << ": Creating filesystem " << curPartition->fsType().constData() << " on " << curPartition->partitionDevice().constData();
+        if (!mkfs(curPartition->partitionDevice(), curPartition->fsType(), curPartition->label(), curPartition->mkfsOptions())) {
+            LFATAL << "Unable to make file system";
+            return false;
+        } else {
+            LINFO << "File system successfully created";
+        }
 
-bool InstallManager::writeImage(OSInfo &image) {
-    QString os_name = image.name();
-    LDEBUG << "Processing OS:" << os_name.toUtf8().constData();
-
-    foreach (PartitionInfo *curPartition, *image.partitions()) {
-        LDEBUG << "Checking partition label";
-        if (curPartition->label().size() > 15) {
-            curPartition->label().clear();
-        } else if (!isLabelAvailable(curPartition->label())) {
-            for (int i=0; i<10; i++) {
-                if (isLabelAvailable(curPartition->label() + QByteArray::number(i))) {
-                    curPartition->label() = curPartition->label() + QByteArray::number(i);
-                    break;
+        if (!curPartition->emptyFS()) {
+            if(curPartition->tarball().isEmpty()) {
+                LWARNING << "No tarball available, this might be intentional!";
+            } else {
+                LDEBUG << os_name.toUtf8().constData() << ": Mounting file system";
+
+                QDir dir;
+                if (!dir.exists(mountDir)) {
+                    dir.mkdir(mountDir);
+                }
+                if(!curPartition->mountPartition(mountDir)) {
+                    LFATAL << os_name.toUtf8().constData() << ": Error mounting file system";
+                    return false;
+                }
+
+                LINFO << os_name.toUtf8().constData() << ": Downloading and extracting filesystem";
+
+                if (!untar(curPartition->tarball(), mountDir, curPartition->chunkIndex(), curPartition->sha256())) {
+                    LFATAL << "Download and extracting file system failed!";
+                    curPartition->unmountPartition();
+                    return false;
+                } else {
+                    LINFO << "Download and extracting file system successfull!";
+                    curPartition->unmountPartition();
                 }
             }
         }
-        LDEBUG << "Using label " << curPartition->label().constData();
+    }
 
-        if (curPartition->fsType() == "raw") {
-            LINFO << os_name.toUtf8().constData() << ": Writing raw OS image to " << curPartition->partitionDevice().constData();
-            if (!dd(curPartition->tarball(), curPartition->partitionDevice())) {
-                LFATAL << "Write failed!";
-                return false;
-            }
-        } else if (curPartition->fsType().startsWith("partclone")) {
-            LINFO << os_name.toUtf8().constData() << ": Writing cloned OS image to " << curPartition->partitionDevice().constData();
-            if (!partclone_restore(curPartition->tarball(), curPartition->partitionDevice())) {
-                LFATAL << "Write failed!";
-                return false;
-            }
-        } else if (curPartition->fsType() != "unformatted") {
-            LINFO << os_name.toUtf8().constData() << ": Creating filesystem " << curPartition->fsType().constData() << " on " << curPartition->partitionDevice().constData();
-            if (!mkfs(curPartition->partitionDevice(), curPartition->fsType(), curPartition->label(), curPartition->mkfsOptions())) {
-                LFATAL << "Unable to make file system";
-                return false;
-            } else {
-                LINFO << "File system successfully created";
+    // The written image or the new file system might carry a label
+    QMutexLocker locker(&_mutex);
+    _labelIndex.update(curPartition->partitionDevice().constData());
+    if (bootFilesWritten) {
+        _bootFilesWritten.insert(&image);
+    }
+    return true;
+}
+
+/*
+ * Writes a single partition on a thread of the pool of writeImage(), the result is stored in the given flag and the
+ * counter of running tasks is decreased once done. Once a partition failed, the partitions not yet started are skipped.
+ */
+class PartitionTask : public QRunnable {
+public:
+    PartitionTask(InstallManager *manager, OSInfo *image, PartitionInfo *partition, const QString &mountDir,
+                  bool *result, QAtomicInt *failed, QAtomicInt *running): _manager(manager),
+                                                                          _image(image),
+                                                                          _partition(partition),
+                                                                          _mountDir(mountDir),
+                                                                          _result(result),
+                                                                          _failed(failed),
+                                                                          _running(running) {}
+
+    void run() {
+        if(*_failed != 0) {
+            LDEBUG << "Skipping partition " << _partition->partitionDevice().constData() << ", another partition failed";
+            *_result = false;
+        } else {
+            *_result = _manager->writePartition(*_image, _partition, _mountDir);
+            if(!*_result) {
+                _failed->fetchAndStoreOrdered(1);
             }
+        }
+        _running->deref();
+    }
+
+private:
+    InstallManager *_manager;
+    OSInfo *_image;
+    PartitionInfo *_partition;
+    QString _mountDir;
+    bool *_result;
+    QAtomicInt *_failed,
+               *_running;
+};
+
+// Sorts the partitions with the largest tarballs first
+static bool largerTarball(const QPair<OSInfo *, PartitionInfo *> &a, const QPair<OSInfo *, PartitionInfo *> &b) {
+    return a.second->uncompressedTarballSize() > b.second->uncompressedTarballSize();
+}
 
-            if (!curPartition->emptyFS()) {
-                if(curPartition->tarball().isEmpty()) {
-                    LWARNING << "No tarball available, this might be intentional!";
-                } else {
-                    LDEBUG << os_name.toUtf8().constData() << ": Mounting file system";
+void InstallManager::prefetchImage(QList<OSInfo *> &osList) {
+    QList<QPair<OSInfo *, PartitionInfo *> > partitions;
+    foreach (OSInfo *image, osList) {
+        foreach (PartitionInfo *curPartition, *image->partitions()) {
+            partitions.append(qMakePair(image, curPartition));
+        }
+    }
+    // Same order as in writeImage(), the prefetched image is one of the first ones written
+    qStableSort(partitions.begin(), partitions.end(), largerTarball);
 
-                    if(!curPartition->mountPartition("/mnt2")) {
-                        LFATAL << os_name.toUtf8().constData() << ": Error mounting file system";
-                        return false;
-                    }
+    for (int i = 0; i < partitions.size(); i++) {
+        PartitionInfo *curPartition = partitions[i].second;
+        QString tarball = curPartition->tarball();
+        if (tarball.isEmpty() || !isURL(tarball) || curPartition->fsType() == "unformatted" || curPartition->emptyFS()) {
+            continue;
+        }
+        /*
+         * Images read through the chunk cache, or only partially (block map of an uncompressed image), are not
+         * prefetched, since they do not read the image from start to end
+         */
+        if (!curPartition->chunkIndex().isEmpty() ||
+            (!curPartition->bmap().isEmpty() && Stream::isUncompressed(tarball.toStdString()))) {
+            continue;
+        }
 
-                    LINFO << os_name.toUtf8().constData() << ": Downloading and extracting filesystem";
+        LINFO << "Prefetching " << tarball.toUtf8().constData() << " while the SD card is prepared";
+        _prefetchPath = tarball;
+        _prefetch = new Stream::Prefetch(new Stream::HttpSource(tarball.toStdString()));
+        return;
+    }
+}
 
-                    if (!untar(curPartition->tarball())) {
-                        LFATAL << "Download and extracting file system failed!";
-                        curPartition->unmountPartition();
-                        return false;
-                    } else {
-                        LINFO << "Download and extracting file system successfull!";
-                        curPartition->unmountPartition();
+bool InstallManager::writeImage(QList<OSInfo *> &osList) {
+    /* Labels are chosen up front, so partitions written concurrently do not pick the same label */
+    QSet<QByteArray> usedLabels;
+    QList<QPair<OSInfo *, PartitionInfo *> > partitions;
+    foreach (OSInfo *image, osList) {
+        LDEBUG << "Processing OS:" << image->name().toUtf8().constData();
+        foreach (PartitionInfo *curPartition, *image->partitions()) {
+            LDEBUG << "Checking partition label";
+            if (curPartition->label().size() > 15) {
+                curPartition->label().clear();
+            } else if (!isLabelAvailable(curPartition->label()) || usedLabels.contains(curPartition->label())) {
+                for (int i=0; i<10; i++) {
+                    QByteArray label = curPartition->label() + QByteArray::number(i);
+                    if (isLabelAvailable(label) && !usedLabels.contains(label)) {
+                        curPartition->label() = label;
+                        break;
                     }
                 }
             }
+            if (!curPartition->label().isEmpty()) {
+                usedLabels.insert(curPartition->label());
+            }
+            LDEBUG << "Using label " << curPartition->label().constData();
+            partitions.append(qMakePair(image, curPartition));
         }
     }
 
-    LINFO << "Finished processing all partitions for " << os_name.toUtf8().constData();
+    /*
+     * The partitions do not depend on each other (not even across operating systems), so they are downloaded and
+     * written concurrently (e.g. the small boot partition is done while the root file system is still downloading).
+     * The largest tarballs are started first, so they do not end up being downloaded alone once all small ones are
+     * done. Writers are added one at a time: Once a writer was added, the combined throughput of the streams (bytes
+     * downloaded and bytes written to the SD card) is compared against the one before. If neither grew noticeably,
+     * the network or the SD card is saturated and the writer is not replaced once it finishes. The number of writers
+     * never exceeds SETTING_MAX_CONCURRENT_WRITERS.
+     */
+    qStableSort(partitions.begin(), partitions.end(), largerTarball);
+    QThreadPool pool;
+    pool.setMaxThreadCount(_maxConcurrentWriters);
+    QVector<bool> results(partitions.size());
+    QAtomicInt failed(0),
+               running(0);
+    int next = 0,
+        writers = 1,
+        finished = 0;
+    // Set while measuring the effect of the last writer added (the window right after adding it is skipped), or once an
+    // additional writer did not raise the throughput
+    bool probing = false,
+         settling = false,
+         saturated = false;
+    qint64 baselineRead = 0,
+           baselineWritten = 0,
+           windowRead = 0,
+           windowWritten = 0;
+    QTime window;
+    while (next < partitions.size()) {
+        while (next < partitions.size() && (running < writers || failed != 0)) {
+            // /mnt2 is left free for finishImage()
+            QString mountDir = "/mnt" + QString::number(next + 3);
+            running.ref();
+            pool.start(new PartitionTask(this, partitions[next].first, partitions[next].second, mountDir,
+                                         &results[next], &failed, &running));
+            next++;
+        }
+        if (next == partitions.size()) {
+            break;
+        }
+        if (window.isNull()) {
+            streamedBytes(&windowRead, &windowWritten);
+            window.start();
+        }
+        // Returns early only once all writers are done, the streams update their counters in this interval as well
+        pool.waitForDone(PROGRESS_INTERVAL);
+
+        /* A finished writer changes the mix of streams, the measurement is started over (and the link re-probed) */
+        int done = next - running;
+        if (done != finished) {
+            finished = done;
+            probing = settling = saturated = false;
+            window = QTime();
+            continue;
+        } else if (window.elapsed() < WRITER_PROBE_INTERVAL) {
+            continue;
+        }
 
-    LINFO << os_name.toUtf8().constData() << ": Mounting first partition";
-    if(!image.partitions()->first()->mountPartition("/mnt2")) {
-        LFATAL << os_name.toUtf8().constData() << ": Error mounting file system on partition " << image.partitions()->first()->partitionDevice().constData();
+        qint64 bytesRead, bytesWritten;
+        streamedBytes(&bytesRead, &bytesWritten);
+        int elapsed = qMax(1, window.elapsed());
+        qint64 readRate = (bytesRead - windowRead) * 1000 / elapsed,
+               writeRate = (bytesWritten - windowWritten) * 1000 / elapsed;
+        window = QTime();
+        if (settling) {
+            settling = false;
+        } else if (probing) {
+            probing = false;
+            if (readRate * 100 < baselineRead * (100 + WRITER_PROBE_MIN_GAIN) &&
+                writeRate * 100 < baselineWritten * (100 + WRITER_PROBE_MIN_GAIN)) {
+                LINFO << "Throughput saturated at " << writers - 1 << " writers (" << baselineRead / 1024
+                      << " KiB/s read, " << baselineWritten / 1024 << " KiB/s written)";
+                saturated = true;
+                writers--;
+            } else {
+                LINFO << writers << " writers raised the throughput to " << readRate / 1024 << " KiB/s read, "
+                      << writeRate / 1024 << " KiB/s written";
+            }
+        } else if (!saturated && writers < _maxConcurrentWriters) {
+            baselineRead = readRate;
+            baselineWritten = writeRate;
+            probing = settling = true;
+            writers++;
+        }
+    }
+    pool.waitForDone();
+    if (results.contains(false)) {
         return false;
     }
 
-    LINFO << os_name.toUtf8().constData() << ": Creating os_config.json";
+    /*
+     * The raw partitions are read back before anything mounts them, since finishImage() (and the partition setup
+     * script) might modify them and even a mount on its own changes the superblock
+     */
+    if (!_writeRecords.isEmpty()) {
+        reportPhase(InstallJob::Verifying);
+        if (!verifyWrites()) {
+            LFATAL << "Unable to verify the written partitions";
+            reportError("Written data differs from the image, the SD card might be failing");
+            return false;
+        }
+    }
 
+    reportPhase(InstallJob::Finishing);
+    foreach (OSInfo *image, osList) {
+        if (!finishImage(*image)) {
+            LFATAL << "Unable to write OS " << image->name().toUtf8().constData();
+            return false;
+        }
+    }
+    return true;
+}
 
+QVariantMap InstallManager::osConfig(OSInfo &image) {
     QSettings settings("/settings/noobs.conf", QSettings::IniFormat);
 
     QVariantMap qm;
@@ -433,16 +743,38 @@ bool InstallManager::writeImage(OSInfo &image) {
     qm.insert("partitions", image.vPartitionList());
     qm.insert("language", settings.value("language", "en").toString());
     qm.insert("keyboard", settings.value("keyboard_layout", "gb").toString());
+    return qm;
+}
 
-    if(!Utility::Json::saveToFile("/mnt2/os_config.json", qm)) {
-        LFATAL << "Unable to save os_config.json to /mnt2/os_config.json";
-        return false;
-    } else {
-        LDEBUG << "Successfully saved os_config.json";
+bool InstallManager::finishImage(OSInfo &image) {
+    QString os_name = image.name();
+    LINFO << "Finished processing all partitions for " << os_name.toUtf8().constData();
+
+    /* The boot partition is only mounted for settings not written while building it and for the partition setup script */
+    bool bootFilesWritten = _bootFilesWritten.contains(&image);
+    bool mounted = !bootFilesWritten || !image.partitionSetupScript()->isEmpty();
+    if (mounted) {
+        LINFO << os_name.toUtf8().constData() << ": Mounting first partition";
+        if(!image.partitions()->first()->mountPartition("/mnt2")) {
+            LFATAL << os_name.toUtf8().constData() << ": Error mounting file system on partition " << image.partitions()->first()->partitionDevice().constData();
+            return false;
+        }
     }
 
-    LINFO << os_name.toUtf8().constData() << ": Saving display mode to config.txt";
-    patchConfigTxt();
+    if (bootFilesWritten) {
+        LDEBUG << "os_config.json and config.txt were written while building the boot partition";
+    } else {
+        LINFO << os_name.toUtf8().constData() << ": Creating os_config.json";
+        if(!Utility::Json::saveToFile("/mnt2/os_config.json", osConfig(image))) {
+            LFATAL << "Unable to save os_config.json to /mnt2/os_config.json";
+            return false;
+        } else {
+            LDEBUG << "Successfully saved os_config.json";
+        }
+
+        LINFO << os_name.toUtf8().constData() << ": Saving display mode to config.txt";
+        patchConfigTxt();
+    }
 
     if(!image.partitionSetupScript()->isEmpty()) {
         LDEBUG << "Writing partition setup script to disc, in order to execute it then";
@@ -469,8 +801,10 @@ bool InstallManager::writeImage(OSInfo &image) {
             foreach (PartitionInfo *p, *image.partitions()) {
                 QString part = p->partitionDevice();
                 QString nr = QString::number(pnr);
-                QString uuid = getUUID(part);
-                QString label = getLabel(part);
+                Disk::FilesystemInfo info;
+                Disk::probeFilesystem(part.toStdString(), &info);
+                QString uuid = QString::fromUtf8(info.uuid.c_str());
+                QString label = QString::fromUtf8(info.label.c_str());
                 QString id;
                 if (!label.isEmpty()) {
                     id = "LABEL=" + label;
@@ -525,9 +859,11 @@ bool InstallManager::writeImage(OSInfo &image) {
         LDEBUG << "No post-install script available";
     }
 
-    LINFO << os_name.toUtf8().constData() << ": Unmounting FAT partition";
-    if(!Utility::Sys::unmountPartition("/mnt2")) {
-        LWARNING << os_name.toUtf8().constData() << ": Error unmounting";
+    if (mounted) {
+        LINFO << os_name.toUtf8().constData() << ": Unmounting FAT partition";
+        if(!Utility::Sys::unmountPartition("/mnt2")) {
+            LWARNING << os_name.toUtf8().constData() << ": Error unmounting";
+        }
     }
 
     /* Save information about installed operating systems in installed_os.json */
@@ -17,29 +17,76 @@
 #define RECOVERY_INSTALLMANAGER_H
 
 #include <qsettings.h>
+#include <QMutex>
+#include <QSet>
 #include <QtNetwork/QNetworkAccessManager>
 #include "OSInfo.h"
+#include "InstallJob.h"
+#include "libs/Disk/Filesystem.h"
+
+namespace Stream {
+    class Stage;
+    class BlockMap;
+    class ChunkIndex;
+    class ChunkStore;
+    class WriteRecord;
+    class Prefetch;
+}
+
+// Interval (in ms) in which the progress of a running install step is reported
+#define PROGRESS_INTERVAL 1000
+// Setting in /settings/noobs.conf enabling the readback of raw images once they are written (see verifyWrites())
+#define SETTING_VERIFY_WRITES "verify_writes"
+// Setting in /settings/noobs.conf limiting the number of partitions written concurrently (see writeImage())
+#define SETTING_MAX_CONCURRENT_WRITERS "max_concurrent_writers"
+#define DEFAULT_MAX_CONCURRENT_WRITERS 2
+// Interval (in ms) over which writeImage() measures the combined throughput of the streams
+#define WRITER_PROBE_INTERVAL 4000
+// Gain of the throughput (in percent) that an additional writer needs to achieve, to be worth keeping
+#define WRITER_PROBE_MIN_GAIN 10
+// Setting in /settings/noobs.conf allowing file systems to be built straight from their tarball (see mkfsFromTarball())
+#define SETTING_BUILD_FILESYSTEMS "build_filesystems"
 
 class InstallManager {
 public:
-    InstallManager();
+    // If a job is given, the install progress is reported to it
+    InstallManager(InstallJob *job = NULL);
     ~InstallManager();
-    bool installOS(QList<OSInfo> &oses);
+    // Installs all operating systems after a single partitioning pass, the first one becomes the default boot partition
+    bool installOS(QList<OSInfo *> &oses);
     bool installOS(OSInfo &os);
 
 private:
     // Must be done for all images before installing the OSes
-    bool prepareImage(QList<OSInfo> &os);
-    bool prepareImage(OSInfo &os);
+    bool prepareImage(QList<OSInfo *> &os);
 
     bool checkImage(OSInfo &os);
     bool checkPartition(PartitionInfo *partitionInfo);
     bool calculateSpaceRequirements();
 
     bool partitionSDCard();
+    // Starts downloading the largest remote tarball, while the SD card is still being partitioned (see streamImage())
+    void prefetchImage(QList<OSInfo *> &os);
+
+    // Writes the partitions of all OSes concurrently, verifying the raw partitions (see verifyWrites()) and finishing
+    // each OS once all of them are done
+    bool writeImage(QList<OSInfo *> &os);
+    // Writes os_config.json and config.txt (unless they were written while building the boot partition), runs the
+    // partition setup script and adds the OS to installed_os.json
+    bool finishImage(OSInfo &os);
+    // Contents of os_config.json on the boot partition of the OS
+    QVariantMap osConfig(OSInfo &os);
+    // Writes the image, or creates the file system and extracts the tarball (using the mount directory)
+    bool writePartition(OSInfo &os, PartitionInfo *partition, const QString &mountDir);
+    friend class PartitionTask;
 
-    bool writeImage(OSInfo &os);
-    bool writeImage(QList<OSInfo> &os);
+    // Reads back the partitions written by dd() (bypassing the page cache) and compares them against the data written,
+    // needs to be called before any of the partitions is mounted
+    bool verifyWrites();
+
+    // Forward the install state to the job, if there is one
+    void reportPhase(InstallJob::Phase phase);
+    void reportError(const QString &error);
 
     // Keeping track of next start sector, etc.
     int _extraSpacePerPartition,
@@ -50,23 +97,97 @@ private:
         _numexpandparts,
         _startSector,
         _totalSectors,
-        _availableMB;
+        _availableMB,
+        _cacheStart,
+        _cacheSectors;
+
+    /* Chunk cache on the cache partition (NULL if there is none) */
+    Stream::ChunkStore *_chunkStore;
+
+    /* If enabled, the digests of the data written by dd() are recorded per device for verifyWrites() */
+    bool _verifyWrites;
+    QList<QPair<QString, Stream::WriteRecord *> > _writeRecords;
+
+    /* If enabled, supported file systems are built without mkfs and mounting them (see mkfsFromTarball()) */
+    bool _buildFilesystems;
+
+    /* Upper limit of partitions written concurrently, the mutex guards the state shared by their threads */
+    int _maxConcurrentWriters;
+    QMutex _mutex;
+    // Progress of a running stream (see streamImage())
+    struct StreamProgress {
+        qint64 bytesRead,
+               bytesWritten;
+        QVariantList stages;
+    };
+    // key: sink
+    QMap<Stream::Stage *, StreamProgress> _runningStreams;
+    // OSes whose os_config.json and config.txt were written while building their boot partition (see writePartition())
+    QSet<OSInfo *> _bootFilesWritten;
+
+    /* Download started ahead of the write (NULL if there is none) and the image it is reading */
+    Stream::Prefetch *_prefetch;
+    QString _prefetchPath;
+
+    /* Labels of all file systems, built once the SD card is partitioned and updated after each written partition */
+    Disk::LabelIndex _labelIndex;
 
     /* key: partition number, value: partition information */
     QMap<int, PartitionInfo *> _partitionMap;
     QList<OSInfo*> *_osList;
     QVariantList _installed_os;
 
+    // The job this install is running in (might be NULL) and the bytes read and written by the finished streams
+    InstallJob *_job;
+    qint64 _bytesRead,
+           _bytesWritten;
+
     /*
      * Utility functions defined in InstallManager_Utility.cpp
      */
     bool mkfs(const QByteArray &device, const QByteArray &fstype = "ext4", const QByteArray &label = "", const QByteArray &mkfsopt = "");
-    bool dd(const QString &imagePath, const QString &device);
-    bool partclone_restore(const QString &imagePath, const QString &device);
-    bool untar(const QString &tarball);
+    // Creates the file system and fills it with the tarball in a single pass over the device, without mounting it. On
+    // FAT file systems, the given files are added to the content of the tarball (key: path, value: content), either
+    // replacing or being appended to the tarball's files.
+    bool mkfsFromTarball(const QString &tarball, const QByteArray &device, const QByteArray &fstype = "ext4",
+                         const QByteArray &label = "", const QString &chunkIndexPath = QString(),
+                         const QString &sha256 = QString(),
+                         const QMap<QString, QByteArray> &files = QMap<QString, QByteArray>(),
+                         const QMap<QString, QByteArray> &appendedFiles = QMap<QString, QByteArray>());
+    // Returns true if mkfsFromTarball() supports the file system and the mkfs options
+    bool canBuildFilesystem(const QByteArray &fstype, const QByteArray &mkfsopt);
+    // If a block map is given, only the ranges listed in it are written (and downloaded, if the image is uncompressed).
+    // If a chunk index is given, chunks are served from the chunk cache where possible (see streamImage()).
+    // If update is set, the device still holds a previous version of the image and only changed chunks are written.
+    // If a SHA-256 digest is given, the image is verified while it is written (see streamImage()).
+    bool dd(const QString &imagePath, const QString &device, const QString &bmapPath = QString(),
+            const QString &chunkIndexPath = QString(), const QString &sha256 = QString(), bool update = false);
+    bool partclone_restore(const QString &imagePath, const QString &device, const QString &chunkIndexPath = QString(),
+                           const QString &sha256 = QString());
+    bool untar(const QString &tarball, const QString &directory, const QString &chunkIndexPath = QString(),
+               const QString &sha256 = QString());
+    // Streams the (possibly remote) image through the matching decoder into the sink, while reporting the progress. If
+    // a block map is given and the image is uncompressed, only the mapped ranges are read. If a chunk index of a remote
+    // image is given and there is a chunk cache, the image is read through the cache. If a SHA-256 digest is given and
+    // the whole image is read, it is computed over the data as it leaves the source and the pipeline fails on mismatch.
+    // If the whole image was prefetched (see prefetchImage()), the buffered download is taken over.
+    bool streamImage(const QString &imagePath, Stream::Stage *sink, const Stream::BlockMap *blockMap = NULL,
+                     const Stream::ChunkIndex *chunkIndex = NULL, const QString &sha256 = QString());
+    // Reports the bytes written by the finished and running streams to the job, needs to be called with the mutex held
+    void reportStreamProgress();
+    // Returns the bytes read by the sources and written by the sinks of the finished and running streams
+    void streamedBytes(qint64 *bytesRead, qint64 *bytesWritten);
+    bool loadBlockMap(const QString &bmapPath, Stream::BlockMap *blockMap);
+    bool loadChunkIndex(const QString &chunkIndexPath, Stream::ChunkIndex *chunkIndex);
+    void removeCachePartition();
+    // Reads a (possibly remote) text resource
+    bool readResource(const QString &path, string *content);
+    // Checks the label against the label index, instead of searching all devices
     bool isLabelAvailable(const QByteArray &label);
     QByteArray getLabel(const QString part);
     QByteArray getUUID(const QString part);
+    // Display settings appended to config.txt
+    QByteArray configTxtOptions();
     void patchConfigTxt();
     bool writePartitionTable();
     bool isURL(const QString &s);
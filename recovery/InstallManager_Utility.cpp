@@ -16,6 +16,19 @@
 #include "InstallManager.h"
 #include "Utility.h"
 #include "libs/easylogging++.h"
+#include "libs/Stream/Stream.h"
+#include "libs/Stream/StreamSource.h"
+#include "libs/Stream/StreamDecoder.h"
+#include "libs/Stream/StreamSink.h"
+#include "libs/Stream/TarExtractor.h"
+#include "libs/Stream/Ext4Builder.h"
+#include "libs/Stream/FatBuilder.h"
+#include "libs/Stream/BlockMap.h"
+#include "libs/Stream/ChunkIndex.h"
+#include "libs/Stream/ChunkStore.h"
+#include "libs/Stream/WriteRecord.h"
+#include "libs/Web/WebClient.h"
+#include "libs/Disk/PartitionTable.h"
 #include "BootManager.h"
 #include "Utility.h"
 #include <QDir>
@@ -23,9 +36,10 @@
 #include <QProcess>
 #include <QSettings>
 #include <QTime>
+#include <QMutexLocker>
 
 bool InstallManager::writePartitionTable() {
-    /* Write partition table using sfdisk */
+    /* Write partition table natively (see libs/Disk/PartitionTable.h) */
 
     /* Fixed NOOBS partition */
     int startP1 = Utility::Sys::getFileContents("/sys/class/block/mmcblk0p1/start").trimmed().toInt();
@@ -46,6 +60,9 @@ bool InstallManager::writePartitionTable() {
 
     partitionMap.insert(1, new PartitionInfo(1, startP1, sizeP1, "0E")); /* FAT boot partition */
     partitionMap.insert(5, new PartitionInfo(5, startP5, sizeP5, "L")); /* Ext4 settings partition */
+    if (_cacheSectors) {
+        partitionMap.insert(3, new PartitionInfo(3, _cacheStart, _cacheSectors, "L")); /* Ext4 cache partition */
+    }
 
     int sizeExtended = partitionMap.values().last()->endSector() - startExtended;
     if (!partitionMap.contains(2)) {
@@ -67,51 +84,24 @@ bool InstallManager::writePartitionTable() {
             LDEBUG << "    Number: " << partitionMap.key(partition);
         }
 
-    QByteArray partitionTable;
-    for (int i=1; i <= partitionMap.keys().last(); i++) {
-        if (partitionMap.contains(i)) {
-            PartitionInfo *p = partitionMap.value(i);
-
-            partitionTable += QByteArray::number(p->offset())+","+QByteArray::number(p->partitionSizeSectors())+","+p->partitionType();
-            if (p->active()) {
-                partitionTable += " *";
-            }
-            partitionTable += "\n";
-        } else {
-            partitionTable += "0,0\n";
+    Disk::PartitionTable partitionTable("/dev/mmcblk0");
+    foreach(int number, partitionMap.keys()) {
+        PartitionInfo *p = partitionMap.value(number);
+        uint8_t type;
+        if (!Disk::PartitionTable::parseType(p->partitionType().constData(), &type)) {
+            LFATAL << "Invalid type of partition " << number;
+            return false;
         }
+        partitionTable.add(Disk::Partition(number, p->offset(), p->partitionSizeSectors(), type, p->active()));
     }
 
     LDEBUG << "Partition map information gathered";
 
-    LDEBUG << "Unmounting all partitions";
-    /* Unmount everything before modifying partition table */
-    Utility::Sys::unmountPartition(SYSTEMS_DIR);
-    Utility::Sys::unmountPartition(SETTINGS_DIR);
-
-    LDEBUG << "Writing partition table using sfdisk";
-    /* Let sfdisk write a proper partition table */
-    QProcess proc;
-    proc.setProcessChannelMode(proc.MergedChannels);
-    proc.start("/sbin/sfdisk -uS /dev/mmcblk0");
-    proc.write(partitionTable);
-    proc.closeWriteChannel();
-    proc.waitForFinished(-1);
-
-    LDEBUG << "sfdisk done, output " << proc.readAll().constData();
-    ::sync();
-    usleep(500000);
-
-    LDEBUG << "Doing partprobe";
-    QProcess::execute("/usr/sbin/partprobe");
-    usleep(500000);
-
-    /* Remount */
-    Utility::Sys::mountSystemsPartition();
-    Utility::Sys::mountSettingsPartition();
-
-    if (proc.exitCode() != 0) {
-        LFATAL << "Error creating partition table (exit code: " << proc.exitCode() << "): " << proc.readAll().constData();
+    /* Only changed partitions are updated in the kernel, the mounted system, settings and cache partitions keep their
+     * place and stay mounted */
+    LDEBUG << "Writing partition table";
+    if (!partitionTable.write()) {
+        LFATAL << "Error creating partition table";
         return false;
     } else {
         return true;
@@ -160,51 +150,86 @@ bool InstallManager::mkfs(const QByteArray &device, const QByteArray &fstype, co
     }
 }
 
-bool InstallManager::isLabelAvailable(const QByteArray &label) {
-    return (QProcess::execute("/sbin/findfs LABEL="+label) != 0);
-}
-
-bool InstallManager::untar(const QString &tarball) {
-    QString cmd = "sh -o pipefail -c \"";
+bool InstallManager::canBuildFilesystem(const QByteArray &fstype, const QByteArray &mkfsopt) {
+    if (!_buildFilesystems) {
+        return false;
+    } else if (fstype == "fat" || fstype == "FAT") {
+        // The options of mkfs.fat (e.g. "-F 32") all change the layout chosen by the builder
+        return mkfsopt.simplified().isEmpty();
+    } else if (fstype != "ext4") {
+        return false;
+    }
 
-    if (isURL(tarball)) {
-        cmd += "wget --no-verbose --tries=inf -O- "+tarball+" | ";
+    /* Options only disabling features the builder does not use anyway (e.g. "-O ^huge_file") make no difference */
+    QList<QByteArray> options = mkfsopt.simplified().split(' ');
+    for (int i = 0; i < options.size(); i++) {
+        QByteArray features;
+        if (options[i].isEmpty()) {
+            continue;
+        } else if (options[i] == "-O" && i + 1 < options.size()) {
+            features = options[++i];
+        } else if (options[i].startsWith("-O")) {
+            features = options[i].mid(2);
+        } else {
+            LDEBUG << "Not building file system, mkfs option " << options[i].constData() << " is not supported";
+            return false;
+        }
+        foreach (const QByteArray &feature, features.split(',')) {
+            if (!feature.startsWith('^') || Stream::Ext4Builder::hasFeature(feature.mid(1).constData())) {
+                LDEBUG << "Not building file system, feature option " << feature.constData() << " is not supported";
+                return false;
+            }
+        }
     }
+    return true;
+}
 
-    if (tarball.endsWith(".gz")) {
-        cmd += "gzip -dc";
-    } else if (tarball.endsWith(".xz")) {
-        cmd += "xz -dc";
-    } else if (tarball.endsWith(".bz2")) {
-        cmd += "bzip2 -dc";
-    } else if (tarball.endsWith(".lzo")) {
-        cmd += "lzop -dc";
-    } else if (tarball.endsWith(".zip")) {
-        /* Note: the image must be the only file inside the .zip */
-        cmd += "unzip -p";
+bool InstallManager::mkfsFromTarball(const QString &tarball, const QByteArray &device, const QByteArray &fstype,
+                                     const QByteArray &label, const QString &chunkIndexPath, const QString &sha256,
+                                     const QMap<QString, QByteArray> &files,
+                                     const QMap<QString, QByteArray> &appendedFiles) {
+    Stream::Stage *builder;
+    if (fstype == "fat" || fstype == "FAT") {
+        Stream::FatBuilder *fatBuilder = new Stream::FatBuilder(device.constData(), label.constData());
+        foreach (const QString &path, files.keys()) {
+            fatBuilder->addFile(path.toStdString(), files.value(path).toStdString());
+        }
+        foreach (const QString &path, appendedFiles.keys()) {
+            fatBuilder->addFile(path.toStdString(), appendedFiles.value(path).toStdString(), true);
+        }
+        builder = fatBuilder;
+    } else if (fstype == "ext4" && files.isEmpty() && appendedFiles.isEmpty()) {
+        builder = new Stream::Ext4Builder(device.constData(), label.constData());
     } else {
-        LFATAL << "Unknown compression format file extension. Expecting .lzo, .gz, .xz, .bz2 or .zip";
+        LFATAL << "Unable to build file system " << fstype.constData();
         return false;
     }
-
-    if (!isURL(tarball)) {
-        cmd += " "+tarball;
-    }
-    cmd += " | tar x -C /mnt2 ";
-    cmd += "\"";
-
     QTime t1;
     t1.start();
-    LDEBUG << "Executing:" << cmd.toUtf8().constData();
+    Stream::ChunkIndex chunkIndex;
+    bool useChunkIndex = !chunkIndexPath.isEmpty() && loadChunkIndex(chunkIndexPath, &chunkIndex);
+    if (!streamImage(tarball, builder, NULL, useChunkIndex ? &chunkIndex : NULL, sha256)) {
+        LFATAL << "Error downloading tarball or building file system";
+        return false;
+    } else {
+        LDEBUG << "Finished building filesystem in " << (t1.elapsed()/1000.0) << " seconds";
+        return true;
+    }
+}
 
-    QProcess p;
-    p.setProcessChannelMode(p.MergedChannels);
-    p.start(cmd);
-    p.closeWriteChannel();
-    p.waitForFinished(-1);
+bool InstallManager::isLabelAvailable(const QByteArray &label) {
+    return !_labelIndex.contains(label.constData());
+}
 
-    if (p.exitCode() != 0) {
-        LFATAL << "Error downloading or extracting tarball: " << p.readAll().constData();
+bool InstallManager::untar(const QString &tarball, const QString &directory, const QString &chunkIndexPath,
+                           const QString &sha256) {
+    QTime t1;
+    t1.start();
+    Stream::ChunkIndex chunkIndex;
+    bool useChunkIndex = !chunkIndexPath.isEmpty() && loadChunkIndex(chunkIndexPath, &chunkIndex);
+    if (!streamImage(tarball, new Stream::TarExtractor(directory.toStdString()), NULL, useChunkIndex ? &chunkIndex : NULL,
+                     sha256)) {
+        LFATAL << "Error downloading or extracting tarball";
         return false;
     } else {
         LDEBUG << "Finished writing filesystem in " << (t1.elapsed()/1000.0) << " seconds";
@@ -212,95 +237,116 @@ bool InstallManager::untar(const QString &tarball) {
     }
 }
 
-bool InstallManager::dd(const QString &imagePath, const QString &device) {
-    QString cmd = "sh -o pipefail -c \"";
+bool InstallManager::dd(const QString &imagePath, const QString &device, const QString &bmapPath, const QString &chunkIndexPath,
+                        const QString &sha256, bool update) {
+    QTime t1;
+    t1.start();
 
-    if (isURL(imagePath)) {
-        cmd += "wget --no-verbose --tries=inf -O- "+imagePath+" | ";
+    Stream::ChunkIndex chunkIndex;
+    bool useChunkIndex = !chunkIndexPath.isEmpty() && loadChunkIndex(chunkIndexPath, &chunkIndex);
+
+    Stream::BlockMap blockMap;
+    bool useBlockMap = false;
+    if (useChunkIndex && update) {
+        QTime t2;
+        t2.start();
+        if (chunkIndex.compare(device.toStdString(), &blockMap)) {
+            LDEBUG << "Compared " << device.toUtf8().constData() << " against the chunk index in " << (t2.elapsed() / 1000.0) << " seconds";
+            LINFO << "Updating " << blockMap.ranges().size() << " changed chunks (" << blockMap.mappedSize() << " bytes)";
+            useBlockMap = true;
+        } else {
+            LWARNING << "Unable to compare " << device.toUtf8().constData() << " against the chunk index, writing the whole image";
+        }
     }
-
-    if (imagePath.endsWith(".gz")) {
-        cmd += "gzip -dc";
-    } else if (imagePath.endsWith(".xz")) {
-        cmd += "xz -dc";
-    } else if (imagePath.endsWith(".bz2")) {
-        cmd += "bzip2 -dc";
-    } else if (imagePath.endsWith(".lzo")) {
-        cmd += "lzop -dc";
-    } else if (imagePath.endsWith(".zip")) {
-        /* Note: the image must be the only file inside the .zip */
-        cmd += "unzip -p";
-    } else {
-        LFATAL << "Unknown compression format file extension. Expecting .lzo, .gz, .xz, .bz2 or .zip";
-        return false;
+    if (!useBlockMap && !bmapPath.isEmpty() && loadBlockMap(bmapPath, &blockMap)) {
+        LINFO << "Writing " << blockMap.mappedSize() << " of " << blockMap.imageSize() << " bytes according to block map";
+        useBlockMap = true;
     }
 
-    if (!isURL(imagePath)) {
-        cmd += " "+imagePath;
+    if (useBlockMap && blockMap.ranges().empty()) {
+        LINFO << "Nothing to write, " << device.toUtf8().constData() << " is up to date";
+        return true;
     }
 
-    cmd += " | dd of="+device+" conv=fsync obs=4M\"";
-
-    QTime t1;
-    t1.start();
-    LDEBUG << "Executing:" << cmd.toUtf8().constData();
-
-    QProcess p;
-    p.setProcessChannelMode(p.MergedChannels);
-    p.start(cmd);
-    p.closeWriteChannel();
-    p.waitForFinished(-1);
+    Stream::WriteRecord *record = _verifyWrites ? new Stream::WriteRecord() : NULL;
+    Stream::Stage *sink;
+    if (useBlockMap) {
+        /* An uncompressed image is read range by range, so the source only provides the mapped data */
+        Stream::BmapSink *bmapSink = new Stream::BmapSink(device.toStdString(), blockMap,
+                                                          Stream::isUncompressed(imagePath.toStdString()));
+        bmapSink->recordWrites(record);
+        sink = bmapSink;
+    } else {
+        Stream::BlockDeviceSink *deviceSink = new Stream::BlockDeviceSink(device.toStdString(), true);
+        deviceSink->recordWrites(record);
+        sink = deviceSink;
+    }
 
-    if (p.exitCode() != 0) {
-        LFATAL << "Error downloading or writing OS to SD card: " << p.readAll().constData();
+    if (!streamImage(imagePath, sink, useBlockMap ? &blockMap : NULL, useChunkIndex ? &chunkIndex : NULL, sha256)) {
+        LFATAL << "Error downloading or writing OS to SD card";
+        delete(record);
         return false;
     } else {
         LDEBUG << "Finished writing filesystem in " << (t1.elapsed() / 1000.0) << " seconds";
+        if (record) {
+            QMutexLocker locker(&_mutex);
+            _writeRecords.append(qMakePair(device, record));
+        }
         return true;
     }
 }
 
-bool InstallManager::partclone_restore(const QString &imagePath, const QString &device) {
-    QString cmd = "sh -o pipefail -c \"";
-
-    if (isURL(imagePath)) {
-        cmd += "wget --no-verbose --tries=inf -O- "+imagePath+" | ";
+bool InstallManager::loadBlockMap(const QString &bmapPath, Stream::BlockMap *blockMap) {
+    LDEBUG << "Loading block map " << bmapPath.toUtf8().constData();
+    string xml;
+    if (!readResource(bmapPath, &xml)) {
+        LWARNING << "Unable to load block map, writing the whole image";
+        return false;
+    } else if (!blockMap->parse(xml)) {
+        LWARNING << "Invalid block map, writing the whole image";
+        return false;
     }
+    return true;
+}
 
-    if (imagePath.endsWith(".gz")) {
-        cmd += "gzip -dc";
-    } else if (imagePath.endsWith(".xz")) {
-        cmd += "xz -dc";
-    } else if (imagePath.endsWith(".bz2")) {
-        cmd += "bzip2 -dc";
-    } else if (imagePath.endsWith(".lzo")) {
-        cmd += "lzop -dc";
-    } else if (imagePath.endsWith(".zip")) {
-        /* Note: the image must be the only file inside the .zip */
-        cmd += "unzip -p";
-    } else {
-        LFATAL << "Unknown compression format file extension. Expecting .lzo, .gz, .xz, .bz2 or .zip";
+bool InstallManager::loadChunkIndex(const QString &chunkIndexPath, Stream::ChunkIndex *chunkIndex) {
+    LDEBUG << "Loading chunk index " << chunkIndexPath.toUtf8().constData();
+    string text;
+    if (!readResource(chunkIndexPath, &text) || !chunkIndex->parse(text)) {
+        LWARNING << "Unable to load chunk index, ignoring it";
         return false;
     }
+    return true;
+}
 
-    if (!isURL(imagePath)) {
-        cmd += " "+imagePath;
+bool InstallManager::readResource(const QString &path, string *content) {
+    content->clear();
+    if (isURL(path)) {
+        Web::WebClient webClient;
+        return webClient.get(path.toStdString(), [&](const char *data, size_t length) {
+            content->append(data, length);
+            return true;
+        });
     }
 
-    cmd += " | partclone.restore -q -s - -o "+device+" \"";
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+    *content = file.readAll().toStdString();
+    return true;
+}
 
+bool InstallManager::partclone_restore(const QString &imagePath, const QString &device, const QString &chunkIndexPath,
+                                       const QString &sha256) {
     QTime t1;
     t1.start();
-    LDEBUG << "Executing:" << cmd.toUtf8().constData();
-
-    QProcess p;
-    p.setProcessChannelMode(p.MergedChannels);
-    p.start(cmd);
-    p.closeWriteChannel();
-    p.waitForFinished(-1);
-
-    if (p.exitCode() != 0) {
-        LFATAL << "Error downloading or writing OS to SD card" << p.readAll().constData();
+    Stream::ChunkIndex chunkIndex;
+    bool useChunkIndex = !chunkIndexPath.isEmpty() && loadChunkIndex(chunkIndexPath, &chunkIndex);
+    QString cmd = "partclone.restore -q -s - -o " + device;
+    if (!streamImage(imagePath, new Stream::ProcessSink(cmd.toStdString(), "partclone"), NULL,
+                     useChunkIndex ? &chunkIndex : NULL, sha256)) {
+        LFATAL << "Error downloading or writing OS to SD card";
         return false;
     } else {
         LDEBUG << "Finished writing filesystem in " << (t1.elapsed()/1000.0) << " seconds";
@@ -309,7 +355,109 @@ bool InstallManager::partclone_restore(const QString &imagePath, const QString &
     return true;
 }
 
-void InstallManager::patchConfigTxt() {
+bool InstallManager::streamImage(const QString &imagePath, Stream::Stage *sink, const Stream::BlockMap *blockMap,
+                                 const Stream::ChunkIndex *chunkIndex, const QString &sha256) {
+    /* The pipeline takes ownership of all stages */
+    Stream::Pipeline pipeline;
+    bool uncompressed = Stream::isUncompressed(imagePath.toStdString());
+    vector<Stream::ByteRange> ranges;
+    if (blockMap && uncompressed) {
+        ranges = blockMap->ranges();
+    }
+    Stream::Stage *source = NULL;
+    if (_prefetch && imagePath == _prefetchPath && ranges.empty() && !(chunkIndex && _chunkStore)) {
+        // NULL if the prefetched download was already taken over by another partition using the same image
+        source = _prefetch->take();
+    }
+    if (source) {
+        LDEBUG << "Using prefetched " << imagePath.toUtf8().constData();
+    } else if (isURL(imagePath) && chunkIndex && _chunkStore) {
+        source = new Stream::CachedSource(imagePath.toStdString(), chunkIndex, _chunkStore, ranges);
+    } else if (isURL(imagePath)) {
+        source = new Stream::HttpSource(imagePath.toStdString(), ranges);
+    } else {
+        source = new Stream::FileSource(imagePath.toStdString(), ranges);
+    }
+    pipeline.add(source);
+
+    /* Only the whole image can be checked against its digest, mapped ranges are verified by the block map checksums */
+    if (!sha256.isEmpty() && ranges.empty()) {
+        if (!source->verifyOutput("sha256", sha256.toLower().toStdString())) {
+            LWARNING << "Unable to verify " << imagePath.toUtf8().constData() << ", SHA-256 is not supported";
+        }
+    } else if (!sha256.isEmpty()) {
+        LDEBUG << "Only reading parts of " << imagePath.toUtf8().constData() << ", not verifying its SHA-256 digest";
+    }
+
+    if (!uncompressed) {
+        Stream::Stage *decoder = Stream::createDecoder(imagePath.toStdString());
+        if (!decoder) {
+            delete(sink);
+            return false;
+        }
+        pipeline.add(decoder);
+    }
+    pipeline.add(sink);
+
+    /* The counters are collected without a job as well, since writeImage() schedules the writers based on them */
+    bool success = pipeline.run([&]() {
+        StreamProgress progress;
+        progress.bytesRead = source->bytesOut();
+        progress.bytesWritten = sink->bytesOut();
+        if (_job) {
+            foreach (const Stream::StageStats &stats, pipeline.stats()) {
+                QVariantMap stage;
+                stage.insert("name", QString::fromStdString(stats.name));
+                stage.insert("bytes_in", (qint64) stats.bytesIn);
+                stage.insert("bytes_out", (qint64) stats.bytesOut);
+                progress.stages.append(stage);
+            }
+        }
+
+        /* Several partitions might be streamed concurrently, the job reports their combined progress */
+        QMutexLocker locker(&_mutex);
+        _runningStreams.insert(sink, progress);
+        reportStreamProgress();
+    }, PROGRESS_INTERVAL);
+
+    QMutexLocker locker(&_mutex);
+    _runningStreams.remove(sink);
+    _bytesRead += source->bytesOut();
+    _bytesWritten += sink->bytesOut();
+    reportStreamProgress();
+    locker.unlock();
+    if (!success) {
+        reportError(QString::fromStdString(pipeline.error()));
+    }
+    return success;
+}
+
+void InstallManager::reportStreamProgress() {
+    if (_job) {
+        qint64 bytesDone = _bytesWritten;
+        QVariantList stages;
+        foreach (const StreamProgress &progress, _runningStreams) {
+            bytesDone += progress.bytesWritten;
+            stages += progress.stages;
+        }
+        _job->setBytesDone(bytesDone);
+        if (!stages.isEmpty()) {
+            _job->setStages(stages);
+        }
+    }
+}
+
+void InstallManager::streamedBytes(qint64 *bytesRead, qint64 *bytesWritten) {
+    QMutexLocker locker(&_mutex);
+    *bytesRead = _bytesRead;
+    *bytesWritten = _bytesWritten;
+    foreach (const StreamProgress &progress, _runningStreams) {
+        *bytesRead += progress.bytesRead;
+        *bytesWritten += progress.bytesWritten;
+    }
+}
+
+QByteArray InstallManager::configTxtOptions() {
     QSettings settings("/settings/noobs.conf", QSettings::IniFormat);
     int videomode = settings.value("display_mode", 0).toInt();
 
@@ -329,40 +477,29 @@ void InstallManager::patchConfigTxt() {
             dispOptions = "hdmi_ignore_hotplug=1\r\nsdtv_mode=0\r\n";
             break;
         default:
-            LWARNING << "Reached default case in patchConfigTxt, this should not happen";
+            LWARNING << "Reached default case in configTxtOptions, this should not happen";
             break;
     }
+    return "\r\n# NOOBS Auto-generated Settings:\r\n"+dispOptions;
+}
 
+void InstallManager::patchConfigTxt() {
     QFile f("/mnt2/config.txt");
     f.open(f.Append);
-    f.write("\r\n# NOOBS Auto-generated Settings:\r\n"+dispOptions);
+    f.write(configTxtOptions());
     f.close();
 }
 
 QByteArray InstallManager::getLabel(const QString part) {
-    QByteArray result;
-    QProcess p;
-    p.start("/sbin/blkid -s LABEL -o value "+part);
-    p.waitForFinished();
-
-    if (p.exitCode() == 0) {
-        result = p.readAll().trimmed();
-    }
-
-    return result;
+    Disk::FilesystemInfo info;
+    Disk::probeFilesystem(part.toStdString(), &info);
+    return QByteArray(info.label.c_str());
 }
 
 QByteArray InstallManager::getUUID(const QString part) {
-    QByteArray result;
-    QProcess p;
-    p.start("/sbin/blkid -s UUID -o value "+part);
-    p.waitForFinished();
-
-    if (p.exitCode() == 0) {
-        result = p.readAll().trimmed();
-    }
-
-    return result;
+    Disk::FilesystemInfo info;
+    Disk::probeFilesystem(part.toStdString(), &info);
+    return QByteArray(info.uuid.c_str());
 }
 
 bool InstallManager::isURL(const QString &s) {
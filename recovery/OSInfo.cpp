@@ -101,54 +101,59 @@ bool OSInfo::parseOS(const QMap<QString, QVariant> &os) {
     if(!Utility::Json::parseEntry<QStringList>(os, OS_TARBALLS, &_tarballs, false, "tarball information")) {
         return false;
     }
-
-    /*
-     * Parsing nested OS info
-     */
-    QString url;
-    if(!Utility::Json::parseEntry<QString>(os, OS_INFO, &url, false, "OS info URL")) {
+    if(!Utility::Json::parseEntry<QStringList>(os, OS_TARBALL_SHA256, &_tarballDigests, true, "tarball digests")) {
         return false;
-    } else {
-        LDEBUG << "Found OS info URL " << url.toUtf8().constData();
-        if(!parseOSInfo(url)) {
-            LFATAL << "Error while parsing os info";
-            return false;
-        }
     }
 
     /*
-     * Parsing nested OS partition info
+     * Nested OS info, partition info and partition setup script
      */
-    if(!Utility::Json::parseEntry<QString>(os, OS_PARTITION_INFO, &url, false, "OS partition info URL")) {
+    QString osInfoUrl, partitionInfoUrl, partitionSetupUrl;
+    if(!Utility::Json::parseEntry<QString>(os, OS_INFO, &osInfoUrl, false, "OS info URL") ||
+       !Utility::Json::parseEntry<QString>(os, OS_PARTITION_INFO, &partitionInfoUrl, false, "OS partition info URL") ||
+       !Utility::Json::parseEntry<QString>(os, OS_PARTITION_SETUP, &partitionSetupUrl, true, "OS partition setup URL")) {
         return false;
-    } else {
-        LDEBUG << "Found OS partition info URL " << url.toUtf8().constData();
-        if(!parsePartitionInfo(url)) {
-            LFATAL << "Error while parsing OS partition info";
-            return false;
-        }
     }
+    LDEBUG << "Found OS info URL " << osInfoUrl.toUtf8().constData();
+    LDEBUG << "Found OS partition info URL " << partitionInfoUrl.toUtf8().constData();
 
-    url.clear();
-    if(!Utility::Json::parseEntry<QString>(os, OS_PARTITION_SETUP, &url, true, "OS partition setup URL")) {
-        return false;
-    } else if (url.isEmpty()) {
+    std::vector<std::string> urls;
+    urls.push_back(osInfoUrl.toUtf8().constData());
+    urls.push_back(partitionInfoUrl.toUtf8().constData());
+    if (partitionSetupUrl.isEmpty()) {
         LWARNING << "Unable to find OS partition setup URL";
     } else {
-        LDEBUG << "Found OS partition setup URL " << url.toUtf8().constData();
-        _partitionSetupScript = downloadRessource(url);
-        if(_partitionSetupScript.isEmpty()) {
-            LFATAL << "Unable to download OS partition setup script";
-            return false;
-        }
+        LDEBUG << "Found OS partition setup URL " << partitionSetupUrl.toUtf8().constData();
+        urls.push_back(partitionSetupUrl.toUtf8().constData());
     }
 
-    return true;
+    /* All documents are downloaded concurrently, each one is parsed as soon as it arrives */
+    bool success = true;
+    Web::WebClient webClient;
+    webClient.fetchAll(urls, [&](size_t index, bool fetched, const std::string &body) {
+        QByteArray document(body.data(), (int) body.size());
+        if(!success) {
+            return;
+        } else if(!fetched || document.isEmpty()) {
+            LFATAL << "Unable to download " << urls[index];
+            success = false;
+        } else if(index == 0 && !parseOSInfo(document)) {
+            LFATAL << "Error while parsing os info";
+            success = false;
+        } else if(index == 1 && !parsePartitionInfo(document)) {
+            LFATAL << "Error while parsing OS partition info";
+            success = false;
+        } else if(index == 2) {
+            _partitionSetupScript = document;
+        }
+    });
+
+    return success;
 }
 
-bool OSInfo::parseOSInfo(QString &url) {
+bool OSInfo::parseOSInfo(const QByteArray &json) {
     LDEBUG << "Processing OS info";
-    QMap<QString, QVariant> osInfo = Utility::Json::parseJson(downloadRessource(url));
+    QMap<QString, QVariant> osInfo = Utility::Json::parseJson(json);
 
     /*
      * Values that might already have been set previously
@@ -186,9 +191,9 @@ bool OSInfo::parseOSInfo(QString &url) {
     return true;
 }
 
-bool OSInfo::parsePartitionInfo(QString &url) {
+bool OSInfo::parsePartitionInfo(const QByteArray &json) {
     LINFO << "Processing partition info";
-    QMap<QString, QVariant> partitionInfo = Utility::Json::parseJson(downloadRessource(url));
+    QMap<QString, QVariant> partitionInfo = Utility::Json::parseJson(json);
     QVariantList partitionInfoList;
 
     if(!Utility::Json::parseEntry<QVariantList>(partitionInfo, OS_PARTITIONS, &partitionInfoList, false, "OS partitions")) {
@@ -207,7 +212,8 @@ bool OSInfo::parsePartitionInfo(QString &url) {
         int i = 0;
         foreach(QVariant partition, partitionInfoList) {
             if(partition.canConvert<QVariantMap>()) {
-                partInfo = new PartitionInfo(partition.toMap(), _tarballs[i++]);
+                partInfo = new PartitionInfo(partition.toMap(), _tarballs[i], i < _tarballDigests.size() ? _tarballDigests[i] : QString());
+                i++;
                 if(partInfo->isValid()) {
                     _partitions.append(partInfo);
                 } else {
@@ -223,23 +229,6 @@ bool OSInfo::parsePartitionInfo(QString &url) {
     return true;
 }
 
-QByteArray OSInfo::downloadRessource(QString &url) {
-    LDEBUG << "Downloading " << url.toUtf8().constData();
-
-    Web::WebClient webClient;
-    std::string urlString = std::string(url.toUtf8().constData());
-    std::string response = webClient.get(urlString);
-
-
-    if(response.empty()) {
-        LFATAL << "Unable to download " << url.toUtf8().constData();
-        return QByteArray();
-    } else {
-        LDEBUG << "Successfully downloaded " << url.toUtf8().constData();
-        return QByteArray(response.c_str());
-    }
-}
-
 QVariantList OSInfo::vPartitionList() const {
     QVariantList vPartitions;
     foreach (PartitionInfo *p, _partitions) {
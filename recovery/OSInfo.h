@@ -30,6 +30,7 @@
 #define OS_RELEASE_DATE "release_date"
 #define OS_SUP_MODELS "supported_models"
 #define OS_TARBALLS "tarballs"
+#define OS_TARBALL_SHA256 "tarball_sha256" // Optional list of digests, in the order of the tarballs
 #define OS_BOOTABLE "bootable"
 #define OS_VERSION "version"
 #define OS_RISCOS_OFFSET "riscos_offset" // Formerly known as RISCOS_OFFSET_KEY
@@ -71,7 +72,8 @@ protected:
             _version,
             _releaseDate;
 
-    QStringList _tarballs;
+    QStringList _tarballs,
+                _tarballDigests;
 
     bool _bootable,
          _valid, // Check for this variable to see if the object is usable
@@ -84,20 +86,20 @@ protected:
 
 
 private:
+    // The object owns its PartitionInfo objects, so copies would delete them twice
+    Q_DISABLE_COPY(OSInfo)
+
     bool parseOS(const QMap<QString, QVariant> &os);
 
     /*
-     * This function retrieves the os_info.json file, parses its information into the object and stores the file persistently
+     * This function parses the content of the os_info.json file into the object
      */
-    bool parseOSInfo(QString &url);
+    bool parseOSInfo(const QByteArray &json);
 
     /*
-     * This function retrieves the partitions.json file, parses its information into the object and stores the file persistently
+     * This function parses the content of the partitions.json file into the object
      */
-    bool parsePartitionInfo(QString &url);
-
-
-    QByteArray downloadRessource(QString &url);
+    bool parsePartitionInfo(const QByteArray &json);
 };
 
 #endif // RECOVERY_OSINFO_H
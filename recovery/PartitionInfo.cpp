@@ -20,6 +20,7 @@
 #include "PartitionInfo.h"
 #include "libs/easylogging++.h"
 #include "Utility.h"
+#include "libs/Disk/Mount.h"
 
 /*
  * Keys of partition info map
@@ -35,17 +36,23 @@
 #define PI_UNCOMPRESSED_TAR_SIZE "uncompressed_tarball_size"
 #define PI_ACTIVE "active"
 #define PI_PART_TYPE "partition_type"
+#define PI_SHA256 "sha256"
+#define PI_BMAP "bmap"
+#define PI_CHUNK_INDEX "chunk_index"
 
 PartitionInfo::PartitionInfo(const QMap<QString, QVariant> &partInfo,
-                             const QString &tarball) : _tarball(tarball),
-                                                       _mountedDir(""),
-                                                       _partitionSizeNominal(0),
-                                                       _requiresPartitionNumber(0),
-                                                       _offset(0),
-                                                       _uncompressedTarballSize(0),
-                                                       _emptyFS(false),
-                                                       _wantMaximised(false),
-                                                       _active(false) {
+                             const QString &tarball,
+                             const QString &sha256) : _tarball(tarball),
+                                                      _sha256(sha256),
+                                                      _mountedDir(""),
+                                                      _partitionSizeNominal(0),
+                                                      _requiresPartitionNumber(0),
+                                                      _offset(0),
+                                                      _uncompressedTarballSize(0),
+                                                      _emptyFS(false),
+                                                      _wantMaximised(false),
+                                                      _active(false),
+                                                      _reuseContents(false) {
     LDEBUG << "Creating PartitionInfo object from JSON";
 
     _valid = parsePartitionInfo(partInfo);
@@ -96,6 +103,21 @@ bool PartitionInfo::parsePartitionInfo(QMap<QString, QVariant> partitionInfo) {
         LDEBUG << "Found required number of partitions: " << _requiresPartitionNumber;
     }
 
+    /* Digest of the tarball as downloaded, overriding the one given by the OS info */
+    if(Utility::Json::parseEntry<QString>(partitionInfo, PI_SHA256, &_sha256, true, "tarball digest")) {
+        LDEBUG << "Found tarball digest " << _sha256.toUtf8().constData();
+    }
+
+    /* Block map (.bmap) of a raw image, listing the ranges that need to be written */
+    if(Utility::Json::parseEntry<QString>(partitionInfo, PI_BMAP, &_bmap, true, "block map")) {
+        LDEBUG << "Found block map " << _bmap.toUtf8().constData();
+    }
+
+    /* Chunk index of a raw image, allowing to only update the chunks that changed since the last install */
+    if(Utility::Json::parseEntry<QString>(partitionInfo, PI_CHUNK_INDEX, &_chunkIndex, true, "chunk index")) {
+        LDEBUG << "Found chunk index " << _chunkIndex.toUtf8().constData();
+    }
+
     if(Utility::Json::parseEntry<int>(partitionInfo, PI_UNCOMPRESSED_TAR_SIZE, &_uncompressedTarballSize, true, "uncompressed tarball size")) {
         LDEBUG << "Found uncompressed tarball size: " << _uncompressedTarballSize;
     }
@@ -112,9 +134,10 @@ PartitionInfo::PartitionInfo(int partitionNr, int offset, int sectors, const QBy
                                                                                                      _requiresPartitionNumber(partitionNr),
                                                                                                      _offset(offset),
                                                                                                      _partitionSizeSectors(sectors),
-                                                                                                     _active(false) {}
+                                                                                                     _active(false),
+                                                                                                     _reuseContents(false) {}
 
-bool PartitionInfo::mountPartition(const QString &dir, const char* args) {
+bool PartitionInfo::mountPartition(const QString &dir, const char* options) {
     if(!_mountedDir.isEmpty()) {
         LFATAL << "Can't mount partition, because it is still mounted";
         return false;
@@ -123,24 +146,26 @@ bool PartitionInfo::mountPartition(const QString &dir, const char* args) {
         return false;
     }
 
-    QString mountCMD;
-    if(_fstype == "ntfs") {
-        LDEBUG << "Mounting ntfs partition";
-        mountCMD = "/sbin/mount.ntfs-3g ";
-    } else {
-        LDEBUG << "Mounting non-ntfs partition";
-        mountCMD = "mount ";
-    }
-
     QDir d;
     if(d.exists(dir) && d.exists(_partitionDevice)) {
-        LDEBUG << "Mounting partition " << _partitionDevice.constData() << "with file system " << _fstype.constData() << " into " << dir.toUtf8().constData() << " (with arguments: " << args << ")";
-        if(QProcess::execute(mountCMD + " " + args + " " + _partitionDevice + " " + dir) == 0) {
+        LDEBUG << "Mounting partition " << _partitionDevice.constData() << "with file system " << _fstype.constData() << " into " << dir.toUtf8().constData() << " (with options: " << options << ")";
+        bool mounted;
+        if(_fstype == "ntfs") {
+            // NTFS is served by the ntfs-3g FUSE driver, which can only be mounted through its helper
+            LDEBUG << "Mounting ntfs partition";
+            mounted = QProcess::execute("/sbin/mount.ntfs-3g " + (qstrlen(options) ? "-o " + QString(options) + " " : QString())
+                                        + _partitionDevice + " " + dir) == 0;
+        } else {
+            // The type given in the OS description (e.g. "FAT") is not necessarily known to the kernel, so it is detected
+            LDEBUG << "Mounting non-ntfs partition";
+            mounted = Disk::mount(_partitionDevice.constData(), dir.toStdString(), string(), options);
+        }
+        if(mounted) {
             LDEBUG << "Mount successful!";
             _mountedDir = dir;
             return true;
         } else {
-            LDEBUG << "Mounting partition " << _partitionDevice.constData() << " with file system " << _fstype.constData() << " into " << dir.toUtf8().constData() << " (with arguments: " << args << ") failed!";
+            LDEBUG << "Mounting partition " << _partitionDevice.constData() << " with file system " << _fstype.constData() << " into " << dir.toUtf8().constData() << " (with options: " << options << ") failed!";
             return false;
         }
     } else {
@@ -152,7 +177,7 @@ bool PartitionInfo::mountPartition(const QString &dir, const char* args) {
 bool PartitionInfo::unmountPartition() {
     if(!_mountedDir.isEmpty()) {
         LDEBUG << "Unmounting partition " << _partitionDevice.constData() << " from mount point " << _mountedDir.toUtf8().constData();
-        if(QProcess::execute("umount " + _mountedDir) == 0) {
+        if(Disk::unmount(_mountedDir.toStdString())) {
             LINFO << "Successfully unmounted partition " << _partitionDevice.constData() << " from mount point " << _mountedDir.toUtf8().constData();
             _mountedDir.clear();
             return true;
@@ -173,5 +198,8 @@ void PartitionInfo::printPartitionInfo() {
     LDEBUG << "        Partition Type: " << _partitionType.constData();
     LDEBUG << "        MKFS Options: " << _mkfsOptions.constData();
     LDEBUG << "        Tarball: " << _tarball.toUtf8().constData();
+    LDEBUG << "        SHA256: " << _sha256.toUtf8().constData();
+    LDEBUG << "        Block map: " << _bmap.toUtf8().constData();
+    LDEBUG << "        Chunk index: " << _chunkIndex.toUtf8().constData();
     LDEBUG << "        Mounted dir: " << _tarball.toUtf8().constData();
 }
\ No newline at end of file
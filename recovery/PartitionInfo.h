@@ -24,10 +24,11 @@
 class PartitionInfo {
 public:
     /* Constructor. Gets called from OsInfo with info from json file */
-    explicit PartitionInfo(const QMap<QString, QVariant> &m, const QString &tarball);
+    explicit PartitionInfo(const QMap<QString, QVariant> &m, const QString &tarball, const QString &sha256 = QString());
     explicit PartitionInfo(int partitionNr, int offset, int sectors, const QByteArray &partType);
 
-    bool mountPartition(const QString &dir, const char* args = "");
+    // Options are given like for mount -o (e.g. "ro,noatime")
+    bool mountPartition(const QString &dir, const char* options = "");
     bool unmountPartition();
 
     void printPartitionInfo();
@@ -39,6 +40,7 @@ public:
     inline void setRequiresPartitionNumber(int nr) { _requiresPartitionNumber = nr; }
     inline void setPartitionSizeSectors(int size) { _partitionSizeSectors = size; }
     inline void setOffset(int offset) { _offset = offset; }
+    inline void setReuseContents(bool reuse) { _reuseContents = reuse; }
 
     /*
      * Getter
@@ -49,6 +51,9 @@ public:
     inline QByteArray label() { return _label; }
     inline QByteArray partitionType() { return _partitionType; }
     inline QString tarball() { return _tarball; }
+    inline QString sha256() { return _sha256; }
+    inline QString bmap() { return _bmap; }
+    inline QString chunkIndex() { return _chunkIndex; }
     inline int partitionSizeNominal() { return _partitionSizeNominal; }
     inline int requiresPartitionNumber() { return _requiresPartitionNumber; }
     inline int uncompressedTarballSize() { return _uncompressedTarballSize; }
@@ -58,6 +63,8 @@ public:
     inline bool emptyFS() { return _emptyFS; }
     inline bool wantMaximised() { return _wantMaximised; }
     inline bool active() { return _active; }
+    /* True if the partition kept its place on the SD card, so its previous content can be updated instead of replaced */
+    inline bool reuseContents() { return _reuseContents; }
     inline bool isValid() { return _valid; } // Indicates if config is valid
 
 protected:
@@ -67,6 +74,9 @@ protected:
                _partitionDevice,
                _partitionType;
     QString _tarball,
+            _sha256,
+            _bmap,
+            _chunkIndex,
             _mountedDir;
     int _partitionSizeNominal,
         _requiresPartitionNumber,
@@ -76,6 +86,7 @@ protected:
     bool _emptyFS,
          _wantMaximised,
          _active,
+         _reuseContents,
          _valid;
 
 private:
@@ -17,6 +17,9 @@
 
 #include "libs/easylogging++.h"
 #include "BootManager.h"
+#include "libs/Disk/PartitionTable.h"
+#include "libs/Disk/DeviceMonitor.h"
+#include "libs/Net/AddressMonitor.h"
 #include <QProcess>
 #include <QFile>
 #include <QDir>
@@ -24,7 +27,7 @@
 #include <unistd.h>
 #include <linux/fs.h>
 #include <sys/ioctl.h>
-#include <QtNetwork/QNetworkInterface>
+#include <QElapsedTimer>
 #include <QCoreApplication>
 
 // This function checks if the SD Card is properly formatted, if this is not the case it will be formatted.
@@ -32,9 +35,10 @@ bool PreSetup::checkAndPrepareSDCard() {
     QDir dir;
 
     LINFO << "Waiting for SD card to be ready";
-    while (!QFile::exists("/dev/mmcblk0"))
+    Disk::DeviceMonitor monitor;
+    while (!monitor.waitForDevice("/dev/mmcblk0", SD_CARD_WAIT_INTERVAL))
     {
-        usleep(100);
+        LWARNING << "Still waiting for SD card";
     }
 
     LINFO << "Checking if this SD Card has already been formatted";
@@ -63,6 +67,14 @@ bool PreSetup::checkAndPrepareSDCard() {
         return false;
     }
 
+    if (QFile::exists(CACHE_PARTITION)) {
+        LDEBUG << "Formatting cache partition";
+        if (!formatCachePartition()) {
+            LFATAL << "Error formatting cache partition";
+            return false;
+        }
+    }
+
 #ifdef RISCOS_BLOB_FILENAME
     if (QFile::exists(RISCOS_BLOB_FILENAME))
     {
@@ -84,10 +96,12 @@ bool PreSetup::checkAndPrepareSDCard() {
 
     LDEBUG << "Checking changes...";
     /* Perform a quick test to verify our changes were written
-     * Drop page cache to make sure we are reading from card, and not from cache */
-    QFile dc("/proc/sys/vm/drop_caches");
-    dc.open(dc.WriteOnly);
-    dc.write("3\n");
+     * Invalidate the cached blocks of the systems partition to make sure we are reading from card, and not from cache.
+     * Unlike dropping the page cache, this does not affect any other device. */
+    QFile dc(SYSTEMS_PARTITION);
+    if (!dc.open(dc.ReadOnly) || ioctl(dc.handle(), BLKFLSBUF) != 0) {
+        LWARNING << "Unable to invalidate cache of " << SYSTEMS_PARTITION;
+    }
     dc.close();
 
     LDEBUG << "Mounting boot partition again";
@@ -124,17 +138,23 @@ bool PreSetup::resizePartitions()
 
     LDEBUG << "Removing partitions 2,3,4";
 
-    QFile f("/dev/mmcblk0");
-    f.open(f.ReadWrite);
-    // Seek to partition entry 2
-    f.seek(462);
-    // Zero out partition 2,3,4 to prevent parted complaining about invalid constraints
-    f.write(QByteArray(16*3, '\0'));
-    f.flush();
-    // Tell Linux to re-read the partition table
-    ioctl(f.handle(), BLKRRPART);
-    f.close();
-    usleep(500000);
+    // Removing partition 2,3,4 (and the logical partitions) to prevent parted complaining about invalid constraints
+    Disk::PartitionTable partitionTable("/dev/mmcblk0");
+    if (!partitionTable.read()) {
+        LFATAL << "Unable to read partition table";
+        return false;
+    }
+    if (!partitionTable.partitions().count(1)) {
+        LFATAL << "FAT partition is missing in partition table";
+        return false;
+    }
+    Disk::Partition fatPartition = partitionTable.partitions().at(1);
+    partitionTable.clear();
+    partitionTable.add(fatPartition);
+    if (!partitionTable.write()) {
+        LFATAL << "Unable to remove partitions";
+        return false;
+    }
 
     LDEBUG << "Resizing FAT partition";
 
@@ -145,6 +165,8 @@ bool PreSetup::resizePartitions()
         newStartOfRescuePartition = PARTITION_ALIGNMENT; /* 4 MiB */
     }
 
+    /* parted might remove and re-add the partition, listening for its events before starting it */
+    Disk::DeviceMonitor monitor;
     QString cmd = "/usr/sbin/parted --script /dev/mmcblk0 resize 1 "+QString::number(newStartOfRescuePartition)+"s "+QString::number(newSizeOfRescuePartition)+"M";
     LDEBUG << "Executing" << cmd.toUtf8().constData();
     QProcess p;
@@ -163,11 +185,13 @@ bool PreSetup::resizePartitions()
         return false;
     }
     LDEBUG << "parted done, output:" << p.readAll().constData();
-    usleep(500000);
+    if (!monitor.waitForDevice(SYSTEMS_PARTITION, PARTITION_WAIT_TIMEOUT)) {
+        LFATAL << "FAT partition did not reappear after resizing it";
+        return false;
+    }
 
     LINFO << "Creating extended partition";
 
-    QByteArray partitionTable;
     int startOfOurPartition = Utility::Sys::getFileContents("/sys/class/block/mmcblk0p1/start").trimmed().toInt();
     int sizeOfOurPartition  = Utility::Sys::getFileContents("/sys/class/block/mmcblk0p1/size").trimmed().toInt();
     int startOfExtended = startOfOurPartition+sizeOfOurPartition;
@@ -177,39 +201,30 @@ bool PreSetup::resizePartitions()
     if (startOfSettings % PARTITION_ALIGNMENT != 0)
         startOfSettings += PARTITION_ALIGNMENT-(startOfSettings % PARTITION_ALIGNMENT);
 
+    // Chunk cache at the end of the card (aligned on 4 MiB boundary), if the card is large enough
+    int totalSectors = Utility::Sys::getFileContents("/sys/class/block/mmcblk0/size").trimmed().toInt();
+    int startOfCache = 0;
+    if (totalSectors >= CACHE_MINIMUM_CARD_SIZE) {
+        startOfCache = (totalSectors - CACHE_PARTITION_SIZE) / PARTITION_ALIGNMENT * PARTITION_ALIGNMENT;
+    }
+
     // Primary partitions
-    partitionTable  = QByteArray::number(startOfOurPartition)+","+QByteArray::number(sizeOfOurPartition)+",0E\n"; /* FAT partition */
-    partitionTable += QByteArray::number(startOfExtended)+",,E\n"; /* Extended partition with all remaining space */
-    partitionTable += "0,0\n";
-    partitionTable += "0,0\n";
+    partitionTable.clear();
+    partitionTable.add(Disk::Partition(1, startOfOurPartition, sizeOfOurPartition, 0x0e)); /* FAT partition */
+    if (startOfCache) {
+        partitionTable.add(Disk::Partition(2, startOfExtended, startOfCache-startOfExtended, 0x05)); /* Extended partition up to the cache */
+        partitionTable.add(Disk::Partition(3, startOfCache, totalSectors-startOfCache, 0x83)); /* Cache partition */
+    } else {
+        partitionTable.add(Disk::Partition(2, startOfExtended, totalSectors-startOfExtended, 0x05)); /* Extended partition with all remaining space */
+    }
     // Logical partitions
-    partitionTable += QByteArray::number(startOfSettings)+","+QByteArray::number(SETTINGS_PARTITION_SIZE)+",L\n"; /* Settings partition */
-    LDEBUG << "Writing partition table" << partitionTable.constData();
+    partitionTable.add(Disk::Partition(5, startOfSettings, SETTINGS_PARTITION_SIZE, 0x83)); /* Settings partition */
 
-    /* Let sfdisk write a proper partition table */
-    cmd = QString("/sbin/sfdisk -uS /dev/mmcblk0");
-    QProcess proc;
-    proc.setProcessChannelMode(proc.MergedChannels);
-    proc.start(cmd);
-    proc.write(partitionTable);
-    proc.closeWriteChannel();
-    proc.waitForFinished(-1);
-    if (proc.exitCode() != 0)
-    {
-        LFATAL << "Error creating extended partition: " << proc.readAll().constData();
+    LDEBUG << "Writing partition table";
+    if (!partitionTable.write()) {
+        LFATAL << "Error creating extended partition";
         return false;
     }
-    LDEBUG << "sfdisk done, output:" << proc.readAll().constData();
-    usleep(500000);
-
-    /* For reasons unknown Linux sometimes
-     * only finds /dev/mmcblk0p2 and /dev/mmcblk0p1 goes missing */
-    if (!QFile::exists("/dev/mmcblk0p1"))
-    {
-        /* Probe again */
-        QProcess::execute("/usr/sbin/partprobe");
-        usleep(500000);
-    }
 
     QProcess::execute("/sbin/mlabel p:RECOVERY");
 
@@ -272,6 +287,10 @@ bool PreSetup::formatSettingsPartition() {
     return QProcess::execute("/usr/sbin/mkfs.ext4 -L SETTINGS " SETTINGS_PARTITION) == 0;
 }
 
+bool PreSetup::formatCachePartition() {
+    return QProcess::execute("/usr/sbin/mkfs.ext4 -L " CACHE_LABEL " " CACHE_PARTITION) == 0;
+}
+
 #ifdef RISCOS_BLOB_FILENAME
 bool PreSetup::writeRiscOSblob() {
     qDebug() << "writing RiscOS blob";
@@ -281,31 +300,28 @@ bool PreSetup::writeRiscOSblob() {
 
 void PreSetup::startNetworking() {
     LINFO << "Starting network";
+    QElapsedTimer networkTimer;
+    networkTimer.start();
 
     /* Enable dbus so that we can use it to talk to wpa_supplicant later */
     LDEBUG << "Starting dbus";
     QProcess::execute("/etc/init.d/S30dbus start");
 
+    /* Listening for address changes before dhcpcd is started, so the first address is not missed */
+    Net::AddressMonitor monitor;
+    QElapsedTimer timer;
+    timer.start();
+
     /* Run dhcpcd in background */
     QProcess *proc = new QProcess();
     LDEBUG << "Starting dhcpcd";
     proc->start("/sbin/dhcpcd --noarp -e wpa_supplicant_conf=/settings/wpa_supplicant.conf --denyinterfaces \"*_ap\"");
 
-    while(!isOnline()) {
+    string address;
+    while(!monitor.waitForAddress(NETWORK_WAIT_INTERVAL, &address)) {
         LINFO << "Waiting for network...";
-        usleep(5000000);
-    }
-}
-
-bool PreSetup::isOnline() {
-    /* Check if we have an IP-address other than localhost */
-    QList<QHostAddress> addresses = QNetworkInterface::allAddresses();
-
-    foreach (QHostAddress a, addresses) {
-        if (a != QHostAddress::LocalHost && a != QHostAddress::LocalHostIPv6) {
-            return true;
-        }
     }
-
-    return false;
+    _timeToAddress = timer.elapsed();
+    _networkTime = networkTimer.elapsed();
+    LINFO << "Network is up (" << address << "), time to first address: " << _timeToAddress << " ms";
 }
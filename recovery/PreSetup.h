@@ -19,13 +19,28 @@
 #include <QString>
 #include "Utility.h"
 
+// Interval (in ms) in which a warning is logged while waiting for the SD card
+#define SD_CARD_WAIT_INTERVAL 10000
+// Time (in ms) to wait for a partition to reappear after it was changed by an external tool
+#define PARTITION_WAIT_TIMEOUT 5000
+// Interval (in ms) in which a message is logged while waiting for the network
+#define NETWORK_WAIT_INTERVAL 5000
+
 class PreSetup {
 
 public:
+    PreSetup(): _networkTime(-1),
+                _timeToAddress(-1) {}
+
     bool checkAndPrepareSDCard();
     void startNetworking();
     bool clearCMDline();
 
+    // Time (in ms) startNetworking() took and the time from starting dhcpcd until the first address was configured,
+    // -1 if the network is not up
+    inline qint64 networkTime() const { return _networkTime; }
+    inline qint64 timeToAddress() const { return _timeToAddress; }
+
 private:
     /*
      * bootCheck() helper functions
@@ -33,11 +48,13 @@ private:
     bool resizePartitions();
     int sizeofBootFilesInKB();
     bool formatSettingsPartition();
+    bool formatCachePartition();
 #ifdef RISCOS_BLOB_FILENAME
     bool writeRiscOSblob();
 #endif
 
-    bool isOnline();
+    qint64 _networkTime,
+           _timeToAddress;
 };
 
 #endif // RECOVERY_PRESETUP_H
\ No newline at end of file
@@ -33,6 +33,13 @@
 #define SYSTEMS_DIR "/mnt"
 #define SETTINGS_PARTITION_SIZE  (32 * 2048 - PARTITION_GAP)
 
+/* Chunk cache partition (primary partition 3 at the end of the SD card), only created on cards of at least CACHE_MINIMUM_CARD_SIZE */
+#define CACHE_PARTITION "/dev/mmcblk0p3"
+#define CACHE_DIR "/cache"
+#define CACHE_LABEL "CACHE"
+#define CACHE_PARTITION_SIZE  (2048 * 2048)
+#define CACHE_MINIMUM_CARD_SIZE  (8 * 1024 * 2048)
+
 // This file contains the partition device that the system will automatically boot into
 #define DEFAULT_BOOT_PARTITION_FILE "/settings/default_boot_partition"
 
@@ -50,9 +57,12 @@ namespace Utility {
     namespace Json {
         QMap<QString, QVariant> parseJson(const QString &jsonString);
         QMap<QString, QVariant> parseJson(const QByteArray &json);
+        // Parses a JSON array, returns an empty list if the JSON is invalid or not an array
+        QList<QVariant> parseJsonArray(const QByteArray &json);
 
         QVariant loadFromFile(const QString &filename);
         bool saveToFile(const QString &filename, const QVariant &json);
+        QByteArray serialize(const QVariant &json);
         void printJson(QMap<QString, QVariant> &json);
         void printJsonArray(QList<QVariant> &json);
 
@@ -87,9 +97,14 @@ namespace Utility {
         bool unmountSystemsPartition();
         bool mountSettingsPartition();
         bool unmountSettingsPartition();
-        bool mountPartition(const QString &partition, const QString &dir, const QString &args = QString());
+        bool mountCachePartition();
+        bool unmountCachePartition();
+        // Mounts through mount(2), if no file system type is given it is detected (see libs/Disk/Mount.h)
+        bool mountPartition(const QString &partition, const QString &dir, const QString &type = QString(),
+                            const QString &options = QString());
         bool unmountPartition(const QString &dir);
-        bool remountPartition(const QString &partition, const QString &args = QString());
+        bool remountPartition(const QString &dir, const QString &options = QString());
+        // Answered from the cached mount table, instead of listing all mounts
         bool partitionIsMounted(const QString &partition, const QString &dir = QString());
         QByteArray getFileContents(const QString &filename);
         bool putFileContents(const QString &filename, const QByteArray &data);
@@ -37,6 +37,21 @@ QMap<QString, QVariant> Utility::Json::parseJson(const QByteArray &jsonArray) {
     return json;
 }
 
+QList<QVariant> Utility::Json::parseJsonArray(const QByteArray &jsonArray) {
+    LDEBUG << "Parsing JSON array: " << jsonArray.constData();
+    QJson::Parser parser;
+    bool ok;
+    QList<QVariant> json = parser.parse(jsonArray, &ok).toList();
+    if(!ok) {
+        LERROR << "Unable to parse JSON: " << parser.errorString().toUtf8().constData() << " at line " << parser.errorLine();
+        json.clear();
+    } else {
+        LDEBUG << "Succesfully parsed JSON array";
+    }
+
+    return json;
+}
+
 QVariant Utility::Json::loadFromFile(const QString &filename) {
     LDEBUG << "Loading JSON from file " << filename.toUtf8().constData();
     QVariant result;
@@ -83,6 +98,20 @@ bool Utility::Json::saveToFile(const QString &filename, const QVariant &json) {
     }
 }
 
+QByteArray Utility::Json::serialize(const QVariant &json) {
+    QJson::Serializer serializer;
+    bool ok;
+
+    serializer.setIndentMode(QJson::IndentFull);
+    QByteArray result = serializer.serialize(json, &ok);
+
+    if (!ok) {
+        LERROR << "Error serializing json: " << serializer.errorMessage().toUtf8().constData();
+        result.clear();
+    }
+    return result;
+}
+
 void Utility::Json::printJson(QMap<QString, QVariant> &json) {
     LDEBUG << "{";
             foreach(QString key, json.keys()) {
@@ -13,9 +13,9 @@
 //
 
 #include <QFile>
-#include <QProcess>
 #include <QDir>
 #include "Utility.h"
+#include "libs/Disk/Mount.h"
 
 QByteArray Utility::Sys::getFileContents(const QString &filename) {
     QByteArray r;
@@ -45,7 +45,7 @@ bool Utility::Sys::putFileContents(const QString &filename, const QByteArray &da
 }
 
 bool Utility::Sys::mountSystemsPartition() {
-    return Utility::Sys::mountPartition(SYSTEMS_PARTITION, SYSTEMS_DIR, "-t vfat");
+    return Utility::Sys::mountPartition(SYSTEMS_PARTITION, SYSTEMS_DIR, "vfat");
 }
 
 bool Utility::Sys::unmountSystemsPartition() {
@@ -53,14 +53,23 @@ bool Utility::Sys::unmountSystemsPartition() {
 }
 
 bool Utility::Sys::mountSettingsPartition() {
-    return Utility::Sys::mountPartition(SETTINGS_PARTITION, SETTINGS_DIR, "-t ext4");
+    return Utility::Sys::mountPartition(SETTINGS_PARTITION, SETTINGS_DIR, "ext4");
 }
 
 bool Utility::Sys::unmountSettingsPartition() {
     return Utility::Sys::unmountPartition(SETTINGS_DIR);
 }
 
-bool Utility::Sys::mountPartition(const QString &partition, const QString &dir, const QString &args) {
+bool Utility::Sys::mountCachePartition() {
+    return Utility::Sys::mountPartition(CACHE_PARTITION, CACHE_DIR, "ext4");
+}
+
+bool Utility::Sys::unmountCachePartition() {
+    return Utility::Sys::unmountPartition(CACHE_DIR);
+}
+
+bool Utility::Sys::mountPartition(const QString &partition, const QString &dir, const QString &type,
+                                  const QString &options) {
     QDir settingsDir;
     if(!settingsDir.exists(dir)) {
         LDEBUG << "Creating directory " << dir.toUtf8().constData();
@@ -73,9 +82,9 @@ bool Utility::Sys::mountPartition(const QString &partition, const QString &dir,
     } else {
         QDir d;
         LDEBUG << "Mounting partition " << partition.toUtf8().constData() << " into " << dir.toUtf8().constData()
-               << (!args.isEmpty()? " (with arguments: " + args + ")": "").toUtf8().constData();
+               << (!options.isEmpty()? " (with options: " + options + ")": "").toUtf8().constData();
         if (d.exists(partition) && d.exists(dir)) {
-            return QProcess::execute("mount " + args + " " + partition + " " + dir) == 0;
+            return Disk::mount(partition.toStdString(), dir.toStdString(), type.toStdString(), options.toStdString());
         } else {
             LERROR << "Partition " << partition.toUtf8().constData() << ", or mounting point "
                    << dir.toUtf8().constData() << " does not exist!";
@@ -85,19 +94,15 @@ bool Utility::Sys::mountPartition(const QString &partition, const QString &dir,
 }
 
 
-bool Utility::Sys::remountPartition(const QString &dir, const QString &args) {
-    if(!partitionIsMounted(dir)) {
+bool Utility::Sys::remountPartition(const QString &dir, const QString &options) {
+    if(!Disk::isMountPoint(dir.toStdString())) {
         LERROR << "There is no partition mounted on this mountpoint, can't remount";
         return false;
     } else {
         QDir d;
         LDEBUG << "Remounting directory " << dir.toUtf8().constData();
         if (d.exists(dir)) {
-            if (!args.isEmpty()) {
-                return QProcess::execute("mount -o remount," + args + " " + dir) == 0;
-            } else {
-                return QProcess::execute("mount -o remount " + dir) == 0;
-            }
+            return Disk::remount(dir.toStdString(), options.toStdString());
         } else {
             LERROR << "Unable to remount directory " << dir.toUtf8().constData() << " because it does not exist";
             return false;
@@ -107,10 +112,10 @@ bool Utility::Sys::remountPartition(const QString &dir, const QString &args) {
 
 bool Utility::Sys::unmountPartition(const QString &dir) {
     LDEBUG << "Unmounting directory " << dir.toUtf8().constData();
-    return QProcess::execute("umount " + dir) == 0;
+    return Disk::unmount(dir.toStdString());
 }
 
 bool Utility::Sys::partitionIsMounted(const QString &partition, const QString &dir) {
     LDEBUG << "Testing if " << partition.toUtf8().constData() << " is mounted" << (!dir.isEmpty()? " on " + dir : "").toUtf8().constData();
-    return QProcess::execute("mount | grep " + partition + (!dir.isEmpty()? " on " + dir : "")) == 0;
-}
\ No newline at end of file
+    return Disk::isMounted(partition.toStdString(), dir.toStdString());
+}
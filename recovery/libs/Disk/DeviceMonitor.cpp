@@ -0,0 +1,107 @@
+//
+// Created by agent on 10/17/26 as part of NOOBS4IoT (https://github.com/steilerDev/NOOBS4IoT)
+//
+// DeviceMonitor.cpp:
+//      This file contains a listener for the kernel's device events (uevents), which is used to wait for device nodes
+//      instead of sleeping for a fixed amount of time. No external, non-standard library is required for this file.
+//      For more information see https://github.com/steilerDev/NOOBS4IoT/wiki.
+//
+// This file is licensed under a GNU General Public License v3.0 (c) Frank Steiler.
+// See https://raw.githubusercontent.com/steilerDev/NOOBS4IoT/master/LICENSE for more information.
+//
+
+#include "DeviceMonitor.h"
+#include "../easylogging++.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+
+// Returns the current value of the monotonic clock in ms
+static uint64_t now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+Disk::DeviceMonitor::DeviceMonitor() {
+    _socket = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_KOBJECT_UEVENT);
+    if(_socket < 0) {
+        LWARNING << "Unable to create uevent socket: " << strerror(errno);
+        return;
+    }
+
+    struct sockaddr_nl address;
+    memset(&address, 0, sizeof(address));
+    address.nl_family = AF_NETLINK;
+    address.nl_pid = 0;
+    // Group 1 receives the events as sent by the kernel
+    address.nl_groups = 1;
+    if(bind(_socket, (struct sockaddr *) &address, sizeof(address)) < 0) {
+        LWARNING << "Unable to bind uevent socket: " << strerror(errno);
+        close(_socket);
+        _socket = -1;
+    }
+}
+
+Disk::DeviceMonitor::~DeviceMonitor() {
+    if(_socket >= 0) {
+        close(_socket);
+    }
+}
+
+bool Disk::DeviceMonitor::waitForDevice(const string &path, unsigned int timeout) {
+    string device = path.substr(path.rfind('/') + 1);
+    uint64_t deadline = now() + timeout;
+    // Without events the node is checked periodically
+    bool announced = _socket < 0;
+    while(access(path.c_str(), F_OK) != 0) {
+        uint64_t current = now();
+        if(current >= deadline) {
+            LERROR << "Timeout while waiting for " << path;
+            return false;
+        }
+
+        int wait = (int) (deadline - current);
+        if(announced && wait > DEVICE_NODE_INTERVAL) {
+            wait = DEVICE_NODE_INTERVAL;
+        }
+        if(_socket < 0) {
+            usleep(wait * 1000);
+            continue;
+        }
+
+        struct pollfd pfd;
+        pfd.fd = _socket;
+        pfd.events = POLLIN;
+        int rv = poll(&pfd, 1, wait);
+        if(rv < 0 && errno != EINTR) {
+            LERROR << "Unable to wait for uevents: " << strerror(errno);
+            return false;
+        } else if(rv > 0 && receiveEvents(device)) {
+            LDEBUG << "Kernel announced " << device;
+            announced = true;
+        }
+    }
+    return true;
+}
+
+bool Disk::DeviceMonitor::receiveEvents(const string &device) {
+    bool found = false;
+    char buffer[4096];
+    ssize_t length;
+    while((length = recv(_socket, buffer, sizeof(buffer) - 1, 0)) > 0) {
+        buffer[length] = '\0';
+        // The message is a header ("<action>@<devpath>") followed by null-terminated KEY=value pairs
+        for(ssize_t i = 0; i < length; i += strlen(buffer + i) + 1) {
+            if(strncmp(buffer + i, "DEVNAME=", 8) == 0 && device == buffer + i + 8) {
+                found = true;
+            }
+        }
+    }
+    return found;
+}
@@ -0,0 +1,46 @@
+//
+// Created by agent on 10/17/26 as part of NOOBS4IoT (https://github.com/steilerDev/NOOBS4IoT)
+//
+// DeviceMonitor.h:
+//      This file contains a listener for the kernel's device events (uevents), which is used to wait for device nodes
+//      instead of sleeping for a fixed amount of time. No external, non-standard library is required for this file.
+//      For more information see https://github.com/steilerDev/NOOBS4IoT/wiki.
+//
+// This file is licensed under a GNU General Public License v3.0 (c) Frank Steiler.
+// See https://raw.githubusercontent.com/steilerDev/NOOBS4IoT/master/LICENSE for more information.
+//
+
+#ifndef DISK_DEVICEMONITOR_H
+#define DISK_DEVICEMONITOR_H
+
+#include <string>
+
+using namespace std;
+
+// Interval (in ms) in which the device node is checked after the kernel announced the device, since the node might be
+// created by a user space helper (e.g. mdev) after the event was sent
+#define DEVICE_NODE_INTERVAL 5
+
+namespace Disk {
+
+    /*
+     * Subscribes to the uevents of the kernel on creation, so events happening between the creation of the monitor and
+     * a call to waitForDevice() are not missed.
+     */
+    class DeviceMonitor {
+    public:
+        DeviceMonitor();
+        ~DeviceMonitor();
+
+        // Waits until the device node exists, returns false if it did not appear within the timeout (in ms)
+        bool waitForDevice(const string &path, unsigned int timeout);
+
+    private:
+        // Receives and drops all pending events, returns true if one of them was about the device
+        bool receiveEvents(const string &device);
+
+        int _socket;
+    };
+}
+
+#endif //DISK_DEVICEMONITOR_H
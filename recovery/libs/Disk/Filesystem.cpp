@@ -0,0 +1,307 @@
+//
+// Created by agent on 10/17/26 as part of NOOBS4IoT (https://github.com/steilerDev/NOOBS4IoT)
+//
+// Filesystem.cpp:
+//      This file contains a prober reading the type, label and UUID of ext2/3/4, FAT and NTFS file systems directly from
+//      their superblocks (reporting them the same way blkid does), as well as an index of the labels of all partitions,
+//      replacing calls to blkid and findfs. No external, non-standard library is required for this file.
+//      For more information see https://github.com/steilerDev/NOOBS4IoT/wiki.
+//
+// This file is licensed under a GNU General Public License v3.0 (c) Frank Steiler.
+// See https://raw.githubusercontent.com/steilerDev/NOOBS4IoT/master/LICENSE for more information.
+//
+
+#include "Filesystem.h"
+#include "../easylogging++.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <stdint.h>
+
+// ext2/3/4 superblock (starting at byte 1024 of the device)
+#define EXT_SUPERBLOCK_OFFSET 1024
+#define EXT_MAGIC_OFFSET 0x38
+#define EXT_MAGIC 0xef53
+#define EXT_COMPAT_OFFSET 0x5c
+#define EXT_INCOMPAT_OFFSET 0x60
+#define EXT_UUID_OFFSET 0x68
+#define EXT_LABEL_OFFSET 0x78
+#define EXT_LABEL_SIZE 16
+#define EXT_COMPAT_HAS_JOURNAL 0x0004
+// External journal, not a file system (reported as "jbd", like blkid does)
+#define EXT_INCOMPAT_JOURNAL_DEV 0x0008
+// Incompatible features unknown to ext3 (everything except filetype, recover, journal device and meta_bg)
+#define EXT_INCOMPAT_EXT4 (~(uint32_t) 0x001e)
+
+// FAT boot sector
+#define FAT_LABEL_SIZE 11
+#define FAT_DIR_ENTRY_SIZE 32
+#define FAT_ATTR_VOLUME_ID 0x08
+#define FAT_ATTR_DIRECTORY 0x10
+#define FAT_ATTR_LONG_NAME 0x0f
+// Upper limit of the root directory read when looking for the volume label
+#define FAT_MAX_ROOT_DIR 65536
+
+// NTFS boot sector and the $Volume record, holding the label
+#define NTFS_VOLUME_RECORD 3
+#define NTFS_ATTR_VOLUME_NAME 0x60
+#define NTFS_ATTR_END 0xffffffff
+#define NTFS_MAX_RECORD_SIZE 65536
+
+static uint16_t readLE16(const unsigned char *data) {
+    return data[0] | (data[1] << 8);
+}
+
+static uint32_t readLE32(const unsigned char *data) {
+    return data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t) data[3] << 24);
+}
+
+static uint64_t readLE64(const unsigned char *data) {
+    return readLE32(data) | ((uint64_t) readLE32(data + 4) << 32);
+}
+
+static bool readAt(int fd, uint64_t offset, unsigned char *buffer, size_t length) {
+    return pread(fd, buffer, length, offset) == (ssize_t) length;
+}
+
+// Removes the padding of on-disk labels (trailing spaces and null characters)
+static string trimLabel(const unsigned char *data, size_t length) {
+    string label((const char *) data, strnlen((const char *) data, length));
+    size_t end = label.find_last_not_of(' ');
+    return end == string::npos ? string() : label.substr(0, end + 1);
+}
+
+static string utf16ToUtf8(const unsigned char *data, size_t length) {
+    string result;
+    for(size_t i = 0; i + 1 < length; i += 2) {
+        uint32_t c = readLE16(data + i);
+        if(c >= 0xd800 && c < 0xdc00 && i + 3 < length) {
+            uint32_t low = readLE16(data + i + 2);
+            if(low >= 0xdc00 && low < 0xe000) {
+                c = 0x10000 + ((c - 0xd800) << 10) + (low - 0xdc00);
+                i += 2;
+            }
+        }
+        if(c < 0x80) {
+            result += (char) c;
+        } else if(c < 0x800) {
+            result += (char) (0xc0 | (c >> 6));
+            result += (char) (0x80 | (c & 0x3f));
+        } else if(c < 0x10000) {
+            result += (char) (0xe0 | (c >> 12));
+            result += (char) (0x80 | ((c >> 6) & 0x3f));
+            result += (char) (0x80 | (c & 0x3f));
+        } else {
+            result += (char) (0xf0 | (c >> 18));
+            result += (char) (0x80 | ((c >> 12) & 0x3f));
+            result += (char) (0x80 | ((c >> 6) & 0x3f));
+            result += (char) (0x80 | (c & 0x3f));
+        }
+    }
+    return result;
+}
+
+static bool probeExt(int fd, Disk::FilesystemInfo *info) {
+    unsigned char sb[256];
+    if(!readAt(fd, EXT_SUPERBLOCK_OFFSET, sb, sizeof(sb)) || readLE16(sb + EXT_MAGIC_OFFSET) != EXT_MAGIC) {
+        return false;
+    }
+
+    if(readLE32(sb + EXT_INCOMPAT_OFFSET) & EXT_INCOMPAT_JOURNAL_DEV) {
+        info->type = "jbd";
+    } else if(readLE32(sb + EXT_INCOMPAT_OFFSET) & EXT_INCOMPAT_EXT4) {
+        info->type = "ext4";
+    } else if(readLE32(sb + EXT_COMPAT_OFFSET) & EXT_COMPAT_HAS_JOURNAL) {
+        info->type = "ext3";
+    } else {
+        info->type = "ext2";
+    }
+    info->label = string((const char *) sb + EXT_LABEL_OFFSET, strnlen((const char *) sb + EXT_LABEL_OFFSET, EXT_LABEL_SIZE));
+
+    const unsigned char *u = sb + EXT_UUID_OFFSET;
+    char uuid[37];
+    snprintf(uuid, sizeof(uuid), "%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x",
+             u[0], u[1], u[2], u[3], u[4], u[5], u[6], u[7], u[8], u[9], u[10], u[11], u[12], u[13], u[14], u[15]);
+    info->uuid = uuid;
+    return true;
+}
+
+static bool probeNTFS(int fd, const unsigned char *boot, Disk::FilesystemInfo *info) {
+    if(memcmp(boot + 3, "NTFS    ", 8) != 0) {
+        return false;
+    }
+    info->type = "ntfs";
+
+    char uuid[17];
+    snprintf(uuid, sizeof(uuid), "%016llX", (unsigned long long) readLE64(boot + 0x48));
+    info->uuid = uuid;
+
+    // The label is the $VOLUME_NAME attribute of the $Volume record in the master file table
+    uint32_t sectorSize = readLE16(boot + 0x0b);
+    uint32_t clusterSize = sectorSize * boot[0x0d];
+    int8_t clustersPerRecord = (int8_t) boot[0x40];
+    uint32_t recordSize = clustersPerRecord < 0 ? 1u << -clustersPerRecord : clustersPerRecord * clusterSize;
+    if(sectorSize < 256 || clusterSize == 0 || recordSize < 1024 || recordSize > NTFS_MAX_RECORD_SIZE) {
+        return true;
+    }
+
+    vector<unsigned char> record(recordSize);
+    uint64_t offset = readLE64(boot + 0x30) * clusterSize + NTFS_VOLUME_RECORD * recordSize;
+    if(!readAt(fd, offset, &record[0], recordSize) || memcmp(&record[0], "FILE", 4) != 0) {
+        return true;
+    }
+
+    // Undo the update sequence, replacing the last two bytes of each sector with their original values
+    uint16_t usaOffset = readLE16(&record[0x04]);
+    uint16_t usaCount = readLE16(&record[0x06]);
+    if(usaOffset + usaCount * 2u > recordSize) {
+        return true;
+    }
+    for(uint16_t i = 1; i < usaCount && i * sectorSize <= recordSize; i++) {
+        memcpy(&record[i * sectorSize - 2], &record[usaOffset + i * 2], 2);
+    }
+
+    uint32_t attribute = readLE16(&record[0x14]);
+    while(attribute + 24 <= recordSize) {
+        uint32_t type = readLE32(&record[attribute]);
+        uint32_t length = readLE32(&record[attribute + 4]);
+        if(type == NTFS_ATTR_END || length == 0 || attribute + length > recordSize) {
+            break;
+        }
+        // Only resident attributes hold their value in the record
+        if(type == NTFS_ATTR_VOLUME_NAME && record[attribute + 8] == 0) {
+            uint32_t valueLength = readLE32(&record[attribute + 0x10]);
+            uint16_t valueOffset = readLE16(&record[attribute + 0x14]);
+            if(valueOffset + valueLength <= length) {
+                info->label = utf16ToUtf8(&record[attribute + valueOffset], valueLength);
+            }
+            break;
+        }
+        attribute += length;
+    }
+    return true;
+}
+
+// Returns the label stored in the root directory (which is the one shown by most systems), or an empty string
+static string fatRootLabel(int fd, uint64_t offset, uint32_t length) {
+    if(length > FAT_MAX_ROOT_DIR) {
+        length = FAT_MAX_ROOT_DIR;
+    }
+    vector<unsigned char> directory(length);
+    if(length == 0 || !readAt(fd, offset, &directory[0], length)) {
+        return string();
+    }
+    for(uint32_t i = 0; i + FAT_DIR_ENTRY_SIZE <= length; i += FAT_DIR_ENTRY_SIZE) {
+        const unsigned char *entry = &directory[i];
+        if(entry[0] == 0x00) {
+            break;
+        }
+        uint8_t attributes = entry[11];
+        if(entry[0] != 0xe5 && attributes != FAT_ATTR_LONG_NAME && (attributes & FAT_ATTR_VOLUME_ID)
+           && !(attributes & FAT_ATTR_DIRECTORY)) {
+            return trimLabel(entry, FAT_LABEL_SIZE);
+        }
+    }
+    return string();
+}
+
+static bool probeFAT(int fd, const unsigned char *boot, Disk::FilesystemInfo *info) {
+    uint16_t sectorSize = readLE16(boot + 0x0b);
+    uint8_t sectorsPerCluster = boot[0x0d];
+    uint16_t reservedSectors = readLE16(boot + 0x0e);
+    uint8_t fats = boot[0x10];
+    if((boot[0] != 0xeb && boot[0] != 0xe9) || sectorSize < 512 || sectorSize > 4096 || (sectorSize & (sectorSize - 1))
+       || sectorsPerCluster == 0 || (sectorsPerCluster & (sectorsPerCluster - 1)) || reservedSectors == 0
+       || fats == 0 || fats > 2) {
+        return false;
+    }
+
+    bool fat32 = memcmp(boot + 0x52, "FAT32   ", 8) == 0;
+    if(!fat32 && memcmp(boot + 0x36, "FAT", 3) != 0) {
+        return false;
+    }
+    info->type = "vfat";
+
+    // FAT32 moved the extended boot record behind its additional fields
+    const unsigned char *extended = boot + (fat32 ? 0x43 : 0x27);
+    char uuid[10];
+    snprintf(uuid, sizeof(uuid), "%02X%02X-%02X%02X", extended[3], extended[2], extended[1], extended[0]);
+    info->uuid = uuid;
+
+    uint64_t fatSectors = fat32 ? readLE32(boot + 0x24) : readLE16(boot + 0x16);
+    uint64_t rootStart = reservedSectors + fats * fatSectors;
+    string label;
+    if(fat32) {
+        // The root directory starts at the given cluster of the data area, only its first cluster is searched
+        uint32_t rootCluster = readLE32(boot + 0x2c);
+        if(rootCluster >= 2) {
+            label = fatRootLabel(fd, (rootStart + (uint64_t) (rootCluster - 2) * sectorsPerCluster) * sectorSize,
+                                 (uint32_t) sectorsPerCluster * sectorSize);
+        }
+    } else {
+        label = fatRootLabel(fd, rootStart * sectorSize, (uint32_t) readLE16(boot + 0x11) * FAT_DIR_ENTRY_SIZE);
+    }
+    if(label.empty()) {
+        label = trimLabel(extended + 4, FAT_LABEL_SIZE);
+    }
+    info->label = label == "NO NAME" ? string() : label;
+    return true;
+}
+
+bool Disk::probeFilesystem(const string &device, FilesystemInfo *info) {
+    *info = FilesystemInfo();
+    int fd = open(device.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0) {
+        return false;
+    }
+
+    unsigned char boot[512];
+    bool found = probeExt(fd, info);
+    if(!found && readAt(fd, 0, boot, sizeof(boot)) && boot[510] == 0x55 && boot[511] == 0xaa) {
+        found = probeNTFS(fd, boot, info) || probeFAT(fd, boot, info);
+    }
+    close(fd);
+    return found;
+}
+
+void Disk::LabelIndex::build() {
+    _labels.clear();
+    ifstream partitions("/proc/partitions");
+    string line;
+    // The first two lines are the header
+    getline(partitions, line);
+    getline(partitions, line);
+    while(getline(partitions, line)) {
+        istringstream fields(line);
+        unsigned int major, minor;
+        unsigned long long blocks;
+        string name;
+        if(fields >> major >> minor >> blocks >> name) {
+            update("/dev/" + name);
+        }
+    }
+    LDEBUG << "Indexed " << _labels.size() << " labeled file systems";
+}
+
+void Disk::LabelIndex::update(const string &device) {
+    FilesystemInfo info;
+    if(probeFilesystem(device, &info) && !info.label.empty()) {
+        _labels[device] = info.label;
+    } else {
+        _labels.erase(device);
+    }
+}
+
+bool Disk::LabelIndex::contains(const string &label) const {
+    for(map<string, string>::const_iterator it = _labels.begin(); it != _labels.end(); ++it) {
+        if(it->second == label) {
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,51 @@
+//
+// Created by agent on 10/17/26 as part of NOOBS4IoT (https://github.com/steilerDev/NOOBS4IoT)
+//
+// Filesystem.h:
+//      This file contains a prober reading the type, label and UUID of ext2/3/4, FAT and NTFS file systems directly from
+//      their superblocks (reporting them the same way blkid does), as well as an index of the labels of all partitions,
+//      replacing calls to blkid and findfs. No external, non-standard library is required for this file.
+//      For more information see https://github.com/steilerDev/NOOBS4IoT/wiki.
+//
+// This file is licensed under a GNU General Public License v3.0 (c) Frank Steiler.
+// See https://raw.githubusercontent.com/steilerDev/NOOBS4IoT/master/LICENSE for more information.
+//
+
+#ifndef DISK_FILESYSTEM_H
+#define DISK_FILESYSTEM_H
+
+#include <map>
+#include <string>
+
+using namespace std;
+
+namespace Disk {
+
+    struct FilesystemInfo {
+        // "ext2", "ext3", "ext4", "vfat" or "ntfs"
+        string type,
+               label,
+               uuid;
+    };
+
+    // Reads the superblock of the device, returns false if it could not be read or holds no known file system
+    bool probeFilesystem(const string &device, FilesystemInfo *info);
+
+    /*
+     * Labels of the file systems on all block devices known to the kernel (see /proc/partitions), built once and kept
+     * up to date by the caller whenever it changes a file system.
+     */
+    class LabelIndex {
+    public:
+        void build();
+        // Probes the device again (e.g. after a file system was created on it)
+        void update(const string &device);
+        bool contains(const string &label) const;
+
+    private:
+        // key: device, value: label
+        map<string, string> _labels;
+    };
+}
+
+#endif //DISK_FILESYSTEM_H
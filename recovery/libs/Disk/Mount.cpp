@@ -0,0 +1,281 @@
+//
+// Created by agent on 10/17/26 as part of NOOBS4IoT (https://github.com/steilerDev/NOOBS4IoT)
+//
+// Mount.cpp:
+//      This file contains functions mounting and unmounting file systems through the mount(2) and umount2(2) system
+//      calls, as well as a table of the current mounts. The table is parsed from /proc/self/mountinfo once and only
+//      read again after the kernel signalled a change of the mounts. No external, non-standard library is required for
+//      this file.
+//      For more information see https://github.com/steilerDev/NOOBS4IoT/wiki.
+//
+// This file is licensed under a GNU General Public License v3.0 (c) Frank Steiler.
+// See https://raw.githubusercontent.com/steilerDev/NOOBS4IoT/master/LICENSE for more information.
+//
+
+#include "Mount.h"
+#include "Filesystem.h"
+#include "../easylogging++.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <mutex>
+#include <sstream>
+#include <vector>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#define MOUNTINFO_PATH "/proc/self/mountinfo"
+
+struct MountPoint {
+    dev_t device;
+    string source,
+           directory,
+           options;
+};
+
+struct MountFlag {
+    const char *option;
+    unsigned long flag;
+    // Whether the option clears the flag instead of setting it
+    bool clear;
+};
+
+static const MountFlag mountFlags[] = {
+        {"ro",         MS_RDONLY,      false},
+        {"rw",         MS_RDONLY,      true},
+        {"nosuid",     MS_NOSUID,      false},
+        {"suid",       MS_NOSUID,      true},
+        {"nodev",      MS_NODEV,       false},
+        {"dev",        MS_NODEV,       true},
+        {"noexec",     MS_NOEXEC,      false},
+        {"exec",       MS_NOEXEC,      true},
+        {"sync",       MS_SYNCHRONOUS, false},
+        {"async",      MS_SYNCHRONOUS, true},
+        {"noatime",    MS_NOATIME,     false},
+        {"atime",      MS_NOATIME,     true},
+        {"nodiratime", MS_NODIRATIME,  false},
+        {"diratime",   MS_NODIRATIME,  true},
+        {"relatime",   MS_RELATIME,    false},
+        {"norelatime", MS_RELATIME,    true},
+        {"dirsync",    MS_DIRSYNC,     false}
+};
+
+/*
+ * The table of mounts, the file descriptor stays open, since the kernel signals changes to the mounts as POLLPRI on
+ * it (the event is consumed by the poll, so the table needs to be read whenever it was signalled).
+ */
+static mutex tableMutex;
+static int tableFd = -1;
+static vector<MountPoint> table;
+
+// Replaces the octal escapes of mountinfo (e.g. \040 for a space)
+static string unescape(const string &field) {
+    string result;
+    for(size_t i = 0; i < field.size(); i++) {
+        if(field[i] == '\\' && i + 3 < field.size()) {
+            result += (char) strtol(field.substr(i + 1, 3).c_str(), NULL, 8);
+            i += 3;
+        } else {
+            result += field[i];
+        }
+    }
+    return result;
+}
+
+static bool readTable() {
+    string content;
+    char buffer[4096];
+    ssize_t length;
+    if(lseek(tableFd, 0, SEEK_SET) < 0) {
+        return false;
+    }
+    while((length = read(tableFd, buffer, sizeof(buffer))) > 0) {
+        content.append(buffer, length);
+    }
+    if(length < 0) {
+        return false;
+    }
+
+    table.clear();
+    istringstream lines(content);
+    string line;
+    while(getline(lines, line)) {
+        // <id> <parent> <major>:<minor> <root> <mount point> <options> [<optional fields>] - <type> <source> <super options>
+        istringstream fields(line);
+        string id, parent, device, root, directory, options, field, type, source;
+        fields >> id >> parent >> device >> root >> directory >> options;
+        while(fields >> field && field != "-");
+        fields >> type >> source;
+
+        unsigned int major, minor;
+        if(sscanf(device.c_str(), "%u:%u", &major, &minor) != 2) {
+            continue;
+        }
+        MountPoint mountPoint;
+        mountPoint.device = makedev(major, minor);
+        mountPoint.source = unescape(source);
+        mountPoint.directory = unescape(directory);
+        mountPoint.options = options;
+        table.push_back(mountPoint);
+    }
+    return true;
+}
+
+// Reads the table if it changed since it was read last, needs to be called with the mutex held
+static bool updateTable() {
+    if(tableFd < 0) {
+        tableFd = open(MOUNTINFO_PATH, O_RDONLY | O_CLOEXEC);
+        if(tableFd < 0) {
+            LERROR << "Unable to open " << MOUNTINFO_PATH << ": " << strerror(errno);
+            return false;
+        }
+        // The open already consumed the pending change events
+        return readTable();
+    }
+
+    struct pollfd pfd;
+    pfd.fd = tableFd;
+    pfd.events = POLLPRI;
+    if(poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLPRI | POLLERR))) {
+        LDEBUG << "Mounts changed, reading " << MOUNTINFO_PATH;
+        return readTable();
+    }
+    return true;
+}
+
+// Mount points are compared by their resolved path, the way the kernel reports them
+static string canonicalPath(const string &path) {
+    char resolved[PATH_MAX];
+    if(realpath(path.c_str(), resolved) != NULL) {
+        return resolved;
+    }
+    return path;
+}
+
+static unsigned long parseOptions(const string &options, unsigned long flags, string *data) {
+    istringstream stream(options);
+    string option;
+    while(getline(stream, option, ',')) {
+        if(option.empty()) {
+            continue;
+        }
+        bool known = false;
+        for(size_t i = 0; i < sizeof(mountFlags) / sizeof(mountFlags[0]); i++) {
+            if(option == mountFlags[i].option) {
+                flags = mountFlags[i].clear ? flags & ~mountFlags[i].flag : flags | mountFlags[i].flag;
+                known = true;
+                break;
+            }
+        }
+        if(!known) {
+            if(!data->empty()) {
+                *data += ",";
+            }
+            *data += option;
+        }
+    }
+    return flags;
+}
+
+bool Disk::mount(const string &device, const string &directory, const string &type, const string &options) {
+    string fsType = type;
+    if(fsType.empty()) {
+        FilesystemInfo info;
+        if(!probeFilesystem(device, &info)) {
+            LERROR << "Unable to detect the file system on " << device;
+            return false;
+        }
+        fsType = info.type;
+    }
+
+    string data;
+    unsigned long flags = parseOptions(options, 0, &data);
+    LDEBUG << "Mounting " << device << " (" << fsType << ") on " << directory
+           << (options.empty() ? "" : " with options " + options);
+    if(::mount(device.c_str(), directory.c_str(), fsType.c_str(), flags, data.empty() ? NULL : data.c_str()) != 0) {
+        // ext2 and ext3 file systems are served by the ext4 driver, if their own drivers are not available
+        if(errno == ENODEV && fsType.compare(0, 3, "ext") == 0 && fsType != "ext4") {
+            return mount(device, directory, "ext4", options);
+        }
+        LERROR << "Unable to mount " << device << " on " << directory << ": " << strerror(errno);
+        return false;
+    }
+    return true;
+}
+
+bool Disk::remount(const string &directory, const string &options) {
+    string path = canonicalPath(directory);
+    string currentOptions;
+    string source;
+    {
+        lock_guard<mutex> lock(tableMutex);
+        updateTable();
+        // The last mount on a directory is the visible one
+        for(vector<MountPoint>::const_reverse_iterator it = table.rbegin(); it != table.rend(); ++it) {
+            if(it->directory == path) {
+                currentOptions = it->options;
+                source = it->source;
+                break;
+            }
+        }
+    }
+    if(source.empty()) {
+        LERROR << "Nothing is mounted on " << directory << ", unable to remount";
+        return false;
+    }
+
+    // The new options are applied on top of the current ones
+    string data;
+    unsigned long flags = parseOptions(options, parseOptions(currentOptions, 0, &data), &data);
+    LDEBUG << "Remounting " << directory << (options.empty() ? "" : " with options " + options);
+    if(::mount(source.c_str(), path.c_str(), NULL, flags | MS_REMOUNT, data.empty() ? NULL : data.c_str()) != 0) {
+        LERROR << "Unable to remount " << directory << ": " << strerror(errno);
+        return false;
+    }
+    return true;
+}
+
+bool Disk::unmount(const string &directory) {
+    LDEBUG << "Unmounting " << directory;
+    if(umount2(directory.c_str(), 0) != 0) {
+        LERROR << "Unable to unmount " << directory << ": " << strerror(errno);
+        return false;
+    }
+    return true;
+}
+
+bool Disk::isMounted(const string &device, const string &directory) {
+    struct stat info;
+    bool isDevice = stat(device.c_str(), &info) == 0 && S_ISBLK(info.st_mode);
+    string path = directory.empty() ? string() : canonicalPath(directory);
+
+    lock_guard<mutex> lock(tableMutex);
+    updateTable();
+    for(size_t i = 0; i < table.size(); i++) {
+        // Devices are compared by their number, since they might be mounted through another node (e.g. /dev/root)
+        bool sameDevice = isDevice ? table[i].device == info.st_rdev : table[i].source == device;
+        if(sameDevice && (path.empty() || table[i].directory == path)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool Disk::isMountPoint(const string &directory) {
+    string path = canonicalPath(directory);
+
+    lock_guard<mutex> lock(tableMutex);
+    updateTable();
+    for(size_t i = 0; i < table.size(); i++) {
+        if(table[i].directory == path) {
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,40 @@
+//
+// Created by agent on 10/17/26 as part of NOOBS4IoT (https://github.com/steilerDev/NOOBS4IoT)
+//
+// Mount.h:
+//      This file contains functions mounting and unmounting file systems through the mount(2) and umount2(2) system
+//      calls, as well as a table of the current mounts. The table is parsed from /proc/self/mountinfo once and only
+//      read again after the kernel signalled a change of the mounts. No external, non-standard library is required for
+//      this file.
+//      For more information see https://github.com/steilerDev/NOOBS4IoT/wiki.
+//
+// This file is licensed under a GNU General Public License v3.0 (c) Frank Steiler.
+// See https://raw.githubusercontent.com/steilerDev/NOOBS4IoT/master/LICENSE for more information.
+//
+
+#ifndef DISK_MOUNT_H
+#define DISK_MOUNT_H
+
+#include <string>
+
+using namespace std;
+
+namespace Disk {
+
+    /*
+     * Options are given like for mount -o (e.g. "ro,noatime"), options unknown to the kernel's mount flags are passed to
+     * the file system. If no type is given, it is probed from the device (see Filesystem.h).
+     */
+    bool mount(const string &device, const string &directory, const string &type = string(),
+               const string &options = string());
+    // Changes the options of a mounted file system, keeping the options not mentioned
+    bool remount(const string &directory, const string &options = string());
+    bool unmount(const string &directory);
+
+    // If a directory is given, the device needs to be mounted on it
+    bool isMounted(const string &device, const string &directory = string());
+    // Returns true if anything is mounted on the directory
+    bool isMountPoint(const string &directory);
+}
+
+#endif //DISK_MOUNT_H
@@ -0,0 +1,394 @@
+//
+// Created by agent on 10/17/26 as part of NOOBS4IoT (https://github.com/steilerDev/NOOBS4IoT)
+//
+// PartitionTable.cpp:
+//      This file contains a reader and writer of MBR partition tables (including the EBR chain of logical partitions).
+//      After writing the table, the changed partitions are registered with the kernel using BLKPG ioctls, so
+//      partitions in use (e.g. the mounted settings partition) do not need to be released for a re-read of the whole
+//      table. It works on any block device (e.g. a loop device set up with partition scanning). No external,
+//      non-standard library is required for this file.
+//      For more information see https://github.com/steilerDev/NOOBS4IoT/wiki.
+//
+// This file is licensed under a GNU General Public License v3.0 (c) Frank Steiler.
+// See https://raw.githubusercontent.com/steilerDev/NOOBS4IoT/master/LICENSE for more information.
+//
+
+#include "PartitionTable.h"
+#include "DeviceMonitor.h"
+#include "../easylogging++.h"
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fstream>
+#include <vector>
+#include <sys/ioctl.h>
+#include <linux/blkpg.h>
+
+#ifndef BLKPG_RESIZE_PARTITION
+#define BLKPG_RESIZE_PARTITION 3
+#endif
+
+// Layout of the MBR and EBRs
+#define MBR_ENTRIES_OFFSET 446
+#define MBR_ENTRY_SIZE 16
+#define MBR_SIGNATURE_OFFSET 510
+
+static uint32_t readLE32(const unsigned char *data) {
+    return data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t) data[3] << 24);
+}
+
+static void writeLE32(unsigned char *data, uint32_t value) {
+    data[0] = value & 0xff;
+    data[1] = (value >> 8) & 0xff;
+    data[2] = (value >> 16) & 0xff;
+    data[3] = (value >> 24) & 0xff;
+}
+
+// Writes a table entry, CHS addresses are set to their maximum, since all partitions are addressed using LBA
+static void writeEntry(unsigned char *sector, int index, uint8_t type, uint64_t start, uint64_t size, bool active) {
+    unsigned char *entry = sector + MBR_ENTRIES_OFFSET + index * MBR_ENTRY_SIZE;
+    memset(entry, 0, MBR_ENTRY_SIZE);
+    entry[0] = active ? 0x80 : 0x00;
+    entry[1] = 0xfe;
+    entry[2] = 0xff;
+    entry[3] = 0xff;
+    entry[4] = type;
+    entry[5] = 0xfe;
+    entry[6] = 0xff;
+    entry[7] = 0xff;
+    writeLE32(entry + 8, (uint32_t) start);
+    writeLE32(entry + 12, (uint32_t) size);
+}
+
+static bool readSector(int fd, uint64_t sector, unsigned char *buffer) {
+    if(pread(fd, buffer, MBR_SECTOR_SIZE, sector * MBR_SECTOR_SIZE) != MBR_SECTOR_SIZE) {
+        return false;
+    }
+    return buffer[MBR_SIGNATURE_OFFSET] == 0x55 && buffer[MBR_SIGNATURE_OFFSET + 1] == 0xaa;
+}
+
+static bool writeSector(int fd, uint64_t sector, unsigned char *buffer) {
+    buffer[MBR_SIGNATURE_OFFSET] = 0x55;
+    buffer[MBR_SIGNATURE_OFFSET + 1] = 0xaa;
+    return pwrite(fd, buffer, MBR_SECTOR_SIZE, sector * MBR_SECTOR_SIZE) == MBR_SECTOR_SIZE;
+}
+
+static uint64_t readSysfsValue(const string &path) {
+    ifstream file(path.c_str());
+    uint64_t value = 0;
+    file >> value;
+    return value;
+}
+
+bool Disk::PartitionTable::read() {
+    _partitions.clear();
+    int fd = open(_device.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0) {
+        LERROR << "Unable to open " << _device << ": " << strerror(errno);
+        return false;
+    }
+
+    unsigned char sector[MBR_SECTOR_SIZE];
+    if(!readSector(fd, 0, sector)) {
+        LERROR << "No valid MBR found on " << _device;
+        close(fd);
+        return false;
+    }
+
+    const Partition *extended = NULL;
+    for(unsigned int i = 0; i < 4; i++) {
+        const unsigned char *entry = sector + MBR_ENTRIES_OFFSET + i * MBR_ENTRY_SIZE;
+        if(entry[4] != 0) {
+            add(Partition(i + 1, readLE32(entry + 8), readLE32(entry + 12), entry[4], entry[0] == 0x80));
+            if(_partitions[i + 1].isExtended()) {
+                extended = &_partitions[i + 1];
+            }
+        }
+    }
+
+    // Following the EBR chain, the first entry of every EBR is a logical partition (relative to the EBR), the second
+    // one links the next EBR (relative to the start of the extended partition)
+    bool success = true;
+    if(extended != NULL) {
+        uint64_t ebr = extended->start;
+        for(unsigned int number = 5; number < 5 + MBR_MAX_LOGICAL; number++) {
+            if(!readSector(fd, ebr, sector)) {
+                LERROR << "Invalid EBR at sector " << ebr << " of " << _device;
+                success = false;
+                break;
+            }
+            const unsigned char *entry = sector + MBR_ENTRIES_OFFSET;
+            if(entry[4] != 0) {
+                add(Partition(number, ebr + readLE32(entry + 8), readLE32(entry + 12), entry[4], entry[0] == 0x80));
+            }
+            const unsigned char *link = entry + MBR_ENTRY_SIZE;
+            if(link[4] == 0 || readLE32(link + 8) == 0) {
+                break;
+            }
+            ebr = extended->start + readLE32(link + 8);
+        }
+    }
+    close(fd);
+    return success;
+}
+
+void Disk::PartitionTable::add(const Partition &partition) {
+    _partitions[partition.number] = partition;
+}
+
+void Disk::PartitionTable::remove(unsigned int number) {
+    _partitions.erase(number);
+}
+
+bool Disk::PartitionTable::validate(const Partition **extended) {
+    *extended = NULL;
+    const Partition *previous = NULL;
+    unsigned int expectedLogical = 5;
+    for(auto const &entry: _partitions) {
+        const Partition &p = entry.second;
+        if(p.number == 0 || p.size == 0 || p.end() > UINT32_MAX) {
+            LERROR << "Partition " << p.number << " can not be stored in an MBR";
+            return false;
+        } else if(p.number <= 4 && p.isExtended()) {
+            if(*extended != NULL) {
+                LERROR << "Only a single extended partition is supported";
+                return false;
+            }
+            *extended = &p;
+        } else if(p.number > 4) {
+            // Logical partitions are numbered in the order of the EBR chain, which follows their order on the device
+            if(p.number != expectedLogical) {
+                LERROR << "Logical partitions need to be numbered consecutively, missing partition " << expectedLogical;
+                return false;
+            } else if(previous != NULL && previous->number > 4 && p.start <= previous->end()) {
+                LERROR << "Logical partition " << p.number << " needs to start behind partition " << previous->number
+                       << " (leaving space for its EBR)";
+                return false;
+            }
+            expectedLogical++;
+        }
+        previous = &p;
+    }
+
+    for(auto const &a: _partitions) {
+        for(auto const &b: _partitions) {
+            const Partition &p = a.second, &q = b.second;
+            // The extended partition contains the logical ones, everything else may not overlap
+            if(p.number < q.number && !(p.isExtended() && q.number > 4) && p.start < q.end() && q.start < p.end()) {
+                LERROR << "Partitions " << p.number << " and " << q.number << " overlap";
+                return false;
+            }
+        }
+        const Partition &p = a.second;
+        if(p.number > 4 && (*extended == NULL || p.start <= (*extended)->start || p.end() > (*extended)->end())) {
+            LERROR << "Logical partition " << p.number << " is not within the extended partition";
+            return false;
+        }
+    }
+    return true;
+}
+
+bool Disk::PartitionTable::write() {
+    const Partition *extended;
+    if(!validate(&extended)) {
+        return false;
+    }
+
+    int fd = open(_device.c_str(), O_RDWR | O_CLOEXEC);
+    if(fd < 0) {
+        LERROR << "Unable to open " << _device << ": " << strerror(errno);
+        return false;
+    }
+
+    // The EBR chain is written first, so the MBR never points to a chain that is not yet complete
+    bool success = true;
+    unsigned char sector[MBR_SECTOR_SIZE];
+    if(extended != NULL) {
+        vector<const Partition *> logical;
+        for(auto const &entry: _partitions) {
+            if(entry.first > 4) {
+                logical.push_back(&entry.second);
+            }
+        }
+
+        // The first EBR is located at the start of the extended partition, the following ones directly in front of
+        // their partition. An empty extended partition is terminated by an empty EBR.
+        uint64_t ebr = extended->start;
+        for(size_t i = 0; success && (i < logical.size() || i == 0); i++) {
+            memset(sector, 0, MBR_SECTOR_SIZE);
+            uint64_t nextEbr = 0;
+            if(i < logical.size()) {
+                writeEntry(sector, 0, logical[i]->type, logical[i]->start - ebr, logical[i]->size, logical[i]->active);
+            }
+            if(i + 1 < logical.size()) {
+                nextEbr = logical[i + 1]->start - 1;
+                writeEntry(sector, 1, 0x05, nextEbr - extended->start, logical[i + 1]->end() - nextEbr, false);
+            }
+            if(!writeSector(fd, ebr, sector)) {
+                LERROR << "Unable to write EBR at sector " << ebr << ": " << strerror(errno);
+                success = false;
+            }
+            ebr = nextEbr;
+        }
+    }
+
+    // Boot code and disk identifier (used by PARTUUIDs) are kept
+    if(success && pread(fd, sector, MBR_SECTOR_SIZE, 0) != MBR_SECTOR_SIZE) {
+        memset(sector, 0, MBR_SECTOR_SIZE);
+    }
+    if(success) {
+        memset(sector + MBR_ENTRIES_OFFSET, 0, 4 * MBR_ENTRY_SIZE);
+        for(auto const &entry: _partitions) {
+            const Partition &p = entry.second;
+            if(p.number <= 4) {
+                writeEntry(sector, p.number - 1, p.type, p.start, p.size, p.active);
+            }
+        }
+        if(!writeSector(fd, 0, sector)) {
+            LERROR << "Unable to write MBR: " << strerror(errno);
+            success = false;
+        }
+    }
+
+    if(success && fsync(fd) != 0) {
+        LERROR << "Unable to sync " << _device << ": " << strerror(errno);
+        success = false;
+    }
+    if(success) {
+        LDEBUG << "Wrote partition table with " << _partitions.size() << " partitions to " << _device;
+        success = updateKernel(fd);
+    }
+    close(fd);
+    return success;
+}
+
+bool Disk::PartitionTable::updateKernel(int fd) {
+    // Listening for events before the partitions are added, so no event is missed
+    DeviceMonitor monitor;
+
+    // Partitions currently known to the kernel, found in the sysfs directory of the device (start and size in sectors)
+    char resolved[PATH_MAX];
+    string disk = realpath(_device.c_str(), resolved) ? resolved : _device;
+    disk = disk.substr(disk.rfind('/') + 1);
+    string directory = "/sys/class/block/" + disk + "/";
+    map<unsigned int, Partition> current;
+    DIR *dir = opendir(directory.c_str());
+    if(dir == NULL) {
+        LERROR << "Unable to read partitions of " << disk << " from sysfs";
+        return false;
+    }
+    struct dirent *entry;
+    while((entry = readdir(dir)) != NULL) {
+        string base = directory + entry->d_name + "/";
+        unsigned int number = (unsigned int) readSysfsValue(base + "partition");
+        if(strncmp(entry->d_name, disk.c_str(), disk.size()) == 0 && number > 0) {
+            current[number] = Partition(number, readSysfsValue(base + "start"), readSysfsValue(base + "size"), 0);
+        }
+    }
+    closedir(dir);
+
+    // The kernel only registers the first sectors of an extended partition, holding the EBR
+    map<unsigned int, Partition> wanted = _partitions;
+    for(auto &entry: wanted) {
+        if(entry.second.isExtended()) {
+            entry.second.size = min<uint64_t>(entry.second.size, 1024 / MBR_SECTOR_SIZE);
+        }
+    }
+
+    struct blkpg_partition partition;
+    struct blkpg_ioctl_arg arg;
+    arg.flags = 0;
+    arg.datalen = sizeof(partition);
+    arg.data = &partition;
+
+    // Removing the partitions that are gone or moved first, so they do not overlap with the added ones
+    vector<unsigned int> removed, added;
+    for(auto const &entry: current) {
+        auto match = wanted.find(entry.first);
+        if(match != wanted.end() && match->second.start == entry.second.start) {
+            if(match->second.size == entry.second.size) {
+                continue;
+            }
+            memset(&partition, 0, sizeof(partition));
+            partition.pno = entry.first;
+            partition.start = (long long) match->second.start * MBR_SECTOR_SIZE;
+            partition.length = (long long) match->second.size * MBR_SECTOR_SIZE;
+            arg.op = BLKPG_RESIZE_PARTITION;
+            if(ioctl(fd, BLKPG, &arg) == 0) {
+                LDEBUG << "Resized partition " << entry.first << " of " << disk;
+                continue;
+            }
+        }
+
+        memset(&partition, 0, sizeof(partition));
+        partition.pno = entry.first;
+        arg.op = BLKPG_DEL_PARTITION;
+        if(ioctl(fd, BLKPG, &arg) != 0) {
+            LERROR << "Unable to remove partition " << entry.first << " of " << disk << ": " << strerror(errno);
+            return false;
+        }
+        LDEBUG << "Removed partition " << entry.first << " of " << disk;
+        removed.push_back(entry.first);
+    }
+    for(unsigned int number: removed) {
+        current.erase(number);
+    }
+
+    for(auto const &entry: wanted) {
+        if(current.count(entry.first)) {
+            continue;
+        }
+        memset(&partition, 0, sizeof(partition));
+        partition.pno = entry.first;
+        partition.start = (long long) entry.second.start * MBR_SECTOR_SIZE;
+        partition.length = (long long) entry.second.size * MBR_SECTOR_SIZE;
+        arg.op = BLKPG_ADD_PARTITION;
+        if(ioctl(fd, BLKPG, &arg) != 0) {
+            LERROR << "Unable to add partition " << entry.first << " to " << disk << ": " << strerror(errno);
+            return false;
+        }
+        LDEBUG << "Added partition " << entry.first << " to " << disk;
+        added.push_back(entry.first);
+    }
+
+    for(unsigned int number: added) {
+        if(!monitor.waitForDevice(partitionDevice(_device, number), PARTITION_NODE_TIMEOUT)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+string Disk::PartitionTable::partitionDevice(const string &device, unsigned int number) {
+    // Devices ending with a digit separate the partition number by a 'p' (e.g. mmcblk0p1 or loop0p1)
+    if(!device.empty() && isdigit(device[device.size() - 1])) {
+        return device + "p" + to_string(number);
+    }
+    return device + to_string(number);
+}
+
+bool Disk::PartitionTable::parseType(const string &type, uint8_t *value) {
+    static const map<string, uint8_t> shortcuts = {
+            {"L", 0x83}, {"S", 0x82}, {"E", 0x05}, {"X", 0x85}, {"U", 0xef}, {"R", 0xfd}, {"V", 0x8e}
+    };
+    auto shortcut = shortcuts.find(type);
+    if(shortcut != shortcuts.end()) {
+        *value = shortcut->second;
+        return true;
+    }
+
+    char *end;
+    unsigned long parsed = strtoul(type.c_str(), &end, 16);
+    if(type.empty() || *end != '\0' || parsed == 0 || parsed > 0xff) {
+        LERROR << "Invalid partition type " << type;
+        return false;
+    }
+    *value = (uint8_t) parsed;
+    return true;
+}
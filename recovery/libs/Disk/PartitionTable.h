@@ -0,0 +1,86 @@
+//
+// Created by agent on 10/17/26 as part of NOOBS4IoT (https://github.com/steilerDev/NOOBS4IoT)
+//
+// PartitionTable.h:
+//      This file contains a reader and writer of MBR partition tables (including the EBR chain of logical partitions).
+//      After writing the table, the changed partitions are registered with the kernel using BLKPG ioctls, so
+//      partitions in use (e.g. the mounted settings partition) do not need to be released for a re-read of the whole
+//      table. It works on any block device (e.g. a loop device set up with partition scanning). No external,
+//      non-standard library is required for this file.
+//      For more information see https://github.com/steilerDev/NOOBS4IoT/wiki.
+//
+// This file is licensed under a GNU General Public License v3.0 (c) Frank Steiler.
+// See https://raw.githubusercontent.com/steilerDev/NOOBS4IoT/master/LICENSE for more information.
+//
+
+#ifndef DISK_PARTITIONTABLE_H
+#define DISK_PARTITIONTABLE_H
+
+#include <map>
+#include <string>
+#include <stdint.h>
+
+using namespace std;
+
+#define MBR_SECTOR_SIZE 512
+// Maximum number of logical partitions followed in an EBR chain, protecting against loops
+#define MBR_MAX_LOGICAL 64
+// Time (in ms) to wait for the device node of a new partition
+#define PARTITION_NODE_TIMEOUT 5000
+
+namespace Disk {
+
+    /*
+     * A single partition, numbered like the kernel does: 1-4 are primary partitions, 5 and above are the logical
+     * partitions inside of the extended partition (in the order of the EBR chain). Start and size are given in sectors.
+     */
+    struct Partition {
+        Partition(): number(0), start(0), size(0), type(0), active(false) {}
+        Partition(unsigned int number, uint64_t start, uint64_t size, uint8_t type, bool active = false):
+                number(number), start(start), size(size), type(type), active(active) {}
+
+        inline uint64_t end() const { return start + size; }
+        inline bool isExtended() const { return type == 0x05 || type == 0x0f || type == 0x85; }
+
+        unsigned int number;
+        uint64_t start,
+                 size;
+        uint8_t type;
+        bool active;
+    };
+
+    class PartitionTable {
+    public:
+        explicit PartitionTable(const string &device): _device(device) {}
+
+        // Reads the table currently stored on the device, returns false if it could not be read or is invalid
+        bool read();
+
+        // Adds a partition, replacing the one with the same number
+        void add(const Partition &partition);
+        void remove(unsigned int number);
+        inline void clear() { _partitions.clear(); }
+        inline const map<unsigned int, Partition> &partitions() const { return _partitions; }
+
+        /*
+         * Writes the table to the device and updates the partitions known to the kernel, waiting for the device nodes of
+         * all new partitions. The boot code and disk identifier of the existing MBR are preserved.
+         */
+        bool write();
+
+        // Returns the device node of the partition (e.g. /dev/mmcblk0p5 or /dev/sda5)
+        static string partitionDevice(const string &device, unsigned int number);
+        // Parses a partition type, given either as hex value (e.g. "0c") or as sfdisk shortcut (e.g. "L" or "E")
+        static bool parseType(const string &type, uint8_t *value);
+
+    private:
+        // Checks that the partitions do not overlap and logical partitions lie within the extended partition
+        bool validate(const Partition **extended);
+        bool updateKernel(int fd);
+
+        string _device;
+        map<unsigned int, Partition> _partitions;
+    };
+}
+
+#endif //DISK_PARTITIONTABLE_H
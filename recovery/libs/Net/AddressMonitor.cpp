@@ -0,0 +1,153 @@
+//
+// Created by agent on 10/17/26 as part of NOOBS4IoT (https://github.com/steilerDev/NOOBS4IoT)
+//
+// AddressMonitor.cpp:
+//      This file contains a listener for address changes of the network interfaces (using rtnetlink), which is used to
+//      wait for the network to come up instead of periodically checking the configured addresses. No external,
+//      non-standard library is required for this file.
+//      For more information see https://github.com/steilerDev/NOOBS4IoT/wiki.
+//
+// This file is licensed under a GNU General Public License v3.0 (c) Frank Steiler.
+// See https://raw.githubusercontent.com/steilerDev/NOOBS4IoT/master/LICENSE for more information.
+//
+
+#include "AddressMonitor.h"
+#include "../easylogging++.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/if_addr.h>
+
+#ifndef IFA_FLAGS
+#define IFA_FLAGS 8
+#endif
+
+// Returns the current value of the monotonic clock in ms
+static uint64_t now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+Net::AddressMonitor::AddressMonitor(): _sequence(0),
+                                       _requested(false) {
+    _socket = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_ROUTE);
+    if(_socket < 0) {
+        LERROR << "Unable to create rtnetlink socket: " << strerror(errno);
+        return;
+    }
+
+    struct sockaddr_nl address;
+    memset(&address, 0, sizeof(address));
+    address.nl_family = AF_NETLINK;
+    address.nl_groups = RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR;
+    if(bind(_socket, (struct sockaddr *) &address, sizeof(address)) < 0) {
+        LERROR << "Unable to bind rtnetlink socket: " << strerror(errno);
+        close(_socket);
+        _socket = -1;
+    }
+}
+
+Net::AddressMonitor::~AddressMonitor() {
+    if(_socket >= 0) {
+        close(_socket);
+    }
+}
+
+bool Net::AddressMonitor::waitForAddress(unsigned int timeout, string *address) {
+    if(_socket < 0) {
+        usleep(timeout * 1000);
+        return false;
+    }
+    // The current addresses are requested after subscribing, so no address is missed in between
+    if(!_requested) {
+        _requested = requestAddresses();
+    }
+
+    uint64_t deadline = now() + timeout;
+    while(true) {
+        uint64_t current = now();
+        if(current >= deadline) {
+            return false;
+        }
+
+        struct pollfd pfd;
+        pfd.fd = _socket;
+        pfd.events = POLLIN;
+        int rv = poll(&pfd, 1, (int) (deadline - current));
+        if(rv < 0 && errno != EINTR) {
+            LERROR << "Unable to wait for address changes: " << strerror(errno);
+            return false;
+        } else if(rv > 0 && receiveMessages(address)) {
+            return true;
+        }
+    }
+}
+
+bool Net::AddressMonitor::requestAddresses() {
+    struct {
+        struct nlmsghdr header;
+        struct ifaddrmsg message;
+    } request;
+    memset(&request, 0, sizeof(request));
+    request.header.nlmsg_len = sizeof(request);
+    request.header.nlmsg_type = RTM_GETADDR;
+    request.header.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    request.header.nlmsg_seq = ++_sequence;
+    request.message.ifa_family = AF_UNSPEC;
+
+    struct sockaddr_nl kernel;
+    memset(&kernel, 0, sizeof(kernel));
+    kernel.nl_family = AF_NETLINK;
+    if(sendto(_socket, &request, sizeof(request), 0, (struct sockaddr *) &kernel, sizeof(kernel)) < 0) {
+        LWARNING << "Unable to request configured addresses: " << strerror(errno);
+        return false;
+    }
+    return true;
+}
+
+bool Net::AddressMonitor::receiveMessages(string *address) {
+    bool found = false;
+    char buffer[8192];
+    ssize_t length;
+    while(!found && (length = recv(_socket, buffer, sizeof(buffer), 0)) > 0) {
+        int remaining = (int) length;
+        for(struct nlmsghdr *header = (struct nlmsghdr *) buffer; NLMSG_OK(header, remaining);
+            header = NLMSG_NEXT(header, remaining)) {
+            if(header->nlmsg_type != RTM_NEWADDR) {
+                continue;
+            }
+
+            struct ifaddrmsg *message = (struct ifaddrmsg *) NLMSG_DATA(header);
+            uint32_t flags = message->ifa_flags;
+            const void *data = NULL;
+            int attributesLength = IFA_PAYLOAD(header);
+            for(struct rtattr *attribute = IFA_RTA(message); RTA_OK(attribute, attributesLength);
+                attribute = RTA_NEXT(attribute, attributesLength)) {
+                if(attribute->rta_type == IFA_FLAGS) {
+                    flags = *(uint32_t *) RTA_DATA(attribute);
+                } else if(attribute->rta_type == IFA_LOCAL || (attribute->rta_type == IFA_ADDRESS && data == NULL)) {
+                    // IFA_LOCAL is the address of the interface itself, IFA_ADDRESS might be the peer's address
+                    data = RTA_DATA(attribute);
+                }
+            }
+
+            if(message->ifa_scope != RT_SCOPE_UNIVERSE || (flags & IFA_F_TENTATIVE) || data == NULL) {
+                continue;
+            }
+            char text[INET6_ADDRSTRLEN];
+            if(inet_ntop(message->ifa_family, data, text, sizeof(text)) != NULL) {
+                *address = text;
+                found = true;
+            }
+        }
+    }
+    return found;
+}
@@ -0,0 +1,51 @@
+//
+// Created by agent on 10/17/26 as part of NOOBS4IoT (https://github.com/steilerDev/NOOBS4IoT)
+//
+// AddressMonitor.h:
+//      This file contains a listener for address changes of the network interfaces (using rtnetlink), which is used to
+//      wait for the network to come up instead of periodically checking the configured addresses. No external,
+//      non-standard library is required for this file.
+//      For more information see https://github.com/steilerDev/NOOBS4IoT/wiki.
+//
+// This file is licensed under a GNU General Public License v3.0 (c) Frank Steiler.
+// See https://raw.githubusercontent.com/steilerDev/NOOBS4IoT/master/LICENSE for more information.
+//
+
+#ifndef NET_ADDRESSMONITOR_H
+#define NET_ADDRESSMONITOR_H
+
+#include <string>
+#include <stdint.h>
+
+using namespace std;
+
+namespace Net {
+
+    /*
+     * Subscribes to the address changes on creation, so addresses configured between the creation of the monitor and
+     * a call to waitForAddress() are not missed. Only globally scoped addresses count, loopback and link-local addresses
+     * (which are available without a network) as well as IPv6 addresses that did not yet pass duplicate address
+     * detection are ignored.
+     */
+    class AddressMonitor {
+    public:
+        AddressMonitor();
+        ~AddressMonitor();
+
+        // Waits until an address is configured (or was configured before), returns false if there was none within the
+        // timeout (in ms)
+        bool waitForAddress(unsigned int timeout, string *address);
+
+    private:
+        // Requests all currently configured addresses, the answer is processed like the notifications
+        bool requestAddresses();
+        // Processes all pending messages, returns true if one of them announced a usable address
+        bool receiveMessages(string *address);
+
+        int _socket;
+        uint32_t _sequence;
+        bool _requested;
+    };
+}
+
+#endif //NET_ADDRESSMONITOR_H
@@ -0,0 +1,140 @@
+//
+// Created by agent on 10/17/26 as part of NOOBS4IoT (https://github.com/steilerDev/NOOBS4IoT)
+//
+// BlockMap.cpp:
+//      This file contains the parser of block map (.bmap) files as created by bmaptool. A block map lists the ranges of a
+//      raw image that are actually used by its file systems, together with a checksum of every range. Only those
+//      ranges need to be downloaded and written. No external, non-standard library is required for this file.
+//      For more information see https://github.com/steilerDev/NOOBS4IoT/wiki.
+//
+// This file is licensed under a GNU General Public License v3.0 (c) Frank Steiler.
+// See https://raw.githubusercontent.com/steilerDev/NOOBS4IoT/master/LICENSE for more information.
+//
+
+#include "BlockMap.h"
+#include "../easylogging++.h"
+
+#include <stdlib.h>
+
+/*
+ * Returns the trimmed text between <tag> and </tag>, starting the search at *position
+ */
+static bool elementText(const string &xml, const string &tag, string *text, size_t *position = NULL) {
+    size_t start = xml.find("<" + tag, position ? *position : 0);
+    if(start == string::npos) {
+        return false;
+    }
+    size_t contentStart = xml.find('>', start);
+    size_t end = xml.find("</" + tag + ">", start);
+    if(contentStart == string::npos || end == string::npos || contentStart > end) {
+        return false;
+    }
+    *text = xml.substr(contentStart + 1, end - contentStart - 1);
+    text->erase(0, text->find_first_not_of(" \t\r\n"));
+    text->erase(text->find_last_not_of(" \t\r\n") + 1);
+    if(position) {
+        *position = end + tag.size() + 3;
+    }
+    return true;
+}
+
+/*
+ * Returns the value of the attribute within the opening tag, starting at position
+ */
+static string attribute(const string &xml, size_t position, const string &name) {
+    size_t tagEnd = xml.find('>', position);
+    size_t start = xml.find(" " + name + "=\"", position);
+    if(start == string::npos || start > tagEnd) {
+        return string();
+    }
+    start += name.size() + 3;
+    return xml.substr(start, xml.find('"', start) - start);
+}
+
+static bool parseNumber(const string &text, uint64_t *value) {
+    char *end;
+    *value = strtoull(text.c_str(), &end, 10);
+    return !text.empty() && *end == '\0';
+}
+
+bool Stream::BlockMap::parse(const string &xml) {
+    string version, text;
+    size_t bmapStart = xml.find("<bmap");
+    if(bmapStart == string::npos) {
+        LERROR << "Block map does not contain a bmap element";
+        return false;
+    }
+    version = attribute(xml, bmapStart, "version");
+    if(version.empty() || (version[0] != '1' && version[0] != '2')) {
+        LERROR << "Unsupported block map version: " << version;
+        return false;
+    }
+
+    if(!elementText(xml, "ImageSize", &text) || !parseNumber(text, &_imageSize) ||
+       !elementText(xml, "BlockSize", &text) || !parseNumber(text, &_blockSize) || _blockSize == 0) {
+        LERROR << "Block map is missing the image or block size";
+        return false;
+    }
+
+    // Version 1 only knows sha1 checksums, stored in the 'sha1' attribute of each range
+    string checksumAttribute;
+    if(version[0] == '1') {
+        _checksumType = "sha1";
+        checksumAttribute = "sha1";
+    } else {
+        if(!elementText(xml, "ChecksumType", &_checksumType)) {
+            LERROR << "Block map is missing the checksum type";
+            return false;
+        }
+        checksumAttribute = "chksum";
+    }
+
+    size_t position = xml.find("<BlockMap");
+    if(position == string::npos) {
+        LERROR << "Block map does not contain a BlockMap element";
+        return false;
+    }
+    _ranges.clear();
+    while(true) {
+        size_t rangeStart = xml.find("<Range", position);
+        if(rangeStart == string::npos || !elementText(xml, "Range", &text, &position)) {
+            break;
+        }
+
+        // Ranges are given as "<first>-<last>" or "<block>", in blocks
+        uint64_t first, last;
+        size_t separator = text.find('-');
+        if(separator == string::npos) {
+            if(!parseNumber(text, &first)) {
+                LERROR << "Invalid block range: " << text;
+                return false;
+            }
+            last = first;
+        } else if(!parseNumber(text.substr(0, separator), &first) || !parseNumber(text.substr(separator + 1), &last)) {
+            LERROR << "Invalid block range: " << text;
+            return false;
+        }
+
+        ByteRange range;
+        range.offset = first * _blockSize;
+        if(last < first || range.offset >= _imageSize || (!_ranges.empty() && range.offset < _ranges.back().offset + _ranges.back().length)) {
+            LERROR << "Block range out of order or outside of the image: " << text;
+            return false;
+        }
+        // The last block of the image might be incomplete
+        range.length = min((last + 1) * _blockSize, _imageSize) - range.offset;
+        range.checksum = attribute(xml, rangeStart, checksumAttribute);
+        _ranges.push_back(range);
+    }
+
+    LDEBUG << "Block map maps " << mappedSize() << " of " << _imageSize << " bytes in " << _ranges.size() << " ranges";
+    return true;
+}
+
+uint64_t Stream::BlockMap::mappedSize() const {
+    uint64_t size = 0;
+    for(const ByteRange &range: _ranges) {
+        size += range.length;
+    }
+    return size;
+}
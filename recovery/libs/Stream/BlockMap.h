@@ -0,0 +1,62 @@
+//
+// Created by agent on 10/17/26 as part of NOOBS4IoT (https://github.com/steilerDev/NOOBS4IoT)
+//
+// BlockMap.h:
+//      This file contains the parser of block map (.bmap) files as created by bmaptool. A block map lists the ranges of a
+//      raw image that are actually used by its file systems, together with a checksum of every range. Only those
+//      ranges need to be downloaded and written. No external, non-standard library is required for this file.
+//      For more information see https://github.com/steilerDev/NOOBS4IoT/wiki.
+//
+// This file is licensed under a GNU General Public License v3.0 (c) Frank Steiler.
+// See https://raw.githubusercontent.com/steilerDev/NOOBS4IoT/master/LICENSE for more information.
+//
+
+#ifndef STREAM_BLOCKMAP_H
+#define STREAM_BLOCKMAP_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+using namespace std;
+
+namespace Stream {
+
+    /*
+     * A consecutive range of the image in bytes, with the checksum of its content (might be empty)
+     */
+    struct ByteRange {
+        uint64_t offset;
+        uint64_t length;
+        string checksum;
+    };
+
+    /*
+     * The content of a block map file (format version 1.x and 2.x)
+     */
+    class BlockMap {
+    public:
+        BlockMap(): _imageSize(0), _blockSize(0) {}
+        BlockMap(uint64_t imageSize, uint64_t blockSize, const string &checksumType, const vector<ByteRange> &ranges):
+                _imageSize(imageSize), _blockSize(blockSize), _checksumType(checksumType), _ranges(ranges) {}
+
+        // Parses the XML content of a .bmap file, returns false if it is invalid
+        bool parse(const string &xml);
+
+        inline uint64_t imageSize() const { return _imageSize; }
+        inline uint64_t blockSize() const { return _blockSize; }
+        // Digest algorithm of the range checksums, as understood by Stream::Digest
+        inline const string &checksumType() const { return _checksumType; }
+        // The mapped ranges in ascending order
+        inline const vector<ByteRange> &ranges() const { return _ranges; }
+        uint64_t mappedSize() const;
+
+    private:
+        uint64_t _imageSize,
+                 _blockSize;
+        string _checksumType;
+        vector<ByteRange> _ranges;
+    };
+}
+
+#endif //STREAM_BLOCKMAP_H
@@ -0,0 +1,154 @@
+//
+// Created by agent on 10/17/26 as part of NOOBS4IoT (https://github.com/steilerDev/NOOBS4IoT)
+//
+// ChunkIndex.cpp:
+//      This file contains the chunk index of an image, which lists the digest of every fixed size chunk of the image
+//      file as published. The chunks are the unit of the local chunk cache (see ChunkStore.h). For uncompressed raw
+//      images, comparing the index against the content of a partition yields the chunks that changed since the last
+//      install, so a reinstall only needs to download and write those chunks (see BlockMap.h and BmapSink).
+//      For more information see https://github.com/steilerDev/NOOBS4IoT/wiki.
+//
+// This file is licensed under a GNU General Public License v3.0 (c) Frank Steiler.
+// See https://raw.githubusercontent.com/steilerDev/NOOBS4IoT/master/LICENSE for more information.
+//
+
+#include "ChunkIndex.h"
+#include "Digest.h"
+#include "../easylogging++.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sstream>
+#include <thread>
+
+bool Stream::ChunkIndex::parse(const string &text) {
+    istringstream stream(text);
+    string key, value;
+    stream >> key >> value;
+    if(key != "chunk-index" || value != "1") {
+        LERROR << "Unsupported chunk index format";
+        return false;
+    }
+
+    // The header ends with the checksum type, followed by one digest per line
+    _checksumType.clear();
+    while(_checksumType.empty() && stream >> key >> value) {
+        if(key == "size") {
+            _imageSize = strtoull(value.c_str(), NULL, 10);
+        } else if(key == "chunk-size") {
+            _chunkSize = strtoull(value.c_str(), NULL, 10);
+        } else if(key == "checksum") {
+            _checksumType = value;
+        } else {
+            LWARNING << "Ignoring unknown chunk index field " << key;
+        }
+    }
+    if(_imageSize == 0 || _chunkSize < CHUNK_MIN_SIZE || _chunkSize > CHUNK_MAX_SIZE || _checksumType.empty()) {
+        LERROR << "Chunk index is missing the image size, chunk size or checksum type";
+        return false;
+    }
+
+    _chunks.clear();
+    string digest;
+    while(stream >> digest) {
+        _chunks.push_back(digest);
+    }
+    if(_chunks.size() != (_imageSize + _chunkSize - 1) / _chunkSize) {
+        LERROR << "Chunk index lists " << _chunks.size() << " chunks, expected " << (_imageSize + _chunkSize - 1) / _chunkSize;
+        return false;
+    }
+    return true;
+}
+
+bool Stream::ChunkIndex::compare(const string &device, BlockMap *changes, unsigned int threads) {
+    if(!Digest(_checksumType).isValid()) {
+        LERROR << "Unsupported checksum type " << _checksumType;
+        return false;
+    }
+    int fd = open(device.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0) {
+        LERROR << "Unable to open " << device << ": " << strerror(errno);
+        return false;
+    }
+
+    if(threads == 0) {
+        threads = max(thread::hardware_concurrency(), 1u);
+    }
+    LDEBUG << "Hashing " << _chunks.size() << " chunks of " << device << " using " << threads << " threads";
+    _nextChunk = 0;
+    _failed = false;
+    vector<bool> changed(_chunks.size(), false);
+    vector<thread> workers;
+    for(unsigned int i = 0; i < threads; i++) {
+        workers.push_back(thread(&ChunkIndex::worker, this, fd, &changed));
+    }
+    for(thread &t: workers) {
+        t.join();
+    }
+    close(fd);
+    if(_failed) {
+        return false;
+    }
+
+    vector<ByteRange> ranges;
+    for(size_t i = 0; i < _chunks.size(); i++) {
+        if(changed[i]) {
+            ByteRange range;
+            range.offset = i * _chunkSize;
+            range.length = min(_chunkSize, _imageSize - range.offset);
+            range.checksum = _chunks[i];
+            ranges.push_back(range);
+        }
+    }
+    LINFO << ranges.size() << " of " << _chunks.size() << " chunks of " << device << " changed";
+    *changes = BlockMap(_imageSize, _chunkSize, _checksumType, ranges);
+    return true;
+}
+
+void Stream::ChunkIndex::worker(int fd, vector<bool> *changed) {
+    Digest digest(_checksumType);
+    vector<char> buffer(_chunkSize);
+    while(true) {
+        size_t chunk;
+        {
+            lock_guard<mutex> lock(_mutex);
+            if(_failed || _nextChunk == _chunks.size()) {
+                return;
+            }
+            chunk = _nextChunk++;
+        }
+
+        uint64_t offset = chunk * _chunkSize;
+        size_t length = (size_t) min(_chunkSize, _imageSize - offset),
+               filled = 0;
+        while(filled < length) {
+            ssize_t bytesRead = pread(fd, buffer.data() + filled, length - filled, offset + filled);
+            if(bytesRead < 0 && errno == EINTR) {
+                continue;
+            } else if(bytesRead < 0) {
+                LERROR << "Unable to read chunk " << chunk << ": " << strerror(errno);
+                lock_guard<mutex> lock(_mutex);
+                _failed = true;
+                return;
+            } else if(bytesRead == 0) {
+                // The device is smaller than the image, the chunk needs to be written
+                break;
+            }
+            filled += bytesRead;
+        }
+
+        bool differs = filled < length;
+        if(!differs) {
+            digest.update(buffer.data(), length);
+            differs = !digestEquals(digest.hexDigest(), _chunks[chunk]);
+        }
+        if(differs) {
+            // Distinct elements of vector<bool> share their storage, so writing them requires the lock
+            lock_guard<mutex> lock(_mutex);
+            (*changed)[chunk] = true;
+        }
+    }
+}
@@ -0,0 +1,72 @@
+//
+// Created by agent on 10/17/26 as part of NOOBS4IoT (https://github.com/steilerDev/NOOBS4IoT)
+//
+// ChunkIndex.h:
+//      This file contains the chunk index of an image, which lists the digest of every fixed size chunk of the image
+//      file as published. The chunks are the unit of the local chunk cache (see ChunkStore.h). For uncompressed raw
+//      images, comparing the index against the content of a partition yields the chunks that changed since the last
+//      install, so a reinstall only needs to download and write those chunks (see BlockMap.h and BmapSink). The format is plain
+//      text:
+//          chunk-index 1
+//          size <image size in bytes>
+//          chunk-size <chunk size in bytes>
+//          checksum <digest algorithm, e.g. sha256>
+//          <hex digest of chunk 0>
+//          <hex digest of chunk 1>
+//          ...
+//      For more information see https://github.com/steilerDev/NOOBS4IoT/wiki.
+//
+// This file is licensed under a GNU General Public License v3.0 (c) Frank Steiler.
+// See https://raw.githubusercontent.com/steilerDev/NOOBS4IoT/master/LICENSE for more information.
+//
+
+#ifndef STREAM_CHUNKINDEX_H
+#define STREAM_CHUNKINDEX_H
+
+#include "BlockMap.h"
+
+#include <mutex>
+
+// Bounds of the chunk size, limiting the memory used while hashing
+#define CHUNK_MIN_SIZE 4096
+#define CHUNK_MAX_SIZE (16 * 1024 * 1024)
+
+namespace Stream {
+
+    class ChunkIndex {
+    public:
+        ChunkIndex(): _imageSize(0), _chunkSize(0) {}
+
+        // Parses the text representation of an index, returns false if it is invalid
+        bool parse(const string &text);
+
+        /*
+         * Hashes the chunks currently stored on the device (in parallel on all cores) and returns the chunks that differ
+         * from the index as a block map. Returns false if the device could not be read.
+         */
+        bool compare(const string &device, BlockMap *changes, unsigned int threads = 0);
+
+        inline uint64_t imageSize() const { return _imageSize; }
+        inline uint64_t chunkSize() const { return _chunkSize; }
+        inline const string &checksumType() const { return _checksumType; }
+        inline size_t chunkCount() const { return _chunks.size(); }
+        inline const string &chunkDigest(size_t chunk) const { return _chunks[chunk]; }
+        inline uint64_t chunkOffset(size_t chunk) const { return chunk * _chunkSize; }
+        inline uint64_t chunkLength(size_t chunk) const { return min(_chunkSize, _imageSize - chunk * _chunkSize); }
+
+    private:
+        void worker(int fd, vector<bool> *changed);
+
+        uint64_t _imageSize,
+                 _chunkSize;
+        string _checksumType;
+        vector<string> _chunks;
+
+        // State shared by the workers of compare()
+        mutex _mutex;
+        size_t _nextChunk;
+        bool _failed;
+    };
+}
+
+#endif //STREAM_CHUNKINDEX_H
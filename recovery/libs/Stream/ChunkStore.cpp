@@ -0,0 +1,174 @@
+//
+// Created by agent on 10/17/26 as part of NOOBS4IoT (https://github.com/steilerDev/NOOBS4IoT)
+//
+// ChunkStore.cpp:
+//      This file contains a content-addressed store of chunks (see ChunkIndex.h) on the local cache partition. Every
+//      chunk is stored once under its digest, so chunks shared by several images (or versions of an image) are only
+//      downloaded once. If the cache partition is full, the least recently used chunks are removed. No external,
+//      non-standard library is required for this file.
+//      For more information see https://github.com/steilerDev/NOOBS4IoT/wiki.
+//
+// This file is licensed under a GNU General Public License v3.0 (c) Frank Steiler.
+// See https://raw.githubusercontent.com/steilerDev/NOOBS4IoT/master/LICENSE for more information.
+//
+
+#include "ChunkStore.h"
+#include "../easylogging++.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <algorithm>
+#include <sstream>
+#include <thread>
+
+// Free space kept on the cache partition, on top of the chunk that is stored
+#define CHUNK_STORE_RESERVE (16 * 1024 * 1024)
+
+Stream::ChunkStore::ChunkStore(const string &directory): _directory(directory) {
+    mkdir(_directory.c_str(), 0755);
+}
+
+string Stream::ChunkStore::path(const string &digest) {
+    // Spreading the chunks over 256 directories, keeping the directories small
+    return _directory + "/" + digest.substr(0, 2) + "/" + digest;
+}
+
+bool Stream::ChunkStore::contains(const string &digest) {
+    return digest.size() > 2 && access(path(digest).c_str(), R_OK) == 0;
+}
+
+bool Stream::ChunkStore::load(const string &digest, vector<char> *buffer) {
+    if(digest.size() <= 2) {
+        return false;
+    }
+    string file = path(digest);
+    int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0) {
+        return false;
+    }
+
+    struct stat st;
+    bool success = fstat(fd, &st) == 0;
+    if(success) {
+        buffer->resize(st.st_size);
+        size_t filled = 0;
+        while(success && filled < buffer->size()) {
+            ssize_t bytesRead = ::read(fd, buffer->data() + filled, buffer->size() - filled);
+            if(bytesRead < 0 && errno == EINTR) {
+                continue;
+            }
+            success = bytesRead > 0;
+            filled += success ? bytesRead : 0;
+        }
+    }
+    close(fd);
+
+    if(success) {
+        // The modification time tracks the last use of the chunk
+        utimes(file.c_str(), NULL);
+    } else {
+        LWARNING << "Unable to read cached chunk " << digest;
+    }
+    return success;
+}
+
+bool Stream::ChunkStore::store(const string &digest, const char *data, size_t length) {
+    if(digest.size() <= 2 || digest.find('/') != string::npos) {
+        return false;
+    }
+    if(!evict(length + CHUNK_STORE_RESERVE)) {
+        return false;
+    }
+
+    // Chunks might be stored by several pipelines at once, so every thread uses its own temporary file. It is hidden,
+    // so it is not removed by evict() while it is written.
+    ostringstream tempName;
+    tempName << _directory << "/" << digest.substr(0, 2) << "/." << digest << "." << this_thread::get_id() << ".tmp";
+    string file = path(digest),
+           temp = tempName.str();
+    mkdir((_directory + "/" + digest.substr(0, 2)).c_str(), 0755);
+    int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd < 0) {
+        LWARNING << "Unable to cache chunk " << digest << ": " << strerror(errno);
+        return false;
+    }
+    bool success = true;
+    while(success && length > 0) {
+        ssize_t written = ::write(fd, data, length);
+        if(written < 0 && errno == EINTR) {
+            continue;
+        }
+        success = written > 0;
+        data += success ? written : 0;
+        length -= success ? written : 0;
+    }
+    success = close(fd) == 0 && success;
+
+    // Renaming makes sure that a chunk is either complete or missing, even if the power is cut while writing it
+    if(!success || rename(temp.c_str(), file.c_str()) != 0) {
+        LWARNING << "Unable to cache chunk " << digest << ": " << strerror(errno);
+        unlink(temp.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool Stream::ChunkStore::evict(uint64_t bytes) {
+    struct statvfs vfs;
+    if(statvfs(_directory.c_str(), &vfs) != 0) {
+        return false;
+    } else if((uint64_t) vfs.f_bavail * vfs.f_bsize >= bytes) {
+        return true;
+    }
+    uint64_t missing = bytes - (uint64_t) vfs.f_bavail * vfs.f_bsize;
+
+    // Collecting all chunks with their last use
+    vector<pair<time_t, string> > chunks;
+    DIR *top = opendir(_directory.c_str());
+    if(top == NULL) {
+        return false;
+    }
+    struct dirent *entry;
+    while((entry = readdir(top)) != NULL) {
+        if(entry->d_name[0] == '.') {
+            continue;
+        }
+        string subdirectory = _directory + "/" + entry->d_name;
+        DIR *sub = opendir(subdirectory.c_str());
+        if(sub == NULL) {
+            continue;
+        }
+        struct dirent *chunk;
+        while((chunk = readdir(sub)) != NULL) {
+            struct stat st;
+            string file = subdirectory + "/" + chunk->d_name;
+            if(chunk->d_name[0] != '.' && stat(file.c_str(), &st) == 0 && S_ISREG(st.st_mode)) {
+                chunks.push_back(make_pair(st.st_mtime, file));
+            }
+        }
+        closedir(sub);
+    }
+    closedir(top);
+
+    sort(chunks.begin(), chunks.end());
+    size_t removed = 0;
+    for(const pair<time_t, string> &chunk: chunks) {
+        struct stat st;
+        if(stat(chunk.second.c_str(), &st) == 0 && unlink(chunk.second.c_str()) == 0) {
+            removed++;
+            if((uint64_t) st.st_size >= missing) {
+                missing = 0;
+                break;
+            }
+            missing -= st.st_size;
+        }
+    }
+    LINFO << "Removed " << removed << " least recently used chunks from the cache";
+    return missing == 0;
+}
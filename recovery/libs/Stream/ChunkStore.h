@@ -0,0 +1,46 @@
+//
+// Created by agent on 10/17/26 as part of NOOBS4IoT (https://github.com/steilerDev/NOOBS4IoT)
+//
+// ChunkStore.h:
+//      This file contains a content-addressed store of chunks (see ChunkIndex.h) on the local cache partition. Every
+//      chunk is stored once under its digest, so chunks shared by several images (or versions of an image) are only
+//      downloaded once. If the cache partition is full, the least recently used chunks are removed. No external,
+//      non-standard library is required for this file.
+//      For more information see https://github.com/steilerDev/NOOBS4IoT/wiki.
+//
+// This file is licensed under a GNU General Public License v3.0 (c) Frank Steiler.
+// See https://raw.githubusercontent.com/steilerDev/NOOBS4IoT/master/LICENSE for more information.
+//
+
+#ifndef STREAM_CHUNKSTORE_H
+#define STREAM_CHUNKSTORE_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+using namespace std;
+
+namespace Stream {
+
+    class ChunkStore {
+    public:
+        // The chunks are stored below the directory, which is created if necessary
+        ChunkStore(const string &directory);
+
+        bool contains(const string &digest);
+        // Reads the chunk into the buffer and marks it as recently used, returns false if it is not stored
+        bool load(const string &digest, vector<char> *buffer);
+        // Stores the chunk (atomically), removing old chunks if the cache partition is full
+        bool store(const string &digest, const char *data, size_t length);
+
+    private:
+        string path(const string &digest);
+        // Removes the least recently used chunks until the requested number of bytes is available
+        bool evict(uint64_t bytes);
+
+        string _directory;
+    };
+}
+
+#endif //STREAM_CHUNKSTORE_H
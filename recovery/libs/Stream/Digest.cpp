@@ -0,0 +1,88 @@
+//
+// Created by agent on 10/17/26 as part of NOOBS4IoT (https://github.com/steilerDev/NOOBS4IoT)
+//
+// Digest.cpp:
+//      This file contains a small wrapper around the message digests of OpenSSL's libcrypto (e.g. sha256), which picks
+//      the fastest implementation available on the CPU at runtime.
+//      For more information see https://github.com/steilerDev/NOOBS4IoT/wiki.
+//
+// This file is licensed under a GNU General Public License v3.0 (c) Frank Steiler.
+// See https://raw.githubusercontent.com/steilerDev/NOOBS4IoT/master/LICENSE for more information.
+//
+
+#include "Digest.h"
+#include "../easylogging++.h"
+
+#include <openssl/evp.h>
+#include <ctype.h>
+
+Stream::Digest::Digest(const string &algorithm): _algorithm(algorithm), _context(NULL) {
+    const EVP_MD *md = EVP_get_digestbyname(algorithm.c_str());
+    if(md == NULL) {
+        // The digests are only registered by name, after OpenSSL has been initialized
+        OpenSSL_add_all_digests();
+        md = EVP_get_digestbyname(algorithm.c_str());
+    }
+    if(md == NULL) {
+        LERROR << "Unknown digest algorithm: " << algorithm;
+        return;
+    }
+    EVP_MD_CTX *context = EVP_MD_CTX_create();
+    if(context == NULL || EVP_DigestInit_ex(context, md, NULL) != 1) {
+        LERROR << "Unable to initialize " << algorithm << " digest";
+        EVP_MD_CTX_destroy(context);
+        return;
+    }
+    _context = context;
+}
+
+Stream::Digest::~Digest() {
+    if(_context != NULL) {
+        EVP_MD_CTX_destroy((EVP_MD_CTX *) _context);
+    }
+}
+
+void Stream::Digest::update(const char *data, size_t length) {
+    if(_context != NULL) {
+        EVP_DigestUpdate((EVP_MD_CTX *) _context, data, length);
+    }
+}
+
+string Stream::Digest::hexDigest() {
+    if(_context == NULL) {
+        return string();
+    }
+    EVP_MD_CTX *context = (EVP_MD_CTX *) _context;
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int length = 0;
+    const EVP_MD *md = EVP_MD_CTX_md(context);
+    EVP_DigestFinal_ex(context, digest, &length);
+    EVP_DigestInit_ex(context, md, NULL);
+
+    static const char hex[] = "0123456789abcdef";
+    string result;
+    for(unsigned int i = 0; i < length; i++) {
+        result += hex[digest[i] >> 4];
+        result += hex[digest[i] & 0x0f];
+    }
+    return result;
+}
+
+bool Stream::digestEquals(const string &a, const string &b) {
+    size_t aStart = a.find_first_not_of(" \t\r\n"),
+           bStart = b.find_first_not_of(" \t\r\n");
+    if(aStart == string::npos || bStart == string::npos) {
+        return false;
+    }
+    size_t aLength = a.find_last_not_of(" \t\r\n") + 1 - aStart,
+           bLength = b.find_last_not_of(" \t\r\n") + 1 - bStart;
+    if(aLength != bLength) {
+        return false;
+    }
+    for(size_t i = 0; i < aLength; i++) {
+        if(tolower(a[aStart + i]) != tolower(b[bStart + i])) {
+            return false;
+        }
+    }
+    return true;
+}
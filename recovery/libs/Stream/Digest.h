@@ -0,0 +1,51 @@
+//
+// Created by agent on 10/17/26 as part of NOOBS4IoT (https://github.com/steilerDev/NOOBS4IoT)
+//
+// Digest.h:
+//      This file contains a small wrapper around the message digests of OpenSSL's libcrypto (e.g. sha256), which picks
+//      the fastest implementation available on the CPU at runtime.
+//      For more information see https://github.com/steilerDev/NOOBS4IoT/wiki.
+//
+// This file is licensed under a GNU General Public License v3.0 (c) Frank Steiler.
+// See https://raw.githubusercontent.com/steilerDev/NOOBS4IoT/master/LICENSE for more information.
+//
+
+#ifndef STREAM_DIGEST_H
+#define STREAM_DIGEST_H
+
+#include <string>
+#include <stddef.h>
+
+using namespace std;
+
+namespace Stream {
+
+    /*
+     * Incrementally computes a message digest. The algorithm is given by its name (e.g. "sha256", "sha1" or "md5").
+     */
+    class Digest {
+    public:
+        Digest(const string &algorithm);
+        ~Digest();
+
+        // Returns false if the algorithm is unknown
+        inline bool isValid() const { return _context != NULL; }
+        inline const string &algorithm() const { return _algorithm; }
+
+        void update(const char *data, size_t length);
+        // Finishes the computation and returns the lower case hex representation, the digest starts over afterwards
+        string hexDigest();
+
+    private:
+        Digest(const Digest &);
+        Digest &operator=(const Digest &);
+
+        string _algorithm;
+        void *_context;
+    };
+
+    // Compares two hex digests, ignoring case and surrounding white space
+    bool digestEquals(const string &a, const string &b);
+}
+
+#endif //STREAM_DIGEST_H
@@ -0,0 +1,958 @@
+//
+// Created by agent on 10/17/26 as part of NOOBS4IoT (https://github.com/steilerDev/NOOBS4IoT)
+//
+// Ext4Builder.cpp:
+//      This file contains a sink stage of a streaming pipeline, building an ext4 file system on a block device (or file)
+//      straight from a tar archive, similar to mke2fs -d. The file system is never mounted: File data is allocated
+//      contiguously and written in large sequential writes as it arrives, directories and metadata are written once the
+//      archive ended. No external, non-standard library is required for this file.
+//      For more information see https://github.com/steilerDev/NOOBS4IoT/wiki.
+//
+// This file is licensed under a GNU General Public License v3.0 (c) Frank Steiler.
+// See https://raw.githubusercontent.com/steilerDev/NOOBS4IoT/master/LICENSE for more information.
+//
+
+#include "Ext4Builder.h"
+#include "../easylogging++.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/sysmacros.h>
+#include <linux/fs.h>
+
+/* On-disk constants (see Documentation/filesystems/ext4 of the kernel) */
+#define EXT4_SUPER_MAGIC 0xEF53
+#define EXT4_SUPERBLOCK_OFFSET 1024
+#define EXT4_DESCRIPTOR_SIZE 32
+#define EXT4_ROOT_INODE 2
+#define EXT4_JOURNAL_INODE 8
+#define EXT4_FIRST_INODE 11
+#define EXT4_EXTRA_ISIZE 32
+#define EXT4_EXTENTS_FL 0x80000
+#define EXT4_BG_INODE_UNINIT 0x1
+#define EXT4_EXTENT_MAGIC 0xF30A
+#define EXT4_MAX_EXTENT_LENGTH 32768
+#define EXT4_INODE_EXTENTS 4
+#define EXT4_LEAF_EXTENTS ((EXT4_BLOCK_SIZE - 12) / 12)
+#define EXT4_FAST_LINK_SIZE 60
+#define EXT4_LINK_MAX 65000
+#define EXT4_NAME_MAX 255
+
+#define EXT4_COMPAT_HAS_JOURNAL 0x4
+#define EXT4_INCOMPAT_FILETYPE 0x2
+#define EXT4_INCOMPAT_EXTENTS 0x40
+#define EXT4_RO_COMPAT_SPARSE_SUPER 0x1
+#define EXT4_RO_COMPAT_LARGE_FILE 0x2
+#define EXT4_RO_COMPAT_GDT_CSUM 0x10
+#define EXT4_RO_COMPAT_DIR_NLINK 0x20
+#define EXT4_RO_COMPAT_EXTRA_ISIZE 0x40
+
+#define JBD2_MAGIC 0xC03B3998
+#define JBD2_SUPERBLOCK_V2 4
+
+// Names of the features (as used by mke2fs -O) enabled on the built file systems
+static const char *features[] = {
+        "has_journal", "filetype", "extent", "extents", "sparse_super", "large_file", "uninit_bg", "dir_nlink",
+        "extra_isize"
+};
+
+static const char zeroBlock[EXT4_BLOCK_SIZE] = {0};
+
+static void put16(char *buffer, uint16_t value) {
+    buffer[0] = (char) (value & 0xff);
+    buffer[1] = (char) (value >> 8);
+}
+
+static void put32(char *buffer, uint32_t value) {
+    put16(buffer, (uint16_t) (value & 0xffff));
+    put16(buffer + 2, (uint16_t) (value >> 16));
+}
+
+// The journal is stored big endian
+static void put32be(char *buffer, uint32_t value) {
+    buffer[0] = (char) (value >> 24);
+    buffer[1] = (char) ((value >> 16) & 0xff);
+    buffer[2] = (char) ((value >> 8) & 0xff);
+    buffer[3] = (char) (value & 0xff);
+}
+
+static void setBits(char *bitmap, uint32_t first, uint32_t count) {
+    for(uint32_t bit = first; bit < first + count; bit++) {
+        bitmap[bit / 8] |= (char) (1 << (bit % 8));
+    }
+}
+
+// CRC16 (polynomial 0x8005, reflected) protecting the group descriptors
+static uint16_t crc16(uint16_t crc, const void *data, size_t length) {
+    const unsigned char *bytes = (const unsigned char *) data;
+    for(size_t i = 0; i < length; i++) {
+        crc ^= bytes[i];
+        for(int bit = 0; bit < 8; bit++) {
+            crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+        }
+    }
+    return crc;
+}
+
+static bool isPowerOf(uint32_t value, uint32_t base) {
+    while(value > 1 && value % base == 0) {
+        value /= base;
+    }
+    return value == 1;
+}
+
+static bool randomBytes(void *buffer, size_t length) {
+    int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+    if(fd < 0) {
+        return false;
+    }
+    bool success = read(fd, buffer, length) == (ssize_t) length;
+    close(fd);
+    return success;
+}
+
+static uint8_t fileType(uint16_t mode) {
+    switch(mode & S_IFMT) {
+        case S_IFREG:
+            return 1;
+        case S_IFDIR:
+            return 2;
+        case S_IFCHR:
+            return 3;
+        case S_IFBLK:
+            return 4;
+        case S_IFIFO:
+            return 5;
+        case S_IFSOCK:
+            return 6;
+        case S_IFLNK:
+            return 7;
+        default:
+            return 0;
+    }
+}
+
+// Journal size in blocks, as chosen by mke2fs for the size of the file system
+static uint32_t journalSize(uint32_t blocks) {
+    if(blocks < 32768) {
+        return 1024;
+    } else if(blocks < 256 * 1024) {
+        return 4096;
+    } else if(blocks < 512 * 1024) {
+        return 8192;
+    } else if(blocks < 4096 * 1024) {
+        return 16384;
+    } else if(blocks < 8192 * 1024) {
+        return 32768;
+    } else if(blocks < 16384 * 1024) {
+        return 65536;
+    } else if(blocks < 32768 * 1024) {
+        return 131072;
+    }
+    return 262144;
+}
+
+Stream::Ext4Builder::~Ext4Builder() {
+    if(_fd >= 0) {
+        close(_fd);
+    }
+}
+
+bool Stream::Ext4Builder::hasFeature(const string &feature) {
+    for(size_t i = 0; i < sizeof(features) / sizeof(features[0]); i++) {
+        if(feature == features[i]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool Stream::Ext4Builder::begin() {
+    LDEBUG << "Building ext4 file system on " << _device;
+    _now = time(NULL);
+    _fd = open(_device.c_str(), O_WRONLY | O_CLOEXEC);
+    if(_fd < 0) {
+        setError("Unable to open " + _device + ": " + strerror(errno));
+        return false;
+    }
+
+    struct stat st;
+    uint64_t size = 0;
+    if(fstat(_fd, &st) != 0) {
+        setError("Unable to access " + _device + ": " + strerror(errno));
+        return false;
+    } else if(S_ISREG(st.st_mode)) {
+        size = st.st_size;
+    } else if(!S_ISBLK(st.st_mode) || ioctl(_fd, BLKGETSIZE64, &size) != 0) {
+        setError("Unable to determine the size of " + _device);
+        return false;
+    }
+    if(!layout(size)) {
+        setError("Device " + _device + " is too small for an ext4 file system");
+        return false;
+    }
+    if(!randomBytes(_uuid, sizeof(_uuid)) || !randomBytes(_hashSeed, sizeof(_hashSeed)) ||
+       !randomBytes(&_journalSequence, sizeof(_journalSequence))) {
+        setError("Unable to generate the file system UUID");
+        return false;
+    }
+    // Random (version 4) UUID
+    _uuid[6] = (unsigned char) ((_uuid[6] & 0x0f) | 0x40);
+    _uuid[8] = (unsigned char) ((_uuid[8] & 0x3f) | 0x80);
+
+    // Like mke2fs, the previous content is discarded (blocks not written below are unused anyway)
+    if(S_ISBLK(st.st_mode)) {
+        uint64_t range[2] = {0, size};
+        if(ioctl(_fd, BLKDISCARD, &range) != 0) {
+            LDEBUG << "Unable to discard " << _device << ": " << strerror(errno);
+        }
+    }
+
+    // Inodes 1 to 10 are reserved, only the root directory and the journal are used
+    _inodes.assign(EXT4_FIRST_INODE - 1, Inode());
+    Inode &root = _inodes[EXT4_ROOT_INODE - 1];
+    root.mode = S_IFDIR | 0755;
+    root.links = 1;
+    root.mtime = _now;
+    _directories[EXT4_ROOT_INODE];
+    _parents[EXT4_ROOT_INODE] = EXT4_ROOT_INODE;
+
+    Inode &journal = _inodes[EXT4_JOURNAL_INODE - 1];
+    journal.mode = S_IFREG | 0600;
+    journal.links = 1;
+    journal.mtime = _now;
+    journal.size = (uint64_t) _journalBlocks * EXT4_BLOCK_SIZE;
+    _nextBlock = 0;
+    if(!allocate(_journalBlocks, &journal.extents)) {
+        return false;
+    }
+
+    uint32_t lostFound = newInode(S_IFDIR | 0700, 0, 0, _now);
+    _directories[lostFound];
+    _parents[lostFound] = EXT4_ROOT_INODE;
+    _pending.reserve(EXT4_WRITE_SIZE);
+    _pendingOffset = 0;
+    return link(EXT4_ROOT_INODE, "lost+found", lostFound);
+}
+
+bool Stream::Ext4Builder::finish() {
+    if(!writeDirectories() || !writeExtentTrees() || !writeJournal() || !flush() || !writeGroups()) {
+        return false;
+    }
+    if(fsync(_fd) != 0) {
+        setError("Unable to sync " + _device + ": " + strerror(errno));
+        return false;
+    }
+    close(_fd);
+    _fd = -1;
+    LINFO << "Built ext4 file system on " << _device << " with " << (_inodes.size() - EXT4_FIRST_INODE + 1)
+          << " inodes, using " << _nextBlock << " of " << _blocks << " blocks";
+    return true;
+}
+
+bool Stream::Ext4Builder::extract(const Entry &entry) {
+    vector<string> components;
+    if(!splitPath(entry.path, &components)) {
+        LWARNING << "Skipping unsafe path " << entry.path;
+        return skipData(entry.size);
+    }
+    if(components.empty()) {
+        // The archive root is the root directory of the file system
+        if(entry.type == '5') {
+            Inode &root = _inodes[EXT4_ROOT_INODE - 1];
+            root.mode = (uint16_t) (S_IFDIR | entry.mode);
+            root.uid = entry.uid;
+            root.gid = entry.gid;
+            root.mtime = entry.mtime;
+        }
+        return skipData(entry.size);
+    }
+
+    uint32_t parent;
+    if(!lookupDirectory(components, components.size() - 1, &parent)) {
+        return false;
+    }
+    const string &name = components.back();
+    if(name.size() > EXT4_NAME_MAX) {
+        setError("Name of " + entry.path + " is too long");
+        return false;
+    }
+
+    uint32_t inode;
+    switch(entry.type) {
+        case '0':
+        case '7':
+            inode = newInode((uint16_t) (S_IFREG | entry.mode), entry.uid, entry.gid, entry.mtime);
+            return inode != 0 && link(parent, name, inode) && writeFile(inode, entry.size);
+        case '1': {
+            vector<string> target;
+            inode = splitPath(entry.linkPath, &target) ? find(target) : 0;
+            if(inode == 0 || S_ISDIR(_inodes[inode - 1].mode)) {
+                setError("Unable to create hard link " + entry.path + " to " + entry.linkPath);
+                return false;
+            }
+            map<string, uint32_t>::const_iterator existing = _directories[parent].find(name);
+            if(existing == _directories[parent].end() || existing->second != inode) {
+                _inodes[inode - 1].links++;
+                if(!link(parent, name, inode)) {
+                    return false;
+                }
+            }
+            return skipData(entry.size);
+        }
+        case '2': {
+            inode = newInode(S_IFLNK | 0777, entry.uid, entry.gid, entry.mtime);
+            if(inode == 0 || !link(parent, name, inode)) {
+                return false;
+            }
+            Inode &symlink = _inodes[inode - 1];
+            symlink.size = entry.linkPath.size();
+            if(symlink.size < EXT4_FAST_LINK_SIZE) {
+                symlink.fastLink = entry.linkPath;
+            } else {
+                // Longer targets are stored in a data block, like the content of a file
+                uint32_t blocks = (uint32_t) ((symlink.size + EXT4_BLOCK_SIZE - 1) / EXT4_BLOCK_SIZE);
+                if(!allocate(blocks, &symlink.extents) ||
+                   !queueData(symlink.extents, 0, entry.linkPath.c_str(), entry.linkPath.size()) ||
+                   !queueData(symlink.extents, symlink.size, zeroBlock, blocks * EXT4_BLOCK_SIZE - symlink.size)) {
+                    return false;
+                }
+            }
+            return skipData(entry.size);
+        }
+        case '3':
+        case '4':
+        case '6': {
+            mode_t type = entry.type == '3' ? S_IFCHR : (entry.type == '4' ? S_IFBLK : S_IFIFO);
+            inode = newInode((uint16_t) (type | entry.mode), entry.uid, entry.gid, entry.mtime);
+            if(inode == 0 || !link(parent, name, inode)) {
+                return false;
+            }
+            _inodes[inode - 1].device = entry.device;
+            return skipData(entry.size);
+        }
+        case '5': {
+            map<string, uint32_t>::const_iterator existing = _directories[parent].find(name);
+            if(existing != _directories[parent].end() && S_ISDIR(_inodes[existing->second - 1].mode)) {
+                // The directory was created for an earlier entry, only its metadata is applied
+                inode = existing->second;
+                Inode &directory = _inodes[inode - 1];
+                directory.mode = (uint16_t) (S_IFDIR | entry.mode);
+                directory.uid = entry.uid;
+                directory.gid = entry.gid;
+                directory.mtime = entry.mtime;
+            } else {
+                inode = newInode((uint16_t) (S_IFDIR | entry.mode), entry.uid, entry.gid, entry.mtime);
+                if(inode == 0 || !link(parent, name, inode)) {
+                    return false;
+                }
+                _directories[inode];
+                _parents[inode] = parent;
+            }
+            return skipData(entry.size);
+        }
+        default:
+            LWARNING << "Skipping " << entry.path << " with unsupported type " << entry.type;
+            return skipData(entry.size);
+    }
+}
+
+/*
+ * Layout
+ */
+
+bool Stream::Ext4Builder::hasSuperblock(uint32_t group) {
+    // sparse_super: Backups are only stored in group 1 and the powers of 3, 5 and 7
+    return group == 0 || isPowerOf(group, 3) || isPowerOf(group, 5) || isPowerOf(group, 7);
+}
+
+uint32_t Stream::Ext4Builder::groupOverhead(uint32_t group) {
+    return (hasSuperblock(group) ? 1 + _descriptorBlocks : 0) + 2 + _inodeTableBlocks;
+}
+
+uint32_t Stream::Ext4Builder::groupBlocks(uint32_t group) {
+    return group == _groups - 1 ? _blocks - group * EXT4_BLOCKS_PER_GROUP : EXT4_BLOCKS_PER_GROUP;
+}
+
+bool Stream::Ext4Builder::layout(uint64_t deviceSize) {
+    // Block numbers are 32 bit (there is no 64bit feature)
+    uint64_t blocks = min<uint64_t>(deviceSize / EXT4_BLOCK_SIZE, 0xffffffffULL / EXT4_BLOCKS_PER_GROUP * EXT4_BLOCKS_PER_GROUP);
+    const uint32_t inodesPerBlock = EXT4_BLOCK_SIZE / EXT4_INODE_SIZE;
+    while(true) {
+        _blocks = (uint32_t) blocks;
+        _groups = (_blocks + EXT4_BLOCKS_PER_GROUP - 1) / EXT4_BLOCKS_PER_GROUP;
+        if(_groups == 0) {
+            return false;
+        }
+        uint64_t inodes = blocks * EXT4_BLOCK_SIZE / EXT4_INODE_RATIO;
+        uint64_t perGroup = (inodes + _groups - 1) / _groups;
+        perGroup = (perGroup + inodesPerBlock - 1) / inodesPerBlock * inodesPerBlock;
+        _inodesPerGroup = (uint32_t) min<uint64_t>(max<uint64_t>(perGroup, inodesPerBlock), EXT4_BLOCK_SIZE * 8);
+        _inodeTableBlocks = _inodesPerGroup / inodesPerBlock;
+        _descriptorBlocks = (_groups * EXT4_DESCRIPTOR_SIZE + EXT4_BLOCK_SIZE - 1) / EXT4_BLOCK_SIZE;
+
+        // Like mke2fs, a last group too small to hold its metadata and some data is dropped
+        if(_groups > 1 && groupBlocks(_groups - 1) < groupOverhead(_groups - 1) + 50) {
+            blocks = (uint64_t) (_groups - 1) * EXT4_BLOCKS_PER_GROUP;
+            continue;
+        }
+        break;
+    }
+    _journalBlocks = journalSize(_blocks);
+    return _blocks >= groupOverhead(0) + _journalBlocks + 1024;
+}
+
+/*
+ * Allocation
+ */
+
+bool Stream::Ext4Builder::allocate(uint32_t count, vector<Extent> *extents) {
+    uint32_t logical = extents->empty() ? 0 : extents->back().logical + extents->back().length;
+    while(count > 0) {
+        uint32_t group = _nextBlock / EXT4_BLOCKS_PER_GROUP;
+        if(group >= _groups) {
+            setError("No space left on the file system");
+            return false;
+        }
+        uint32_t groupStart = group * EXT4_BLOCKS_PER_GROUP;
+        if(_nextBlock < groupStart + groupOverhead(group)) {
+            _nextBlock = groupStart + groupOverhead(group);
+        }
+        uint32_t available = groupStart + groupBlocks(group) - _nextBlock;
+        if(available == 0) {
+            _nextBlock = groupStart + EXT4_BLOCKS_PER_GROUP;
+            continue;
+        }
+
+        uint32_t length = min(count, available);
+        Extent *last = extents->empty() ? NULL : &extents->back();
+        if(last && last->start + last->length == _nextBlock && last->length < EXT4_MAX_EXTENT_LENGTH) {
+            length = min<uint32_t>(length, EXT4_MAX_EXTENT_LENGTH - last->length);
+            last->length += length;
+        } else {
+            length = min<uint32_t>(length, EXT4_MAX_EXTENT_LENGTH);
+            Extent extent = {logical, _nextBlock, length};
+            extents->push_back(extent);
+        }
+        _nextBlock += length;
+        logical += length;
+        count -= length;
+    }
+    return true;
+}
+
+uint32_t Stream::Ext4Builder::newInode(uint16_t mode, uid_t uid, gid_t gid, time_t mtime) {
+    if(_inodes.size() >= (uint64_t) _inodesPerGroup * _groups) {
+        setError("No inodes left on the file system");
+        return 0;
+    }
+    Inode inode = Inode();
+    inode.mode = mode;
+    inode.links = 1;
+    inode.uid = uid;
+    inode.gid = gid;
+    inode.mtime = mtime;
+    _inodes.push_back(inode);
+    return (uint32_t) _inodes.size();
+}
+
+void Stream::Ext4Builder::unlink(uint32_t inode) {
+    Inode &entry = _inodes[inode - 1];
+    if(S_ISDIR(entry.mode) || --entry.links == 0) {
+        // The blocks already written are simply left unused
+        entry = Inode();
+        _directories.erase(inode);
+        _parents.erase(inode);
+    }
+}
+
+/*
+ * Directory tree
+ */
+
+bool Stream::Ext4Builder::lookupDirectory(const vector<string> &components, size_t count, uint32_t *inode) {
+    uint32_t directory = EXT4_ROOT_INODE;
+    for(size_t i = 0; i < count; i++) {
+        map<string, uint32_t> &entries = _directories[directory];
+        map<string, uint32_t>::const_iterator it = entries.find(components[i]);
+        if(it == entries.end()) {
+            uint32_t created = newInode(S_IFDIR | 0755, 0, 0, _now);
+            if(created == 0 || !link(directory, components[i], created)) {
+                return false;
+            }
+            _directories[created];
+            _parents[created] = directory;
+            directory = created;
+        } else if(S_ISDIR(_inodes[it->second - 1].mode)) {
+            directory = it->second;
+        } else {
+            setError(components[i] + " is not a directory");
+            return false;
+        }
+    }
+    *inode = directory;
+    return true;
+}
+
+uint32_t Stream::Ext4Builder::find(const vector<string> &components) {
+    uint32_t inode = EXT4_ROOT_INODE;
+    for(size_t i = 0; i < components.size(); i++) {
+        map<uint32_t, map<string, uint32_t> >::const_iterator directory = _directories.find(inode);
+        if(directory == _directories.end()) {
+            return 0;
+        }
+        map<string, uint32_t>::const_iterator it = directory->second.find(components[i]);
+        if(it == directory->second.end()) {
+            return 0;
+        }
+        inode = it->second;
+    }
+    return inode;
+}
+
+bool Stream::Ext4Builder::link(uint32_t directory, const string &name, uint32_t inode) {
+    map<string, uint32_t> &entries = _directories[directory];
+    map<string, uint32_t>::iterator it = entries.find(name);
+    if(it != entries.end()) {
+        // Replacing the existing entry, like tar does
+        map<uint32_t, map<string, uint32_t> >::const_iterator replaced = _directories.find(it->second);
+        if(replaced != _directories.end() && !replaced->second.empty()) {
+            setError("Unable to replace non-empty directory " + name);
+            return false;
+        }
+        unlink(it->second);
+    }
+    // Looking up the entries again, since unlink() might have changed the map of directories
+    _directories[directory][name] = inode;
+    return true;
+}
+
+/*
+ * Writing
+ */
+
+bool Stream::Ext4Builder::writeFile(uint32_t inode, uint64_t size) {
+    uint64_t blocks = (size + EXT4_BLOCK_SIZE - 1) / EXT4_BLOCK_SIZE;
+    if(blocks > 0xffffffffULL) {
+        setError("File too large");
+        return false;
+    }
+    Inode &file = _inodes[inode - 1];
+    file.size = size;
+    if(!allocate((uint32_t) blocks, &file.extents)) {
+        return false;
+    }
+
+    char buffer[STREAM_CHUNK_SIZE / 4];
+    uint64_t position = 0;
+    while(position < size) {
+        ssize_t bytesRead = read(buffer, min<uint64_t>(size - position, sizeof(buffer)));
+        if(bytesRead <= 0) {
+            setError("Unexpected end of archive");
+            return false;
+        }
+        if(!queueData(file.extents, position, buffer, (size_t) bytesRead)) {
+            return false;
+        }
+        countOut(bytesRead);
+        position += bytesRead;
+    }
+    // The rest of the last block is zeroed, instead of leaving whatever was stored there before
+    if(!queueData(file.extents, size, zeroBlock, blocks * EXT4_BLOCK_SIZE - size)) {
+        return false;
+    }
+
+    // Skipping the padding up to the next block
+    return skipBytes((TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE);
+}
+
+bool Stream::Ext4Builder::queueData(const vector<Extent> &extents, uint64_t position, const char *data, size_t length) {
+    for(size_t i = 0; i < extents.size() && length > 0; i++) {
+        uint64_t extentStart = (uint64_t) extents[i].logical * EXT4_BLOCK_SIZE,
+                 extentEnd = extentStart + (uint64_t) extents[i].length * EXT4_BLOCK_SIZE;
+        if(position >= extentEnd) {
+            continue;
+        }
+        size_t chunk = (size_t) min<uint64_t>(length, extentEnd - position);
+        if(!queue((uint64_t) extents[i].start * EXT4_BLOCK_SIZE + (position - extentStart), data, chunk)) {
+            return false;
+        }
+        data += chunk;
+        length -= chunk;
+        position += chunk;
+    }
+    return true;
+}
+
+bool Stream::Ext4Builder::queue(uint64_t offset, const char *data, size_t length) {
+    while(length > 0) {
+        if(!_pending.empty() && (offset != _pendingOffset + _pending.size() || _pending.size() >= EXT4_WRITE_SIZE)) {
+            if(!flush()) {
+                return false;
+            }
+        }
+        if(_pending.empty()) {
+            _pendingOffset = offset;
+        }
+        size_t chunk = min<size_t>(length, EXT4_WRITE_SIZE - _pending.size());
+        _pending.insert(_pending.end(), data, data + chunk);
+        data += chunk;
+        length -= chunk;
+        offset += chunk;
+    }
+    return true;
+}
+
+bool Stream::Ext4Builder::flush() {
+    if(_pending.empty()) {
+        return true;
+    }
+    bool success = writeAt(&_pending[0], _pending.size(), _pendingOffset);
+    _pending.clear();
+    return success;
+}
+
+bool Stream::Ext4Builder::writeAt(const char *data, size_t length, uint64_t offset) {
+    while(length > 0) {
+        ssize_t written = pwrite(_fd, data, length, offset);
+        if(written < 0 && errno == EINTR) {
+            continue;
+        } else if(written <= 0) {
+            setError("Unable to write " + _device + ": " + strerror(errno));
+            return false;
+        }
+        data += written;
+        length -= written;
+        offset += written;
+    }
+    return true;
+}
+
+bool Stream::Ext4Builder::writeDirectories() {
+    for(map<uint32_t, map<string, uint32_t> >::const_iterator directory = _directories.begin();
+        directory != _directories.end(); ++directory) {
+        uint32_t inode = directory->first;
+        vector<pair<string, uint32_t> > entries;
+        entries.push_back(make_pair(string("."), inode));
+        entries.push_back(make_pair(string(".."), _parents[inode]));
+        entries.insert(entries.end(), directory->second.begin(), directory->second.end());
+
+        // Entries do not span blocks, the last entry of a block covers the rest of it
+        vector<char> data(EXT4_BLOCK_SIZE, 0);
+        size_t blockStart = 0,
+               position = 0,
+               lastEntry = 0;
+        uint32_t subdirectories = 0;
+        for(size_t i = 0; i < entries.size(); i++) {
+            const string &name = entries[i].first;
+            size_t length = (8 + name.size() + 3) / 4 * 4;
+            if(position + length > blockStart + EXT4_BLOCK_SIZE) {
+                put16(&data[lastEntry + 4], (uint16_t) (blockStart + EXT4_BLOCK_SIZE - lastEntry));
+                blockStart += EXT4_BLOCK_SIZE;
+                position = blockStart;
+                data.resize(blockStart + EXT4_BLOCK_SIZE, 0);
+            }
+            uint16_t mode = _inodes[entries[i].second - 1].mode;
+            put32(&data[position], entries[i].second);
+            put16(&data[position + 4], (uint16_t) length);
+            data[position + 6] = (char) name.size();
+            data[position + 7] = (char) fileType(mode);
+            memcpy(&data[position + 8], name.data(), name.size());
+            if(i >= 2 && S_ISDIR(mode)) {
+                subdirectories++;
+            }
+            lastEntry = position;
+            position += length;
+        }
+        put16(&data[lastEntry + 4], (uint16_t) (blockStart + EXT4_BLOCK_SIZE - lastEntry));
+
+        // e2fsck expects lost+found to have room for some entries, without needing to allocate blocks
+        if(inode == EXT4_FIRST_INODE) {
+            while(data.size() < 4 * EXT4_BLOCK_SIZE) {
+                size_t start = data.size();
+                data.resize(start + EXT4_BLOCK_SIZE, 0);
+                put16(&data[start + 4], EXT4_BLOCK_SIZE);
+            }
+        }
+
+        Inode &entry = _inodes[inode - 1];
+        entry.size = data.size();
+        // With dir_nlink, a link count of 1 means the directory has too many subdirectories to count them
+        entry.links = (uint16_t) (2 + subdirectories > EXT4_LINK_MAX ? 1 : 2 + subdirectories);
+        if(!allocate((uint32_t) (data.size() / EXT4_BLOCK_SIZE), &entry.extents) ||
+           !queueData(entry.extents, 0, &data[0], data.size())) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool Stream::Ext4Builder::writeExtentTrees() {
+    for(size_t i = 0; i < _inodes.size(); i++) {
+        Inode &inode = _inodes[i];
+        if(inode.extents.size() <= EXT4_INODE_EXTENTS) {
+            continue;
+        }
+        // A single level of leaves is enough for about 170 GB of fragmented data
+        size_t leaves = (inode.extents.size() + EXT4_LEAF_EXTENTS - 1) / EXT4_LEAF_EXTENTS;
+        if(leaves > EXT4_INODE_EXTENTS) {
+            setError("File too fragmented");
+            return false;
+        }
+        for(size_t leaf = 0; leaf < leaves; leaf++) {
+            vector<Extent> block;
+            if(!allocate(1, &block)) {
+                return false;
+            }
+            inode.leaves.push_back(block[0].start);
+
+            char buffer[EXT4_BLOCK_SIZE] = {0};
+            size_t first = leaf * EXT4_LEAF_EXTENTS,
+                   count = min<size_t>(inode.extents.size() - first, EXT4_LEAF_EXTENTS);
+            put16(buffer, EXT4_EXTENT_MAGIC);
+            put16(buffer + 2, (uint16_t) count);
+            put16(buffer + 4, EXT4_LEAF_EXTENTS);
+            for(size_t j = 0; j < count; j++) {
+                const Extent &extent = inode.extents[first + j];
+                char *entry = buffer + 12 + j * 12;
+                put32(entry, extent.logical);
+                put16(entry + 4, (uint16_t) extent.length);
+                put32(entry + 8, extent.start);
+            }
+            if(!queue((uint64_t) block[0].start * EXT4_BLOCK_SIZE, buffer, sizeof(buffer))) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+bool Stream::Ext4Builder::writeJournal() {
+    // Only the journal superblock is written, the journal is empty (s_start is 0) and nothing of it is ever replayed
+    char buffer[EXT4_BLOCK_SIZE] = {0};
+    put32be(buffer, JBD2_MAGIC);
+    put32be(buffer + 4, JBD2_SUPERBLOCK_V2);
+    put32be(buffer + 12, EXT4_BLOCK_SIZE);
+    put32be(buffer + 16, _journalBlocks);
+    put32be(buffer + 20, 1);
+    put32be(buffer + 24, _journalSequence);
+    memcpy(buffer + 48, _uuid, sizeof(_uuid));
+    put32be(buffer + 64, 1);
+    return queue((uint64_t) _inodes[EXT4_JOURNAL_INODE - 1].extents[0].start * EXT4_BLOCK_SIZE, buffer, sizeof(buffer));
+}
+
+bool Stream::Ext4Builder::writeGroups() {
+    /* Usage of every group */
+    vector<uint32_t> usedBlocks(_groups, 0),
+                     usedInodes(_groups, 0),
+                     usedDirectories(_groups, 0),
+                     highestInode(_groups, 0);
+    // Allocations never span groups, so they are sorted into their group by their start
+    vector<pair<uint32_t, uint32_t> > ranges;
+    for(size_t i = 0; i < _inodes.size(); i++) {
+        const Inode &inode = _inodes[i];
+        uint32_t group = (uint32_t) (i / _inodesPerGroup);
+        if(inode.mode != 0 || i + 1 < EXT4_FIRST_INODE) {
+            usedInodes[group]++;
+            highestInode[group] = (uint32_t) (i % _inodesPerGroup) + 1;
+            if(S_ISDIR(inode.mode)) {
+                usedDirectories[group]++;
+            }
+        }
+        for(size_t j = 0; j < inode.extents.size(); j++) {
+            ranges.push_back(make_pair(inode.extents[j].start, inode.extents[j].length));
+        }
+        for(size_t j = 0; j < inode.leaves.size(); j++) {
+            ranges.push_back(make_pair(inode.leaves[j], 1u));
+        }
+    }
+    sort(ranges.begin(), ranges.end());
+    for(size_t i = 0; i < ranges.size(); i++) {
+        usedBlocks[ranges[i].first / EXT4_BLOCKS_PER_GROUP] += ranges[i].second;
+    }
+
+    /* Group descriptors, each stored with a checksum over the UUID, its number and its content */
+    vector<char> descriptors(_descriptorBlocks * EXT4_BLOCK_SIZE, 0);
+    uint32_t freeBlocks = 0,
+             freeInodes = 0;
+    for(uint32_t group = 0; group < _groups; group++) {
+        char *descriptor = &descriptors[group * EXT4_DESCRIPTOR_SIZE];
+        uint32_t bitmaps = group * EXT4_BLOCKS_PER_GROUP + (hasSuperblock(group) ? 1 + _descriptorBlocks : 0);
+        uint32_t groupFreeBlocks = groupBlocks(group) - groupOverhead(group) - usedBlocks[group],
+                 groupFreeInodes = _inodesPerGroup - usedInodes[group];
+        put32(descriptor, bitmaps);
+        put32(descriptor + 4, bitmaps + 1);
+        put32(descriptor + 8, bitmaps + 2);
+        put16(descriptor + 12, (uint16_t) groupFreeBlocks);
+        put16(descriptor + 14, (uint16_t) groupFreeInodes);
+        put16(descriptor + 16, (uint16_t) usedDirectories[group]);
+        put16(descriptor + 18, usedInodes[group] == 0 ? EXT4_BG_INODE_UNINIT : 0);
+        // The kernel zeroes the unused part of the inode table in the background, e2fsck does not look at it
+        put16(descriptor + 28, (uint16_t) (_inodesPerGroup - highestInode[group]));
+        char number[4];
+        put32(number, group);
+        uint16_t checksum = crc16(0xffff, _uuid, sizeof(_uuid));
+        checksum = crc16(checksum, number, sizeof(number));
+        put16(descriptor + 30, crc16(checksum, descriptor, 30));
+        freeBlocks += groupFreeBlocks;
+        freeInodes += groupFreeInodes;
+    }
+
+    /* Every group is written at once: superblock and descriptors (if any), bitmaps and the used part of the inodes */
+    const uint32_t inodesPerBlock = EXT4_BLOCK_SIZE / EXT4_INODE_SIZE;
+    size_t range = 0;
+    for(uint32_t group = 0; group < _groups; group++) {
+        uint32_t start = group * EXT4_BLOCKS_PER_GROUP,
+                 metadata = hasSuperblock(group) ? 1 + _descriptorBlocks : 0,
+                 inodeBlocks = (highestInode[group] + inodesPerBlock - 1) / inodesPerBlock;
+        vector<char> buffer((metadata + 2 + inodeBlocks) * EXT4_BLOCK_SIZE, 0);
+        if(metadata > 0) {
+            // The primary superblock is preceded by the boot sector, which is cleared as well
+            encodeSuperblock(group, freeBlocks, freeInodes, &buffer[group == 0 ? EXT4_SUPERBLOCK_OFFSET : 0]);
+            memcpy(&buffer[EXT4_BLOCK_SIZE], &descriptors[0], descriptors.size());
+        }
+
+        char *blockBitmap = &buffer[metadata * EXT4_BLOCK_SIZE],
+             *inodeBitmap = blockBitmap + EXT4_BLOCK_SIZE;
+        setBits(blockBitmap, 0, groupOverhead(group));
+        for(; range < ranges.size() && ranges[range].first < start + EXT4_BLOCKS_PER_GROUP; range++) {
+            setBits(blockBitmap, ranges[range].first - start, ranges[range].second);
+        }
+        // Bits behind the end of the group (or the inodes of the group) are set, as expected by e2fsck
+        setBits(blockBitmap, groupBlocks(group), EXT4_BLOCK_SIZE * 8 - groupBlocks(group));
+        setBits(inodeBitmap, _inodesPerGroup, EXT4_BLOCK_SIZE * 8 - _inodesPerGroup);
+
+        for(uint32_t index = 0; index < highestInode[group]; index++) {
+            uint32_t inode = group * _inodesPerGroup + index + 1;
+            if(inode <= _inodes.size() && (_inodes[inode - 1].mode != 0 || inode < EXT4_FIRST_INODE)) {
+                setBits(inodeBitmap, index, 1);
+                encodeInode(inode, &buffer[(metadata + 2) * EXT4_BLOCK_SIZE + index * EXT4_INODE_SIZE]);
+            }
+        }
+        if(!writeAt(&buffer[0], buffer.size(), (uint64_t) start * EXT4_BLOCK_SIZE)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void Stream::Ext4Builder::encodeInode(uint32_t number, char *buffer) {
+    const Inode &inode = _inodes[number - 1];
+    if(inode.mode == 0) {
+        return;
+    }
+    uint32_t blocks = (uint32_t) inode.leaves.size();
+    for(size_t i = 0; i < inode.extents.size(); i++) {
+        blocks += inode.extents[i].length;
+    }
+
+    put16(buffer, inode.mode);
+    put16(buffer + 2, (uint16_t) (inode.uid & 0xffff));
+    put32(buffer + 4, (uint32_t) (inode.size & 0xffffffff));
+    put32(buffer + 8, (uint32_t) inode.mtime);
+    put32(buffer + 12, (uint32_t) _now);
+    put32(buffer + 16, (uint32_t) inode.mtime);
+    put16(buffer + 24, (uint16_t) (inode.gid & 0xffff));
+    put16(buffer + 26, inode.links);
+    put32(buffer + 28, blocks * (EXT4_BLOCK_SIZE / 512));
+
+    char *block = buffer + 40;
+    if(S_ISCHR(inode.mode) || S_ISBLK(inode.mode)) {
+        // Device numbers are stored in the old 16 bit format where possible
+        uint32_t major = major(inode.device),
+                 minor = minor(inode.device);
+        if(major < 256 && minor < 256) {
+            put32(block, (major << 8) | minor);
+        } else {
+            put32(block + 4, (minor & 0xff) | (major << 8) | ((minor & ~0xffu) << 12));
+        }
+    } else if(!inode.fastLink.empty()) {
+        memcpy(block, inode.fastLink.data(), inode.fastLink.size());
+    } else if(S_ISREG(inode.mode) || S_ISDIR(inode.mode) || S_ISLNK(inode.mode)) {
+        put32(buffer + 32, EXT4_EXTENTS_FL);
+        put16(block, EXT4_EXTENT_MAGIC);
+        put16(block + 4, EXT4_INODE_EXTENTS);
+        if(inode.leaves.empty()) {
+            put16(block + 2, (uint16_t) inode.extents.size());
+            for(size_t i = 0; i < inode.extents.size(); i++) {
+                char *entry = block + 12 + i * 12;
+                put32(entry, inode.extents[i].logical);
+                put16(entry + 4, (uint16_t) inode.extents[i].length);
+                put32(entry + 8, inode.extents[i].start);
+            }
+        } else {
+            // The root of the tree indexes the leaves by the first logical block they cover
+            put16(block + 2, (uint16_t) inode.leaves.size());
+            put16(block + 6, 1);
+            for(size_t i = 0; i < inode.leaves.size(); i++) {
+                char *entry = block + 12 + i * 12;
+                put32(entry, inode.extents[i * EXT4_LEAF_EXTENTS].logical);
+                put32(entry + 4, inode.leaves[i]);
+            }
+        }
+    }
+
+    put32(buffer + 108, (uint32_t) (inode.size >> 32));
+    put16(buffer + 120, (uint16_t) (inode.uid >> 16));
+    put16(buffer + 122, (uint16_t) (inode.gid >> 16));
+    put16(buffer + 128, EXT4_EXTRA_ISIZE);
+    put32(buffer + 144, (uint32_t) _now);
+}
+
+void Stream::Ext4Builder::encodeSuperblock(uint32_t group, uint32_t freeBlocks, uint32_t freeInodes, char *buffer) {
+    put32(buffer, _inodesPerGroup * _groups);
+    put32(buffer + 4, _blocks);
+    put32(buffer + 8, (uint32_t) ((uint64_t) _blocks * EXT4_RESERVED_RATIO / 100));
+    put32(buffer + 12, freeBlocks);
+    put32(buffer + 16, freeInodes);
+    put32(buffer + 20, 0);
+    // Block and cluster size as a shift of 1024
+    put32(buffer + 24, 2);
+    put32(buffer + 28, 2);
+    put32(buffer + 32, EXT4_BLOCKS_PER_GROUP);
+    put32(buffer + 36, EXT4_BLOCKS_PER_GROUP);
+    put32(buffer + 40, _inodesPerGroup);
+    put32(buffer + 48, (uint32_t) _now);
+    // No forced checks (maximal mount count -1)
+    put16(buffer + 54, 0xffff);
+    put16(buffer + 56, EXT4_SUPER_MAGIC);
+    // Cleanly unmounted, continue on errors
+    put16(buffer + 58, 1);
+    put16(buffer + 60, 1);
+    put32(buffer + 64, (uint32_t) _now);
+    // Dynamic revision, first non-reserved inode and inode size
+    put32(buffer + 76, 1);
+    put32(buffer + 84, EXT4_FIRST_INODE);
+    put16(buffer + 88, EXT4_INODE_SIZE);
+    put16(buffer + 90, (uint16_t) group);
+    put32(buffer + 92, EXT4_COMPAT_HAS_JOURNAL);
+    put32(buffer + 96, EXT4_INCOMPAT_FILETYPE | EXT4_INCOMPAT_EXTENTS);
+    put32(buffer + 100, EXT4_RO_COMPAT_SPARSE_SUPER | EXT4_RO_COMPAT_LARGE_FILE | EXT4_RO_COMPAT_GDT_CSUM |
+                        EXT4_RO_COMPAT_DIR_NLINK | EXT4_RO_COMPAT_EXTRA_ISIZE);
+    memcpy(buffer + 104, _uuid, sizeof(_uuid));
+    strncpy(buffer + 120, _label.c_str(), 16);
+    put32(buffer + 224, EXT4_JOURNAL_INODE);
+    memcpy(buffer + 236, _hashSeed, sizeof(_hashSeed));
+    // Half MD4 hash, backup of the journal inode's blocks
+    buffer[252] = 1;
+    buffer[253] = 1;
+    // Default mount options user_xattr and acl, like mke2fs
+    put32(buffer + 256, 0x0004 | 0x0008);
+    put32(buffer + 264, (uint32_t) _now);
+
+    char journal[EXT4_INODE_SIZE] = {0};
+    encodeInode(EXT4_JOURNAL_INODE, journal);
+    memcpy(buffer + 268, journal + 40, 60);
+    put32(buffer + 328, (uint32_t) (_inodes[EXT4_JOURNAL_INODE - 1].size >> 32));
+    put32(buffer + 332, (uint32_t) _inodes[EXT4_JOURNAL_INODE - 1].size);
+
+    put16(buffer + 348, EXT4_EXTRA_ISIZE);
+    put16(buffer + 350, EXT4_EXTRA_ISIZE);
+    // Directory hashes depend on the signedness of char, which is recorded (signed on x86, unsigned on ARM)
+    put32(buffer + 352, (char) -1 < 0 ? 0x1 : 0x2);
+}
@@ -0,0 +1,159 @@
+//
+// Created by agent on 10/17/26 as part of NOOBS4IoT (https://github.com/steilerDev/NOOBS4IoT)
+//
+// Ext4Builder.h:
+//      This file contains a sink stage of a streaming pipeline, building an ext4 file system on a block device (or file)
+//      straight from a tar archive, similar to mke2fs -d. The file system is never mounted: File data is allocated
+//      contiguously and written in large sequential writes as it arrives, directories and metadata are written once the
+//      archive ended. No external, non-standard library is required for this file.
+//      For more information see https://github.com/steilerDev/NOOBS4IoT/wiki.
+//
+// This file is licensed under a GNU General Public License v3.0 (c) Frank Steiler.
+// See https://raw.githubusercontent.com/steilerDev/NOOBS4IoT/master/LICENSE for more information.
+//
+
+#ifndef STREAM_EXT4BUILDER_H
+#define STREAM_EXT4BUILDER_H
+
+#include "TarReader.h"
+#include <map>
+
+/* Geometry of the file system, matching the defaults of mke2fs for ext4 */
+#define EXT4_BLOCK_SIZE 4096
+#define EXT4_BLOCKS_PER_GROUP (8 * EXT4_BLOCK_SIZE)
+#define EXT4_INODE_SIZE 256
+#define EXT4_INODE_RATIO 16384
+// Percentage of the blocks reserved for root
+#define EXT4_RESERVED_RATIO 5
+
+// Size of the writes issued to the device, file data is collected until it is reached or the next block is not adjacent
+#define EXT4_WRITE_SIZE (4 * 1024 * 1024)
+
+namespace Stream {
+
+    /*
+     * The file system has a journal and uses extents, uninitialized inode tables are left to the kernel (like mke2fs
+     * does by default). Features not needed for a freshly installed file system (e.g. flex_bg, resize_inode, dir_index
+     * or metadata_csum) are not enabled. Extended attributes of the archive are not applied, like by TarExtractor.
+     */
+    class Ext4Builder: public TarReader {
+    public:
+        Ext4Builder(const string &device, const string &label = string()): TarReader("mkfs"),
+                                                                           _device(device),
+                                                                           _label(label),
+                                                                           _fd(-1) {}
+        ~Ext4Builder();
+
+        // Returns true if a feature of the given name is enabled on the built file systems (e.g. "extent")
+        static bool hasFeature(const string &feature);
+
+    protected:
+        bool begin();
+        bool finish();
+        bool extract(const Entry &entry);
+
+    private:
+        struct Extent {
+            uint32_t logical,
+                     start,
+                     length;
+        };
+
+        struct Inode {
+            uint16_t mode,
+                     links;
+            uid_t uid;
+            gid_t gid;
+            uint64_t size;
+            time_t mtime;
+            dev_t device;
+            // Target of a symbolic link short enough to be stored within the inode
+            string fastLink;
+            vector<Extent> extents;
+            // Leaves of the extent tree, if the extents do not fit into the inode
+            vector<uint32_t> leaves;
+        };
+
+        /*
+         * Layout
+         */
+        bool hasSuperblock(uint32_t group);
+        // Number of blocks at the start of the group holding superblock, descriptors, bitmaps and inode table
+        uint32_t groupOverhead(uint32_t group);
+        uint32_t groupBlocks(uint32_t group);
+        // Calculates the geometry for the device size, returns false if the device is too small
+        bool layout(uint64_t deviceSize);
+
+        /*
+         * Allocation
+         */
+        // Allocates the blocks behind the previous allocation (skipping group metadata) and appends them to the extents
+        bool allocate(uint32_t count, vector<Extent> *extents);
+        uint32_t newInode(uint16_t mode, uid_t uid, gid_t gid, time_t mtime);
+        // Drops a link to the inode, the inode (and its blocks) are freed with the last one
+        void unlink(uint32_t inode);
+
+        /*
+         * Directory tree
+         */
+        // Looks up the directory of the first count components, creating missing directories on the way
+        bool lookupDirectory(const vector<string> &components, size_t count, uint32_t *inode);
+        // Returns the inode of the path, or 0 if it does not exist
+        uint32_t find(const vector<string> &components);
+        // Adds the inode to the directory, replacing a previous entry of the same name
+        bool link(uint32_t directory, const string &name, uint32_t inode);
+
+        /*
+         * Writing
+         */
+        bool writeFile(uint32_t inode, uint64_t size);
+        // Queues data of an inode, position is the offset within the inode
+        bool queueData(const vector<Extent> &extents, uint64_t position, const char *data, size_t length);
+        // Queues the data for writing at the given offset, adjacent data is collected into a single write
+        bool queue(uint64_t offset, const char *data, size_t length);
+        bool flush();
+        bool writeAt(const char *data, size_t length, uint64_t offset);
+        bool writeDirectories();
+        bool writeExtentTrees();
+        bool writeJournal();
+        bool writeGroups();
+
+        // Serializes the inode into its 256 byte on-disk format
+        void encodeInode(uint32_t inode, char *buffer);
+        // Serializes the superblock as stored in the given group
+        void encodeSuperblock(uint32_t group, uint32_t freeBlocks, uint32_t freeInodes, char *buffer);
+
+        string _device,
+               _label;
+        int _fd;
+
+        /* Geometry */
+        uint32_t _blocks,
+                 _groups,
+                 _inodesPerGroup,
+                 _inodeTableBlocks,
+                 _descriptorBlocks,
+                 _journalBlocks;
+        unsigned char _uuid[16],
+                      _hashSeed[16];
+        // First sequence number of the journal, random so blocks left over by a previous journal are never replayed
+        uint32_t _journalSequence;
+        time_t _now;
+
+        // First block, which has not been allocated
+        uint32_t _nextBlock;
+
+        /* Index i describes inode i + 1, the entries of freed inodes stay (with mode 0) */
+        vector<Inode> _inodes;
+        // key: directory inode, value: entries of the directory (key: name, value: inode)
+        map<uint32_t, map<string, uint32_t> > _directories;
+        // Parent of every directory, key: directory inode
+        map<uint32_t, uint32_t> _parents;
+
+        /* Data queued for writing, starting at _pendingOffset */
+        vector<char> _pending;
+        uint64_t _pendingOffset;
+    };
+}
+
+#endif //STREAM_EXT4BUILDER_H
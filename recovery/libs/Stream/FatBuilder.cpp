@@ -0,0 +1,852 @@
+//
+// Created by agent on 10/17/26 as part of NOOBS4IoT (https://github.com/steilerDev/NOOBS4IoT)
+//
+// FatBuilder.cpp:
+//      This file contains a sink stage of a streaming pipeline, building a FAT16 or FAT32 file system on a block device
+//      (or file) straight from a tar archive, including files added to the archive's content (e.g. the NOOBS settings of
+//      the boot partition). The file system is never mounted: File data is written in large sequential writes as it
+//      arrives, directories, FATs and boot sector are written once the archive ended. No external, non-standard library
+//      is required for this file.
+//      For more information see https://github.com/steilerDev/NOOBS4IoT/wiki.
+//
+// This file is licensed under a GNU General Public License v3.0 (c) Frank Steiler.
+// See https://raw.githubusercontent.com/steilerDev/NOOBS4IoT/master/LICENSE for more information.
+//
+
+#include "FatBuilder.h"
+#include "../easylogging++.h"
+
+#include <algorithm>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+/* On-disk constants (see the FAT specification of Microsoft) */
+#define FAT_ATTR_READ_ONLY 0x01
+#define FAT_ATTR_VOLUME_ID 0x08
+#define FAT_ATTR_DIRECTORY 0x10
+#define FAT_ATTR_ARCHIVE 0x20
+#define FAT_ATTR_LONG_NAME 0x0f
+// Lower case flags of short names (as used by Windows NT and Linux)
+#define FAT_CASE_LOWER_BASE 0x08
+#define FAT_CASE_LOWER_EXT 0x10
+#define FAT_LONG_NAME_CHARS 13
+#define FAT_LONG_NAME_MAX 255
+#define FAT_MEDIA 0xf8
+#define FAT16_MIN_CLUSTERS 4085
+#define FAT32_MIN_CLUSTERS 65525
+#define FAT32_MAX_CLUSTERS 0x0ffffff5
+#define FAT32_RESERVED_SECTORS 32
+#define FAT32_INFO_SECTOR 1
+#define FAT32_BACKUP_SECTOR 6
+
+static void put16(char *buffer, uint16_t value) {
+    buffer[0] = (char) (value & 0xff);
+    buffer[1] = (char) (value >> 8);
+}
+
+static void put32(char *buffer, uint32_t value) {
+    put16(buffer, (uint16_t) (value & 0xffff));
+    put16(buffer + 2, (uint16_t) (value >> 16));
+}
+
+// Time and date of an entry, FAT is not able to store anything outside of 1980 - 2107
+static void putTime(char *buffer, time_t time) {
+    struct tm tm;
+    gmtime_r(&time, &tm);
+    if(tm.tm_year < 80) {
+        memset(&tm, 0, sizeof(tm));
+        tm.tm_year = 80;
+        tm.tm_mday = 1;
+    } else if(tm.tm_year > 207) {
+        tm.tm_year = 207;
+    }
+    put16(buffer, (uint16_t) ((tm.tm_hour << 11) | (tm.tm_min << 5) | (tm.tm_sec / 2)));
+    put16(buffer + 2, (uint16_t) (((tm.tm_year - 80) << 9) | ((tm.tm_mon + 1) << 5) | tm.tm_mday));
+}
+
+static string upper(const string &value) {
+    string result = value;
+    for(size_t i = 0; i < result.size(); i++) {
+        result[i] = (char) toupper((unsigned char) result[i]);
+    }
+    return result;
+}
+
+// Converts an UTF-8 name to UTF-16 (as used by long names), invalid sequences are replaced
+static vector<uint16_t> utf16(const string &name) {
+    vector<uint16_t> result;
+    for(size_t i = 0; i < name.size();) {
+        unsigned char c = (unsigned char) name[i];
+        size_t length = c < 0x80 ? 1 : (c >> 5) == 0x6 ? 2 : (c >> 4) == 0xe ? 3 : (c >> 3) == 0x1e ? 4 : 0;
+        if(length == 0 || i + length > name.size()) {
+            result.push_back('_');
+            i++;
+            continue;
+        }
+        uint32_t code = length == 1 ? c : c & (0x7f >> length);
+        for(size_t j = 1; j < length; j++) {
+            code = (code << 6) | ((unsigned char) name[i + j] & 0x3f);
+        }
+        if(code >= 0x10000) {
+            code -= 0x10000;
+            result.push_back((uint16_t) (0xd800 | (code >> 10)));
+            result.push_back((uint16_t) (0xdc00 | (code & 0x3ff)));
+        } else {
+            result.push_back((uint16_t) code);
+        }
+        i += length;
+    }
+    return result;
+}
+
+static bool isShortChar(char c) {
+    return isalnum((unsigned char) c) || strchr("!#$%&'()-@^_`{}~", c) != NULL;
+}
+
+/*
+ * Returns true if the name is a valid short (8.3) name, which only needs the lower case flags. Otherwise it needs a long
+ * name entry.
+ */
+static bool shortName(const string &name, string *result, uint8_t *caseFlags) {
+    size_t dot = name.rfind('.');
+    string base = name.substr(0, dot),
+           extension = dot == string::npos ? string() : name.substr(dot + 1);
+    if(base.empty() || base.size() > 8 || extension.size() > 3 || (dot != string::npos && extension.empty())) {
+        return false;
+    }
+    *caseFlags = 0;
+    for(int part = 0; part < 2; part++) {
+        const string &value = part == 0 ? base : extension;
+        bool lower = false,
+             upper = false;
+        for(size_t i = 0; i < value.size(); i++) {
+            if(!isShortChar(value[i])) {
+                return false;
+            }
+            lower |= islower((unsigned char) value[i]) != 0;
+            upper |= isupper((unsigned char) value[i]) != 0;
+        }
+        // Mixed case is only preserved by a long name
+        if(lower && upper) {
+            return false;
+        } else if(lower) {
+            *caseFlags |= part == 0 ? FAT_CASE_LOWER_BASE : FAT_CASE_LOWER_EXT;
+        }
+    }
+    base.resize(8, ' ');
+    extension.resize(3, ' ');
+    *result = ::upper(base + extension);
+    return true;
+}
+
+// Generates a unique short name for a long name (e.g. "BCM271~1DTB" for "bcm2710-rpi-3-b.dtb")
+static string shortAlias(const string &name, const set<string> &used) {
+    size_t dot = name.rfind('.');
+    if(dot == 0) {
+        dot = string::npos;
+    }
+    string base,
+           extension;
+    for(size_t i = 0; i < name.size(); i++) {
+        char c = name[i];
+        if(c == ' ' || (c == '.' && i != dot)) {
+            continue;
+        }
+        string &part = (dot != string::npos && i > dot) ? extension : base;
+        if(i != dot) {
+            part += isShortChar(c) ? (char) toupper((unsigned char) c) : '_';
+        }
+    }
+    if(base.empty()) {
+        base = "_";
+    }
+    extension = extension.substr(0, 3);
+    extension.resize(3, ' ');
+
+    for(unsigned int number = 1; ; number++) {
+        string tail = "~" + to_string(number);
+        string candidate = base.substr(0, 8 - tail.size()) + tail;
+        candidate.resize(8, ' ');
+        candidate += extension;
+        if(used.count(candidate) == 0) {
+            return candidate;
+        }
+    }
+}
+
+static uint8_t shortChecksum(const string &name) {
+    uint8_t sum = 0;
+    for(size_t i = 0; i < FAT_LABEL_LENGTH; i++) {
+        sum = (uint8_t) (((sum & 1) << 7) + (sum >> 1) + (unsigned char) name[i]);
+    }
+    return sum;
+}
+
+static bool randomBytes(void *buffer, size_t length) {
+    int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+    if(fd < 0) {
+        return false;
+    }
+    bool success = read(fd, buffer, length) == (ssize_t) length;
+    close(fd);
+    return success;
+}
+
+// Start sector of the partition (stored in the boot sector as hidden sectors), 0 if it is not a partition
+static uint32_t partitionStart(const string &device) {
+    char resolved[PATH_MAX];
+    if(realpath(device.c_str(), resolved) == NULL) {
+        return 0;
+    }
+    string name = resolved;
+    name = name.substr(name.rfind('/') + 1);
+    uint32_t start = 0;
+    FILE *file = fopen(("/sys/class/block/" + name + "/start").c_str(), "r");
+    if(file) {
+        if(fscanf(file, "%u", &start) != 1) {
+            start = 0;
+        }
+        fclose(file);
+    }
+    return start;
+}
+
+Stream::FatBuilder::~FatBuilder() {
+    if(_fd >= 0) {
+        close(_fd);
+    }
+}
+
+void Stream::FatBuilder::addFile(const string &path, const string &data, bool append) {
+    vector<string> components;
+    if(splitPath(path, &components) && !components.empty()) {
+        ExtraFile file = {path, data, append};
+        _extraFiles[normalizedPath(components)] = file;
+    }
+}
+
+bool Stream::FatBuilder::begin() {
+    LDEBUG << "Building FAT file system on " << _device;
+    _now = time(NULL);
+    if(_label.size() > FAT_LABEL_LENGTH) {
+        setError("Label " + _label + " is longer than 11 characters");
+        return false;
+    }
+    _fd = open(_device.c_str(), O_WRONLY | O_CLOEXEC);
+    if(_fd < 0) {
+        setError("Unable to open " + _device + ": " + strerror(errno));
+        return false;
+    }
+
+    struct stat st;
+    uint64_t size = 0;
+    if(fstat(_fd, &st) != 0) {
+        setError("Unable to access " + _device + ": " + strerror(errno));
+        return false;
+    } else if(S_ISREG(st.st_mode)) {
+        size = st.st_size;
+    } else if(!S_ISBLK(st.st_mode) || ioctl(_fd, BLKGETSIZE64, &size) != 0) {
+        setError("Unable to determine the size of " + _device);
+        return false;
+    }
+    if(!layout(size / FAT_SECTOR_SIZE)) {
+        setError("Device " + _device + " is too small for a FAT file system");
+        return false;
+    }
+    _hiddenSectors = S_ISBLK(st.st_mode) ? partitionStart(_device) : 0;
+    if(!randomBytes(&_volumeId, sizeof(_volumeId))) {
+        setError("Unable to generate the volume ID");
+        return false;
+    }
+    LDEBUG << "Using FAT" << (_fat32 ? 32 : 16) << " with " << _clusters << " clusters of "
+           << (_sectorsPerCluster * FAT_SECTOR_SIZE) << " bytes";
+
+    Node root = Node();
+    root.directory = true;
+    root.mtime = _now;
+    _nodes.push_back(root);
+    _nextCluster = 2;
+    _pending.reserve(FAT_WRITE_SIZE);
+    _pendingOffset = 0;
+    return true;
+}
+
+bool Stream::FatBuilder::finish() {
+    if(!writeExtraFiles() || !writeDirectories() || !flush() || !writeTables()) {
+        return false;
+    }
+    if(fsync(_fd) != 0) {
+        setError("Unable to sync " + _device + ": " + strerror(errno));
+        return false;
+    }
+    close(_fd);
+    _fd = -1;
+    LINFO << "Built FAT" << (_fat32 ? 32 : 16) << " file system on " << _device << ", using " << (_nextCluster - 2)
+          << " of " << _clusters << " clusters";
+    return true;
+}
+
+bool Stream::FatBuilder::extract(const Entry &entry) {
+    vector<string> components;
+    if(!splitPath(entry.path, &components)) {
+        LWARNING << "Skipping unsafe path " << entry.path;
+        return skipData(entry.size);
+    }
+    if(components.empty()) {
+        if(entry.type == '5') {
+            _nodes[0].mtime = entry.mtime;
+        }
+        return skipData(entry.size);
+    }
+
+    size_t parent,
+           node;
+    if(!lookupDirectory(components, components.size() - 1, &parent)) {
+        return false;
+    }
+    const string &name = components.back();
+    if(utf16(name).size() > FAT_LONG_NAME_MAX) {
+        setError("Name of " + entry.path + " is too long");
+        return false;
+    }
+
+    switch(entry.type) {
+        case '0':
+        case '7':
+            if(!addNode(parent, name, false, entry.mtime, &node)) {
+                return false;
+            }
+            _nodes[node].readOnly = (entry.mode & S_IWUSR) == 0;
+            return writeFile(node, normalizedPath(components), entry.size);
+        case '5': {
+            map<string, size_t>::const_iterator existing = _nodes[parent].children.find(upper(name));
+            if(existing != _nodes[parent].children.end() && _nodes[existing->second].directory) {
+                _nodes[existing->second].mtime = entry.mtime;
+            } else if(!addNode(parent, name, true, entry.mtime, &node)) {
+                return false;
+            }
+            return skipData(entry.size);
+        }
+        case '1':
+        case '2':
+        case '3':
+        case '4':
+        case '6':
+            // Extracting the archive onto a mounted FAT file system fails as well
+            setError("Unable to create " + entry.path + ", links and special files are not supported by FAT");
+            return false;
+        default:
+            LWARNING << "Skipping " << entry.path << " with unsupported type " << entry.type;
+            return skipData(entry.size);
+    }
+}
+
+/*
+ * Layout
+ */
+
+bool Stream::FatBuilder::layout(uint64_t sectors) {
+    _sectors = (uint32_t) min<uint64_t>(sectors, 0xffffffffULL);
+    // Cluster sizes as recommended by Microsoft (and used by mkfs.fat)
+    _fat32 = _sectors > 1024 * 1024;
+    if(_fat32) {
+        _sectorsPerCluster = _sectors <= 16 * 1024 * 1024 ? 8 : _sectors <= 32 * 1024 * 1024 ? 16 :
+                             _sectors <= 64 * 1024 * 1024 ? 32 : 64;
+    } else {
+        _sectorsPerCluster = _sectors <= 32680 ? 2 : _sectors <= 256 * 1024 ? 4 : _sectors <= 512 * 1024 ? 8 : 16;
+    }
+
+    while(_sectorsPerCluster >= 1 && _sectorsPerCluster <= 128) {
+        _rootSectors = _fat32 ? 0 : FAT16_ROOT_ENTRIES * FAT_ENTRY_SIZE / FAT_SECTOR_SIZE;
+        _reservedSectors = _fat32 ? FAT32_RESERVED_SECTORS : 1;
+        uint32_t entrySize = _fat32 ? 4 : 2;
+
+        // The size of the FATs depends on the number of clusters, which depends on the size of the FATs
+        _fatSectors = 1;
+        uint64_t clusters = 0;
+        while(true) {
+            uint64_t overhead = (uint64_t) _reservedSectors + 2 * _fatSectors + _rootSectors;
+            clusters = overhead < _sectors ? (_sectors - overhead) / _sectorsPerCluster : 0;
+            uint32_t needed = (uint32_t) (((clusters + 2) * entrySize + FAT_SECTOR_SIZE - 1) / FAT_SECTOR_SIZE);
+            if(needed <= _fatSectors) {
+                break;
+            }
+            _fatSectors = needed;
+        }
+
+        // The data area starts at a cluster boundary, which keeps the clusters aligned to the flash pages
+        _dataStart = _reservedSectors + 2 * _fatSectors + _rootSectors;
+        uint32_t padding = (_sectorsPerCluster - _dataStart % _sectorsPerCluster) % _sectorsPerCluster;
+        _reservedSectors += padding;
+        _dataStart += padding;
+        clusters = _dataStart < _sectors ? (_sectors - _dataStart) / _sectorsPerCluster : 0;
+
+        // The number of clusters determines the FAT type, the cluster size is adjusted to match it
+        if(!_fat32 && clusters >= FAT32_MIN_CLUSTERS) {
+            _sectorsPerCluster *= 2;
+        } else if(clusters < (_fat32 ? FAT32_MIN_CLUSTERS : FAT16_MIN_CLUSTERS)) {
+            _sectorsPerCluster /= 2;
+        } else {
+            _clusters = (uint32_t) min<uint64_t>(clusters, FAT32_MAX_CLUSTERS);
+            return true;
+        }
+    }
+    return false;
+}
+
+uint64_t Stream::FatBuilder::clusterOffset(uint32_t cluster) {
+    return ((uint64_t) _dataStart + (uint64_t) (cluster - 2) * _sectorsPerCluster) * FAT_SECTOR_SIZE;
+}
+
+/*
+ * Allocation and directory tree
+ */
+
+bool Stream::FatBuilder::allocate(uint64_t bytes, uint32_t *cluster, uint32_t *clusters) {
+    uint64_t clusterSize = (uint64_t) _sectorsPerCluster * FAT_SECTOR_SIZE,
+             count = (bytes + clusterSize - 1) / clusterSize;
+    if(_nextCluster + count > (uint64_t) _clusters + 2) {
+        setError("No space left on the file system");
+        return false;
+    }
+    *cluster = count == 0 ? 0 : _nextCluster;
+    *clusters = (uint32_t) count;
+    _nextCluster += (uint32_t) count;
+    return true;
+}
+
+bool Stream::FatBuilder::lookupDirectory(const vector<string> &components, size_t count, size_t *node) {
+    size_t directory = 0;
+    for(size_t i = 0; i < count; i++) {
+        map<string, size_t>::const_iterator it = _nodes[directory].children.find(upper(components[i]));
+        if(it == _nodes[directory].children.end()) {
+            if(!addNode(directory, components[i], true, _now, &directory)) {
+                return false;
+            }
+        } else if(_nodes[it->second].directory) {
+            directory = it->second;
+        } else {
+            setError(components[i] + " is not a directory");
+            return false;
+        }
+    }
+    *node = directory;
+    return true;
+}
+
+bool Stream::FatBuilder::addNode(size_t directory, const string &name, bool isDirectory, time_t mtime, size_t *node) {
+    string key = upper(name);
+    map<string, size_t>::iterator existing = _nodes[directory].children.find(key);
+    if(existing != _nodes[directory].children.end()) {
+        // Replacing the existing entry, like tar does (its clusters are simply left unused)
+        if(_nodes[existing->second].directory && !_nodes[existing->second].children.empty()) {
+            setError("Unable to replace non-empty directory " + name);
+            return false;
+        }
+        _nodes[directory].children.erase(existing);
+    }
+
+    Node entry = Node();
+    entry.name = name;
+    entry.directory = isDirectory;
+    entry.mtime = mtime;
+    entry.parent = directory;
+    _nodes.push_back(entry);
+    *node = _nodes.size() - 1;
+    _nodes[directory].children[key] = *node;
+    return true;
+}
+
+string Stream::FatBuilder::normalizedPath(const vector<string> &components) {
+    string path;
+    for(size_t i = 0; i < components.size(); i++) {
+        path += (i == 0 ? "" : "/") + upper(components[i]);
+    }
+    return path;
+}
+
+void Stream::FatBuilder::collectNodes(vector<size_t> *nodes) {
+    nodes->clear();
+    nodes->push_back(0);
+    for(size_t i = 0; i < nodes->size(); i++) {
+        const Node &node = _nodes[(*nodes)[i]];
+        for(map<string, size_t>::const_iterator it = node.children.begin(); it != node.children.end(); ++it) {
+            nodes->push_back(it->second);
+        }
+    }
+}
+
+/*
+ * Writing
+ */
+
+bool Stream::FatBuilder::writeFile(size_t node, const string &path, uint64_t size) {
+    if(size > 0xffffffffULL) {
+        setError("File " + path + " is too large for FAT");
+        return false;
+    }
+
+    map<string, ExtraFile>::const_iterator extra = _extraFiles.find(path);
+    if(extra != _extraFiles.end()) {
+        // The file is written along with the added data once the archive ended
+        if(extra->second.append) {
+            string &content = _appendedContent[path];
+            content.resize(size);
+            if(size > 0 && !readFully(&content[0], size)) {
+                setError("Unexpected end of archive");
+                return false;
+            }
+            countOut(size);
+            return skipBytes((TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE);
+        }
+        return skipData(size);
+    }
+
+    Node &file = _nodes[node];
+    file.size = (uint32_t) size;
+    if(!allocate(size, &file.cluster, &file.clusters)) {
+        return false;
+    }
+
+    char buffer[STREAM_CHUNK_SIZE / 4];
+    uint64_t offset = clusterOffset(file.cluster),
+             position = 0;
+    while(position < size) {
+        ssize_t bytesRead = read(buffer, min<uint64_t>(size - position, sizeof(buffer)));
+        if(bytesRead <= 0) {
+            setError("Unexpected end of archive");
+            return false;
+        }
+        if(!queue(offset + position, buffer, (size_t) bytesRead)) {
+            return false;
+        }
+        countOut(bytesRead);
+        position += bytesRead;
+    }
+
+    // Zeroing the rest of the last cluster keeps the writes of consecutive files adjacent
+    vector<char> padding((uint64_t) file.clusters * _sectorsPerCluster * FAT_SECTOR_SIZE - size, 0);
+    if(!padding.empty() && !queue(offset + size, &padding[0], padding.size())) {
+        return false;
+    }
+
+    // Skipping the padding up to the next block
+    return skipBytes((TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE);
+}
+
+bool Stream::FatBuilder::writeNode(size_t node, const string &data) {
+    Node &file = _nodes[node];
+    if(!allocate(data.size(), &file.cluster, &file.clusters)) {
+        return false;
+    }
+    string padded = data;
+    padded.resize((size_t) file.clusters * _sectorsPerCluster * FAT_SECTOR_SIZE, '\0');
+    return padded.empty() || queue(clusterOffset(file.cluster), padded.data(), padded.size());
+}
+
+bool Stream::FatBuilder::writeExtraFiles() {
+    for(map<string, ExtraFile>::const_iterator it = _extraFiles.begin(); it != _extraFiles.end(); ++it) {
+        vector<string> components;
+        splitPath(it->second.path, &components);
+        size_t parent,
+               node;
+        if(!lookupDirectory(components, components.size() - 1, &parent)) {
+            return false;
+        }
+        // The name of a file of the archive is kept (the path only matches it regardless of the case)
+        string name = components.back();
+        map<string, size_t>::const_iterator existing = _nodes[parent].children.find(upper(name));
+        if(existing != _nodes[parent].children.end()) {
+            name = _nodes[existing->second].name;
+        }
+
+        string data = it->second.append ? _appendedContent[it->first] + it->second.data : it->second.data;
+        if(!addNode(parent, name, false, _now, &node) || !writeNode(node, data)) {
+            return false;
+        }
+        _nodes[node].size = (uint32_t) data.size();
+    }
+    return true;
+}
+
+bool Stream::FatBuilder::writeDirectories() {
+    vector<size_t> nodes;
+    collectNodes(&nodes);
+
+    /* All directories are allocated first, since the entries refer to the clusters of their parent and children */
+    for(size_t i = 0; i < nodes.size(); i++) {
+        Node &directory = _nodes[nodes[i]];
+        if(!directory.directory) {
+            continue;
+        }
+        size_t entries = nodes[i] == 0 ? (_label.empty() ? 0 : 1) : 2;
+        for(map<string, size_t>::const_iterator it = directory.children.begin(); it != directory.children.end(); ++it) {
+            entries += entryCount(_nodes[it->second].name);
+        }
+        if(nodes[i] == 0 && !_fat32) {
+            // The FAT16 root directory has a fixed size, it is written along with the FATs
+            if(entries > FAT16_ROOT_ENTRIES) {
+                setError("Too many entries in the root directory");
+                return false;
+            }
+            continue;
+        }
+        // Empty directories still occupy a cluster
+        if(!allocate(max<size_t>(entries, 1) * FAT_ENTRY_SIZE, &directory.cluster, &directory.clusters)) {
+            return false;
+        }
+    }
+
+    for(size_t i = 0; i < nodes.size(); i++) {
+        const Node &directory = _nodes[nodes[i]];
+        if(!directory.directory || directory.clusters == 0) {
+            continue;
+        }
+        vector<char> data((size_t) directory.clusters * _sectorsPerCluster * FAT_SECTOR_SIZE, 0);
+        encodeDirectory(nodes[i], &data[0]);
+        if(!queue(clusterOffset(directory.cluster), &data[0], data.size())) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool Stream::FatBuilder::writeTables() {
+    /* Reserved sectors (boot sector and on FAT32 its backup), both FATs and the FAT16 root directory are adjacent */
+    uint32_t fatOffset = _reservedSectors * FAT_SECTOR_SIZE,
+             fatSize = _fatSectors * FAT_SECTOR_SIZE;
+    vector<char> buffer((size_t) _dataStart * FAT_SECTOR_SIZE, 0);
+    char *fat = &buffer[fatOffset];
+
+    // The first two entries hold the media type and the clean shutdown flags
+    uint32_t endOfChain = _fat32 ? 0x0fffffff : 0xffff;
+    vector<size_t> nodes;
+    collectNodes(&nodes);
+    for(size_t i = 0; i < nodes.size(); i++) {
+        const Node &node = _nodes[nodes[i]];
+        for(uint32_t cluster = node.cluster; cluster < node.cluster + node.clusters; cluster++) {
+            uint32_t next = cluster + 1 == node.cluster + node.clusters ? endOfChain : cluster + 1;
+            if(_fat32) {
+                put32(fat + cluster * 4, next);
+            } else {
+                put16(fat + cluster * 2, (uint16_t) next);
+            }
+        }
+    }
+    if(_fat32) {
+        put32(fat, 0x0fffff00 | FAT_MEDIA);
+        put32(fat + 4, endOfChain);
+    } else {
+        put16(fat, 0xff00 | FAT_MEDIA);
+        put16(fat + 2, (uint16_t) endOfChain);
+    }
+    memcpy(fat + fatSize, fat, fatSize);
+    if(!_fat32) {
+        encodeDirectory(0, &buffer[fatOffset + 2 * fatSize]);
+    }
+
+    /* Boot sector */
+    char *boot = &buffer[0];
+    string label = _label.empty() ? "NO NAME" : _label;
+    label.resize(FAT_LABEL_LENGTH, ' ');
+    // Jump over the BIOS parameter block (as expected by the probes of blkid)
+    boot[0] = (char) 0xeb;
+    boot[1] = (char) (_fat32 ? 0x58 : 0x3c);
+    boot[2] = (char) 0x90;
+    memcpy(boot + 3, "mkfs.fat", 8);
+    put16(boot + 11, FAT_SECTOR_SIZE);
+    boot[13] = (char) _sectorsPerCluster;
+    put16(boot + 14, (uint16_t) _reservedSectors);
+    boot[16] = 2;
+    put16(boot + 17, _fat32 ? 0 : FAT16_ROOT_ENTRIES);
+    put16(boot + 19, (uint16_t) (!_fat32 && _sectors < 65536 ? _sectors : 0));
+    boot[21] = (char) FAT_MEDIA;
+    put16(boot + 22, (uint16_t) (_fat32 ? 0 : _fatSectors));
+    put16(boot + 24, 63);
+    put16(boot + 26, 255);
+    put32(boot + 28, _hiddenSectors);
+    put32(boot + 32, !_fat32 && _sectors < 65536 ? 0 : _sectors);
+    // FAT32 moved the extended boot record behind its additional fields
+    char *extended = boot + 36;
+    if(_fat32) {
+        put32(boot + 36, _fatSectors);
+        put32(boot + 44, _nodes[0].cluster);
+        put16(boot + 48, FAT32_INFO_SECTOR);
+        put16(boot + 50, FAT32_BACKUP_SECTOR);
+        extended = boot + 64;
+    }
+    extended[0] = (char) 0x80;
+    extended[2] = 0x29;
+    put32(extended + 3, _volumeId);
+    memcpy(extended + 7, label.data(), FAT_LABEL_LENGTH);
+    memcpy(extended + 18, _fat32 ? "FAT32   " : "FAT16   ", 8);
+    boot[510] = 0x55;
+    boot[511] = (char) 0xaa;
+
+    if(_fat32) {
+        // Clusters of replaced files are never linked in the FAT, the free count is taken from the entries written
+        uint32_t freeClusters = 0;
+        for(uint32_t cluster = 2; cluster < _clusters + 2; cluster++) {
+            if(memcmp(fat + cluster * 4, "\0\0\0\0", 4) == 0) {
+                freeClusters++;
+            }
+        }
+        char *info = &buffer[FAT32_INFO_SECTOR * FAT_SECTOR_SIZE];
+        put32(info, 0x41615252);
+        put32(info + 484, 0x61417272);
+        put32(info + 488, freeClusters);
+        put32(info + 492, _nextCluster);
+        put32(info + 508, 0xaa550000);
+        memcpy(&buffer[FAT32_BACKUP_SECTOR * FAT_SECTOR_SIZE], boot, 2 * FAT_SECTOR_SIZE);
+    }
+    return writeAt(&buffer[0], buffer.size(), 0);
+}
+
+size_t Stream::FatBuilder::entryCount(const string &name) {
+    string result;
+    uint8_t caseFlags;
+    if(shortName(name, &result, &caseFlags)) {
+        return 1;
+    }
+    return 1 + (utf16(name).size() + FAT_LONG_NAME_CHARS - 1) / FAT_LONG_NAME_CHARS;
+}
+
+void Stream::FatBuilder::encodeDirectory(size_t number, char *data) {
+    const Node &directory = _nodes[number];
+    char *entry = data;
+
+    if(number == 0 && !_label.empty()) {
+        string label = _label;
+        label.resize(FAT_LABEL_LENGTH, ' ');
+        memcpy(entry, label.data(), FAT_LABEL_LENGTH);
+        entry[11] = FAT_ATTR_VOLUME_ID;
+        putTime(entry + 22, _now);
+        entry += FAT_ENTRY_SIZE;
+    } else if(number != 0) {
+        // The parent is referenced as cluster 0, if it is the root directory
+        const char *names[] = {".          ", "..         "};
+        uint32_t clusters[] = {directory.cluster, directory.parent == 0 ? 0 : _nodes[directory.parent].cluster};
+        for(int i = 0; i < 2; i++) {
+            memcpy(entry, names[i], FAT_LABEL_LENGTH);
+            entry[11] = FAT_ATTR_DIRECTORY;
+            putTime(entry + 14, directory.mtime);
+            put16(entry + 18, (uint16_t) ((unsigned char) entry[16] | ((unsigned char) entry[17] << 8)));
+            put16(entry + 20, (uint16_t) (clusters[i] >> 16));
+            putTime(entry + 22, directory.mtime);
+            put16(entry + 26, (uint16_t) (clusters[i] & 0xffff));
+            entry += FAT_ENTRY_SIZE;
+        }
+    }
+
+    // Valid short names are reserved first, so the generated aliases do not collide with them
+    set<string> used;
+    map<size_t, pair<string, uint8_t> > shortNames;
+    for(map<string, size_t>::const_iterator it = directory.children.begin(); it != directory.children.end(); ++it) {
+        string name;
+        uint8_t caseFlags;
+        if(shortName(_nodes[it->second].name, &name, &caseFlags)) {
+            used.insert(name);
+            shortNames[it->second] = make_pair(name, caseFlags);
+        }
+    }
+
+    for(map<string, size_t>::const_iterator it = directory.children.begin(); it != directory.children.end(); ++it) {
+        const Node &child = _nodes[it->second];
+        string name;
+        uint8_t caseFlags = 0;
+        if(shortNames.count(it->second)) {
+            name = shortNames[it->second].first;
+            caseFlags = shortNames[it->second].second;
+        } else {
+            name = shortAlias(child.name, used);
+            used.insert(name);
+
+            // Long name entries are stored in reverse order, the first one is flagged as the last
+            vector<uint16_t> longName = utf16(child.name);
+            size_t count = (longName.size() + FAT_LONG_NAME_CHARS - 1) / FAT_LONG_NAME_CHARS;
+            if(longName.size() % FAT_LONG_NAME_CHARS != 0) {
+                longName.push_back(0);
+            }
+            longName.resize(count * FAT_LONG_NAME_CHARS, 0xffff);
+            static const int offsets[FAT_LONG_NAME_CHARS] = {1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30};
+            for(size_t part = count; part > 0; part--) {
+                entry[0] = (char) (part | (part == count ? 0x40 : 0));
+                entry[11] = FAT_ATTR_LONG_NAME;
+                entry[13] = (char) shortChecksum(name);
+                for(int i = 0; i < FAT_LONG_NAME_CHARS; i++) {
+                    put16(entry + offsets[i], longName[(part - 1) * FAT_LONG_NAME_CHARS + i]);
+                }
+                entry += FAT_ENTRY_SIZE;
+            }
+        }
+
+        memcpy(entry, name.data(), FAT_LABEL_LENGTH);
+        entry[11] = (char) ((child.directory ? FAT_ATTR_DIRECTORY : FAT_ATTR_ARCHIVE) |
+                            (child.readOnly ? FAT_ATTR_READ_ONLY : 0));
+        entry[12] = (char) caseFlags;
+        // Creation and modification time are the same, the access date is the date of the modification
+        putTime(entry + 14, child.mtime);
+        put16(entry + 18, (uint16_t) ((unsigned char) entry[16] | ((unsigned char) entry[17] << 8)));
+        put16(entry + 20, (uint16_t) (child.cluster >> 16));
+        putTime(entry + 22, child.mtime);
+        put16(entry + 26, (uint16_t) (child.cluster & 0xffff));
+        put32(entry + 28, child.directory ? 0 : child.size);
+        entry += FAT_ENTRY_SIZE;
+    }
+}
+
+/*
+ * Writing to the device
+ */
+
+bool Stream::FatBuilder::queue(uint64_t offset, const char *data, size_t length) {
+    while(length > 0) {
+        if(!_pending.empty() && (offset != _pendingOffset + _pending.size() || _pending.size() >= FAT_WRITE_SIZE)) {
+            if(!flush()) {
+                return false;
+            }
+        }
+        if(_pending.empty()) {
+            _pendingOffset = offset;
+        }
+        size_t chunk = min<size_t>(length, FAT_WRITE_SIZE - _pending.size());
+        _pending.insert(_pending.end(), data, data + chunk);
+        data += chunk;
+        length -= chunk;
+        offset += chunk;
+    }
+    return true;
+}
+
+bool Stream::FatBuilder::flush() {
+    if(_pending.empty()) {
+        return true;
+    }
+    bool success = writeAt(&_pending[0], _pending.size(), _pendingOffset);
+    _pending.clear();
+    return success;
+}
+
+bool Stream::FatBuilder::writeAt(const char *data, size_t length, uint64_t offset) {
+    while(length > 0) {
+        ssize_t written = pwrite(_fd, data, length, offset);
+        if(written < 0 && errno == EINTR) {
+            continue;
+        } else if(written <= 0) {
+            setError("Unable to write " + _device + ": " + strerror(errno));
+            return false;
+        }
+        data += written;
+        length -= written;
+        offset += written;
+    }
+    return true;
+}
@@ -0,0 +1,144 @@
+//
+// Created by agent on 10/17/26 as part of NOOBS4IoT (https://github.com/steilerDev/NOOBS4IoT)
+//
+// FatBuilder.h:
+//      This file contains a sink stage of a streaming pipeline, building a FAT16 or FAT32 file system on a block device
+//      (or file) straight from a tar archive, including files added to the archive's content (e.g. the NOOBS settings of
+//      the boot partition). The file system is never mounted: File data is written in large sequential writes as it
+//      arrives, directories, FATs and boot sector are written once the archive ended. No external, non-standard library
+//      is required for this file.
+//      For more information see https://github.com/steilerDev/NOOBS4IoT/wiki.
+//
+// This file is licensed under a GNU General Public License v3.0 (c) Frank Steiler.
+// See https://raw.githubusercontent.com/steilerDev/NOOBS4IoT/master/LICENSE for more information.
+//
+
+#ifndef STREAM_FATBUILDER_H
+#define STREAM_FATBUILDER_H
+
+#include "TarReader.h"
+#include <map>
+#include <set>
+
+#define FAT_SECTOR_SIZE 512
+#define FAT_ENTRY_SIZE 32
+#define FAT_LABEL_LENGTH 11
+// Number of entries of the FAT16 root directory
+#define FAT16_ROOT_ENTRIES 512
+
+// Size of the writes issued to the device, file data is collected until it is reached
+#define FAT_WRITE_SIZE (4 * 1024 * 1024)
+
+namespace Stream {
+
+    /*
+     * The cluster size and FAT type are chosen by the size of the device, like mkfs.fat does (FAT16 up to 512 MB). Long
+     * file names are stored as VFAT entries. Like on a mounted FAT file system, owners and permissions (except for the
+     * read-only flag) are dropped, links and special files are not supported.
+     */
+    class FatBuilder: public TarReader {
+    public:
+        FatBuilder(const string &device, const string &label = string()): TarReader("mkfs"),
+                                                                         _device(device),
+                                                                         _label(label),
+                                                                         _fd(-1) {}
+        ~FatBuilder();
+
+        // Adds a file once the archive ended. If append is set, the data is appended to the file of the archive (if
+        // there is one), otherwise it replaces it.
+        void addFile(const string &path, const string &data, bool append = false);
+
+    protected:
+        bool begin();
+        bool finish();
+        bool extract(const Entry &entry);
+
+    private:
+        /*
+         * A file or directory, its clusters are always contiguous
+         */
+        struct Node {
+            string name;
+            bool directory;
+            bool readOnly;
+            time_t mtime;
+            uint32_t size,
+                     cluster,
+                     clusters;
+            size_t parent;
+            // key: name in upper case (FAT is case insensitive), value: index of the node
+            map<string, size_t> children;
+        };
+
+        struct ExtraFile {
+            string path,
+                   data;
+            bool append;
+        };
+
+        // Calculates the geometry for the device size, returns false if the device is too small
+        bool layout(uint64_t sectors);
+        uint64_t clusterOffset(uint32_t cluster);
+
+        // Allocates the clusters behind the previous allocation
+        bool allocate(uint64_t bytes, uint32_t *cluster, uint32_t *clusters);
+        // Returns the node of the directory, creating missing directories on the way
+        bool lookupDirectory(const vector<string> &components, size_t count, size_t *node);
+        // Adds a node to the directory, replacing a previous entry of the same name
+        bool addNode(size_t directory, const string &name, bool isDirectory, time_t mtime, size_t *node);
+        // Returns the path used to match the added files
+        static string normalizedPath(const vector<string> &components);
+        // Collects all nodes reachable from the root directory (nodes replaced by later entries are not)
+        void collectNodes(vector<size_t> *nodes);
+
+        bool writeFile(size_t node, const string &path, uint64_t size);
+        // Writes data into the clusters of the node, starting at the beginning of the node
+        bool writeNode(size_t node, const string &data);
+        bool writeExtraFiles();
+        bool writeDirectories();
+        bool writeTables();
+
+        // Serializes the entries of a directory, the long name entries of each child precede its short entry
+        void encodeDirectory(size_t node, char *data);
+        // Number of entries needed for the child, including its long name entries
+        static size_t entryCount(const string &name);
+
+        // Queues the data for writing at the given offset, adjacent data is collected into a single write
+        bool queue(uint64_t offset, const char *data, size_t length);
+        bool flush();
+        bool writeAt(const char *data, size_t length, uint64_t offset);
+
+        string _device,
+               _label;
+        int _fd;
+
+        /* Geometry (in sectors, unless mentioned otherwise) */
+        bool _fat32;
+        uint32_t _sectors,
+                 _hiddenSectors,
+                 _sectorsPerCluster,
+                 _reservedSectors,
+                 _fatSectors,
+                 _rootSectors,
+                 _dataStart,
+                 _clusters,
+                 _volumeId;
+        time_t _now;
+
+        // First cluster, which has not been allocated
+        uint32_t _nextCluster;
+
+        /* Index 0 is the root directory, removed nodes stay without a parent referencing them */
+        vector<Node> _nodes;
+        // key: normalized path
+        map<string, ExtraFile> _extraFiles;
+        // Content of archive files, which data is appended to (key: normalized path)
+        map<string, string> _appendedContent;
+
+        /* Data queued for writing, starting at _pendingOffset */
+        vector<char> _pending;
+        uint64_t _pendingOffset;
+    };
+}
+
+#endif //STREAM_FATBUILDER_H
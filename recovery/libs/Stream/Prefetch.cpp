@@ -0,0 +1,88 @@
+//
+// Created by agent on 10/17/26 as part of NOOBS4IoT (https://github.com/steilerDev/NOOBS4IoT)
+//
+// Prefetch.cpp:
+//      This file contains a wrapper running the source stage of a pipeline ahead of time (e.g. downloading an image
+//      while the SD card is still being partitioned). The output is buffered in memory until the pipeline is set up
+//      and takes over the source. No external, non-standard library is required for this file.
+//      For more information see https://github.com/steilerDev/NOOBS4IoT/wiki.
+//
+// This file is licensed under a GNU General Public License v3.0 (c) Frank Steiler.
+// See https://raw.githubusercontent.com/steilerDev/NOOBS4IoT/master/LICENSE for more information.
+//
+
+#include "Prefetch.h"
+#include "../easylogging++.h"
+
+namespace Stream {
+
+    /*
+     * Stands in for the prefetched source within the pipeline
+     */
+    class PrefetchedSource: public Stage {
+    public:
+        PrefetchedSource(Prefetch *prefetch): Stage(prefetch->_source->name()),
+                                              _prefetch(prefetch) {}
+
+    protected:
+        bool process();
+
+    private:
+        Prefetch *_prefetch;
+    };
+}
+
+bool Stream::PrefetchedSource::process() {
+    char buffer[STREAM_CHUNK_SIZE];
+    ssize_t bytesRead;
+    while((bytesRead = _prefetch->_buffer->read(buffer, sizeof(buffer))) > 0) {
+        if(!write(buffer, (size_t) bytesRead)) {
+            // Stopping the source, since the pipeline failed
+            _prefetch->_buffer->abort();
+            return false;
+        }
+    }
+    if(bytesRead < 0) {
+        string error = _prefetch->_source->error();
+        setError(error.empty() ? "Prefetching failed" : error);
+        return false;
+    }
+    return true;
+}
+
+Stream::Prefetch::Prefetch(Stage *source, size_t capacity): _source(source),
+                                                            _buffer(new RingBuffer(capacity)),
+                                                            _taken(false) {
+    _source->_output = _buffer;
+    _thread = thread(&Prefetch::run, this);
+}
+
+Stream::Prefetch::~Prefetch() {
+    // Does not affect data that was already read completely, otherwise the source is stopped
+    _buffer->abort();
+    _thread.join();
+    delete _source;
+    delete _buffer;
+}
+
+Stream::Stage *Stream::Prefetch::take() {
+    lock_guard<mutex> lock(_mutex);
+    if(_taken) {
+        return NULL;
+    }
+    _taken = true;
+    LDEBUG << "Taking over prefetched " << _source->name() << " after " << _source->bytesOut() << " bytes";
+    return new PrefetchedSource(this);
+}
+
+void Stream::Prefetch::run() {
+    // If the buffer was aborted, the source was stopped on purpose and did not fail
+    if(_source->process()) {
+        _buffer->close();
+    } else if(!_buffer->isAborted()) {
+        if(_source->error().empty()) {
+            _source->setError("Stage failed");
+        }
+        _buffer->abort();
+    }
+}
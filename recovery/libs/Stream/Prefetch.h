@@ -0,0 +1,54 @@
+//
+// Created by agent on 10/17/26 as part of NOOBS4IoT (https://github.com/steilerDev/NOOBS4IoT)
+//
+// Prefetch.h:
+//      This file contains a wrapper running the source stage of a pipeline ahead of time (e.g. downloading an image
+//      while the SD card is still being partitioned). The output is buffered in memory until the pipeline is set up
+//      and takes over the source. No external, non-standard library is required for this file.
+//      For more information see https://github.com/steilerDev/NOOBS4IoT/wiki.
+//
+// This file is licensed under a GNU General Public License v3.0 (c) Frank Steiler.
+// See https://raw.githubusercontent.com/steilerDev/NOOBS4IoT/master/LICENSE for more information.
+//
+
+#ifndef STREAM_PREFETCH_H
+#define STREAM_PREFETCH_H
+
+#include "Stream.h"
+
+#include <thread>
+
+// Size of the buffer holding the prefetched data, once it is full the source blocks until the pipeline takes over
+#define PREFETCH_BUFFER_SIZE (32 * 1024 * 1024)
+
+namespace Stream {
+
+    /*
+     * Runs the source on its own thread, writing into a bounded buffer. The stage returned by take() passes on the
+     * buffered data and everything the source produces afterwards, so it replaces the source in the pipeline. Failures
+     * of the source are reported by this stage.
+     */
+    class Prefetch {
+    public:
+        // Takes ownership of the source, which is started right away
+        Prefetch(Stage *source, size_t capacity = PREFETCH_BUFFER_SIZE);
+        // Stops the source, if the prefetched data was not used
+        ~Prefetch();
+
+        // Returns the stage to add to the pipeline (which takes ownership of it), or NULL if it was already taken
+        Stage *take();
+
+    private:
+        friend class PrefetchedSource;
+
+        void run();
+
+        Stage *_source;
+        RingBuffer *_buffer;
+        thread _thread;
+        mutex _mutex;
+        bool _taken;
+    };
+}
+
+#endif //STREAM_PREFETCH_H
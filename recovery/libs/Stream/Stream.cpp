@@ -0,0 +1,308 @@
+//
+// Created by agent on 10/17/26 as part of NOOBS4IoT (https://github.com/steilerDev/NOOBS4IoT)
+//
+// Stream.cpp:
+//      This file contains the building blocks of a streaming pipeline: A bounded ring buffer, the stage base class and
+//      the pipeline connecting the stages. Each stage runs on its own thread and exchanges data with its neighbours
+//      through ring buffers, e.g. download -> decompress -> extract. A stage is able to verify the digest of its output
+//      on the fly (see Digest.h).
+//      For more information see https://github.com/steilerDev/NOOBS4IoT/wiki.
+//
+// This file is licensed under a GNU General Public License v3.0 (c) Frank Steiler.
+// See https://raw.githubusercontent.com/steilerDev/NOOBS4IoT/master/LICENSE for more information.
+//
+
+#include "Stream.h"
+#include "Digest.h"
+#include "../easylogging++.h"
+
+#include <string.h>
+#include <thread>
+#include <chrono>
+
+/*
+ * RingBuffer
+ */
+
+Stream::RingBuffer::RingBuffer(size_t capacity): _capacity(capacity),
+                                                 _head(0),
+                                                 _size(0),
+                                                 _closed(false),
+                                                 _aborted(false) {
+    _buffer = new char[capacity];
+}
+
+Stream::RingBuffer::~RingBuffer() {
+    delete[] _buffer;
+}
+
+bool Stream::RingBuffer::write(const char *data, size_t length) {
+    unique_lock<mutex> lock(_mutex);
+    while(length > 0) {
+        while(_size == _capacity && !_aborted) {
+            _notFull.wait(lock);
+        }
+        if(_aborted) {
+            return false;
+        }
+
+        // Copying into the free space behind the tail, which might wrap around the end of the buffer
+        size_t tail = (_head + _size) % _capacity;
+        size_t chunk = min(length, min(_capacity - _size, _capacity - tail));
+        memcpy(_buffer + tail, data, chunk);
+        _size += chunk;
+        data += chunk;
+        length -= chunk;
+        _notEmpty.notify_one();
+    }
+    return true;
+}
+
+ssize_t Stream::RingBuffer::read(char *data, size_t length) {
+    unique_lock<mutex> lock(_mutex);
+    while(_size == 0 && !_closed && !_aborted) {
+        _notEmpty.wait(lock);
+    }
+    if(_aborted) {
+        return -1;
+    } else if(_size == 0) {
+        return 0;
+    }
+
+    size_t chunk = min(length, min(_size, _capacity - _head));
+    memcpy(data, _buffer + _head, chunk);
+    _head = (_head + chunk) % _capacity;
+    _size -= chunk;
+    _notFull.notify_one();
+    return chunk;
+}
+
+void Stream::RingBuffer::close() {
+    lock_guard<mutex> lock(_mutex);
+    _closed = true;
+    _notEmpty.notify_all();
+}
+
+void Stream::RingBuffer::abort() {
+    lock_guard<mutex> lock(_mutex);
+    _aborted = true;
+    _notEmpty.notify_all();
+    _notFull.notify_all();
+}
+
+bool Stream::RingBuffer::isAborted() {
+    lock_guard<mutex> lock(_mutex);
+    return _aborted;
+}
+
+/*
+ * Stage
+ */
+
+Stream::Stage::Stage(const string &name): _input(NULL),
+                                          _output(NULL),
+                                          _name(name),
+                                          _bytesIn(0),
+                                          _bytesOut(0),
+                                          _outputDigest(NULL) {}
+
+Stream::Stage::~Stage() {
+    delete _outputDigest;
+}
+
+bool Stream::Stage::verifyOutput(const string &algorithm, const string &expected) {
+    delete _outputDigest;
+    _outputDigest = new Digest(algorithm);
+    if(!_outputDigest->isValid()) {
+        delete _outputDigest;
+        _outputDigest = NULL;
+        return false;
+    }
+    _expectedDigest = expected;
+    return true;
+}
+
+bool Stream::Stage::checkOutputDigest() {
+    if(_outputDigest == NULL) {
+        return true;
+    }
+    string digest = _outputDigest->hexDigest();
+    if(!digestEquals(digest, _expectedDigest)) {
+        setError(_outputDigest->algorithm() + " mismatch: expected " + _expectedDigest + ", got " + digest);
+        return false;
+    }
+    LDEBUG << "Stage " << _name << ": " << _outputDigest->algorithm() << " verified";
+    return true;
+}
+
+ssize_t Stream::Stage::read(char *buffer, size_t length) {
+    if(_input == NULL) {
+        LERROR << "Stage " << _name << " has no input";
+        return -1;
+    }
+    ssize_t bytesRead = _input->read(buffer, length);
+    if(bytesRead > 0) {
+        countIn(bytesRead);
+    }
+    return bytesRead;
+}
+
+bool Stream::Stage::write(const char *buffer, size_t length) {
+    if(_output == NULL) {
+        LERROR << "Stage " << _name << " has no output";
+        return false;
+    }
+    if(!_output->write(buffer, length)) {
+        return false;
+    }
+    if(_outputDigest != NULL) {
+        _outputDigest->update(buffer, length);
+    }
+    countOut(length);
+    return true;
+}
+
+bool Stream::Stage::drain() {
+    char buffer[STREAM_CHUNK_SIZE / 16];
+    ssize_t bytesRead;
+    while((bytesRead = read(buffer, sizeof(buffer))) > 0);
+    return bytesRead == 0;
+}
+
+void Stream::Stage::setError(const string &error) {
+    LERROR << _name << ": " << error;
+    lock_guard<mutex> lock(_statsMutex);
+    if(_error.empty()) {
+        _error = error;
+    }
+}
+
+void Stream::Stage::countIn(uint64_t bytes) {
+    lock_guard<mutex> lock(_statsMutex);
+    _bytesIn += bytes;
+}
+
+void Stream::Stage::countOut(uint64_t bytes) {
+    lock_guard<mutex> lock(_statsMutex);
+    _bytesOut += bytes;
+}
+
+uint64_t Stream::Stage::bytesIn() {
+    lock_guard<mutex> lock(_statsMutex);
+    return _bytesIn;
+}
+
+uint64_t Stream::Stage::bytesOut() {
+    lock_guard<mutex> lock(_statsMutex);
+    return _bytesOut;
+}
+
+string Stream::Stage::error() {
+    lock_guard<mutex> lock(_statsMutex);
+    return _error;
+}
+
+/*
+ * Pipeline
+ */
+
+Stream::Pipeline::Pipeline(): _finishedStages(0), _failed(false) {}
+
+Stream::Pipeline::~Pipeline() {
+    for(Stage *stage: _stages) {
+        delete stage;
+    }
+    for(RingBuffer *buffer: _buffers) {
+        delete buffer;
+    }
+}
+
+void Stream::Pipeline::add(Stage *stage) {
+    if(!_stages.empty()) {
+        RingBuffer *buffer = new RingBuffer();
+        _stages.back()->_output = buffer;
+        stage->_input = buffer;
+        _buffers.push_back(buffer);
+    }
+    _stages.push_back(stage);
+}
+
+bool Stream::Pipeline::run(function<void()> progress, unsigned int interval) {
+    if(_stages.size() < 2) {
+        LERROR << "A pipeline requires at least a source and a sink";
+        return false;
+    }
+
+    LDEBUG << "Starting pipeline with " << _stages.size() << " stages";
+    vector<thread> threads;
+    for(Stage *stage: _stages) {
+        threads.push_back(thread(&Pipeline::runStage, this, stage));
+    }
+
+    {
+        unique_lock<mutex> lock(_mutex);
+        while(_finishedStages < _stages.size()) {
+            _stageFinished.wait_for(lock, chrono::milliseconds(interval));
+            if(progress) {
+                lock.unlock();
+                progress();
+                lock.lock();
+            }
+        }
+    }
+
+    for(thread &t: threads) {
+        t.join();
+    }
+
+    for(Stage *stage: _stages) {
+        LDEBUG << "Stage " << stage->name() << ": " << stage->bytesIn() << " bytes in, " << stage->bytesOut() << " bytes out";
+    }
+    return !_failed;
+}
+
+void Stream::Pipeline::runStage(Stage *stage) {
+    bool success = stage->process() && stage->checkOutputDigest();
+    if(success && stage->_output != NULL) {
+        stage->_output->close();
+    }
+
+    lock_guard<mutex> lock(_mutex);
+    if(!success) {
+        if(stage->error().empty()) {
+            stage->setError("Stage failed");
+        }
+        // Only the first failure is of interest, the following ones are caused by aborting the pipeline
+        if(!_failed) {
+            LERROR << "Stage " << stage->name() << " failed, aborting pipeline";
+            _failed = true;
+            _error = stage->name() + ": " + stage->error();
+            abort();
+        }
+    }
+    _finishedStages++;
+    _stageFinished.notify_all();
+}
+
+void Stream::Pipeline::abort() {
+    for(RingBuffer *buffer: _buffers) {
+        buffer->abort();
+    }
+}
+
+vector<Stream::StageStats> Stream::Pipeline::stats() {
+    vector<StageStats> stats;
+    for(Stage *stage: _stages) {
+        StageStats s;
+        s.name = stage->name();
+        s.bytesIn = stage->bytesIn();
+        s.bytesOut = stage->bytesOut();
+        stats.push_back(s);
+    }
+    return stats;
+}
+
+string Stream::Pipeline::error() {
+    lock_guard<mutex> lock(_mutex);
+    return _error;
+}
@@ -0,0 +1,173 @@
+//
+// Created by agent on 10/17/26 as part of NOOBS4IoT (https://github.com/steilerDev/NOOBS4IoT)
+//
+// Stream.h:
+//      This file contains the building blocks of a streaming pipeline: A bounded ring buffer, the stage base class and
+//      the pipeline connecting the stages. Each stage runs on its own thread and exchanges data with its neighbours
+//      through ring buffers, e.g. download -> decompress -> extract. A stage is able to verify the digest of its output
+//      on the fly (see Digest.h).
+//      For more information see https://github.com/steilerDev/NOOBS4IoT/wiki.
+//
+// This file is licensed under a GNU General Public License v3.0 (c) Frank Steiler.
+// See https://raw.githubusercontent.com/steilerDev/NOOBS4IoT/master/LICENSE for more information.
+//
+
+#ifndef STREAM_STREAM_H
+#define STREAM_STREAM_H
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Size of the ring buffer between two stages
+#define RING_BUFFER_SIZE (4 * 1024 * 1024)
+// Size of the chunks a stage reads from its input
+#define STREAM_CHUNK_SIZE (128 * 1024)
+
+using namespace std;
+
+namespace Stream {
+
+    class Digest;
+
+    /*
+     * Bounded, blocking single producer/single consumer byte buffer
+     */
+    class RingBuffer {
+    public:
+        RingBuffer(size_t capacity = RING_BUFFER_SIZE);
+        ~RingBuffer();
+
+        // Blocks until all bytes are written, returns false if the buffer was aborted
+        bool write(const char *data, size_t length);
+        // Blocks until at least one byte is available, returns 0 at the end of the stream and -1 if aborted
+        ssize_t read(char *data, size_t length);
+
+        // Signals the end of the stream (called by the producer)
+        void close();
+        // Wakes up producer and consumer, all further calls fail (called on error)
+        void abort();
+
+        bool isAborted();
+
+    private:
+        char *_buffer;
+        size_t _capacity,
+               _head,
+               _size;
+        bool _closed,
+             _aborted;
+
+        mutex _mutex;
+        condition_variable _notEmpty,
+                           _notFull;
+    };
+
+    /*
+     * A single step of the pipeline. Every stage runs process() on its own thread, reading from the output of the
+     * previous stage and writing to the input of the next stage.
+     */
+    class Stage {
+    public:
+        Stage(const string &name);
+        virtual ~Stage();
+
+        inline const string &name() const { return _name; }
+
+        /*
+         * Computes the digest (e.g. "sha256") of all data written by the stage while it is passed on. If it does not
+         * match the expected hex digest once the stage finished, the stage fails.
+         */
+        bool verifyOutput(const string &algorithm, const string &expected);
+
+        uint64_t bytesIn();
+        uint64_t bytesOut();
+        string error();
+
+    protected:
+        friend class Pipeline;
+        friend class Prefetch;
+
+        // Does the actual work of the stage, returns false on error
+        virtual bool process() = 0;
+
+        // Reads up to length bytes from the previous stage. Returns 0 at the end of the stream and -1 on error
+        ssize_t read(char *buffer, size_t length);
+        // Writes the bytes to the next stage, returns false on error
+        bool write(const char *buffer, size_t length);
+        // Reads and discards the remaining input, so the previous stage is able to finish
+        bool drain();
+
+        void setError(const string &error);
+        // Counts bytes that were consumed without being read through read() (e.g. by sinks writing on their own)
+        void countIn(uint64_t bytes);
+        void countOut(uint64_t bytes);
+
+        RingBuffer *_input,
+                   *_output;
+
+    private:
+        // Compares the digest of the output against the expected one, if there is one
+        bool checkOutputDigest();
+
+        string _name,
+               _error,
+               _expectedDigest;
+        uint64_t _bytesIn,
+                 _bytesOut;
+        mutex _statsMutex;
+        Digest *_outputDigest;
+    };
+
+    /*
+     * Byte counters of a stage at a given point in time
+     */
+    struct StageStats {
+        string name;
+        uint64_t bytesIn;
+        uint64_t bytesOut;
+    };
+
+    /*
+     * The pipeline owns its stages and connects them through ring buffers. The first stage is the source (it does not
+     * read) and the last stage is the sink (it does not write).
+     */
+    class Pipeline {
+    public:
+        Pipeline();
+        ~Pipeline();
+
+        // Appends a stage, the pipeline takes ownership
+        void add(Stage *stage);
+
+        // Runs all stages and blocks until they finished. If a progress callback is given, it is called every
+        // interval milliseconds while the stages are running. Returns true if all stages succeeded.
+        bool run(function<void()> progress = function<void()>(), unsigned int interval = 1000);
+
+        vector<StageStats> stats();
+        // Returns the error of the first failed stage
+        string error();
+
+        inline Stage *source() { return _stages.empty() ? NULL : _stages.front(); }
+        inline Stage *sink() { return _stages.empty() ? NULL : _stages.back(); }
+
+    private:
+        void runStage(Stage *stage);
+        void abort();
+
+        vector<Stage *> _stages;
+        vector<RingBuffer *> _buffers;
+
+        mutex _mutex;
+        condition_variable _stageFinished;
+        size_t _finishedStages;
+        bool _failed;
+        string _error;
+    };
+}
+
+#endif //STREAM_STREAM_H
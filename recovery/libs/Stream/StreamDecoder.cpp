@@ -0,0 +1,449 @@
+//
+// Created by agent on 10/17/26 as part of NOOBS4IoT (https://github.com/steilerDev/NOOBS4IoT)
+//
+// StreamDecoder.cpp:
+//      This file contains the decompression stages of a streaming pipeline. gzip, zip, xz and bzip2 are decoded
+//      in-process using zlib, liblzma (see XzDecoder.h) and libbz2, other formats are handed to an external decoder.
+//      For more information see https://github.com/steilerDev/NOOBS4IoT/wiki.
+//
+// This file is licensed under a GNU General Public License v3.0 (c) Frank Steiler.
+// See https://raw.githubusercontent.com/steilerDev/NOOBS4IoT/master/LICENSE for more information.
+//
+
+#include "StreamDecoder.h"
+#include "XzDecoder.h"
+#include "../easylogging++.h"
+
+#include <zlib.h>
+#include <bzlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <algorithm>
+#include <thread>
+
+#define ZIP_LOCAL_HEADER_SIGNATURE 0x04034b50
+#define ZIP_DESCRIPTOR_SIGNATURE 0x08074b50
+#define ZIP_LOCAL_HEADER_SIZE 30
+#define ZIP_FLAG_ENCRYPTED 0x0001
+#define ZIP_FLAG_DESCRIPTOR 0x0008
+#define ZIP_METHOD_STORED 0
+#define ZIP_METHOD_DEFLATED 8
+#define ZIP_EXTRA_ZIP64 0x0001
+
+static bool endsWith(const string &s, const string &suffix) {
+    return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+// Fields of zip headers are little endian
+static uint16_t zip16(const char *p) {
+    return (uint16_t) ((uint8_t) p[0] | (uint8_t) p[1] << 8);
+}
+
+static uint32_t zip32(const char *p) {
+    return zip16(p) | (uint32_t) zip16(p + 2) << 16;
+}
+
+Stream::Stage *Stream::createDecoder(const string &path) {
+    if(endsWith(path, ".gz")) {
+        return new GzipDecoder();
+    } else if(endsWith(path, ".xz")) {
+        return new XzDecoder();
+    } else if(endsWith(path, ".bz2")) {
+        return new Bzip2Decoder();
+    } else if(endsWith(path, ".lzo")) {
+        return new ProcessDecoder("lzop -dc", "lzo");
+    } else if(endsWith(path, ".zip")) {
+        /* Note: the image must be the only file inside the .zip */
+        return new ZipDecoder();
+    }
+    LERROR << "Unknown compression format file extension. Expecting .lzo, .gz, .xz, .bz2 or .zip";
+    return NULL;
+}
+
+bool Stream::isUncompressed(const string &path) {
+    return endsWith(path, ".img");
+}
+
+/*
+ * gzip
+ */
+
+bool Stream::GzipDecoder::process() {
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    // 15 + 32: Maximum window size and automatic detection of the gzip/zlib header
+    if(inflateInit2(&stream, 15 + 32) != Z_OK) {
+        setError("Unable to initialize zlib");
+        return false;
+    }
+
+    vector<char> in(STREAM_CHUNK_SIZE), out(STREAM_CHUNK_SIZE);
+    bool success = true,
+         streamEnd = false,
+         trailingData = false;
+    unsigned int members = 0;
+    ssize_t bytesRead;
+    while(success && (bytesRead = read(in.data(), in.size())) > 0) {
+        stream.next_in = (Bytef *) in.data();
+        stream.avail_in = bytesRead;
+        while(stream.avail_in > 0 && !trailingData) {
+            if(streamEnd) {
+                // Another gzip member is following the previous one
+                inflateReset(&stream);
+                streamEnd = false;
+            }
+            stream.next_out = (Bytef *) out.data();
+            stream.avail_out = out.size();
+            int ret = inflate(&stream, Z_NO_FLUSH);
+            if(ret == Z_DATA_ERROR && members > 0 && stream.total_out == 0) {
+                // Same as gzip, ignoring trailing garbage (e.g. zero padding) behind the last member
+                LWARNING << "Ignoring trailing data behind gzip stream";
+                trailingData = streamEnd = true;
+                break;
+            } else if(ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+                setError(string("Corrupt gzip stream: ") + (stream.msg ? stream.msg : "unknown error"));
+                success = false;
+                break;
+            }
+            if(!write(out.data(), out.size() - stream.avail_out)) {
+                success = false;
+                break;
+            }
+            streamEnd = ret == Z_STREAM_END;
+            if(streamEnd) {
+                members++;
+            }
+        }
+    }
+
+    if(success && bytesRead < 0) {
+        success = false;
+    }
+    // Flushing the remaining output, if the input ended while the output buffer was full
+    while(success && !streamEnd) {
+        stream.next_out = (Bytef *) out.data();
+        stream.avail_out = out.size();
+        int ret = inflate(&stream, Z_NO_FLUSH);
+        size_t produced = out.size() - stream.avail_out;
+        if(produced > 0 && !write(out.data(), produced)) {
+            success = false;
+        } else if(ret == Z_STREAM_END) {
+            streamEnd = true;
+        } else if(produced == 0) {
+            setError("Unexpected end of gzip stream");
+            success = false;
+        }
+    }
+    inflateEnd(&stream);
+    return success;
+}
+
+/*
+ * zip
+ */
+
+bool Stream::ZipDecoder::process() {
+    _buffer.resize(STREAM_CHUNK_SIZE);
+    _begin = _end = 0;
+    if(!fill(ZIP_LOCAL_HEADER_SIZE)) {
+        return false;
+    }
+    const char *header = _buffer.data() + _begin;
+    if(zip32(header) != ZIP_LOCAL_HEADER_SIGNATURE) {
+        setError("Not a zip archive");
+        return false;
+    }
+    uint16_t flags = zip16(header + 6),
+             method = zip16(header + 8);
+    uint32_t expectedCrc = zip32(header + 14);
+    uint64_t compressedSize = zip32(header + 18);
+    size_t nameLength = zip16(header + 26),
+           extraLength = zip16(header + 28);
+    if(flags & ZIP_FLAG_ENCRYPTED) {
+        setError("Encrypted zip archives are not supported");
+        return false;
+    } else if(method != ZIP_METHOD_STORED && method != ZIP_METHOD_DEFLATED) {
+        setError("Unsupported zip compression method " + to_string(method));
+        return false;
+    }
+
+    _begin += ZIP_LOCAL_HEADER_SIZE;
+    if(!fill(nameLength + extraLength)) {
+        return false;
+    }
+    string name(_buffer.data() + _begin, nameLength);
+    // Entries larger than 4 GiB keep their sizes in the ZIP64 extra field (uncompressed size first)
+    const char *extra = _buffer.data() + _begin + nameLength,
+               *extraEnd = extra + extraLength;
+    while(extraEnd - extra >= 4) {
+        uint16_t id = zip16(extra),
+                 size = zip16(extra + 2);
+        if(id == ZIP_EXTRA_ZIP64 && compressedSize == 0xffffffff && size >= 16) {
+            compressedSize = zip32(extra + 12) | (uint64_t) zip32(extra + 16) << 32;
+        }
+        extra += 4 + size;
+    }
+    _begin += nameLength + extraLength;
+
+    LINFO << "Extracting " << name << " from zip archive";
+    uint32_t crc = crc32(0, NULL, 0);
+    if(method == ZIP_METHOD_DEFLATED) {
+        if(!inflateEntry(crc)) {
+            return false;
+        }
+    } else if(flags & ZIP_FLAG_DESCRIPTOR) {
+        // The end of a stored entry is only known from its size, which is written behind the data in this case
+        setError("Stored zip entries without size are not supported");
+        return false;
+    } else if(!copyEntry(compressedSize, crc)) {
+        return false;
+    }
+
+    if(flags & ZIP_FLAG_DESCRIPTOR) {
+        // The data descriptor holds the CRC-32 and the sizes, its signature is optional
+        if(!fill(4)) {
+            return false;
+        } else if(zip32(_buffer.data() + _begin) == ZIP_DESCRIPTOR_SIGNATURE) {
+            _begin += 4;
+        }
+        if(!fill(4)) {
+            return false;
+        }
+        expectedCrc = zip32(_buffer.data() + _begin);
+        _begin += 4;
+    }
+    if(crc != expectedCrc) {
+        setError("CRC-32 mismatch of " + name + " inside zip archive");
+        return false;
+    }
+
+    // Same as funzip, the remaining entries and the central directory are skipped
+    if(_end - _begin >= 4 && zip32(_buffer.data() + _begin) == ZIP_LOCAL_HEADER_SIGNATURE) {
+        LWARNING << "Ignoring further entries of zip archive, only " << name << " is extracted";
+    }
+    return drain();
+}
+
+bool Stream::ZipDecoder::fill(size_t length) {
+    if(_end - _begin >= length) {
+        return true;
+    }
+    memmove(_buffer.data(), _buffer.data() + _begin, _end - _begin);
+    _end -= _begin;
+    _begin = 0;
+    if(_buffer.size() < length) {
+        _buffer.resize(length);
+    }
+    while(_end < length) {
+        ssize_t bytesRead = read(_buffer.data() + _end, _buffer.size() - _end);
+        if(bytesRead == 0) {
+            setError("Unexpected end of zip archive");
+        }
+        if(bytesRead <= 0) {
+            return false;
+        }
+        _end += bytesRead;
+    }
+    return true;
+}
+
+bool Stream::ZipDecoder::inflateEntry(uint32_t &crc) {
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    // Negative window size: Raw deflate data without zlib header
+    if(inflateInit2(&stream, -MAX_WBITS) != Z_OK) {
+        setError("Unable to initialize zlib");
+        return false;
+    }
+
+    vector<char> out(STREAM_CHUNK_SIZE);
+    bool success = true;
+    int ret = Z_OK;
+    while(success && ret != Z_STREAM_END) {
+        if(_begin == _end && !fill(1)) {
+            success = false;
+            break;
+        }
+        stream.next_in = (Bytef *) _buffer.data() + _begin;
+        stream.avail_in = _end - _begin;
+        stream.next_out = (Bytef *) out.data();
+        stream.avail_out = out.size();
+        ret = inflate(&stream, Z_NO_FLUSH);
+        if(ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+            setError(string("Corrupt zip entry: ") + (stream.msg ? stream.msg : "unknown error"));
+            success = false;
+            break;
+        }
+        _begin = _end - stream.avail_in;
+        size_t produced = out.size() - stream.avail_out;
+        crc = crc32(crc, (Bytef *) out.data(), produced);
+        if(produced > 0 && !write(out.data(), produced)) {
+            success = false;
+        }
+    }
+    inflateEnd(&stream);
+    return success;
+}
+
+bool Stream::ZipDecoder::copyEntry(uint64_t size, uint32_t &crc) {
+    while(size > 0) {
+        if(_begin == _end && !fill(1)) {
+            return false;
+        }
+        size_t length = (size_t) min<uint64_t>(size, _end - _begin);
+        crc = crc32(crc, (Bytef *) _buffer.data() + _begin, length);
+        if(!write(_buffer.data() + _begin, length)) {
+            return false;
+        }
+        _begin += length;
+        size -= length;
+    }
+    return true;
+}
+
+/*
+ * bzip2
+ */
+
+bool Stream::Bzip2Decoder::process() {
+    bz_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if(BZ2_bzDecompressInit(&stream, 0, 0) != BZ_OK) {
+        setError("Unable to initialize libbz2");
+        return false;
+    }
+
+    vector<char> in(STREAM_CHUNK_SIZE), out(STREAM_CHUNK_SIZE);
+    bool success = true,
+         streamEnd = false,
+         inputEnd = false;
+    while(success && !(streamEnd && inputEnd)) {
+        if(stream.avail_in == 0 && !inputEnd) {
+            ssize_t bytesRead = read(in.data(), in.size());
+            if(bytesRead < 0) {
+                success = false;
+                break;
+            }
+            inputEnd = bytesRead == 0;
+            stream.next_in = in.data();
+            stream.avail_in = bytesRead;
+        }
+        if(streamEnd) {
+            if(stream.avail_in == 0) {
+                continue;
+            }
+            // Another bzip2 stream is following the previous one
+            BZ2_bzDecompressEnd(&stream);
+            char *nextIn = stream.next_in;
+            unsigned int availIn = stream.avail_in;
+            memset(&stream, 0, sizeof(stream));
+            BZ2_bzDecompressInit(&stream, 0, 0);
+            stream.next_in = nextIn;
+            stream.avail_in = availIn;
+            streamEnd = false;
+        }
+
+        stream.next_out = out.data();
+        stream.avail_out = out.size();
+        int ret = BZ2_bzDecompress(&stream);
+        size_t produced = out.size() - stream.avail_out;
+        if(produced > 0 && !write(out.data(), produced)) {
+            success = false;
+        } else if(ret == BZ_STREAM_END) {
+            streamEnd = true;
+        } else if(ret != BZ_OK) {
+            setError("Corrupt bzip2 stream (libbz2 error " + to_string(ret) + ")");
+            success = false;
+        } else if(inputEnd && stream.avail_in == 0 && produced == 0) {
+            setError("Unexpected end of bzip2 stream");
+            success = false;
+        }
+    }
+    BZ2_bzDecompressEnd(&stream);
+    return success;
+}
+
+/*
+ * External decoder
+ */
+
+bool Stream::ProcessDecoder::process() {
+    int in[2], out[2];
+    if(pipe2(in, O_CLOEXEC) != 0 || pipe2(out, O_CLOEXEC) != 0) {
+        setError(string("Unable to create pipe: ") + strerror(errno));
+        return false;
+    }
+
+    LDEBUG << "Executing: " << _command;
+    pid_t pid = fork();
+    if(pid < 0) {
+        setError(string("Unable to fork: ") + strerror(errno));
+        close(in[0]);
+        close(in[1]);
+        close(out[0]);
+        close(out[1]);
+        return false;
+    } else if(pid == 0) {
+        dup2(in[0], STDIN_FILENO);
+        dup2(out[1], STDOUT_FILENO);
+        execl("/bin/sh", "sh", "-c", _command.c_str(), (char *) NULL);
+        _exit(127);
+    }
+    close(in[0]);
+    close(out[1]);
+
+    // The command's input is fed from a separate thread, since the command might block on its output
+    bool fed = false;
+    thread feeder([&]() {
+        fed = feed(in[1]);
+        close(in[1]);
+    });
+
+    vector<char> buffer(STREAM_CHUNK_SIZE);
+    bool success = true;
+    ssize_t bytesRead;
+    while((bytesRead = ::read(out[0], buffer.data(), buffer.size())) != 0) {
+        if(bytesRead < 0 && errno == EINTR) {
+            continue;
+        } else if(bytesRead < 0 || !write(buffer.data(), bytesRead)) {
+            success = false;
+            break;
+        }
+    }
+    // Closing the output makes the command fail on its next write, in case we stopped reading early
+    close(out[0]);
+    feeder.join();
+
+    int status;
+    while(waitpid(pid, &status, 0) < 0 && errno == EINTR);
+    if(success && (!fed || !WIFEXITED(status) || WEXITSTATUS(status) != 0)) {
+        setError("Command failed: " + _command);
+        success = false;
+    }
+    return success;
+}
+
+bool Stream::ProcessDecoder::feed(int fd) {
+    vector<char> buffer(STREAM_CHUNK_SIZE);
+    ssize_t bytesRead;
+    while((bytesRead = read(buffer.data(), buffer.size())) > 0) {
+        const char *data = buffer.data();
+        while(bytesRead > 0) {
+            ssize_t written = ::write(fd, data, bytesRead);
+            if(written < 0 && errno == EINTR) {
+                continue;
+            } else if(written < 0) {
+                // drain() might overwrite errno, EPIPE means the command exited before consuming all of its input
+                int error = errno;
+                drain();
+                return error == EPIPE;
+            }
+            data += written;
+            bytesRead -= written;
+        }
+    }
+    return bytesRead == 0;
+}
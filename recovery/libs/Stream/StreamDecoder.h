@@ -0,0 +1,86 @@
+//
+// Created by agent on 10/17/26 as part of NOOBS4IoT (https://github.com/steilerDev/NOOBS4IoT)
+//
+// StreamDecoder.h:
+//      This file contains the decompression stages of a streaming pipeline. gzip, zip, xz and bzip2 are decoded
+//      in-process using zlib, liblzma (see XzDecoder.h) and libbz2, other formats are handed to an external decoder.
+//      For more information see https://github.com/steilerDev/NOOBS4IoT/wiki.
+//
+// This file is licensed under a GNU General Public License v3.0 (c) Frank Steiler.
+// See https://raw.githubusercontent.com/steilerDev/NOOBS4IoT/master/LICENSE for more information.
+//
+
+#ifndef STREAM_STREAMDECODER_H
+#define STREAM_STREAMDECODER_H
+
+#include "Stream.h"
+
+namespace Stream {
+
+    /*
+     * Decodes gzip streams (including concatenated members)
+     */
+    class GzipDecoder: public Stage {
+    public:
+        GzipDecoder(): Stage("gzip") {}
+
+    protected:
+        bool process();
+    };
+
+    /*
+     * Extracts the first entry of a zip archive (same as funzip), further entries are ignored. Only stored and deflated
+     * entries are supported, since the archive is read as a stream and the central directory is never seen.
+     */
+    class ZipDecoder: public Stage {
+    public:
+        ZipDecoder(): Stage("zip"), _begin(0), _end(0) {}
+
+    protected:
+        bool process();
+
+    private:
+        // Makes sure at least length bytes of input are buffered, starting at _begin
+        bool fill(size_t length);
+        bool inflateEntry(uint32_t &crc);
+        bool copyEntry(uint64_t size, uint32_t &crc);
+
+        vector<char> _buffer;
+        size_t _begin,
+               _end;
+    };
+
+    /*
+     * Decodes bzip2 streams (including concatenated streams)
+     */
+    class Bzip2Decoder: public Stage {
+    public:
+        Bzip2Decoder(): Stage("bzip2") {}
+
+    protected:
+        bool process();
+    };
+
+    /*
+     * Pipes the data through an external command (executed through /bin/sh), reading from stdin and writing to stdout
+     */
+    class ProcessDecoder: public Stage {
+    public:
+        ProcessDecoder(const string &command, const string &name): Stage(name), _command(command) {}
+
+    protected:
+        bool process();
+
+    private:
+        bool feed(int fd);
+
+        string _command;
+    };
+
+    // Creates the decoder matching the file extension of the path, returns NULL if the format is unknown
+    Stage *createDecoder(const string &path);
+    // Returns true if the path denotes an uncompressed image (.img), which does not need a decoder
+    bool isUncompressed(const string &path);
+}
+
+#endif //STREAM_STREAMDECODER_H
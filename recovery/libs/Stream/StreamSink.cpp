@@ -0,0 +1,329 @@
+//
+// Created by agent on 10/17/26 as part of NOOBS4IoT (https://github.com/steilerDev/NOOBS4IoT)
+//
+// StreamSink.cpp:
+//      This file contains the sink stages of a streaming pipeline, writing the data to a block device (optionally only
+//      the ranges listed in a block map) or into the standard input of a command. The range checksums of a block map
+//      are verified using libcrypto (see Digest.h). The data written to a block device may be recorded, in order to
+//      read it back later on (see WriteRecord.h).
+//      For more information see https://github.com/steilerDev/NOOBS4IoT/wiki.
+//
+// This file is licensed under a GNU General Public License v3.0 (c) Frank Steiler.
+// See https://raw.githubusercontent.com/steilerDev/NOOBS4IoT/master/LICENSE for more information.
+//
+
+#include "StreamSink.h"
+#include "Digest.h"
+#include "../easylogging++.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/falloc.h>
+
+static bool writeAt(int fd, const char *data, size_t length, uint64_t offset) {
+    while(length > 0) {
+        ssize_t written = pwrite(fd, data, length, offset);
+        if(written < 0 && errno == EINTR) {
+            continue;
+        } else if(written <= 0) {
+            return false;
+        }
+        data += written;
+        length -= written;
+        offset += written;
+    }
+    return true;
+}
+
+bool Stream::isZero(const char *data, size_t length) {
+    // Or-ing 64 bytes per iteration in 16 byte vectors, which are mapped to NEON/SSE registers where available
+    typedef uint32_t Vector __attribute__((vector_size(16)));
+    const Vector *vectors = (const Vector *) data;
+    size_t count = length / (4 * sizeof(Vector));
+    for(size_t i = 0; i < count; i++, vectors += 4) {
+        Vector v = vectors[0] | vectors[1] | vectors[2] | vectors[3];
+        if(v[0] | v[1] | v[2] | v[3]) {
+            return false;
+        }
+    }
+    for(size_t i = count * 4 * sizeof(Vector); i < length; i++) {
+        if(data[i] != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool Stream::BlockDeviceSink::process() {
+    LDEBUG << "Writing to " << _device;
+    _fd = open(_device.c_str(), O_WRONLY | O_CLOEXEC);
+    if(_fd < 0) {
+        setError("Unable to open " + _device + ": " + strerror(errno));
+        return false;
+    }
+    if(_skipZeroes) {
+        _skipZeroes = prepareSparse();
+    }
+
+    // Collecting the input into large writes, which are a lot faster on SD cards. The buffer is page aligned, so the
+    // zero detection is able to use aligned vector loads.
+    char *buffer;
+    if(posix_memalign((void **) &buffer, SPARSE_BLOCK_SIZE, BLOCK_WRITE_SIZE) != 0) {
+        setError("Unable to allocate write buffer");
+        close(_fd);
+        return false;
+    }
+
+    size_t filled = 0;
+    bool success = true;
+    ssize_t bytesRead;
+    while((bytesRead = read(buffer + filled, BLOCK_WRITE_SIZE - filled)) > 0) {
+        filled += bytesRead;
+        if(filled == BLOCK_WRITE_SIZE) {
+            if(_record) {
+                _record->add(buffer, filled, _offset);
+            }
+            if(!writeBuffer(buffer, filled)) {
+                success = false;
+                break;
+            }
+            filled = 0;
+        }
+    }
+    if(bytesRead < 0) {
+        success = false;
+    }
+
+    if(success && filled > 0) {
+        if(_record) {
+            _record->add(buffer, filled, _offset);
+        }
+        success = writeBuffer(buffer, filled);
+    }
+    free(buffer);
+
+    // A regular file needs to be extended, if it ends with skipped blocks
+    struct stat st;
+    if(success && _skipZeroes && fstat(_fd, &st) == 0 && S_ISREG(st.st_mode) && ftruncate(_fd, _offset) != 0) {
+        setError("Unable to resize " + _device + ": " + strerror(errno));
+        success = false;
+    }
+    if(success && fsync(_fd) != 0) {
+        setError("Unable to sync " + _device + ": " + strerror(errno));
+        success = false;
+    }
+    close(_fd);
+    _fd = -1;
+
+    if(success && _skipZeroes) {
+        LINFO << "Skipped " << _bytesSkipped << " of " << _offset << " bytes, since they were zero";
+    }
+    return success;
+}
+
+bool Stream::BlockDeviceSink::prepareSparse() {
+    struct stat st;
+    if(fstat(_fd, &st) != 0) {
+        return false;
+    } else if(S_ISREG(st.st_mode)) {
+        // Holes of a regular file always read back as zero
+        return ftruncate(_fd, 0) == 0;
+    } else if(!S_ISBLK(st.st_mode)) {
+        return false;
+    }
+
+    uint64_t range[2] = {0, 0};
+    if(ioctl(_fd, BLKGETSIZE64, &range[1]) != 0) {
+        LWARNING << "Unable to get size of " << _device << ", writing all blocks: " << strerror(errno);
+        return false;
+    }
+
+    // Zeroing the device through fallocate() is supported for block devices since Linux 4.9
+    if(fallocate(_fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE, 0, range[1]) == 0) {
+        LINFO << "Zeroed " << range[1] << " bytes of " << _device << " (fallocate), skipping zero blocks";
+        return true;
+    }
+    LDEBUG << "Unable to zero " << _device << " using fallocate: " << strerror(errno);
+
+    unsigned int discardZeroes = 0;
+    if(ioctl(_fd, BLKDISCARDZEROES, &discardZeroes) != 0 || !discardZeroes) {
+        LWARNING << _device << " does not guarantee zeroes after discard, writing all blocks";
+        return false;
+    } else if(ioctl(_fd, BLKDISCARD, range) != 0) {
+        LWARNING << "Unable to discard " << _device << ", writing all blocks: " << strerror(errno);
+        return false;
+    }
+    LINFO << "Discarded " << range[1] << " bytes of " << _device << " (BLKDISCARDZEROES), skipping zero blocks";
+    return true;
+}
+
+bool Stream::BlockDeviceSink::writeBuffer(const char *data, size_t length) {
+    if(!_skipZeroes) {
+        if(!writeRegion(data, length, _offset)) {
+            return false;
+        }
+        _offset += length;
+        countOut(length);
+        return true;
+    }
+
+    // Writing consecutive non-zero blocks with a single write, skipping the zero blocks in between
+    size_t runStart = 0,
+           position = 0;
+    while(position < length) {
+        size_t blockLength = min((size_t) SPARSE_BLOCK_SIZE, length - position);
+        if(isZero(data + position, blockLength)) {
+            if(position > runStart && !writeRegion(data + runStart, position - runStart, _offset + runStart)) {
+                return false;
+            }
+            _bytesSkipped += blockLength;
+            runStart = position + blockLength;
+        }
+        position += blockLength;
+    }
+    if(length > runStart && !writeRegion(data + runStart, length - runStart, _offset + runStart)) {
+        return false;
+    }
+    _offset += length;
+    // Skipped blocks are counted as well, since they are part of the device's content
+    countOut(length);
+    return true;
+}
+
+bool Stream::BlockDeviceSink::writeRegion(const char *data, size_t length, uint64_t offset) {
+    if(!writeAt(_fd, data, length, offset)) {
+        setError("Unable to write to " + _device + ": " + strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+bool Stream::BmapSink::process() {
+    LDEBUG << "Writing " << _blockMap.ranges().size() << " mapped ranges to " << _device;
+    int fd = open(_device.c_str(), O_WRONLY | O_CLOEXEC);
+    if(fd < 0) {
+        setError("Unable to open " + _device + ": " + strerror(errno));
+        return false;
+    }
+    vector<char> buffer(BLOCK_WRITE_SIZE);
+    Digest digest(_blockMap.checksumType());
+    if(!digest.isValid()) {
+        setError("Unsupported checksum type " + _blockMap.checksumType());
+        close(fd);
+        return false;
+    }
+
+    bool success = true;
+    // Position of the input within the image, only relevant if the input is the complete image
+    uint64_t position = 0;
+    for(const ByteRange &range: _blockMap.ranges()) {
+        if(!_mappedOnly) {
+            if(!(success = skipInput(buffer.data(), range.offset - position))) {
+                break;
+            }
+            position = range.offset + range.length;
+        }
+
+        uint64_t written = 0;
+        while(success && written < range.length) {
+            ssize_t bytesRead = read(buffer.data(), (size_t) min<uint64_t>(buffer.size(), range.length - written));
+            if(bytesRead == 0) {
+                setError("Image ended before all mapped ranges were written");
+                success = false;
+            } else if(bytesRead < 0) {
+                success = false;
+            } else if(!writeAt(fd, buffer.data(), bytesRead, range.offset + written)) {
+                setError("Unable to write to " + _device + ": " + strerror(errno));
+                success = false;
+            } else {
+                if(_record) {
+                    _record->add(buffer.data(), bytesRead, range.offset + written);
+                }
+                digest.update(buffer.data(), bytesRead);
+                written += bytesRead;
+                countOut(bytesRead);
+            }
+        }
+        if(!success) {
+            break;
+        }
+
+        string checksum = digest.hexDigest();
+        if(!range.checksum.empty() && !digestEquals(checksum, range.checksum)) {
+            setError("Checksum mismatch of the range at byte " + to_string(range.offset) + ": expected " +
+                     range.checksum + ", got " + checksum);
+            success = false;
+            break;
+        }
+    }
+
+    // The rest of the image is not mapped
+    if(success && !_mappedOnly) {
+        success = skipInput(buffer.data(), UINT64_MAX);
+    }
+    if(success && fsync(fd) != 0) {
+        setError("Unable to sync " + _device + ": " + strerror(errno));
+        success = false;
+    }
+    close(fd);
+    return success;
+}
+
+bool Stream::BmapSink::skipInput(char *buffer, uint64_t length) {
+    while(length > 0) {
+        ssize_t bytesRead = read(buffer, (size_t) min<uint64_t>(BLOCK_WRITE_SIZE, length));
+        if(bytesRead < 0) {
+            return false;
+        } else if(bytesRead == 0) {
+            if(length == UINT64_MAX) {
+                return true;
+            }
+            setError("Image ended before all mapped ranges were written");
+            return false;
+        }
+        // Dropped bytes are counted as well, so the progress matches the image size
+        countOut(bytesRead);
+        if(length != UINT64_MAX) {
+            length -= bytesRead;
+        }
+    }
+    return true;
+}
+
+bool Stream::ProcessSink::process() {
+    LDEBUG << "Executing: " << _command;
+    FILE *pipe = popen(_command.c_str(), "w");
+    if(pipe == NULL) {
+        setError("Unable to execute " + _command + ": " + strerror(errno));
+        return false;
+    }
+
+    vector<char> buffer(STREAM_CHUNK_SIZE);
+    bool success = true;
+    ssize_t bytesRead;
+    while((bytesRead = read(buffer.data(), buffer.size())) > 0) {
+        if(fwrite(buffer.data(), 1, bytesRead, pipe) != (size_t) bytesRead) {
+            setError("Command stopped reading its input: " + _command);
+            success = false;
+            break;
+        }
+        countOut(bytesRead);
+    }
+    if(bytesRead < 0) {
+        success = false;
+    }
+
+    int status = pclose(pipe);
+    if(success && (!WIFEXITED(status) || WEXITSTATUS(status) != 0)) {
+        setError("Command failed: " + _command);
+        success = false;
+    }
+    return success;
+}
@@ -0,0 +1,112 @@
+//
+// Created by agent on 10/17/26 as part of NOOBS4IoT (https://github.com/steilerDev/NOOBS4IoT)
+//
+// StreamSink.h:
+//      This file contains the sink stages of a streaming pipeline, writing the data to a block device (optionally only
+//      the ranges listed in a block map) or into the standard input of a command. The range checksums of a block map
+//      are verified using libcrypto (see Digest.h). The data written to a block device may be recorded, in order to
+//      read it back later on (see WriteRecord.h).
+//      For more information see https://github.com/steilerDev/NOOBS4IoT/wiki.
+//
+// This file is licensed under a GNU General Public License v3.0 (c) Frank Steiler.
+// See https://raw.githubusercontent.com/steilerDev/NOOBS4IoT/master/LICENSE for more information.
+//
+
+#ifndef STREAM_STREAMSINK_H
+#define STREAM_STREAMSINK_H
+
+#include "Stream.h"
+#include "BlockMap.h"
+#include "WriteRecord.h"
+
+// Size of the writes issued to the block device
+#define BLOCK_WRITE_SIZE (4 * 1024 * 1024)
+// Granularity in which all-zero regions are detected and skipped
+#define SPARSE_BLOCK_SIZE 4096
+
+namespace Stream {
+
+    /*
+     * Writes the raw data to a block device (or file), syncing it once the stream ended. If skipZeroes is set, the
+     * whole device is discarded first and all-zero blocks of the data are skipped instead of written. This only happens
+     * if the device guarantees that discarded blocks read back as zero, otherwise every block is written.
+     */
+    class BlockDeviceSink: public Stage {
+    public:
+        BlockDeviceSink(const string &device, bool skipZeroes = false): Stage("write"),
+                                                                        _device(device),
+                                                                        _skipZeroes(skipZeroes),
+                                                                        _fd(-1),
+                                                                        _offset(0),
+                                                                        _bytesSkipped(0),
+                                                                        _record(NULL) {}
+
+        // Records the digests of the written data (including skipped zeroes) for a later readback
+        inline void recordWrites(WriteRecord *record) { _record = record; }
+
+    protected:
+        bool process();
+
+    private:
+        // Discards the device (or truncates a regular file), returns true if skipped regions will read back as zero
+        bool prepareSparse();
+        // Writes the data at the current offset, skipping all-zero blocks if enabled
+        bool writeBuffer(const char *data, size_t length);
+        bool writeRegion(const char *data, size_t length, uint64_t offset);
+
+        string _device;
+        bool _skipZeroes;
+        int _fd;
+        uint64_t _offset,
+                 _bytesSkipped;
+        WriteRecord *_record;
+    };
+
+    // Returns true if all bytes are zero (vectorized, data needs to be 16 byte aligned)
+    bool isZero(const char *data, size_t length);
+
+    /*
+     * Writes only the ranges listed in the block map to a block device (or file), verifying the checksum of every range
+     * while writing it. If mappedOnly is set, the input consists of the mapped ranges only (back to back), otherwise
+     * it is the complete image and everything outside of the ranges is dropped.
+     */
+    class BmapSink: public Stage {
+    public:
+        BmapSink(const string &device, const BlockMap &blockMap, bool mappedOnly): Stage("write"),
+                                                                                   _device(device),
+                                                                                   _blockMap(blockMap),
+                                                                                   _mappedOnly(mappedOnly),
+                                                                                   _record(NULL) {}
+
+        // Records the digests of the written ranges for a later readback
+        inline void recordWrites(WriteRecord *record) { _record = record; }
+
+    protected:
+        bool process();
+
+    private:
+        // Reads and drops the given number of bytes of the input (or everything, if length is UINT64_MAX)
+        bool skipInput(char *buffer, uint64_t length);
+
+        string _device;
+        BlockMap _blockMap;
+        bool _mappedOnly;
+        WriteRecord *_record;
+    };
+
+    /*
+     * Writes the data into the standard input of a command (executed through /bin/sh), fails if the command fails
+     */
+    class ProcessSink: public Stage {
+    public:
+        ProcessSink(const string &command, const string &name = "process"): Stage(name), _command(command) {}
+
+    protected:
+        bool process();
+
+    private:
+        string _command;
+    };
+}
+
+#endif //STREAM_STREAMSINK_H
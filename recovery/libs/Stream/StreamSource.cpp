@@ -0,0 +1,352 @@
+//
+// Created by agent on 10/17/26 as part of NOOBS4IoT (https://github.com/steilerDev/NOOBS4IoT)
+//
+// StreamSource.cpp:
+//      This file contains the source stages of a streaming pipeline, reading data from a local file or from a web server
+//      (resuming interrupted downloads or serving chunks from the local chunk cache). All sources are able to read only
+//      selected ranges of the resource (see BlockMap.h). The digests of cached chunks are verified using libcrypto.
+//      For more information see https://github.com/steilerDev/NOOBS4IoT/wiki.
+//
+// This file is licensed under a GNU General Public License v3.0 (c) Frank Steiler.
+// See https://raw.githubusercontent.com/steilerDev/NOOBS4IoT/master/LICENSE for more information.
+//
+
+#include "StreamSource.h"
+#include "Digest.h"
+#include "../easylogging++.h"
+#include "../Web/WebClient.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <memory>
+#include <thread>
+#include <chrono>
+
+bool Stream::FileSource::process() {
+    LDEBUG << "Reading " << _path;
+    int fd = open(_path.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0) {
+        setError("Unable to open " + _path + ": " + strerror(errno));
+        return false;
+    }
+
+    bool success = true;
+    if(_ranges.empty()) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        success = readRange(fd, 0, UINT64_MAX);
+    } else {
+        for(const ByteRange &range: _ranges) {
+            if(!(success = readRange(fd, range.offset, range.length))) {
+                break;
+            }
+        }
+    }
+    close(fd);
+    return success;
+}
+
+bool Stream::FileSource::readRange(int fd, uint64_t offset, uint64_t length) {
+    vector<char> buffer(STREAM_CHUNK_SIZE);
+    while(length > 0) {
+        ssize_t bytesRead = pread(fd, buffer.data(), (size_t) min<uint64_t>(buffer.size(), length), offset);
+        if(bytesRead < 0 && errno == EINTR) {
+            continue;
+        } else if(bytesRead < 0) {
+            setError("Unable to read " + _path + ": " + strerror(errno));
+            return false;
+        } else if(bytesRead == 0) {
+            // Reading the whole file ends here, a range must not exceed the file
+            if(length != UINT64_MAX) {
+                setError("Unexpected end of " + _path + " at byte " + to_string(offset));
+                return false;
+            }
+            break;
+        } else if(!write(buffer.data(), bytesRead)) {
+            return false;
+        }
+        offset += bytesRead;
+        if(length != UINT64_MAX) {
+            length -= bytesRead;
+        }
+    }
+    return true;
+}
+
+bool Stream::HttpSource::process() {
+    // The spans [first, second) to request, covering all ranges
+    vector<pair<uint64_t, uint64_t> > spans;
+    if(_ranges.empty()) {
+        spans.push_back(make_pair(0, UINT64_MAX));
+    } else {
+        for(const ByteRange &range: _ranges) {
+            if(!spans.empty() && range.offset - spans.back().second <= HTTP_RANGE_GAP) {
+                spans.back().second = range.offset + range.length;
+            } else {
+                spans.push_back(make_pair(range.offset, range.offset + range.length));
+            }
+        }
+        LDEBUG << "Requesting " << _ranges.size() << " ranges of " << _url << " in " << spans.size() << " requests";
+    }
+
+    int64_t totalSize = -1;
+    // ETag or Last-Modified of the resource, making sure a resumed download continues the same file
+    string validator;
+    for(const pair<uint64_t, uint64_t> &span: spans) {
+        uint64_t offset = span.first;
+        unsigned int delay = 1;
+        while(true) {
+            uint64_t previousOffset = offset;
+            Result result = request(&offset, span.second, &totalSize, &validator);
+            if(result == RESULT_COMPLETE) {
+                break;
+            } else if(result == RESULT_FAILED || _output->isAborted()) {
+                return false;
+            }
+
+            // Starting over with a short delay, if the last attempt made progress
+            if(offset > previousOffset) {
+                delay = 1;
+            }
+            LWARNING << "Download of " << _url << " interrupted at byte " << offset << ", retrying in " << delay << "s";
+            for(unsigned int i = 0; i < delay && !_output->isAborted(); i++) {
+                this_thread::sleep_for(chrono::seconds(1));
+            }
+            delay = min(delay * 2, (unsigned int) HTTP_MAX_RETRY_DELAY);
+        }
+    }
+    return true;
+}
+
+Stream::HttpSource::Result Stream::HttpSource::request(uint64_t *offset, uint64_t end, int64_t *totalSize, string *validator) {
+    map<string, string> header;
+    if(*offset > 0 || end != UINT64_MAX) {
+        header["Range"] = "bytes=" + to_string(*offset) + "-" + (end != UINT64_MAX ? to_string(end - 1) : string());
+        if(!validator->empty()) {
+            header["If-Range"] = *validator;
+        }
+    }
+
+    Web::WebClient webClient;
+    unique_ptr<Web::Client::Response> response(webClient.open(_url, header));
+    if(!response) {
+        return RESULT_RETRY;
+    }
+
+    string responseValidator = response->getHeader("ETag");
+    if(responseValidator.empty() || responseValidator.compare(0, 2, "W/") == 0) {
+        responseValidator = response->getHeader("Last-Modified");
+    }
+
+    // Number of bytes at the start of the body, that are not requested (or have already been written)
+    uint64_t skip = 0;
+    if(response->code == 206) {
+        // Content-Range: bytes <first>-<last>/<total>
+        string range = response->getHeader("Content-Range");
+        size_t start = range.find_first_of("0123456789");
+        if(start == string::npos || strtoull(range.c_str() + start, NULL, 10) != *offset) {
+            setError("Server returned an unexpected range: " + range);
+            return RESULT_FAILED;
+        }
+        size_t total = range.find('/');
+        if(*totalSize < 0 && total != string::npos && range.compare(total + 1, 1, "*") != 0) {
+            *totalSize = strtoll(range.c_str() + total + 1, NULL, 10);
+        }
+        if(validator->empty()) {
+            *validator = responseValidator;
+        }
+    } else if(response->code == 200) {
+        if(*offset > 0) {
+            if(!validator->empty() && *validator != responseValidator) {
+                setError("Resource changed on the server while downloading");
+                return RESULT_FAILED;
+            }
+            LWARNING << "Server does not support range requests, skipping " << *offset << " bytes";
+            skip = *offset;
+        }
+        string contentLength = response->getHeader("Content-Length");
+        if(!contentLength.empty()) {
+            *totalSize = strtoll(contentLength.c_str(), NULL, 10);
+        }
+        *validator = responseValidator;
+    } else if(response->code == 416 && *totalSize >= 0 && *offset == (uint64_t) *totalSize) {
+        return RESULT_COMPLETE;
+    } else if(response->code >= 500) {
+        LWARNING << "Server error " << response->code << " " << response->phrase;
+        return RESULT_RETRY;
+    } else {
+        setError("Unable to download " + _url + ": " + to_string(response->code) + " " + response->phrase);
+        return RESULT_FAILED;
+    }
+
+    string data;
+    ssize_t bytesRead;
+    while((bytesRead = response->readBody(&data)) > 0) {
+        if(skip > 0) {
+            size_t skipped = (size_t) min<uint64_t>(skip, data.size());
+            data.erase(0, skipped);
+            skip -= skipped;
+        }
+        if(data.size() > end - *offset) {
+            data.resize(end - *offset);
+        }
+        if(!data.empty()) {
+            if(!emit(data.data(), data.size(), *offset)) {
+                return RESULT_FAILED;
+            }
+            *offset += data.size();
+            data.clear();
+        }
+        if(*offset == end) {
+            // Dropping the rest of the body (if the server ignored the range), closing the connection
+            return RESULT_COMPLETE;
+        }
+    }
+
+    if(bytesRead < 0) {
+        return RESULT_RETRY;
+    } else if(end != UINT64_MAX || (*totalSize >= 0 && *offset < (uint64_t) *totalSize)) {
+        // The server closed the connection early, without telling the length of the body
+        return RESULT_RETRY;
+    }
+    LDEBUG << "Downloaded " << *offset << " bytes from " << _url;
+    return RESULT_COMPLETE;
+}
+
+bool Stream::HttpSource::emit(const char *data, size_t length, uint64_t position) {
+    if(_ranges.empty()) {
+        return write(data, length);
+    }
+
+    while(length > 0 && _rangeIndex < _ranges.size()) {
+        const ByteRange &range = _ranges[_rangeIndex];
+        if(position < range.offset) {
+            // Dropping the gap in front of the next range
+            size_t gap = (size_t) min<uint64_t>(length, range.offset - position);
+            data += gap;
+            length -= gap;
+            position += gap;
+            continue;
+        }
+
+        uint64_t rangeEnd = range.offset + range.length;
+        size_t chunk = (size_t) min<uint64_t>(length, rangeEnd - position);
+        if(!write(data, chunk)) {
+            return false;
+        }
+        data += chunk;
+        length -= chunk;
+        position += chunk;
+        if(position == rangeEnd) {
+            _rangeIndex++;
+        }
+    }
+    return true;
+}
+
+bool Stream::CachedSource::process() {
+    // Collecting the chunks covering the requested ranges
+    vector<size_t> chunks;
+    for(size_t chunk = 0; chunk < _index->chunkCount(); chunk++) {
+        uint64_t start = _index->chunkOffset(chunk),
+                 end = start + _index->chunkLength(chunk);
+        bool needed = _ranges.empty();
+        for(size_t i = 0; i < _ranges.size() && !needed; i++) {
+            needed = _ranges[i].offset < end && _ranges[i].offset + _ranges[i].length > start;
+        }
+        if(needed) {
+            chunks.push_back(chunk);
+        }
+    }
+
+    size_t cached = 0;
+    vector<char> buffer;
+    for(size_t i = 0; i < chunks.size(); i++) {
+        size_t chunk = chunks[i];
+        const string &digest = _index->chunkDigest(chunk);
+        if(_store->load(digest, &buffer) && verify(chunk, buffer.data(), buffer.size())) {
+            if(!emit(buffer.data(), buffer.size(), _index->chunkOffset(chunk))) {
+                return false;
+            }
+            cached++;
+            continue;
+        }
+
+        // Downloading the following missing chunks with the same request
+        size_t last = i;
+        while(last + 1 < chunks.size() && last + 1 - i < CHUNK_FETCH_COUNT && chunks[last + 1] == chunks[last] + 1 &&
+              !_store->contains(_index->chunkDigest(chunks[last + 1]))) {
+            last++;
+        }
+        if(!fetch(chunk, chunks[last])) {
+            return false;
+        }
+        i = last;
+    }
+    LINFO << "Served " << cached << " of " << chunks.size() << " chunks of " << _url << " from the cache";
+    return true;
+}
+
+bool Stream::CachedSource::fetch(size_t first, size_t last) {
+    vector<char> buffer;
+    for(unsigned int attempt = 1; first <= last; attempt++) {
+        if(attempt > CHUNK_FETCH_ATTEMPTS) {
+            setError("Unable to download chunk " + to_string(first) + " of " + _url);
+            return false;
+        } else if(_output->isAborted()) {
+            return false;
+        } else if(attempt > 1) {
+            LWARNING << "Download of chunk " << first << " of " << _url << " failed, retrying in " << attempt - 1 << "s";
+            this_thread::sleep_for(chrono::seconds(attempt - 1));
+        }
+
+        uint64_t start = _index->chunkOffset(first),
+                 end = _index->chunkOffset(last) + _index->chunkLength(last);
+        map<string, string> header;
+        header["Range"] = "bytes=" + to_string(start) + "-" + to_string(end - 1);
+        Web::WebClient webClient;
+        unique_ptr<Web::Client::Response> response(webClient.open(_url, header));
+        if(!response) {
+            continue;
+        }
+        // A server ignoring the range sends the whole resource, which is fine for the first chunk
+        if(!(response->code == 206 || (response->code == 200 && start == 0))) {
+            LWARNING << "Unable to download chunks of " << _url << ": " << response->code << " " << response->phrase;
+            continue;
+        }
+
+        string data;
+        ssize_t bytesRead = 1;
+        while(first <= last && bytesRead > 0) {
+            size_t length = (size_t) _index->chunkLength(first);
+            while(data.size() < length && (bytesRead = response->readBody(&data)) > 0);
+            if(data.size() < length) {
+                break;
+            }
+
+            if(!verify(first, data.data(), length)) {
+                setError("Chunk " + to_string(first) + " of " + _url + " does not match its digest");
+                return false;
+            }
+            _store->store(_index->chunkDigest(first), data.data(), length);
+            if(!emit(data.data(), length, _index->chunkOffset(first))) {
+                return false;
+            }
+            data.erase(0, length);
+            first++;
+            // Progress was made, so the next attempt starts from scratch
+            attempt = 0;
+        }
+    }
+    return true;
+}
+
+bool Stream::CachedSource::verify(size_t chunk, const char *data, size_t length) {
+    if(length != _index->chunkLength(chunk)) {
+        return false;
+    }
+    Digest digest(_index->checksumType());
+    digest.update(data, length);
+    return digestEquals(digest.hexDigest(), _index->chunkDigest(chunk));
+}
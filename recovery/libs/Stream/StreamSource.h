@@ -0,0 +1,111 @@
+//
+// Created by agent on 10/17/26 as part of NOOBS4IoT (https://github.com/steilerDev/NOOBS4IoT)
+//
+// StreamSource.h:
+//      This file contains the source stages of a streaming pipeline, reading data from a local file or from a web server
+//      (resuming interrupted downloads or serving chunks from the local chunk cache). All sources are able to read only
+//      selected ranges of the resource (see BlockMap.h). The digests of cached chunks are verified using libcrypto.
+//      For more information see https://github.com/steilerDev/NOOBS4IoT/wiki.
+//
+// This file is licensed under a GNU General Public License v3.0 (c) Frank Steiler.
+// See https://raw.githubusercontent.com/steilerDev/NOOBS4IoT/master/LICENSE for more information.
+//
+
+#ifndef STREAM_STREAMSOURCE_H
+#define STREAM_STREAMSOURCE_H
+
+#include "Stream.h"
+#include "BlockMap.h"
+#include "ChunkIndex.h"
+#include "ChunkStore.h"
+
+// Maximum delay (in seconds) between two attempts of resuming a download
+#define HTTP_MAX_RETRY_DELAY 30
+// Ranges closer than this are requested together, downloading the gap instead of issuing another request
+#define HTTP_RANGE_GAP (1024 * 1024)
+// Maximum number of missing chunks requested at once, and number of attempts to download them
+#define CHUNK_FETCH_COUNT 16
+#define CHUNK_FETCH_ATTEMPTS 5
+
+namespace Stream {
+
+    /*
+     * Reads a local file. If ranges are given, only those ranges are read and passed on (back to back).
+     */
+    class FileSource: public Stage {
+    public:
+        FileSource(const string &path, const vector<ByteRange> &ranges = vector<ByteRange>()): Stage("read"),
+                                                                                               _path(path),
+                                                                                               _ranges(ranges) {}
+
+    protected:
+        bool process();
+
+    private:
+        bool readRange(int fd, uint64_t offset, uint64_t length);
+
+        string _path;
+        vector<ByteRange> _ranges;
+    };
+
+    /*
+     * Downloads a resource using the WebClient. If the connection drops, the download is resumed at the last received
+     * byte using a Range request, retrying (with increasing delay) until the resource is complete or the server reports
+     * a permanent error. If ranges are given, only those ranges are requested and passed on (back to back).
+     */
+    class HttpSource: public Stage {
+    public:
+        HttpSource(const string &url, const vector<ByteRange> &ranges = vector<ByteRange>()): Stage("download"),
+                                                                                              _url(url),
+                                                                                              _ranges(ranges),
+                                                                                              _rangeIndex(0) {}
+
+    protected:
+        bool process();
+
+        // Passes the data received at the position on, dropping everything outside of the requested ranges
+        bool emit(const char *data, size_t length, uint64_t position);
+
+        string _url;
+        vector<ByteRange> _ranges;
+        size_t _rangeIndex;
+
+    private:
+        enum Result {
+            RESULT_COMPLETE,
+            RESULT_RETRY,
+            RESULT_FAILED
+        };
+
+        // Performs a single request, starting at the current offset and ending before end
+        Result request(uint64_t *offset, uint64_t end, int64_t *totalSize, string *validator);
+    };
+
+    /*
+     * Reads a resource chunk by chunk, as listed in its chunk index. Chunks available in the chunk store are read from
+     * there, all others are downloaded (consecutive chunks with a single range request) and added to the store. Every
+     * chunk is verified against its digest, no matter where it came from.
+     */
+    class CachedSource: public HttpSource {
+    public:
+        CachedSource(const string &url,
+                     const ChunkIndex *index,
+                     ChunkStore *store,
+                     const vector<ByteRange> &ranges = vector<ByteRange>()): HttpSource(url, ranges),
+                                                                             _index(index),
+                                                                             _store(store) {}
+
+    protected:
+        bool process();
+
+    private:
+        // Downloads the chunks first to last, passes them on and stores them
+        bool fetch(size_t first, size_t last);
+        bool verify(size_t chunk, const char *data, size_t length);
+
+        const ChunkIndex *_index;
+        ChunkStore *_store;
+    };
+}
+
+#endif //STREAM_STREAMSOURCE_H
@@ -0,0 +1,184 @@
+//
+// Created by agent on 10/17/26 as part of NOOBS4IoT (https://github.com/steilerDev/NOOBS4IoT)
+//
+// TarExtractor.cpp:
+//      This file contains a sink stage of a streaming pipeline, extracting a tar archive into a directory. ustar, GNU
+//      (long names) and pax (extended headers) archives are supported. No external, non-standard library is required for
+//      this file.
+//      For more information see https://github.com/steilerDev/NOOBS4IoT/wiki.
+//
+// This file is licensed under a GNU General Public License v3.0 (c) Frank Steiler.
+// See https://raw.githubusercontent.com/steilerDev/NOOBS4IoT/master/LICENSE for more information.
+//
+
+#include "TarExtractor.h"
+#include "../easylogging++.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+bool Stream::TarExtractor::begin() {
+    LDEBUG << "Extracting archive to " << _directory;
+    return true;
+}
+
+bool Stream::TarExtractor::finish() {
+    for(auto it = _directoryTimes.rbegin(); it != _directoryTimes.rend(); ++it) {
+        struct timeval times[2] = {{it->second, 0}, {it->second, 0}};
+        utimes(it->first.c_str(), times);
+    }
+    return true;
+}
+
+string Stream::TarExtractor::targetPath(const string &path) {
+    vector<string> components;
+    if(!splitPath(path, &components)) {
+        return string();
+    }
+    string result = _directory;
+    for(size_t i = 0; i < components.size(); i++) {
+        result += "/" + components[i];
+    }
+    return result;
+}
+
+bool Stream::TarExtractor::extract(const Entry &entry) {
+    string path = targetPath(entry.path);
+    if(path.empty()) {
+        LWARNING << "Skipping unsafe path " << entry.path;
+        return skipData(entry.size);
+    }
+    if(path != _directory && !createParents(path)) {
+        setError("Unable to create parent directories of " + path + ": " + strerror(errno));
+        return false;
+    }
+
+    // Replacing existing files, like tar does
+    struct stat st;
+    if(entry.type != '5' && lstat(path.c_str(), &st) == 0) {
+        if(S_ISDIR(st.st_mode)) {
+            rmdir(path.c_str());
+        } else {
+            unlink(path.c_str());
+        }
+    }
+
+    switch(entry.type) {
+        case '0':
+        case '7':
+            return extractFile(entry, path);
+        case '1': {
+            string target = targetPath(entry.linkPath);
+            if(target.empty() || link(target.c_str(), path.c_str()) != 0) {
+                setError("Unable to create hard link " + path + ": " + strerror(errno));
+                return false;
+            }
+            return skipData(entry.size);
+        }
+        case '2':
+            if(symlink(entry.linkPath.c_str(), path.c_str()) != 0) {
+                setError("Unable to create symbolic link " + path + ": " + strerror(errno));
+                return false;
+            }
+            break;
+        case '3':
+        case '4':
+        case '6': {
+            mode_t type = entry.type == '3' ? S_IFCHR : (entry.type == '4' ? S_IFBLK : S_IFIFO);
+            if(mknod(path.c_str(), type | entry.mode, entry.device) != 0) {
+                setError("Unable to create special file " + path + ": " + strerror(errno));
+                return false;
+            }
+            break;
+        }
+        case '5':
+            if(mkdir(path.c_str(), 0700) != 0 && errno != EEXIST) {
+                setError("Unable to create directory " + path + ": " + strerror(errno));
+                return false;
+            }
+            _directoryTimes.push_back(make_pair(path, entry.mtime));
+            break;
+        default:
+            LWARNING << "Skipping " << entry.path << " with unsupported type " << entry.type;
+            return skipData(entry.size);
+    }
+
+    return applyMetadata(entry, path) && skipData(entry.size);
+}
+
+bool Stream::TarExtractor::extractFile(const Entry &entry, const string &path) {
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if(fd < 0) {
+        setError("Unable to create " + path + ": " + strerror(errno));
+        return false;
+    }
+
+    char buffer[STREAM_CHUNK_SIZE / 4];
+    uint64_t remaining = entry.size;
+    while(remaining > 0) {
+        ssize_t bytesRead = read(buffer, min<uint64_t>(remaining, sizeof(buffer)));
+        if(bytesRead <= 0) {
+            setError("Unexpected end of archive");
+            close(fd);
+            return false;
+        }
+        const char *data = buffer;
+        size_t length = bytesRead;
+        while(length > 0) {
+            ssize_t written = ::write(fd, data, length);
+            if(written < 0 && errno == EINTR) {
+                continue;
+            } else if(written < 0) {
+                setError("Unable to write " + path + ": " + strerror(errno));
+                close(fd);
+                return false;
+            }
+            data += written;
+            length -= written;
+        }
+        countOut(bytesRead);
+        remaining -= bytesRead;
+    }
+    close(fd);
+
+    // Skipping the padding up to the next block
+    return applyMetadata(entry, path) && skipBytes((TAR_BLOCK_SIZE - entry.size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE);
+}
+
+bool Stream::TarExtractor::applyMetadata(const Entry &entry, const string &path) {
+    if(lchown(path.c_str(), entry.uid, entry.gid) != 0) {
+        LWARNING << "Unable to change owner of " << path << ": " << strerror(errno);
+    }
+    if(entry.type == '2') {
+        struct timeval times[2] = {{entry.mtime, 0}, {entry.mtime, 0}};
+        lutimes(path.c_str(), times);
+        return true;
+    }
+    // Changing the mode after the owner, since chown clears the setuid/setgid bits
+    if(chmod(path.c_str(), entry.mode) != 0) {
+        setError("Unable to change mode of " + path + ": " + strerror(errno));
+        return false;
+    }
+    if(entry.type != '5') {
+        struct timeval times[2] = {{entry.mtime, 0}, {entry.mtime, 0}};
+        utimes(path.c_str(), times);
+    }
+    return true;
+}
+
+bool Stream::TarExtractor::createParents(const string &path) {
+    size_t slash = path.find('/', _directory.size() + 1);
+    while(slash != string::npos) {
+        string parent = path.substr(0, slash);
+        if(mkdir(parent.c_str(), 0755) != 0 && errno != EEXIST) {
+            return false;
+        }
+        slash = path.find('/', slash + 1);
+    }
+    return true;
+}
@@ -0,0 +1,45 @@
+//
+// Created by agent on 10/17/26 as part of NOOBS4IoT (https://github.com/steilerDev/NOOBS4IoT)
+//
+// TarExtractor.h:
+//      This file contains a sink stage of a streaming pipeline, extracting a tar archive into a directory. ustar, GNU
+//      (long names) and pax (extended headers) archives are supported. No external, non-standard library is required for
+//      this file.
+//      For more information see https://github.com/steilerDev/NOOBS4IoT/wiki.
+//
+// This file is licensed under a GNU General Public License v3.0 (c) Frank Steiler.
+// See https://raw.githubusercontent.com/steilerDev/NOOBS4IoT/master/LICENSE for more information.
+//
+
+#ifndef STREAM_TAREXTRACTOR_H
+#define STREAM_TAREXTRACTOR_H
+
+#include "TarReader.h"
+
+namespace Stream {
+
+    class TarExtractor: public TarReader {
+    public:
+        TarExtractor(const string &directory): TarReader("untar"), _directory(directory) {}
+
+    protected:
+        bool begin();
+        bool finish();
+        bool extract(const Entry &entry);
+
+    private:
+        // Returns the path of the entry below the target directory, or an empty string if the path is not acceptable
+        string targetPath(const string &path);
+
+        bool extractFile(const Entry &entry, const string &path);
+        bool applyMetadata(const Entry &entry, const string &path);
+        bool createParents(const string &path);
+
+        string _directory;
+
+        // Directory times are applied at the very end, since extracting their content changes them
+        vector<pair<string, time_t> > _directoryTimes;
+    };
+}
+
+#endif //STREAM_TAREXTRACTOR_H
@@ -0,0 +1,250 @@
+//
+// Created by agent on 10/17/26 as part of NOOBS4IoT (https://github.com/steilerDev/NOOBS4IoT)
+//
+// TarReader.cpp:
+//      This file contains the base of all sink stages consuming a tar archive. ustar, GNU (long names) and pax (extended
+//      headers) archives are supported. No external, non-standard library is required for this file.
+//      For more information see https://github.com/steilerDev/NOOBS4IoT/wiki.
+//
+// This file is licensed under a GNU General Public License v3.0 (c) Frank Steiler.
+// See https://raw.githubusercontent.com/steilerDev/NOOBS4IoT/master/LICENSE for more information.
+//
+
+#include "TarReader.h"
+#include "../easylogging++.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sysmacros.h>
+
+/*
+ * Parses a numeric header field, which is either octal or (for large values) base-256 encoded
+ */
+static uint64_t parseNumber(const char *field, size_t length) {
+    uint64_t value = 0;
+    if((unsigned char) field[0] & 0x80) {
+        value = (unsigned char) field[0] & 0x7f;
+        for(size_t i = 1; i < length; i++) {
+            value = (value << 8) | (unsigned char) field[i];
+        }
+        return value;
+    }
+    for(size_t i = 0; i < length && field[i] != '\0'; i++) {
+        if(field[i] >= '0' && field[i] <= '7') {
+            value = (value << 3) | (field[i] - '0');
+        } else if(field[i] != ' ') {
+            break;
+        }
+    }
+    return value;
+}
+
+static string parseString(const char *field, size_t length) {
+    return string(field, strnlen(field, length));
+}
+
+bool Stream::TarReader::process() {
+    if(!begin()) {
+        return false;
+    }
+
+    char header[TAR_BLOCK_SIZE];
+    Entry entry;
+    string longPath,
+           longLinkPath,
+           pax;
+    bool success = true;
+
+    while(success) {
+        if(!readFully(header, TAR_BLOCK_SIZE)) {
+            setError("Unexpected end of archive");
+            return false;
+        }
+
+        // The archive ends with (at least) two zero blocks
+        bool zeroBlock = true;
+        for(char c: header) {
+            if(c != '\0') {
+                zeroBlock = false;
+                break;
+            }
+        }
+        if(zeroBlock) {
+            break;
+        }
+
+        if(!parseHeader(header, &entry)) {
+            return false;
+        }
+
+        switch(entry.type) {
+            case 'L':
+                // GNU long name of the following entry
+                success = readData(entry.size, &longPath);
+                longPath = longPath.c_str();
+                continue;
+            case 'K':
+                // GNU long link name of the following entry
+                success = readData(entry.size, &longLinkPath);
+                longLinkPath = longLinkPath.c_str();
+                continue;
+            case 'x':
+                // pax extended header of the following entry
+                success = readData(entry.size, &pax);
+                continue;
+            case 'g':
+                // pax global header, nothing of interest for extraction
+                success = skipData(entry.size);
+                continue;
+            default:
+                break;
+        }
+
+        if(!longPath.empty()) {
+            entry.path = longPath;
+            longPath.clear();
+        }
+        if(!longLinkPath.empty()) {
+            entry.linkPath = longLinkPath;
+            longLinkPath.clear();
+        }
+        if(!pax.empty()) {
+            parsePax(pax, &entry);
+            pax.clear();
+        }
+
+        success = extract(entry);
+    }
+
+    if(!success || !finish()) {
+        return false;
+    }
+
+    // Consuming the padding behind the archive, so the previous stage is able to finish
+    return drain();
+}
+
+bool Stream::TarReader::readFully(char *buffer, size_t length) {
+    while(length > 0) {
+        ssize_t bytesRead = read(buffer, length);
+        if(bytesRead <= 0) {
+            return false;
+        }
+        buffer += bytesRead;
+        length -= bytesRead;
+    }
+    return true;
+}
+
+bool Stream::TarReader::readData(uint64_t size, string *data) {
+    // Extended headers are small, refusing anything unreasonable
+    if(size > 1024 * 1024) {
+        setError("Extended header too large");
+        return false;
+    }
+    uint64_t padded = (size + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE * TAR_BLOCK_SIZE;
+    data->resize(padded);
+    if(!readFully(&(*data)[0], padded)) {
+        setError("Unexpected end of archive");
+        return false;
+    }
+    data->resize(size);
+    return true;
+}
+
+bool Stream::TarReader::skipData(uint64_t size) {
+    return skipBytes((size + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE * TAR_BLOCK_SIZE);
+}
+
+bool Stream::TarReader::skipBytes(uint64_t remaining) {
+    char buffer[TAR_BLOCK_SIZE * 16];
+    while(remaining > 0) {
+        size_t chunk = min<uint64_t>(remaining, sizeof(buffer));
+        if(!readFully(buffer, chunk)) {
+            setError("Unexpected end of archive");
+            return false;
+        }
+        remaining -= chunk;
+    }
+    return true;
+}
+
+bool Stream::TarReader::parseHeader(const char *header, Entry *entry) {
+    // The checksum is calculated over the header, with the checksum field itself filled with spaces
+    uint64_t checksum = 0;
+    for(int i = 0; i < TAR_BLOCK_SIZE; i++) {
+        checksum += (i >= 148 && i < 156) ? ' ' : (unsigned char) header[i];
+    }
+    if(checksum != parseNumber(header + 148, 8)) {
+        setError("Invalid tar header checksum");
+        return false;
+    }
+
+    entry->type = header[156] == '\0' ? '0' : header[156];
+    entry->path = parseString(header, 100);
+    entry->linkPath = parseString(header + 157, 100);
+    entry->mode = parseNumber(header + 100, 8) & 07777;
+    entry->uid = parseNumber(header + 108, 8);
+    entry->gid = parseNumber(header + 116, 8);
+    entry->size = parseNumber(header + 124, 12);
+    entry->mtime = parseNumber(header + 136, 12);
+    entry->device = makedev(parseNumber(header + 329, 8), parseNumber(header + 337, 8));
+
+    // ustar archives split long paths into prefix and name
+    if(memcmp(header + 257, "ustar", 5) == 0 && header[345] != '\0') {
+        entry->path = parseString(header + 345, 155) + "/" + entry->path;
+    }
+    return true;
+}
+
+void Stream::TarReader::parsePax(const string &data, Entry *entry) {
+    // Every record has the format "<length> <key>=<value>\n", where length includes the whole record
+    size_t offset = 0;
+    while(offset < data.size()) {
+        size_t length = strtoul(data.c_str() + offset, NULL, 10);
+        size_t space = data.find(' ', offset);
+        if(length == 0 || space == string::npos || offset + length > data.size()) {
+            LWARNING << "Ignoring malformed pax header";
+            return;
+        }
+        string record = data.substr(space + 1, offset + length - space - 2);
+        size_t equals = record.find('=');
+        if(equals != string::npos) {
+            string key = record.substr(0, equals),
+                   value = record.substr(equals + 1);
+            if(key == "path") {
+                entry->path = value;
+            } else if(key == "linkpath") {
+                entry->linkPath = value;
+            } else if(key == "size") {
+                entry->size = strtoull(value.c_str(), NULL, 10);
+            } else if(key == "mtime") {
+                entry->mtime = strtoll(value.c_str(), NULL, 10);
+            } else if(key == "uid") {
+                entry->uid = strtoul(value.c_str(), NULL, 10);
+            } else if(key == "gid") {
+                entry->gid = strtoul(value.c_str(), NULL, 10);
+            }
+        }
+        offset += length;
+    }
+}
+
+bool Stream::TarReader::splitPath(const string &path, vector<string> *components) {
+    components->clear();
+    size_t start = 0;
+    while(start <= path.size()) {
+        size_t end = path.find('/', start);
+        if(end == string::npos) {
+            end = path.size();
+        }
+        string component = path.substr(start, end - start);
+        if(component == "..") {
+            return false;
+        } else if(!component.empty() && component != ".") {
+            components->push_back(component);
+        }
+        start = end + 1;
+    }
+    return true;
+}
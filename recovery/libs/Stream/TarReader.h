@@ -0,0 +1,71 @@
+//
+// Created by agent on 10/17/26 as part of NOOBS4IoT (https://github.com/steilerDev/NOOBS4IoT)
+//
+// TarReader.h:
+//      This file contains the base of all sink stages consuming a tar archive. ustar, GNU (long names) and pax (extended
+//      headers) archives are supported. No external, non-standard library is required for this file.
+//      For more information see https://github.com/steilerDev/NOOBS4IoT/wiki.
+//
+// This file is licensed under a GNU General Public License v3.0 (c) Frank Steiler.
+// See https://raw.githubusercontent.com/steilerDev/NOOBS4IoT/master/LICENSE for more information.
+//
+
+#ifndef STREAM_TARREADER_H
+#define STREAM_TARREADER_H
+
+#include "Stream.h"
+#include <time.h>
+
+#define TAR_BLOCK_SIZE 512
+
+namespace Stream {
+
+    /*
+     * Parses the archive and hands every member to extract(), which needs to consume the data of the member (e.g.
+     * through readFile() or skipData())
+     */
+    class TarReader: public Stage {
+    public:
+        TarReader(const string &name): Stage(name) {}
+
+    protected:
+        /*
+         * A single archive member, assembled from the tar header and preceding GNU/pax headers
+         */
+        struct Entry {
+            char type;
+            string path,
+                   linkPath;
+            uint64_t size;
+            mode_t mode;
+            uid_t uid;
+            gid_t gid;
+            time_t mtime;
+            dev_t device;
+        };
+
+        bool process();
+
+        // Called before the first and after the last member of the archive
+        virtual bool begin() { return true; }
+        virtual bool finish() { return true; }
+        virtual bool extract(const Entry &entry) = 0;
+
+        // Reads exactly length bytes, returns false if the stream ended early or failed
+        bool readFully(char *buffer, size_t length);
+        // Reads the data of an entry (including padding) into memory
+        bool readData(uint64_t size, string *data);
+        // Reads and discards the data of an entry (including padding)
+        bool skipData(uint64_t size);
+        bool skipBytes(uint64_t length);
+
+        // Splits the path into its components, returns false if the path leaves the archive (e.g. through "..")
+        static bool splitPath(const string &path, vector<string> *components);
+
+    private:
+        bool parseHeader(const char *header, Entry *entry);
+        void parsePax(const string &data, Entry *entry);
+    };
+}
+
+#endif //STREAM_TARREADER_H
@@ -0,0 +1,176 @@
+//
+// Created by agent on 10/17/26 as part of NOOBS4IoT (https://github.com/steilerDev/NOOBS4IoT)
+//
+// WriteRecord.cpp:
+//      This file contains the record of the data written to a device by a sink stage, which keeps the digest of every
+//      written piece. Once the data is synced, the device is read back with O_DIRECT (bypassing the page cache) by
+//      several readers in parallel and compared against the recorded digests, detecting failing or counterfeit cards.
+//      For more information see https://github.com/steilerDev/NOOBS4IoT/wiki.
+//
+// This file is licensed under a GNU General Public License v3.0 (c) Frank Steiler.
+// See https://raw.githubusercontent.com/steilerDev/NOOBS4IoT/master/LICENSE for more information.
+//
+
+#include "WriteRecord.h"
+#include "Digest.h"
+#include "../easylogging++.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <thread>
+
+Stream::WriteRecord::WriteRecord(): _recordedSize(0),
+                                    _digest(NULL) {
+    _current.offset = 0;
+    _current.length = 0;
+}
+
+Stream::WriteRecord::~WriteRecord() {
+    delete _digest;
+}
+
+void Stream::WriteRecord::add(const char *data, size_t length, uint64_t offset) {
+    while(length > 0) {
+        // A new piece starts if the data is not adjacent to the current one or the current one is full
+        if(_digest == NULL || offset != _current.offset + _current.length || _current.length == VERIFY_PIECE_SIZE) {
+            finishPiece();
+            _digest = new Digest(VERIFY_CHECKSUM);
+            _current.offset = offset;
+            _current.length = 0;
+        }
+        size_t part = (size_t) min<uint64_t>(length, VERIFY_PIECE_SIZE - _current.length);
+        _digest->update(data, part);
+        _current.length += part;
+        _recordedSize += part;
+        data += part;
+        length -= part;
+        offset += part;
+    }
+}
+
+void Stream::WriteRecord::finishPiece() {
+    if(_digest != NULL) {
+        _current.checksum = _digest->hexDigest();
+        _pieces.push_back(_current);
+        delete _digest;
+        _digest = NULL;
+    }
+}
+
+bool Stream::WriteRecord::verify(const string &device, unsigned int threads) {
+    finishPiece();
+    if(!Digest(VERIFY_CHECKSUM).isValid()) {
+        LERROR << "Unsupported checksum type " << VERIFY_CHECKSUM;
+        return false;
+    }
+
+    // Direct reads bypass the page cache, so the data is actually read from the card. Some file systems do not
+    // support them, in that case the (possibly cached) data is read.
+    int fd = open(device.c_str(), O_RDONLY | O_DIRECT | O_CLOEXEC);
+    if(fd < 0 && errno == EINVAL) {
+        LWARNING << device << " does not support direct reads, reading through the page cache";
+        fd = open(device.c_str(), O_RDONLY | O_CLOEXEC);
+    }
+    if(fd < 0) {
+        LERROR << "Unable to open " << device << ": " << strerror(errno);
+        return false;
+    }
+
+    // Even on a single core, a second reader keeps the card busy while the first one is hashing
+    if(threads == 0) {
+        threads = max(thread::hardware_concurrency(), 2u);
+    }
+    LDEBUG << "Reading back " << _pieces.size() << " pieces (" << _recordedSize << " bytes) of " << device << " using "
+           << threads << " threads";
+    _nextPiece = 0;
+    _mismatches = 0;
+    _failed = false;
+    vector<thread> workers;
+    for(unsigned int i = 0; i < threads; i++) {
+        workers.push_back(thread(&WriteRecord::worker, this, fd));
+    }
+    for(thread &t: workers) {
+        t.join();
+    }
+    close(fd);
+
+    if(_failed) {
+        return false;
+    } else if(_mismatches > 0) {
+        LERROR << _mismatches << " of " << _pieces.size() << " pieces of " << device << " differ from the written data";
+        return false;
+    }
+    LINFO << "Verified " << _recordedSize << " bytes of " << device;
+    return true;
+}
+
+void Stream::WriteRecord::worker(int fd) {
+    Digest digest(VERIFY_CHECKSUM);
+    char *buffer;
+    if(posix_memalign((void **) &buffer, VERIFY_ALIGNMENT, VERIFY_READ_SIZE) != 0) {
+        LERROR << "Unable to allocate read buffer";
+        lock_guard<mutex> lock(_mutex);
+        _failed = true;
+        return;
+    }
+
+    while(true) {
+        size_t piece;
+        {
+            lock_guard<mutex> lock(_mutex);
+            if(_failed || _nextPiece == _pieces.size()) {
+                break;
+            }
+            piece = _nextPiece++;
+        }
+
+        if(!verifyPiece(fd, _pieces[piece], buffer, &digest)) {
+            lock_guard<mutex> lock(_mutex);
+            _mismatches++;
+        }
+    }
+    free(buffer);
+}
+
+bool Stream::WriteRecord::verifyPiece(int fd, const ByteRange &piece, char *buffer, Digest *digest) {
+    // Direct reads need aligned offsets and lengths, so the piece is read within its surrounding aligned blocks
+    uint64_t end = piece.offset + piece.length,
+             position = piece.offset;
+    while(position < end) {
+        uint64_t aligned = position - position % VERIFY_ALIGNMENT;
+        size_t length = (size_t) min<uint64_t>(VERIFY_READ_SIZE, end - aligned);
+        length += (VERIFY_ALIGNMENT - length % VERIFY_ALIGNMENT) % VERIFY_ALIGNMENT;
+        ssize_t bytesRead = pread(fd, buffer, length, aligned);
+        if(bytesRead < 0 && errno == EINTR) {
+            continue;
+        } else if(bytesRead < 0) {
+            LERROR << "Unable to read back byte " << aligned << ": " << strerror(errno);
+            digest->hexDigest();
+            // Not a mismatch, the whole verification fails
+            lock_guard<mutex> lock(_mutex);
+            _failed = true;
+            return true;
+        }
+
+        // Only the part within the piece is hashed
+        uint64_t stop = min(aligned + bytesRead, end);
+        if(stop <= position) {
+            LWARNING << "Device ended before byte " << end;
+            digest->hexDigest();
+            return false;
+        }
+        digest->update(buffer + (position - aligned), (size_t) (stop - position));
+        position = stop;
+    }
+
+    string checksum = digest->hexDigest();
+    if(!digestEquals(checksum, piece.checksum)) {
+        LWARNING << "Content of the " << piece.length << " bytes at byte " << piece.offset << " differs: expected "
+                 << piece.checksum << ", read " << checksum;
+        return false;
+    }
+    return true;
+}
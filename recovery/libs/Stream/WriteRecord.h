@@ -0,0 +1,68 @@
+//
+// Created by agent on 10/17/26 as part of NOOBS4IoT (https://github.com/steilerDev/NOOBS4IoT)
+//
+// WriteRecord.h:
+//      This file contains the record of the data written to a device by a sink stage, which keeps the digest of every
+//      written piece. Once the data is synced, the device is read back with O_DIRECT (bypassing the page cache) by
+//      several readers in parallel and compared against the recorded digests, detecting failing or counterfeit cards.
+//      For more information see https://github.com/steilerDev/NOOBS4IoT/wiki.
+//
+// This file is licensed under a GNU General Public License v3.0 (c) Frank Steiler.
+// See https://raw.githubusercontent.com/steilerDev/NOOBS4IoT/master/LICENSE for more information.
+//
+
+#ifndef STREAM_WRITERECORD_H
+#define STREAM_WRITERECORD_H
+
+#include "BlockMap.h"
+
+#include <mutex>
+
+// Maximum size of a recorded piece, which is the unit of work of the readers
+#define VERIFY_PIECE_SIZE (4 * 1024 * 1024)
+// Size of a single read, offsets and lengths of direct reads are aligned to VERIFY_ALIGNMENT
+#define VERIFY_READ_SIZE (1024 * 1024)
+#define VERIFY_ALIGNMENT 4096
+#define VERIFY_CHECKSUM "sha256"
+
+namespace Stream {
+
+    class Digest;
+
+    class WriteRecord {
+    public:
+        WriteRecord();
+        ~WriteRecord();
+
+        // Adds data written at the given offset of the device, called by the sink stages
+        void add(const char *data, size_t length, uint64_t offset);
+
+        /*
+         * Reads back all recorded pieces from the device (in parallel, using at least two readers) and compares them
+         * against the recorded digests. Returns false if the device could not be read or its content differs.
+         */
+        bool verify(const string &device, unsigned int threads = 0);
+
+        inline uint64_t recordedSize() const { return _recordedSize; }
+
+    private:
+        // Stores the digest of the current piece, if there is one
+        void finishPiece();
+        void worker(int fd);
+        bool verifyPiece(int fd, const ByteRange &piece, char *buffer, Digest *digest);
+
+        vector<ByteRange> _pieces;
+        uint64_t _recordedSize;
+        // The piece currently being recorded
+        Digest *_digest;
+        ByteRange _current;
+
+        // State shared by the workers of verify()
+        mutex _mutex;
+        size_t _nextPiece,
+               _mismatches;
+        bool _failed;
+    };
+}
+
+#endif //STREAM_WRITERECORD_H
@@ -0,0 +1,388 @@
+//
+// Created by agent on 10/17/26 as part of NOOBS4IoT (https://github.com/steilerDev/NOOBS4IoT)
+//
+// XzDecoder.cpp:
+//      This file contains the xz decompression stage of a streaming pipeline. Multi-threaded xz encoders (xz -T) split
+//      the data into independent blocks and record their sizes in the block headers, those blocks are decoded in
+//      parallel on all cores. Blocks without size information are decoded in order on the stage's own thread. liblzma is
+//      required for this file.
+//      For more information see https://github.com/steilerDev/NOOBS4IoT/wiki.
+//
+// This file is licensed under a GNU General Public License v3.0 (c) Frank Steiler.
+// See https://raw.githubusercontent.com/steilerDev/NOOBS4IoT/master/LICENSE for more information.
+//
+
+#include "XzDecoder.h"
+#include "../easylogging++.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Frees the filter options allocated by lzma_block_header_decode
+ */
+static void freeFilters(lzma_filter *filters) {
+    for(int i = 0; filters[i].id != LZMA_VLI_UNKNOWN; i++) {
+        free(filters[i].options);
+        filters[i].options = NULL;
+    }
+}
+
+/* Memory budget shared by all decoders of the process */
+static mutex budgetMutex;
+static condition_variable budgetReleased;
+static uint64_t budgetUsed = 0;
+
+static uint64_t memoryLimit() {
+    long pages = sysconf(_SC_PHYS_PAGES),
+         pageSize = sysconf(_SC_PAGESIZE);
+    if(pages <= 0 || pageSize <= 0) {
+        return XZ_MEMORY_LIMIT;
+    }
+    return min<uint64_t>((uint64_t) pages * pageSize / XZ_MEMORY_SHARE, XZ_MEMORY_LIMIT);
+}
+
+/*
+ * Reserves memory from the shared budget. While the budget is exhausted, this fails (or waits for other decoders to
+ * release memory, if wait is set). If nothing is reserved at all, it always succeeds.
+ */
+static bool reserveMemory(uint64_t bytes, bool wait) {
+    static const uint64_t limit = memoryLimit();
+    unique_lock<mutex> lock(budgetMutex);
+    while(budgetUsed > 0 && budgetUsed + bytes > limit) {
+        if(!wait) {
+            return false;
+        }
+        budgetReleased.wait(lock);
+    }
+    budgetUsed += bytes;
+    return true;
+}
+
+static void releaseMemory(uint64_t bytes) {
+    lock_guard<mutex> lock(budgetMutex);
+    budgetUsed -= bytes;
+    budgetReleased.notify_all();
+}
+
+Stream::XzDecoder::XzDecoder(unsigned int threads): Stage("xz"),
+                                                    _threads(threads),
+                                                    _position(0),
+                                                    _stopping(false) {
+    if(_threads == 0) {
+        _threads = max(thread::hardware_concurrency(), 1u);
+    }
+}
+
+bool Stream::XzDecoder::process() {
+    LDEBUG << "Decoding xz using " << _threads << " threads";
+    vector<thread> workers;
+    for(unsigned int i = 0; i < _threads; i++) {
+        workers.push_back(thread(&XzDecoder::worker, this));
+    }
+
+    bool success = true,
+         firstStream = true;
+    while(success) {
+        if(!firstStream) {
+            // Concatenated streams might be separated by stream padding (multiples of four zero bytes)
+            if(!fill(1)) {
+                break;
+            } else if(_buffer[_position] == 0x00) {
+                static const uint8_t padding[4] = {0, 0, 0, 0};
+                if(!fill(4) || memcmp(&_buffer[_position], padding, 4) != 0) {
+                    setError("Invalid stream padding");
+                    success = false;
+                }
+                _position += 4;
+                continue;
+            }
+        }
+
+        lzma_stream_flags flags;
+        if(!fill(LZMA_STREAM_HEADER_SIZE)) {
+            setError("Unexpected end of xz stream");
+            success = false;
+        } else if(lzma_stream_header_decode(&flags, &_buffer[_position]) != LZMA_OK) {
+            setError("Not an xz stream or unsupported xz options");
+            success = false;
+        } else {
+            _position += LZMA_STREAM_HEADER_SIZE;
+            success = decodeStream(flags);
+            firstStream = false;
+        }
+    }
+
+    if(success) {
+        success = flush(0);
+    }
+
+    {
+        lock_guard<mutex> lock(_mutex);
+        _stopping = true;
+        _blockQueued.notify_all();
+    }
+    for(thread &worker: workers) {
+        worker.join();
+    }
+
+    // Blocks left behind by a failure still hold memory of the shared budget
+    while(!_pending.empty()) {
+        releaseMemory(_pending.front()->memory);
+        _pending.pop_front();
+    }
+    return success;
+}
+
+bool Stream::XzDecoder::fill(size_t length) {
+    while(_buffer.size() - _position < length) {
+        // Dropping consumed data, before the buffer grows
+        if(_position > 0) {
+            _buffer.erase(_buffer.begin(), _buffer.begin() + _position);
+            _position = 0;
+        }
+        size_t filled = _buffer.size();
+        _buffer.resize(filled + max<size_t>(length - filled, STREAM_CHUNK_SIZE));
+        ssize_t bytesRead = read((char *) &_buffer[filled], _buffer.size() - filled);
+        _buffer.resize(filled + max<ssize_t>(bytesRead, 0));
+        if(bytesRead <= 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool Stream::XzDecoder::decodeStream(const lzma_stream_flags &flags) {
+    // The index hash verifies the sizes of all blocks against the index at the end of the stream
+    lzma_index_hash *indexHash = lzma_index_hash_init(NULL, NULL);
+    if(indexHash == NULL) {
+        setError("Unable to initialize liblzma");
+        return false;
+    }
+
+    bool success = true;
+    while(success) {
+        if(!fill(1)) {
+            setError("Unexpected end of xz stream");
+            success = false;
+        } else if(_buffer[_position] == 0x00) {
+            // Index indicator, all blocks of this stream have been read
+            success = decodeIndex(flags, indexHash);
+            break;
+        } else {
+            success = decodeBlock(flags, indexHash);
+        }
+    }
+    lzma_index_hash_end(indexHash, NULL);
+    return success;
+}
+
+bool Stream::XzDecoder::decodeBlock(const lzma_stream_flags &flags, lzma_index_hash *indexHash) {
+    lzma_filter filters[LZMA_FILTERS_MAX + 1];
+    lzma_block block;
+    memset(&block, 0, sizeof(block));
+    block.version = 0;
+    block.check = flags.check;
+    block.filters = filters;
+    block.header_size = lzma_block_header_size_decode(_buffer[_position]);
+
+    if(!fill(block.header_size)) {
+        setError("Unexpected end of xz stream");
+        return false;
+    } else if(lzma_block_header_decode(&block, NULL, &_buffer[_position]) != LZMA_OK) {
+        setError("Invalid or unsupported xz block header");
+        return false;
+    }
+
+    // Memory needed by the decoder of the block (mostly its dictionary)
+    uint64_t decoderMemory = lzma_raw_decoder_memusage(filters);
+    if(decoderMemory == UINT64_MAX) {
+        decoderMemory = 0;
+    }
+
+    if(block.compressed_size == LZMA_VLI_UNKNOWN || block.uncompressed_size == LZMA_VLI_UNKNOWN) {
+        // Single-threaded encoders do not store the block sizes, the end of the block is only known after decoding it
+        bool success = flush(0);
+        if(success) {
+            reserveMemory(decoderMemory, true);
+            success = decodeBlockInline(&block);
+            releaseMemory(decoderMemory);
+        }
+        freeFilters(filters);
+        if(success && lzma_index_hash_append(indexHash, lzma_block_unpadded_size(&block),
+                                             block.uncompressed_size) != LZMA_OK) {
+            setError("Corrupt xz index");
+            success = false;
+        }
+        return success;
+    }
+    freeFilters(filters);
+
+    lzma_vli totalSize = lzma_block_total_size(&block);
+    if(totalSize == 0 || totalSize > SIZE_MAX || block.uncompressed_size > SIZE_MAX ||
+            lzma_index_hash_append(indexHash, lzma_block_unpadded_size(&block), block.uncompressed_size) != LZMA_OK) {
+        setError("Invalid xz block size");
+        return false;
+    }
+
+    // Keeping the number of pending blocks in check and writing them out, until the shared budget has room for the block
+    uint64_t blockMemory = totalSize + block.uncompressed_size + decoderMemory;
+    if(!flush(_threads * 2 - 1)) {
+        return false;
+    }
+    while(!reserveMemory(blockMemory, _pending.empty())) {
+        if(!flush(_pending.size() - 1)) {
+            return false;
+        }
+    }
+
+    shared_ptr<Block> pending = make_shared<Block>();
+    pending->check = flags.check;
+    pending->memory = blockMemory;
+    pending->done = pending->failed = false;
+    if(!fill(totalSize)) {
+        setError("Unexpected end of xz stream");
+        releaseMemory(blockMemory);
+        return false;
+    }
+    pending->input.assign(_buffer.begin() + _position, _buffer.begin() + _position + totalSize);
+    pending->output.resize(block.uncompressed_size);
+    _position += totalSize;
+
+    lock_guard<mutex> lock(_mutex);
+    _pending.push_back(pending);
+    _queue.push_back(pending);
+    _blockQueued.notify_one();
+    return true;
+}
+
+bool Stream::XzDecoder::decodeBlockInline(lzma_block *block) {
+    lzma_stream stream = LZMA_STREAM_INIT;
+    if(lzma_block_decoder(&stream, block) != LZMA_OK) {
+        setError("Unable to initialize liblzma");
+        return false;
+    }
+    _position += block->header_size;
+
+    vector<char> out(STREAM_CHUNK_SIZE);
+    bool success = true;
+    while(success) {
+        if(_position == _buffer.size() && !fill(1)) {
+            setError("Unexpected end of xz stream");
+            success = false;
+            break;
+        }
+        stream.next_in = &_buffer[_position];
+        stream.avail_in = _buffer.size() - _position;
+        stream.next_out = (uint8_t *) out.data();
+        stream.avail_out = out.size();
+        lzma_ret ret = lzma_code(&stream, LZMA_RUN);
+        _position = _buffer.size() - stream.avail_in;
+
+        size_t produced = out.size() - stream.avail_out;
+        if(produced > 0 && !write(out.data(), produced)) {
+            success = false;
+        } else if(ret == LZMA_STREAM_END) {
+            break;
+        } else if(ret != LZMA_OK) {
+            setError("Corrupt xz block (liblzma error " + to_string(ret) + ")");
+            success = false;
+        }
+    }
+    lzma_end(&stream);
+    return success;
+}
+
+bool Stream::XzDecoder::decodeIndex(const lzma_stream_flags &flags, lzma_index_hash *indexHash) {
+    lzma_ret ret = LZMA_OK;
+    while(ret == LZMA_OK) {
+        if(_position == _buffer.size() && !fill(1)) {
+            setError("Unexpected end of xz stream");
+            return false;
+        }
+        ret = lzma_index_hash_decode(indexHash, &_buffer[0], &_position, _buffer.size());
+    }
+    if(ret != LZMA_STREAM_END) {
+        setError("Corrupt xz index");
+        return false;
+    }
+
+    lzma_stream_flags footerFlags;
+    if(!fill(LZMA_STREAM_HEADER_SIZE)) {
+        setError("Unexpected end of xz stream");
+        return false;
+    } else if(lzma_stream_footer_decode(&footerFlags, &_buffer[_position]) != LZMA_OK ||
+              lzma_stream_flags_compare(&flags, &footerFlags) != LZMA_OK ||
+              footerFlags.backward_size != lzma_index_hash_size(indexHash)) {
+        setError("Corrupt xz stream footer");
+        return false;
+    }
+    _position += LZMA_STREAM_HEADER_SIZE;
+    return true;
+}
+
+bool Stream::XzDecoder::flush(size_t maxBlocks) {
+    unique_lock<mutex> lock(_mutex);
+    while(_pending.size() > maxBlocks) {
+        while(!_pending.front()->done) {
+            _blockDone.wait(lock);
+        }
+        shared_ptr<Block> block = _pending.front();
+        _pending.pop_front();
+        releaseMemory(block->memory);
+        if(block->failed) {
+            setError("Corrupt xz block");
+            return false;
+        }
+
+        // Writing without holding the lock, so workers are able to continue with the next blocks
+        lock.unlock();
+        bool success = write(block->output.data(), block->output.size());
+        lock.lock();
+        if(!success) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void Stream::XzDecoder::worker() {
+    unique_lock<mutex> lock(_mutex);
+    while(true) {
+        while(_queue.empty() && !_stopping) {
+            _blockQueued.wait(lock);
+        }
+        if(_stopping) {
+            return;
+        }
+        shared_ptr<Block> block = _queue.front();
+        _queue.pop_front();
+        lock.unlock();
+
+        lzma_filter filters[LZMA_FILTERS_MAX + 1];
+        lzma_block header;
+        memset(&header, 0, sizeof(header));
+        header.version = 0;
+        header.check = block->check;
+        header.filters = filters;
+        header.header_size = lzma_block_header_size_decode(block->input[0]);
+
+        bool failed = lzma_block_header_decode(&header, NULL, block->input.data()) != LZMA_OK;
+        if(!failed) {
+            size_t inPosition = header.header_size,
+                   outPosition = 0;
+            // Decodes the compressed data, padding and check of the block (everything behind the header)
+            failed = lzma_block_buffer_decode(&header, NULL, block->input.data(), &inPosition, block->input.size(),
+                                              (uint8_t *) block->output.data(), &outPosition,
+                                              block->output.size()) != LZMA_OK ||
+                     outPosition != block->output.size();
+            freeFilters(filters);
+        }
+
+        lock.lock();
+        block->done = true;
+        block->failed = failed;
+        _blockDone.notify_all();
+    }
+}
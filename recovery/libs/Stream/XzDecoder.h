@@ -0,0 +1,85 @@
+//
+// Created by agent on 10/17/26 as part of NOOBS4IoT (https://github.com/steilerDev/NOOBS4IoT)
+//
+// XzDecoder.h:
+//      This file contains the xz decompression stage of a streaming pipeline. Multi-threaded xz encoders (xz -T) split
+//      the data into independent blocks and record their sizes in the block headers, those blocks are decoded in
+//      parallel on all cores. Blocks without size information are decoded in order on the stage's own thread. liblzma is
+//      required for this file.
+//      For more information see https://github.com/steilerDev/NOOBS4IoT/wiki.
+//
+// This file is licensed under a GNU General Public License v3.0 (c) Frank Steiler.
+// See https://raw.githubusercontent.com/steilerDev/NOOBS4IoT/master/LICENSE for more information.
+//
+
+#ifndef STREAM_XZDECODER_H
+#define STREAM_XZDECODER_H
+
+#include "Stream.h"
+#include <deque>
+#include <memory>
+#include <thread>
+#include <lzma.h>
+
+/*
+ * Memory used by blocks that are queued, being decoded or waiting to be written, including the state of their decoders.
+ * All decoders of the process (e.g. of partitions written concurrently) share a single budget of a quarter of the
+ * physical memory, but at most XZ_MEMORY_LIMIT. At least one block is always processed, independent of its size.
+ */
+#define XZ_MEMORY_SHARE 4
+#define XZ_MEMORY_LIMIT (256 * 1024 * 1024)
+
+namespace Stream {
+
+    class XzDecoder: public Stage {
+    public:
+        // If threads is 0, one thread per core is used
+        XzDecoder(unsigned int threads = 0);
+
+    protected:
+        bool process();
+
+    private:
+        /*
+         * A block, that is decoded by one of the workers
+         */
+        struct Block {
+            lzma_check check;
+            // Memory reserved from the shared budget
+            uint64_t memory;
+            vector<uint8_t> input;
+            vector<char> output;
+            bool done,
+                 failed;
+        };
+
+        // Makes sure at least length bytes are buffered, returns false if the input ended before
+        bool fill(size_t length);
+
+        bool decodeStream(const lzma_stream_flags &flags);
+        bool decodeBlock(const lzma_stream_flags &flags, lzma_index_hash *indexHash);
+        // Decodes a block of unknown size in order, on the current thread
+        bool decodeBlockInline(lzma_block *block);
+        bool decodeIndex(const lzma_stream_flags &flags, lzma_index_hash *indexHash);
+
+        // Writes finished blocks in order (releasing their memory), until at most maxBlocks blocks are pending
+        bool flush(size_t maxBlocks);
+        void worker();
+
+        unsigned int _threads;
+
+        // Input that was read but not yet consumed starts at _position
+        vector<uint8_t> _buffer;
+        size_t _position;
+
+        // Blocks in stream order (_pending) and blocks waiting for a worker (_queue)
+        mutex _mutex;
+        condition_variable _blockQueued,
+                           _blockDone;
+        deque<shared_ptr<Block> > _pending,
+                                  _queue;
+        bool _stopping;
+    };
+}
+
+#endif //STREAM_XZDECODER_H
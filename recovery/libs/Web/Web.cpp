@@ -13,6 +13,10 @@
 #include "Web.h"
 #include "../easylogging++.h"
 
+#include <errno.h>
+#include <poll.h>
+#include <strings.h>
+
 using namespace std;
 
 bool Web::Web::send() {
@@ -31,176 +35,230 @@ bool Web::Web::send() {
     // append extra crlf to indicate start of body
     strcat(header_buffer, "\r\n");
 
-    LDEBUG << "HTTP message:\n" << header_buffer << body.c_str();
+    LDEBUG << "HTTP message header:\n" << header_buffer;
 
     LINFO << "Sending HTTP message";
-    ssize_t t = 0;
-    t += write(_socket, header_buffer, strlen(header_buffer));
-    t += write(_socket, body.c_str(), strlen(body.c_str()));
-    if(t <= 0) {
+    if(!writeSocket(header_buffer, strlen(header_buffer)) || !writeSocket(body.data(), body.size())) {
         LERROR << "Unable to send HTTP message!";
         return false;
     } else {
-        LDEBUG << "Send HTTP message of size " << t;
+        LDEBUG << "Send HTTP message of size " << strlen(header_buffer) + body.size();
         return true;
     }
 }
 
- bool Web::Web::receive() {
-     _bytesRead = 0;
+bool Web::Web::writeSocket(const char *buffer, size_t length) {
+    size_t written = 0;
+    while(written < length) {
+        ssize_t t = write(_socket, buffer + written, length - written);
+        if(t > 0) {
+            written += t;
+        } else if(t < 0 && errno == EINTR) {
+            continue;
+        } else if(t < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            // The socket is non-blocking and its send buffer is full, wait until the peer consumed some data
+            struct pollfd pfd;
+            pfd.fd = _socket;
+            pfd.events = POLLOUT;
+            if(poll(&pfd, 1, SEND_TIMEOUT * 1000) <= 0) {
+                LERROR << "Timeout while waiting for socket to become writable";
+                return false;
+            }
+        } else {
+            LERROR << "Unable to write to socket";
+            return false;
+        }
+    }
+    return true;
+}
+
+bool Web::Web::receive() {
     LINFO << "Receiving HTTP message";
     string bufferString;
-    if(!readReceive(&bufferString)) {
-        LERROR << "Unable to read receive from socket";
+    size_t headerLength = 0, messageLength = 0;
+    bool continueSent = false;
+
+    Framing framing;
+    while((framing = frameMessage(bufferString, &headerLength, &messageLength)) == FRAME_INCOMPLETE) {
+        if(headerLength > 0 && !continueSent) {
+            string headerString = bufferString.substr(0, headerLength);
+            transform(headerString.begin(), headerString.end(), headerString.begin(), ::tolower);
+            if(headerField(headerString, "expect") == "100-continue") {
+                LDEBUG << "Found expect header, sending continue response";
+                const char *continueResponse = "HTTP/1.1 100 Continue\r\n\r\n";
+                if(!writeSocket(continueResponse, strlen(continueResponse))) {
+                    LERROR << "Unable to send continue response";
+                    return false;
+                }
+            }
+            continueSent = true;
+        }
+        if(readSocket(&bufferString) <= 0) {
+            LERROR << "Connection closed before message was complete";
+            return false;
+        }
+    }
+
+    if(framing == FRAME_INVALID) {
+        LERROR << "Received invalid HTTP message";
         return false;
     }
 
-    if(!parseReceive(bufferString, false)) {
+    if(!parseMessage(bufferString.substr(0, messageLength))) {
         LERROR << "Unable to parse receive";
         return false;
     }
 
-    bool continueRead = false;
-    int messageSize = -1;
+    if(_readUntilClose && !hasHeader("Content-Length") && !hasHeader("Transfer-Encoding")) {
+        LDEBUG << "No message length specified, reading until connection is closed";
+        body.append(bufferString, messageLength, string::npos);
+        ssize_t bytesRead;
+        while((bytesRead = readSocket(&body)) > 0);
+        if(bytesRead < 0) {
+            LERROR << "Unable to read message body";
+            return false;
+        }
+    }
+
+    LDEBUG << "Received HTTP message with body of size " << body.size();
+    return true;
+}
+
+ssize_t Web::Web::readSocket(string *bufferString) {
+    char buffer[BUFFER_SIZE];
+
+    while(true) {
+        struct pollfd pfd;
+        pfd.fd = _socket;
+        pfd.events = POLLIN;
+        int rv = poll(&pfd, 1, RECEIVE_TIMEOUT * 1000);
+        if(rv < 0 && errno == EINTR) {
+            continue;
+        } else if(rv < 0) {
+            LERROR << "An error occurred within poll";
+            return -1;
+        } else if(rv == 0) {
+            LERROR << "Timeout while waiting for data";
+            return -1;
+        }
+
+        ssize_t bytesRead = read(_socket, buffer, BUFFER_SIZE);
+        if(bytesRead < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) {
+            continue;
+        } else if(bytesRead < 0) {
+            LERROR << "Error during read!";
+            return -1;
+        }
+        bufferString->append(buffer, (size_t) bytesRead);
+        return bytesRead;
+    }
+}
+
+Web::Framing Web::Web::frameMessage(const string &buffer, size_t *headerLength, size_t *messageLength) {
+    size_t headerEnd = buffer.find("\r\n\r\n");
+    if(headerEnd == string::npos) {
+        return FRAME_INCOMPLETE;
+    }
+    *headerLength = headerEnd + 4;
 
-    if(header.find("Expect") != header.end() && header["Expect"].compare("100-continue\r") == 0) {
-        LDEBUG << "Found expect header, building continue response";
-        Web expectResponse(_socket);
+    // Header field names are case-insensitive
+    string headerString = buffer.substr(0, headerEnd + 2);
+    transform(headerString.begin(), headerString.end(), headerString.begin(), ::tolower);
 
-        expectResponse.headerLine = "HTTP/1.0 100 Continue";
-        LDEBUG << "Sending continue response";
-        expectResponse.send();
-        continueRead = true;
+    if(headerField(headerString, "transfer-encoding").find("chunked") != string::npos) {
+        return parseChunked(buffer, *headerLength, messageLength, NULL);
     }
-    if(header.find("Content-Length") != header.end() && std::stoi(header["Content-Length"]) > _bytesRead) {
-        messageSize = std::stoi(header["Content-Length"]);
-        // Removing last \n
-        if(!this->body.empty()) {
-            this->body.pop_back();
+
+    size_t contentLength = 0;
+    string contentLengthString = headerField(headerString, "content-length");
+    if(!contentLengthString.empty()) {
+        char *end;
+        contentLength = strtoul(contentLengthString.c_str(), &end, 10);
+        if(end == contentLengthString.c_str()) {
+            LERROR << "Invalid Content-Length: " << contentLengthString;
+            return FRAME_INVALID;
         }
-        LDEBUG << "Complete message not yet read (" << _bytesRead << " vs. " << messageSize << "), continuing read";
-        continueRead = true;
     }
 
-     if(continueRead) {
-         LDEBUG << "Continuing reading";
-         bufferString.clear();
-         do {
-             if (!readReceive(&bufferString)) {
-                 LERROR << "Unable to continue to read from socket";
-                 return false;
-             }
-         } while(messageSize != -1 && _bytesRead < messageSize);
+    if(buffer.size() - *headerLength >= contentLength) {
+        *messageLength = *headerLength + contentLength;
+        return FRAME_COMPLETE;
+    }
+    return FRAME_INCOMPLETE;
+}
+
+bool Web::Web::parseMessage(const string &message) {
+    LDEBUG << "Parsing received HTTP message";
+    size_t headerEnd = message.find("\r\n\r\n");
+    if(headerEnd == string::npos) {
+        LERROR << "Didn't finish read of header, this will be a problem!";
+        return false;
+    }
 
-         if(!parseReceive(bufferString, true)) {
-             LERROR << "Unable to parse continue request";
-             return false;
-         }
-     }
+    if(!parseHeader(message, headerEnd)) {
+        return false;
+    }
 
+    size_t bodyStart = headerEnd + 4;
+    if(getHeader("Transfer-Encoding").find("chunked") != string::npos) {
+        LDEBUG << "Decoding chunked body";
+        size_t bodyEnd;
+        if(parseChunked(message, bodyStart, &bodyEnd, &body) != FRAME_COMPLETE) {
+            LERROR << "Unable to decode chunked body";
+            return false;
+        }
+    } else {
+        body.append(message, bodyStart, string::npos);
+    }
+    LDEBUG << "Finished parsing message";
     return true;
 }
 
-bool Web::Web::readReceive(string *bufferString) {
-    LDEBUG << "Reading HTTP message from socket";
-    static char buffer[BUFFER_SIZE];
-
-    fd_set set;
-    int rv;
-    // Clear the set
-    FD_ZERO(&set);
-    // Add our socket to the set
-    FD_SET(_socket, &set);
-
-    ssize_t thisRoundRead = 0;
-    do {
-        // Redefine timeout struct, since it is consumed by select
-        struct timeval timeout;
-        timeout.tv_sec = 1;
-        timeout.tv_usec = 0;
-        thisRoundRead = 0;
-
-        // Clear the buffer every time
-        memset(buffer, 0, BUFFER_SIZE);
-
-        // Wait for incoming IO or timeout (If content == buffer size we would re-run the loop and read would wait for
-        // additional information, but none would be available, blocking the execution forever.
-        rv = select(_socket + 1, &set, NULL, NULL, &timeout);
-        if(rv == -1) {
-            LERROR << "An error occurred within select";
-            thisRoundRead = -1;
-        } else if (rv == 0) {
-            LWARNING << "Read timeout occurred, this should be okay and due to the fact, that the buffer size == request size";
-            thisRoundRead = 0;
-        } else {
-            thisRoundRead += read(_socket, buffer, BUFFER_SIZE);
-            LDEBUG << "Read " << thisRoundRead << " bytes this round";
-            bufferString->append(buffer);
+bool Web::Web::receiveHeader() {
+    LDEBUG << "Receiving HTTP header";
+    size_t headerEnd;
+    while((headerEnd = _pending.find("\r\n\r\n")) == string::npos) {
+        if(_pending.size() > HEADER_LIMIT) {
+            LERROR << "HTTP header exceeds " << HEADER_LIMIT << " bytes";
+            return false;
+        } else if(readSocket(&_pending) <= 0) {
+            LERROR << "Connection closed before header was complete";
+            return false;
         }
-        _bytesRead += thisRoundRead;
-    } while (thisRoundRead > 0);
+    }
 
-    LDEBUG << "Finished read";
-    if(thisRoundRead < 0)  {
-        LERROR << "Error during read!";
+    if(!parseHeader(_pending, headerEnd)) {
+        LERROR << "Unable to parse header";
         return false;
     }
-    LDEBUG << "Read: \n" << *bufferString;
+    _pending.erase(0, headerEnd + 4);
     return true;
 }
 
-bool Web::Web::parseReceive(const string &bufferString, const bool skipHeader) {
-    LDEBUG << "Parsing received HTTP message line by line";
-    // Indicates if we are still in the header
-    bool header = !skipHeader;
-    // Indicates if we are at the request line
+bool Web::Web::parseHeader(const string &message, size_t headerEnd) {
+    size_t start = 0, end;
     bool methodLine = true;
-
-    istringstream bufferStream(bufferString);
-    for(string line; getline(bufferStream, line); ) {
-        if(header) {
-            if(methodLine) { //Processing method line
-                headerLine = line;
-                methodLine = false;
-            } else { // Processing headers
-                if (!(line.size() == 1 && line[0] == '\r')) { // Processing a header field
-                    if(!parseHeaderLine(line)) {
-                        LERROR << "Unable to parse header line: " << line;
-                        return false;
-                    }
-                } else { // Found start of body
-                    LDEBUG << "Found start of body";
-                    header = false;
-                }
-            }
-        } else { // Processing body line
-            if(!parseBodyLine(line)) {
-                LERROR << "Unable to parse body line: " << line;
-                return false;
-            }
+    while((end = message.find("\r\n", start)) != string::npos && end <= headerEnd) {
+        string line = message.substr(start, end - start);
+        if(methodLine) {
+            headerLine = line;
+            methodLine = false;
+        } else if(!parseHeaderLine(line)) {
+            LERROR << "Unable to parse header line: " << line;
+            return false;
         }
+        start = end + 2;
     }
-    if(header) {
-        LERROR << "Didn't finish read of header, this will be a problem!";
-        return false;
-    }
-    LDEBUG << "Finished parsing request";
     return true;
 }
 
 bool Web::Web::parseHeaderLine(const string &headerLineString) {
-    vector<string> headerLineVector = split(headerLineString, ':');
-    if(headerLineVector.size() >= 2) {
-        string key = headerLineVector[0];
-        string value = headerLineVector[1];
-        if (headerLineVector.size() > 2) {
-            LDEBUG << "Additional splits occurred, re-merging";
-            for (uint i = 2; i < headerLineVector.size(); i++) {
-                value.append(":" + headerLineVector[i]);
-            }
-        }
+    size_t separator = headerLineString.find(':');
+    if(separator != string::npos) {
+        string key = headerLineString.substr(0, separator);
+        string value = headerLineString.substr(separator + 1);
         // Removing unnecessary space at the start
-        if (value[0] == ' ') {
+        if (!value.empty() && value[0] == ' ') {
             value = value.substr(1, value.length());
         }
         header[key] = value;
@@ -212,11 +270,79 @@ bool Web::Web::parseHeaderLine(const string &headerLineString) {
     return true;
 }
 
-bool Web::Web::parseBodyLine(const string &bodyLineString) {
-    //LDEBUG << "Found body line: " << bodyLineString;
-    this->body.append(bodyLineString);
-    this->body.append("\n");
-    return true;
+string Web::Web::getHeader(const string &key) const {
+    for(auto const& x: header) {
+        if(strcasecmp(x.first.c_str(), key.c_str()) == 0) {
+            return x.second;
+        }
+    }
+    return string();
+}
+
+bool Web::Web::hasHeader(const string &key) const {
+    for(auto const& x: header) {
+        if(strcasecmp(x.first.c_str(), key.c_str()) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+Web::Framing Web::parseChunked(const string &buffer, size_t offset, size_t *end, string *body) {
+    size_t pos = offset;
+    while(true) {
+        size_t lineEnd = buffer.find("\r\n", pos);
+        if(lineEnd == string::npos) {
+            return FRAME_INCOMPLETE;
+        }
+
+        // Chunk extensions (after ';') are ignored
+        char *sizeEnd;
+        unsigned long chunkSize = strtoul(buffer.c_str() + pos, &sizeEnd, 16);
+        if(sizeEnd == buffer.c_str() + pos) {
+            LERROR << "Invalid chunk size";
+            return FRAME_INVALID;
+        }
+        pos = lineEnd + 2;
+
+        if(chunkSize == 0) {
+            // The last chunk is followed by optional trailer fields and an empty line
+            while((lineEnd = buffer.find("\r\n", pos)) != string::npos) {
+                if(lineEnd == pos) {
+                    *end = pos + 2;
+                    return FRAME_COMPLETE;
+                }
+                pos = lineEnd + 2;
+            }
+            return FRAME_INCOMPLETE;
+        }
+
+        if(buffer.size() < pos + chunkSize + 2) {
+            return FRAME_INCOMPLETE;
+        } else if(buffer.compare(pos + chunkSize, 2, "\r\n") != 0) {
+            LERROR << "Chunk is not terminated by CRLF";
+            return FRAME_INVALID;
+        }
+
+        if(body != NULL) {
+            body->append(buffer, pos, chunkSize);
+        }
+        pos += chunkSize + 2;
+    }
+}
+
+string Web::headerField(const string &headerString, const string &key) {
+    size_t start = headerString.find("\r\n" + key + ":");
+    if(start == string::npos) {
+        return string();
+    }
+    start += key.size() + 3;
+    size_t end = headerString.find("\r\n", start);
+    string value = headerString.substr(start, end - start);
+    // Removing surrounding white space
+    value.erase(0, value.find_first_not_of(" \t"));
+    value.erase(value.find_last_not_of(" \t") + 1);
+    return value;
 }
 
 vector<string> Web::split(const string &text, const char sep) {
@@ -34,21 +34,46 @@
 
 #define BUFFER_SIZE 4096
 #define HEADER_BUFFER 4096
+// Maximum size of a received header
+#define HEADER_LIMIT (64 * 1024)
+// Seconds to wait for a non-blocking socket to become writable
+#define SEND_TIMEOUT 10
+// Seconds to wait for the next data of an incomplete message
+#define RECEIVE_TIMEOUT 30
 
 using namespace std;
 
 namespace Web {
 
+    // Result of framing a (partially) received HTTP message
+    enum Framing {
+        FRAME_INCOMPLETE,
+        FRAME_COMPLETE,
+        FRAME_INVALID
+    };
+
     class Web {
     public:
         map<string, string> header;
         string body;
 
+        // Returns the value of the given header field (field names are case-insensitive) or an empty string
+        string getHeader(const string &key) const;
+        bool hasHeader(const string &key) const;
+
+        /*
+         * Determines if buffer holds a complete HTTP message, based on the header terminator and the Content-Length or
+         * chunked Transfer-Encoding header. If the message is complete, messageLength is set to the size of the message
+         * within the buffer. headerLength is set as soon as the header is complete.
+         */
+        static Framing frameMessage(const string &buffer, size_t *headerLength, size_t *messageLength);
+
     protected:
-        Web(int socket): body(), _socket(socket) {};
+        Web(int socket): body(), _readUntilClose(false), _socket(socket) {};
+        virtual ~Web() {};
 
         /*
-         * Fills header and body member attribute;
+         * Fills header and body member attribute, reading exactly one message from the socket
          */
         bool receive();
 
@@ -57,24 +82,51 @@ namespace Web {
          */
         bool send();
 
+        // This function will parse the complete message in message string and populate header line, header and body
+        bool parseMessage(const string &message);
+
         // The header line (e.g. GET URI HTTP/1.1 or HTTP/1.1 200 OK)
         string headerLine;
 
+        // If set, a message without Content-Length or chunked Transfer-Encoding ends when the peer closes the connection
+        // (true for responses), otherwise it has no body (true for requests)
+        bool _readUntilClose;
+
+        /*
+         * Reads from the socket until the header line and header are complete and parses them. Data following the
+         * header is stored in _pending, so the body can be read in parts afterwards.
+         */
+        bool receiveHeader();
+
+        // This function will read the next available data from the socket and append it to bufferString. Returns 0
+        // if the peer closed the connection and -1 on error or timeout.
+        ssize_t readSocket(string *bufferString);
+
+        // Data that was received, but not yet processed
+        string _pending;
+
+        int _socket;
+
     private:
-        // This function will read from the socket and store the result in receiveString
-        bool readReceive(string *bufferString);
-        // This function will parse the request in request string and populate header line, header and body
-        bool parseReceive(const string &bufferString, const bool skipHeader);
+        // This function will write the complete buffer to the socket, waiting for the socket if it is non-blocking
+        bool writeSocket(const char *buffer, size_t length);
 
+        // This function will parse the header line and header fields of a message, headerEnd is the position of the
+        // empty line terminating the header
+        bool parseHeader(const string &message, size_t headerEnd);
         // This function will parse a single header line and add it to the header map
         bool parseHeaderLine(const string &headerLineString);
-        // This function will parse a single body line and append it to the body string
-        bool parseBodyLine(const string &bodyLineString);
-
-        int _socket;
-        ssize_t _bytesRead;
     };
 
+    /*
+     * Parses the chunked body starting at offset within buffer. Returns FRAME_COMPLETE and sets end to the end of the
+     * last chunk (including trailer) if all chunks are available. If body is not NULL, the decoded data is appended.
+     */
+    Framing parseChunked(const string &buffer, size_t offset, size_t *end, string *body);
+
+    // This helper returns the value of the given field from a lowercase header string (key needs to be lowercase)
+    string headerField(const string &headerString, const string &key);
+
     // This helper function splits the given string by the sep char
     vector<string> split(const string &text, const char sep);
 
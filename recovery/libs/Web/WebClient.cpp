@@ -3,8 +3,8 @@
 //
 // WebClient.cpp:
 //      This file contains several classes and helper functions providing extended WebClient functionalities. The
-//      WebClient class can be used to retrieve string based content from the web in a blocking fashion. No external,
-//      non-standard library is required for this file.
+//      WebClient class can be used to retrieve string based content from the web in a blocking fashion, or to stream
+//      large resources. No external, non-standard library is required for this file.
 //      For more information see https://github.com/steilerDev/NOOBS4IoT/wiki.
 //
 // This file is licensed under a GNU General Public License v3.0 (c) Frank Steiler.
@@ -16,119 +16,485 @@
 
 #include <netinet/tcp.h>
 #include <netdb.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <deque>
 
 using namespace std;
 
-string Web::WebClient::get(string &url) {
+/*
+ * Resolved host names, shared by all WebClients
+ */
+static mutex dnsCacheMutex;
+static map<string, pair<time_t, struct in_addr> > dnsCache;
 
-    if(strncmp(url.c_str(), "http://", strlen("http://")) == 0) {
-        url = url.substr(strlen("http://"), url.size());
-        LDEBUG << "Removed http:// from host: " << url;
-    } else if(strncmp(url.c_str(), "https://", strlen("https://")) == 0) {
-        LFATAL << "HTTPS is not supported!";
-        return string();
+static time_t monotonicTime() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec;
+}
+
+static bool resolve(const string &host, struct in_addr *address) {
+    {
+        lock_guard<mutex> lock(dnsCacheMutex);
+        auto cached = dnsCache.find(host);
+        if(cached != dnsCache.end() && monotonicTime() - cached->second.first < DNS_CACHE_TTL) {
+            *address = cached->second.second;
+            return true;
+        }
+    }
+
+    struct addrinfo hints, *result;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+
+    // getaddrinfo is used instead of gethostbyname, since downloads are running on worker threads
+    int rv = getaddrinfo(host.c_str(), NULL, &hints, &result);
+    if(rv != 0 || result == NULL) {
+        LFATAL << "Unable to resolve " << host << ": " << gai_strerror(rv);
+        return false;
+    }
+    *address = ((struct sockaddr_in *) result->ai_addr)->sin_addr;
+    freeaddrinfo(result);
+
+    lock_guard<mutex> lock(dnsCacheMutex);
+    dnsCache[host] = make_pair(monotonicTime(), *address);
+    return true;
+}
+
+/*
+ * Resources completed by the fetchAll() worker threads, waiting to be handed to the callback
+ */
+struct Web::WebClient::FetchQueue {
+    struct Result {
+        size_t index;
+        bool success;
+        string body;
+    };
+
+    void push(size_t index, bool success, string &body) {
+        lock_guard<std::mutex> lock(_mutex);
+        results.push_back(Result());
+        results.back().index = index;
+        results.back().success = success;
+        results.back().body.swap(body);
+        available.notify_one();
+    }
+
+    Result pop() {
+        unique_lock<std::mutex> lock(_mutex);
+        while(results.empty()) {
+            available.wait(lock);
+        }
+        Result result = results.front();
+        results.pop_front();
+        return result;
     }
 
-    vector<string> urlVector = split(url, '/');
-    if(urlVector.size() < 1) {
-        LFATAL << "Unable to split URL: " << url;
+    std::mutex _mutex;
+    condition_variable available;
+    deque<Result> results;
+};
+
+string Web::WebClient::get(string &url) {
+    string body;
+    if(!get(url, [&body](const char *data, size_t length) {
+        body.append(data, length);
+        return true;
+    })) {
         return string();
     }
+    return body;
+}
 
-    string host = urlVector[0];
-    string path = "/";
-    path.append(urlVector[1]);
-    if(urlVector.size() > 2) {
-        LDEBUG << "Additional URL splits occured, re-merging";
-        for (uint i = 2; i < urlVector.size(); i++) {
-            path.append("/" + urlVector[i]);
+bool Web::WebClient::parseURL(const string &url, string *host, string *path, uint16_t *port) {
+    string location = url;
+    if(strncmp(location.c_str(), "http://", strlen("http://")) == 0) {
+        location = location.substr(strlen("http://"));
+    } else if(strncmp(location.c_str(), "https://", strlen("https://")) == 0) {
+        LFATAL << "HTTPS is not supported!";
+        return false;
+    }
+
+    size_t pathStart = location.find('/');
+    *path = pathStart == string::npos ? "/" : location.substr(pathStart);
+    *host = location.substr(0, pathStart);
+    *port = 80;
+
+    size_t portStart = host->find(':');
+    if(portStart != string::npos) {
+        char *end;
+        unsigned long portNumber = strtoul(host->c_str() + portStart + 1, &end, 10);
+        if(*end != '\0' || portNumber == 0 || portNumber > 65535) {
+            LFATAL << "Invalid port in URL: " << url;
+            return false;
         }
+        *port = (uint16_t) portNumber;
+        host->erase(portStart);
+    }
+
+    if(host->empty()) {
+        LFATAL << "Unable to find host in URL: " << url;
+        return false;
     }
-    return get(host, path, 80);
+    return true;
 }
 
 string Web::WebClient::get(string &host, string &path, uint16_t port) {
-    LINFO << "GETting resource " << path << " from " << host << ":" << port;
+    string url = "http://" + host + ":" + to_string(port) + path;
+    return get(url);
+}
 
+bool Web::WebClient::get(const string &url, BodySink sink) {
+    LINFO << "GETting resource " << url;
+    Client::Response *response = open(url);
+    if(response == NULL) {
+        LFATAL << "Unable to retrieve " << url;
+        return false;
+    } else if(response->code < 200 || response->code >= 300) {
+        LFATAL << "Unable to retrieve " << url << ": " << response->code << " " << response->phrase;
+        delete(response);
+        return false;
+    }
+
+    string data;
+    ssize_t bytesRead;
+    uint64_t bodySize = 0;
+    while((bytesRead = response->readBody(&data)) > 0) {
+        bodySize += data.size();
+        if(!sink(data.data(), data.size())) {
+            LERROR << "Transfer of " << url << " aborted";
+            delete(response);
+            return false;
+        }
+        data.clear();
+    }
+    delete(response);
+
+    if(bytesRead < 0) {
+        LFATAL << "Unable to receive body of " << url;
+        return false;
+    }
+    LDEBUG << "Successfully received body of size " << bodySize;
+    return true;
+}
+
+Web::Client::Response *Web::WebClient::open(const string &url, const map<string, string> &header) {
+    string host, path;
+    uint16_t port;
+    if(!parseURL(url, &host, &path, &port)) {
+        return NULL;
+    }
+    LINFO << "Opening resource " << path << " from " << host << ":" << port;
 
     int socket = openSocket(host, port);
     if(socket < 0) {
-        LFATAL << "Unable to open socket";
-        return string();
+        LERROR << "Unable to open socket";
+        return NULL;
     }
 
     Client::Request request(socket);
-    request.host = host;
+    request.header = header;
+    request.host = port == 80 ? host : host + ":" + to_string(port);
     request.path = path;
     request.method = "GET";
     if(!request.sendRequest()) {
-        LFATAL << "Unable to send request";
+        LERROR << "Unable to send request";
         close(socket);
-        return string();
+        return NULL;
     }
 
-    Client::Response response(socket);
-    if(!response.receiveResponse()) {
-        LFATAL << "Unable to receive response!";
-        close(socket);
-        return string();
-    } else {
-        LDEBUG << "Successfully received response";
-        close(socket);
-        return response.body;
+    Client::Response *response = new Client::Response(socket);
+    response->_ownsSocket = true;
+    if(!response->receiveHeader()) {
+        LERROR << "Unable to receive response header";
+        delete(response);
+        return NULL;
     }
+    return response;
 }
 
-int Web::WebClient::openSocket(string &hostString, uint16_t port) {
-    struct hostent *host;
-    struct sockaddr_in addr;
-    int on = 1, sock;
+bool Web::WebClient::fetchAll(const vector<string> &urls, FetchCallback callback) {
+    // Grouping the requests by host and port, every group is using its own connection
+    map<pair<string, uint16_t>, vector<pair<size_t, string> > > hosts;
+    bool success = true;
+    size_t pending = 0;
+    for(size_t i = 0; i < urls.size(); i++) {
+        string host, path;
+        uint16_t port;
+        if(!parseURL(urls[i], &host, &path, &port)) {
+            callback(i, false, string());
+            success = false;
+        } else {
+            hosts[make_pair(host, port)].push_back(make_pair(i, path));
+            pending++;
+        }
+    }
+
+    FetchQueue queue;
+    vector<thread> threads;
+    for(auto const& x: hosts) {
+        threads.push_back(thread(&WebClient::fetchHost, this, x.first.first, x.first.second, x.second, &queue));
+    }
+
+    for(; pending > 0; pending--) {
+        FetchQueue::Result result = queue.pop();
+        success = success && result.success;
+        callback(result.index, result.success, result.body);
+    }
+
+    for(thread &t: threads) {
+        t.join();
+    }
+    return success;
+}
+
+void Web::WebClient::fetchHost(const string &host, uint16_t port, vector<pair<size_t, string> > requests,
+                               FetchQueue *queue) {
+    size_t next = 0;
+    int failedAttempts = 0;
+    // Cleared once the host ends a connection after a response, afterwards every request uses its own connection
+    bool pipelining = true;
+    while(next < requests.size() && failedAttempts < FETCH_ATTEMPTS) {
+        size_t previous = next;
+        int socket = openSocket(host, port);
+        if(socket >= 0) {
+            // Pipelining all outstanding requests, the responses are arriving in the same order
+            bool sent = true;
+            size_t last = pipelining ? requests.size() : next + 1;
+            for(size_t i = next; i < last && sent; i++) {
+                Client::Request request(socket);
+                request.host = port == 80 ? host : host + ":" + to_string(port);
+                request.path = requests[i].second;
+                request.method = "GET";
+                request.keepAlive = true;
+                sent = request.sendRequest();
+            }
+
+            // Data behind the end of a response already belongs to the next one
+            string pending;
+            while(sent && next < last) {
+                Client::Response response(socket);
+                response._pending.swap(pending);
+                string body;
+                ssize_t bytesRead = -1;
+                bool untilClose = false;
+                if(response.receiveHeader()) {
+                    untilClose = response._bodyState == Client::Response::BODY_UNTIL_CLOSE;
+                    while((bytesRead = response.readBody(&body)) > 0);
+                }
+                if(bytesRead < 0) {
+                    LWARNING << "Connection to " << host << " failed, " << requests.size() - next << " requests outstanding";
+                    break;
+                }
+
+                bool success = response.code >= 200 && response.code < 300;
+                if(!success) {
+                    LERROR << "Unable to retrieve " << requests[next].second << " from " << host << ": "
+                           << response.code << " " << response.phrase;
+                }
+                queue->push(requests[next++].first, success, body);
+                pending.swap(response._pending);
+
+                // The server is closing the connection, the remaining requests need to be sent again
+                if(untilClose || strcasecmp(response.getHeader("Connection").c_str(), "close") == 0 ||
+                        response.headerLine.compare(0, 8, "HTTP/1.0") == 0) {
+                    if(pipelining && next < requests.size()) {
+                        LDEBUG << host << " closes connections after a response, stopped pipelining";
+                    }
+                    pipelining = false;
+                    break;
+                }
+            }
+            close(socket);
+        }
+        failedAttempts = next > previous ? 0 : failedAttempts + 1;
+    }
+
+    string empty;
+    for(; next < requests.size(); next++) {
+        queue->push(requests[next].first, false, empty);
+    }
+}
 
-    if((host = gethostbyname(hostString.c_str())) == NULL){
-        LFATAL << "Unable to get host by name!";
+int Web::WebClient::openSocket(const string &hostString, uint16_t port) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    if(!resolve(hostString, &addr.sin_addr)) {
         return -1;
     }
-    bcopy(host->h_addr, &addr.sin_addr, (size_t)((unsigned) host->h_length));
     addr.sin_port = htons(port);
     addr.sin_family = AF_INET;
-    sock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
-    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (const char *)&on, sizeof(int));
 
+    int on = 1;
+    int sock = socket(PF_INET, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
     if(sock == -1){
-        LFATAL << "Unable to set sock opts";
+        LFATAL << "Unable to create socket";
         return -1;
     }
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (const char *)&on, sizeof(int));
 
     if(connect(sock, (struct sockaddr *)&addr, sizeof(struct sockaddr_in)) == -1){
-        LFATAL << "Unable to connect to socket";
+        LFATAL << "Unable to connect to " << hostString << ":" << port;
+        close(sock);
+        // The cached address might be outdated, resolving the host again on the next attempt
+        lock_guard<mutex> lock(dnsCacheMutex);
+        dnsCache.erase(hostString);
         return -1;
     }
     return sock;
 }
 
+Web::Client::Response::~Response() {
+    if(_ownsSocket) {
+        close(_socket);
+    }
+}
+
 bool Web::Client::Response::receiveResponse() {
 
     if(!receive()) {
         LFATAL << "Unable to receive response";
         return false;
     } else {
-        LDEBUG << "Parsing method line from header line";
-        vector<string> methodLineVector = split(headerLine, ' ');
-        if(methodLineVector.size() != 3) {
-            LERROR << "Request-Line does not conform specifications";
-            return false;
-        } else if (methodLineVector[0].compare("HTTP/1.1") != 0) {
-            LERROR << "This server only supports HTTP/1.1, found " << methodLineVector[2];
+        return parseStatusLine();
+    }
+}
+
+bool Web::Client::Response::parseStatusLine() {
+    LDEBUG << "Parsing status line from header line";
+    vector<string> statusLineVector = split(headerLine, ' ');
+    if(statusLineVector.size() < 3) {
+        LERROR << "Status-Line does not conform specifications";
+        return false;
+    } else if (statusLineVector[0].compare("HTTP/1.1") != 0 && statusLineVector[0].compare("HTTP/1.0") != 0) {
+        LERROR << "This client only supports HTTP/1.x, found " << statusLineVector[0];
+        return false;
+    }
+
+    // The reason phrase might contain spaces
+    this->phrase = headerLine.substr(statusLineVector[0].size() + statusLineVector[1].size() + 2);
+    this->code = atoi(statusLineVector[1].c_str());
+
+    LDEBUG << "Found response phrase: " << this->phrase;
+    LDEBUG << "Found response code: " << this->code;
+    return true;
+}
+
+bool Web::Client::Response::receiveHeader() {
+    // Interim responses (1xx, e.g. 100 Continue) have no body and are followed by the final response
+    do {
+        header.clear();
+        if(!Web::receiveHeader() || !parseStatusLine()) {
             return false;
         }
+    } while(code >= 100 && code < 200);
 
-        // Removing trailing \r
-        this->phrase = methodLineVector[2].substr(0, methodLineVector[2].size()-1);
-        this->code = stoi(methodLineVector[1]);
+    string contentLength = getHeader("Content-Length");
+    if(code == 204 || code == 304) {
+        // These responses never have a body, regardless of their header (RFC 7230, section 3.3.3)
+        _bodyState = BODY_LENGTH;
+        _remaining = 0;
+    } else if(getHeader("Transfer-Encoding").find("chunked") != string::npos) {
+        _bodyState = BODY_CHUNK_SIZE;
+    } else if(!contentLength.empty()) {
+        // Parsing as 64 bit number, since images might exceed 4 GB
+        _bodyState = BODY_LENGTH;
+        _remaining = strtoull(contentLength.c_str(), NULL, 10);
+    } else {
+        _bodyState = BODY_UNTIL_CLOSE;
+    }
+    return true;
+}
 
-        LDEBUG << "Found response phrase: " << this->phrase;
-        LDEBUG << "Found response code: " << this->code;
-        return true;
+ssize_t Web::Client::Response::readBody(string *data) {
+    while(true) {
+        // Every state except for the final one requires data, reading from the socket if nothing is pending
+        if(_pending.empty() && _bodyState != BODY_DONE && !(_bodyState == BODY_LENGTH && _remaining == 0)) {
+            ssize_t bytesRead = readSocket(&_pending);
+            if(bytesRead == 0 && _bodyState == BODY_UNTIL_CLOSE) {
+                _bodyState = BODY_DONE;
+            } else if(bytesRead <= 0) {
+                LERROR << "Connection closed before body was complete";
+                return -1;
+            }
+        }
+
+        switch(_bodyState) {
+            case BODY_LENGTH:
+            case BODY_CHUNK_DATA: {
+                if(_remaining == 0) {
+                    if(_bodyState == BODY_LENGTH) {
+                        return 0;
+                    }
+                    _bodyState = BODY_CHUNK_END;
+                    continue;
+                }
+                size_t length = (size_t) min<uint64_t>(_remaining, _pending.size());
+                data->append(_pending, 0, length);
+                _pending.erase(0, length);
+                _remaining -= length;
+                return length;
+            }
+            case BODY_UNTIL_CLOSE: {
+                size_t length = _pending.size();
+                data->append(_pending);
+                _pending.clear();
+                return length;
+            }
+            case BODY_CHUNK_SIZE: {
+                size_t lineEnd = _pending.find("\r\n");
+                if(lineEnd == string::npos) {
+                    // Forcing a read, the size line is incomplete
+                    if(readSocket(&_pending) <= 0) {
+                        LERROR << "Connection closed before body was complete";
+                        return -1;
+                    }
+                    continue;
+                }
+                // Chunk extensions (after ';') are ignored
+                char *sizeEnd;
+                _remaining = strtoull(_pending.c_str(), &sizeEnd, 16);
+                if(sizeEnd == _pending.c_str()) {
+                    LERROR << "Invalid chunk size";
+                    return -1;
+                }
+                _pending.erase(0, lineEnd + 2);
+                _bodyState = _remaining == 0 ? BODY_TRAILER : BODY_CHUNK_DATA;
+                continue;
+            }
+            case BODY_CHUNK_END:
+            case BODY_TRAILER: {
+                size_t lineEnd = _pending.find("\r\n");
+                if(lineEnd == string::npos) {
+                    if(readSocket(&_pending) <= 0) {
+                        LERROR << "Connection closed before body was complete";
+                        return -1;
+                    }
+                    continue;
+                } else if(_bodyState == BODY_CHUNK_END) {
+                    if(lineEnd != 0) {
+                        LERROR << "Chunk is not terminated by CRLF";
+                        return -1;
+                    }
+                    _bodyState = BODY_CHUNK_SIZE;
+                } else if(lineEnd == 0) {
+                    // The empty line terminates the trailer
+                    _bodyState = BODY_DONE;
+                }
+                _pending.erase(0, lineEnd + 2);
+                continue;
+            }
+            case BODY_DONE:
+            default:
+                return 0;
+        }
     }
 }
 
@@ -143,6 +509,7 @@ bool Web::Client::Request::sendRequest() {
     header["Host"] = this->host;
     header["User-Agent"] = USER_AGENT " " USER_AGENT_VERSION;
     header["Accept"] = this->accept;
+    header["Connection"] = keepAlive ? "keep-alive" : "close";
 
     return send();
 }
@@ -3,8 +3,8 @@
 //
 // WebClient.h:
 //      This file contains several classes and helper functions providing extended WebClient functionalities. The
-//      WebClient class can be used to retrieve string based content from the web in a blocking fashion. No external,
-//      non-standard library is required for this file.
+//      WebClient class can be used to retrieve string based content from the web in a blocking fashion, or to stream
+//      large resources. No external, non-standard library is required for this file.
 //      For more information see https://github.com/steilerDev/NOOBS4IoT/wiki.
 //
 // This file is licensed under a GNU General Public License v3.0 (c) Frank Steiler.
@@ -16,18 +16,25 @@
 
 #include "Web.h"
 #include <string>
+#include <functional>
 
 #define USER_AGENT "NOOBS4IoT"
 #define USER_AGENT_VERSION "0.1a"
+// Seconds a resolved host name is cached
+#define DNS_CACHE_TTL 300
+// Number of connection attempts per host, before fetchAll() gives up on the remaining resources
+#define FETCH_ATTEMPTS 3
 
 using namespace std;
 
 namespace Web {
 
+    class WebClient;
+
     namespace Client {
         class Request : public Web {
         public:
-            Request(int socket) : Web(socket), accept("*/*") {}
+            Request(int socket) : Web(socket), accept("*/*"), keepAlive(false) {}
 
             bool sendRequest();
 
@@ -36,29 +43,98 @@ namespace Web {
             string path;
             string host;
             string accept;
+            // If set, the server is asked to keep the connection open for further requests
+            bool keepAlive;
         };
 
         class Response : public Web {
         public:
-            Response(int socket): Web(socket) {};
+            Response(int socket): Web(socket), _bodyState(BODY_UNTIL_CLOSE), _remaining(0), _ownsSocket(false) {
+                _readUntilClose = true;
+            };
+            // Closes the socket, if the response was created by WebClient::open()
+            ~Response();
 
             bool receiveResponse();
 
+            /*
+             * Streaming interface: receiveHeader() only reads the status line and header, afterwards the body is read
+             * in parts using readBody(), decoding a chunked transfer encoding if necessary.
+             */
+            bool receiveHeader();
+            // Appends the next part of the body to data. Returns 0 at the end of the body and -1 on error
+            ssize_t readBody(string *data);
+
             int code;
             string phrase;
             string type;
+
+        private:
+            friend class ::Web::WebClient;
+
+            bool parseStatusLine();
+
+            enum BodyState {
+                BODY_LENGTH,
+                BODY_UNTIL_CLOSE,
+                BODY_CHUNK_SIZE,
+                BODY_CHUNK_DATA,
+                BODY_CHUNK_END,
+                BODY_TRAILER,
+                BODY_DONE
+            };
+            BodyState _bodyState;
+            // Remaining bytes of the body (BODY_LENGTH) or of the current chunk (BODY_CHUNK_DATA)
+            uint64_t _remaining;
+            bool _ownsSocket;
         };
     }
 
+    // Receives the body of a resource in parts, returning false aborts the transfer
+    typedef function<bool(const char *data, size_t length)> BodySink;
+    // Receives a resource fetched by fetchAll(), index is the position of its URL
+    typedef function<void(size_t index, bool success, const string &body)> FetchCallback;
+
     class WebClient {
     public:
+        // Returns the complete (binary) body of the resource, or an empty string on error
         string get(string &url);
         // Host cannot be prefixed with http
         string get(string &host, string &path, uint16_t port = 80);
 
+        /*
+         * Hands the body of the resource to the sink as it arrives, so only a small part of the body is kept in memory.
+         * Returns false if the resource could not be retrieved completely, the server did not respond with 2xx or the
+         * sink aborted the transfer.
+         */
+        bool get(const string &url, BodySink sink);
+
+        /*
+         * Sends a GET request for the URL (including additional header fields) and receives the response's header. The
+         * body can be read through Response::readBody(). The caller owns the returned response, deleting it closes the
+         * connection. Returns NULL on error.
+         */
+        Client::Response *open(const string &url, const map<string, string> &header = map<string, string>());
+
+        /*
+         * Fetches multiple resources concurrently. Every host is handled by its own thread, using a single keep-alive
+         * connection with all requests for the host pipelined on it. If the host closes the connection after a
+         * response, the remaining requests are sent one per connection. The callback is called on the calling thread as
+         * soon as a resource is complete (or failed). Returns false if any resource could not be fetched.
+         */
+        bool fetchAll(const vector<string> &urls, FetchCallback callback);
+
+        // Splits an http:// URL into host, path and port, returns false if the URL is not supported
+        static bool parseURL(const string &url, string *host, string *path, uint16_t *port);
+
     private:
+        struct FetchQueue;
+
+        // Fetches the given (index, path) pairs from the host on a single connection, reconnecting if necessary
+        void fetchHost(const string &host, uint16_t port, vector<pair<size_t, string> > requests, FetchQueue *queue);
+
         // Host cannot be prefixed with http
-        int openSocket(string &host, uint16_t port);
+        int openSocket(const string &host, uint16_t port);
     };
 }
 
@@ -3,8 +3,9 @@
 //
 // WebServer.cpp:
 //      This file contains several classes and helper functions providing extended WebServer functionalities. The
-//      WebServer class can be used to expose a simple, blocking REST-API to clients. It allows the selection of
-//      callback functions based on dynamic routing rules. No external, non-standard library is required for this file.
+//      WebServer class can be used to expose a simple, event driven (epoll based) REST-API to clients. It allows the
+//      selection of callback functions based on dynamic routing rules. No external, non-standard library is required
+//      for this file.
 //      For more information see https://github.com/steilerDev/NOOBS4IoT/wiki.
 //
 // This file is licensed under a GNU General Public License v3.0 (c) Frank Steiler.
@@ -14,82 +15,266 @@
 #include "WebServer.h"
 #include "../easylogging++.h"
 
+#include <errno.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
 using namespace std;
 
 void Web::WebServer::start(uint16_t port) {
     _stopServer = false;
-    int newSocket;
+    int on = 1;
 
     LDEBUG << "Creating listening socket";
-    int listeningSocket = socket(AF_INET, SOCK_STREAM, 0);
+    int listeningSocket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
 
     if (listeningSocket < 0) {
         LFATAL << "Unable to open listening socket!";
         return;
     }
+    setsockopt(listeningSocket, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
 
-    struct sockaddr_in servAddr, peerAddr;
+    struct sockaddr_in servAddr;
     servAddr.sin_family = AF_INET;
     servAddr.sin_addr.s_addr = INADDR_ANY;
     servAddr.sin_port = htons(port);
 
     if(::bind(listeningSocket, (struct sockaddr *) &servAddr, sizeof(servAddr)) != 0) {
-        LFATAL << "Unable to bind listening socket: " ; //<< strerror(errno);
+        LFATAL << "Unable to bind listening socket: " << strerror(errno);
+        close(listeningSocket);
         return;
     }
 
     LDEBUG << "Starting to listen on socket";
 
-    listen(listeningSocket, 1);
+    if(listen(listeningSocket, SOMAXCONN) != 0) {
+        LFATAL << "Unable to listen on socket: " << strerror(errno);
+        close(listeningSocket);
+        return;
+    }
 
-    socklen_t peerLen;
-    peerLen = sizeof(peerAddr);
+    _epoll = epoll_create1(EPOLL_CLOEXEC);
+    if(_epoll < 0) {
+        LFATAL << "Unable to create epoll instance: " << strerror(errno);
+        close(listeningSocket);
+        return;
+    }
 
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = listeningSocket;
+    if(epoll_ctl(_epoll, EPOLL_CTL_ADD, listeningSocket, &event) != 0) {
+        LFATAL << "Unable to register listening socket: " << strerror(errno);
+        close(_epoll);
+        close(listeningSocket);
+        return;
+    }
+
+    struct epoll_event events[MAX_EVENTS];
     while(!_stopServer) {
-        newSocket = accept(listeningSocket, (struct sockaddr *) &peerAddr, &peerLen);
+        // Waking up at least once a second in order to close idle connections
+        int ready = epoll_wait(_epoll, events, MAX_EVENTS, 1000);
+        if(ready < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            LFATAL << "Error while waiting for events: " << strerror(errno);
+            break;
+        }
+
+        for(int i = 0; i < ready; i++) {
+            int fd = events[i].data.fd;
+            if(fd == listeningSocket) {
+                acceptConnections(listeningSocket);
+            } else if(events[i].events & (EPOLLERR | EPOLLHUP)) {
+                LDEBUG << "Connection " << fd << " closed by peer";
+                closeConnection(fd);
+            } else if(events[i].events & EPOLLIN) {
+                readConnection(fd);
+            }
+        }
+        closeIdleConnections();
+    }
+
+    LDEBUG << "Stopping server, closing " << _connections.size() << " open connection(s)";
+    while(!_connections.empty()) {
+        closeConnection(_connections.begin()->first);
+    }
+    close(_epoll);
+    close(listeningSocket);
+}
+
+void Web::WebServer::stop() {
+    _stopServer = true;
+}
+
+void Web::WebServer::acceptConnections(int listeningSocket) {
+    struct sockaddr_in peerAddr;
+    socklen_t peerLen;
 
+    // Accepting all pending connections, since the listening socket is non-blocking
+    while(true) {
+        peerLen = sizeof(peerAddr);
+        int newSocket = accept4(listeningSocket, (struct sockaddr *) &peerAddr, &peerLen, SOCK_NONBLOCK | SOCK_CLOEXEC);
         if(newSocket < 0) {
-            LERROR << "Unable to accept connection";
+            if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                LERROR << "Unable to accept connection: " << strerror(errno);
+            }
+            return;
+        }
+
+        if(_connections.size() >= MAX_CONNECTIONS) {
+            LWARNING << "Maximum number of connections reached, rejecting connection";
             close(newSocket);
             continue;
         }
 
-        LINFO << "Connection accepted!";
-
-        Server::Request request(newSocket);
-        Server::Response response(newSocket);
-
-        if(!request.receiveRequest()) {
-            LERROR << "Unable to process request";
-            response.code = 400;
-            response.phrase = "Bad Request";
-            response.type = "text/plain";
-            response.body = "Bad Request";
-        } else if(!matchRoute(&request, &response)) {
-            LWARNING << "Unable to match route";
-            response.code = 404;
-            response.phrase = "Not Found";
-            response.type = "text/plain";
-            response.body = "Not found";
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLRDHUP;
+        event.data.fd = newSocket;
+        if(epoll_ctl(_epoll, EPOLL_CTL_ADD, newSocket, &event) != 0) {
+            LERROR << "Unable to register connection: " << strerror(errno);
+            close(newSocket);
+            continue;
         }
 
-        if(!response.sendResponse()) {
-            LERROR << "Unable to send response";
-            close(newSocket);
+        Server::Connection connection;
+        connection.socket = newSocket;
+        connection.lastActivity = time(0);
+        connection.continueSent = false;
+        _connections[newSocket] = connection;
+
+        LINFO << "Connection accepted! (" << _connections.size() << " open)";
+    }
+}
+
+void Web::WebServer::readConnection(int socket) {
+    map<int, Server::Connection>::iterator it = _connections.find(socket);
+    if(it == _connections.end()) {
+        LWARNING << "Received event for unknown connection " << socket;
+        close(socket);
+        return;
+    }
+    Server::Connection &connection = it->second;
+
+    char buffer[BUFFER_SIZE];
+    bool peerClosed = false;
+    while(true) {
+        ssize_t bytesRead = read(socket, buffer, BUFFER_SIZE);
+        if(bytesRead > 0) {
+            connection.buffer.append(buffer, (size_t) bytesRead);
+        } else if(bytesRead == 0) {
+            peerClosed = true;
+            break;
+        } else if(errno == EINTR) {
             continue;
+        } else if(errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;
+        } else {
+            LERROR << "Unable to read from connection: " << strerror(errno);
+            closeConnection(socket);
+            return;
+        }
+    }
+    connection.lastActivity = time(0);
+
+    if(connection.buffer.size() > MAX_REQUEST_SIZE) {
+        LERROR << "Request exceeds maximum request size, dropping connection";
+        Server::Response response(socket);
+        response.code = 413;
+        response.phrase = "Request Entity Too Large";
+        response.body = "Request Entity Too Large";
+        response.sendResponse();
+        closeConnection(socket);
+    } else if(requestComplete(connection)) {
+        dispatchRequest(connection);
+        closeConnection(socket);
+    } else if(peerClosed) {
+        LDEBUG << "Connection " << socket << " closed by peer before request was complete";
+        closeConnection(socket);
+    }
+}
+
+bool Web::WebServer::requestComplete(Server::Connection &connection) {
+    size_t headerLength = 0, messageLength = 0;
+    Framing framing = Web::frameMessage(connection.buffer, &headerLength, &messageLength);
+    if(framing == FRAME_COMPLETE) {
+        if(messageLength < connection.buffer.size()) {
+            LWARNING << "Ignoring " << connection.buffer.size() - messageLength << " bytes following the request";
+            connection.buffer.resize(messageLength);
+        }
+        return true;
+    } else if(framing == FRAME_INVALID) {
+        // Dispatching the request anyway, parsing it will fail and the client is informed through a 400 response
+        return true;
+    }
+
+    if(headerLength > 0 && !connection.continueSent) {
+        string headerString = connection.buffer.substr(0, headerLength);
+        transform(headerString.begin(), headerString.end(), headerString.begin(), ::tolower);
+        if(headerField(headerString, "expect") == "100-continue") {
+            LDEBUG << "Found expect header, sending continue response";
+            const char *continueResponse = "HTTP/1.1 100 Continue\r\n\r\n";
+            if(write(connection.socket, continueResponse, strlen(continueResponse)) < 0) {
+                LWARNING << "Unable to send continue response";
+            }
         }
+        connection.continueSent = true;
+    }
+    return false;
+}
+
+void Web::WebServer::dispatchRequest(Server::Connection &connection) {
+    Server::Request request(connection.socket);
+    Server::Response response(connection.socket);
+
+    if(!request.parseRequest(connection.buffer)) {
+        LERROR << "Unable to process request";
+        response.code = 400;
+        response.phrase = "Bad Request";
+        response.type = "text/plain";
+        response.body = "Bad Request";
+    } else if(!matchRoute(&request, &response)) {
+        LWARNING << "Unable to match route";
+        response.code = 404;
+        response.phrase = "Not Found";
+        response.type = "text/plain";
+        response.body = "Not found";
+    }
 
+    if(!response.sendResponse()) {
+        LERROR << "Unable to send response";
+    } else {
         LINFO << "Finished processing request!";
-        close(newSocket);
     }
-    close(listeningSocket);
+}
+
+void Web::WebServer::closeConnection(int socket) {
+    epoll_ctl(_epoll, EPOLL_CTL_DEL, socket, NULL);
+    close(socket);
+    _connections.erase(socket);
+}
+
+void Web::WebServer::closeIdleConnections() {
+    time_t now = time(0);
+    vector<int> idle;
+    for(auto const& x: _connections) {
+        if(now - x.second.lastActivity > CONNECTION_TIMEOUT) {
+            idle.push_back(x.first);
+        }
+    }
+    for(int socket: idle) {
+        LWARNING << "Closing idle connection " << socket;
+        closeConnection(socket);
+    }
 }
 
 bool Web::WebServer::matchRoute(Server::Request* req, Server::Response* res) {
     LDEBUG << "Matching routes for " << req->method << " at " << req->path;
 
     for (vector<Server::Route>::size_type i = 0; i < _routes.size(); i++) {
-        if(_routes[i].path == req->path && (_routes[i].method == req->method || _routes[i].method == "ALL")) {
+        if(matchPath(_routes[i].path, req) && (_routes[i].method == req->method || _routes[i].method == "ALL")) {
             LDEBUG << "Found matching route for " << req->method << " at " << req->path << ", starting callback";
             _routes[i].callback(req, res);
             return true;
@@ -99,6 +284,30 @@ bool Web::WebServer::matchRoute(Server::Request* req, Server::Response* res) {
     return false;
 }
 
+bool Web::WebServer::matchPath(const string &routePath, Server::Request* req) {
+    if(routePath == req->path) {
+        return true;
+    }
+
+    // Route segments starting with ':' match any request segment and store it as parameter
+    vector<string> routeSegments = split(routePath, '/');
+    vector<string> requestSegments = split(req->path, '/');
+    if(routeSegments.size() != requestSegments.size()) {
+        return false;
+    }
+
+    map<string, string> params;
+    for (vector<string>::size_type i = 0; i < routeSegments.size(); i++) {
+        if(!routeSegments[i].empty() && routeSegments[i][0] == ':' && !requestSegments[i].empty()) {
+            params[routeSegments[i].substr(1)] = requestSegments[i];
+        } else if(routeSegments[i] != requestSegments[i]) {
+            return false;
+        }
+    }
+    req->params = params;
+    return true;
+}
+
 void Web::WebServer::addRoute(string path, string method, void (*callback)(Server::Request *, Server::Response *)) {
     Server::Route r = {
             path,
@@ -126,24 +335,36 @@ bool Web::Server::Request::receiveRequest() {
         LFATAL << "Unable to receive request";
         return false;
     } else {
-        LDEBUG << "Parsing method line from header line";
-        vector<string> methodLineVector = split(headerLine, ' ');
-        if(methodLineVector.size() != 3) {
-            LERROR << "Request-Line does not conform specifications";
-            return false;
-        } else if (methodLineVector[2].compare("HTTP/1.1\r") != 0) {
-            // Specification says CRLF and getline splits at \n, to \r remains at end of line.
-            LERROR << "This server only supports HTTP/1.1, found " << methodLineVector[2];
-            return false;
-        }
+        return parseRequestLine();
+    }
+}
 
-        this->method = methodLineVector[0];
-        this->path = methodLineVector[1];
+bool Web::Server::Request::parseRequest(const string &message) {
+    if(!parseMessage(message)) {
+        LERROR << "Unable to parse request";
+        return false;
+    } else {
+        return parseRequestLine();
+    }
+}
 
-        LDEBUG << "Found request method: " << this->method;
-        LDEBUG << "Found request path: " << this->path;
-        return true;
+bool Web::Server::Request::parseRequestLine() {
+    LDEBUG << "Parsing method line from header line";
+    vector<string> methodLineVector = split(headerLine, ' ');
+    if(methodLineVector.size() != 3) {
+        LERROR << "Request-Line does not conform specifications";
+        return false;
+    } else if (methodLineVector[2].compare("HTTP/1.1") != 0) {
+        LERROR << "This server only supports HTTP/1.1, found " << methodLineVector[2];
+        return false;
     }
+
+    this->method = methodLineVector[0];
+    this->path = methodLineVector[1];
+
+    LDEBUG << "Found request method: " << this->method;
+    LDEBUG << "Found request path: " << this->path;
+    return true;
 }
 
 Web::Server::Response::Response(int socket): Web(socket) {
@@ -170,7 +391,7 @@ bool Web::Server::Response::sendResponse() {
     header["Server"] = SERVER_NAME " " SERVER_VERSION;
     header["Date"] = date;
     header["Content-Type"] = type;
-    header["Content-Length"] = to_string(strlen(body.c_str()));
+    header["Content-Length"] = to_string(body.size());
 
     return send();
 }
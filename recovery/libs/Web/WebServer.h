@@ -3,8 +3,9 @@
 //
 // WebServer.h:
 //      This file contains several classes and helper functions providing extended WebServer functionalities. The
-//      WebServer class can be used to expose a simple, blocking REST-API to clients. It allows the selection of
-//      callback functions based on dynamic routing rules. No external, non-standard library is required for this file.
+//      WebServer class can be used to expose a simple, event driven (epoll based) REST-API to clients. It allows the
+//      selection of callback functions based on dynamic routing rules. No external, non-standard library is required
+//      for this file.
 //      For more information see https://github.com/steilerDev/NOOBS4IoT/wiki.
 //
 // This file is licensed under a GNU General Public License v3.0 (c) Frank Steiler.
@@ -19,6 +20,15 @@
 #define SERVER_NAME "NOOBS4IoT"
 #define SERVER_VERSION "0.1a"
 
+// Maximum number of simultaneously open client connections
+#define MAX_CONNECTIONS 64
+// Maximum number of events processed per epoll_wait call
+#define MAX_EVENTS 16
+// Seconds after which an idle client connection is closed
+#define CONNECTION_TIMEOUT 30
+// Maximum size of a request (header + body) in bytes
+#define MAX_REQUEST_SIZE (1024 * 1024)
+
 namespace Web {
     namespace Server {
 
@@ -27,9 +37,17 @@ namespace Web {
             Request(int socket): Web(socket) {}
 
             bool receiveRequest();
+            // Parses an already received, complete request
+            bool parseRequest(const string &message);
 
             string method;
             string path;
+            // Values of the dynamic route segments (e.g. 'id' for route /jobs/:id)
+            map<string, string> params;
+
+        private:
+            // Populates method and path from the header line
+            bool parseRequestLine();
         };
 
         class Response: public Web {
@@ -49,6 +67,14 @@ namespace Web {
             string method;
             void (*callback)(Request*, Response*);
         };
+
+        // State of a single client connection, while its request is being received
+        struct Connection {
+            int socket;
+            string buffer;
+            time_t lastActivity;
+            bool continueSent;
+        };
     }
 
     class WebServer {
@@ -57,13 +83,29 @@ namespace Web {
         void post(string path, void (*callback)(Server::Request*, Server::Response*));
         void all(string path, void (*callback)(Server::Request*, Server::Response*));
         void start(uint16_t port);
+        void stop();
 
     private:
         std::vector<Server::Route> _routes;
+        std::map<int, Server::Connection> _connections;
         bool _stopServer;
+        int _epoll;
 
         void addRoute(string path, string method, void (*callback)(Server::Request*, Server::Response*));
         bool matchRoute(Server::Request* request, Server::Response* response);
+        // Matches the request path against a route path, which may contain dynamic segments (e.g. /jobs/:id)
+        bool matchPath(const string &routePath, Server::Request* request);
+
+        /*
+         * Event loop helper functions
+         */
+        void acceptConnections(int listeningSocket);
+        void readConnection(int socket);
+        // Returns true if the connection holds the complete request (header and body as framed by the header)
+        bool requestComplete(Server::Connection &connection);
+        void dispatchRequest(Server::Connection &connection);
+        void closeConnection(int socket);
+        void closeIdleConnections();
     };
 
 }
@@ -12,6 +12,7 @@
 
 #include <QCoreApplication>
 #include <QTimer>
+#include <signal.h>
 #include "libs/easylogging++.h"
 #include "BootManager.h"
 
@@ -30,6 +31,9 @@ int main(int argc, char *argv[])
     setup_logger();
     LINFO << "Welcome to NOOBS4IoT";
 
+    // Write errors on pipes and sockets are handled where they occur, instead of terminating the application
+    signal(SIGPIPE, SIG_IGN);
+
     // Creating and using QCoreApplication, since QNetworking requires an active event loop.
     QCoreApplication a(argc, argv);
 
@@ -6,11 +6,11 @@
 
 QT       += core gui network dbus
 
-greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
+greaterThan(QT_MAJOR_VERSION, 4): QT += widgets concurrent
 
 TARGET = recovery
 TEMPLATE = app
-LIBS += -lqjson
+LIBS += -lqjson -lz -llzma -lbz2 -lcrypto
 
 QMAKE_CXXFLAGS += -std=c++11
 CONFIG += c++11
@@ -22,6 +22,26 @@ SOURCES += main.cpp \
     libs/Web/Web.cpp \
     libs/Web/WebServer.cpp \
     libs/Web/WebClient.cpp \
+    libs/Stream/Stream.cpp \
+    libs/Stream/StreamSource.cpp \
+    libs/Stream/StreamDecoder.cpp \
+    libs/Stream/XzDecoder.cpp \
+    libs/Stream/StreamSink.cpp \
+    libs/Stream/TarReader.cpp \
+    libs/Stream/TarExtractor.cpp \
+    libs/Stream/Ext4Builder.cpp \
+    libs/Stream/FatBuilder.cpp \
+    libs/Stream/BlockMap.cpp \
+    libs/Stream/Digest.cpp \
+    libs/Stream/ChunkIndex.cpp \
+    libs/Stream/ChunkStore.cpp \
+    libs/Stream/WriteRecord.cpp \
+    libs/Stream/Prefetch.cpp \
+    libs/Disk/PartitionTable.cpp \
+    libs/Disk/DeviceMonitor.cpp \
+    libs/Disk/Filesystem.cpp \
+    libs/Disk/Mount.cpp \
+    libs/Net/AddressMonitor.cpp \
     Utility.cpp \
     Utility_Json.cpp \
     Utility_Sys.cpp \
@@ -31,7 +51,8 @@ SOURCES += main.cpp \
     PreSetup.cpp \
     BootManager.cpp \
     InstallManager.cpp \
-    InstallManager_Utility.cpp
+    InstallManager_Utility.cpp \
+    InstallJob.cpp
 
 HEADERS  += \
     libs/easylogging++.h \
@@ -41,9 +62,30 @@ HEADERS  += \
     libs/Web/Web.h \
     libs/Web/WebServer.h \
     libs/Web/WebClient.h \
+    libs/Stream/Stream.h \
+    libs/Stream/StreamSource.h \
+    libs/Stream/StreamDecoder.h \
+    libs/Stream/XzDecoder.h \
+    libs/Stream/StreamSink.h \
+    libs/Stream/TarReader.h \
+    libs/Stream/TarExtractor.h \
+    libs/Stream/Ext4Builder.h \
+    libs/Stream/FatBuilder.h \
+    libs/Stream/BlockMap.h \
+    libs/Stream/Digest.h \
+    libs/Stream/ChunkIndex.h \
+    libs/Stream/ChunkStore.h \
+    libs/Stream/WriteRecord.h \
+    libs/Stream/Prefetch.h \
+    libs/Disk/PartitionTable.h \
+    libs/Disk/DeviceMonitor.h \
+    libs/Disk/Filesystem.h \
+    libs/Disk/Mount.h \
+    libs/Net/AddressMonitor.h \
     Utility.h \
     OSInfo.h \
     PartitionInfo.h \
     PreSetup.h \
     BootManager.h \
-    InstallManager.h
+    InstallManager.h \
+    InstallJob.h